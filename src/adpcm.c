@@ -0,0 +1,113 @@
+/*
+	IMA ADPCM, 4 bits a sample, see adpcm.h for the frames
+*/
+
+#include <stdint.h>
+#include "adpcm.h"
+
+static const int16_t step_table[89] = {
+	7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+	50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+	253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+	1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+	3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442,
+	11487, 12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794,
+	32767
+};
+
+static const int8_t index_table[16] = {
+	-1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8
+};
+
+// moves the state by the code, returns the new sample
+static int adpcm_step(struct adpcm_state *s, int code){
+	int step = step_table[s->index];
+	int diff = step >> 3;
+
+	if (code & 4)
+		diff += step;
+	if (code & 2)
+		diff += step >> 1;
+	if (code & 1)
+		diff += step >> 2;
+	if (code & 8)
+		s->predictor -= diff;
+	else
+		s->predictor += diff;
+	if (s->predictor > 32767)
+		s->predictor = 32767;
+	else if (s->predictor < -32768)
+		s->predictor = -32768;
+
+	s->index += index_table[code];
+	if (s->index < 0)
+		s->index = 0;
+	else if (s->index > 88)
+		s->index = 88;
+	return s->predictor;
+}
+
+// codes the samples into a frame, returns its length in bytes
+int adpcm_encode(struct adpcm_state *s, int rate, const int16_t *in, int count,
+	uint8_t *out){
+	out[0] = 'A';
+	out[1] = 'D';
+	out[2] = rate / 1000;
+	out[3] = s->index;
+	out[4] = s->predictor & 0xff;
+	out[5] = (s->predictor >> 8) & 0xff;
+	out[6] = count & 0xff;
+	out[7] = count >> 8;
+
+	uint8_t *p = out + ADPCM_HEADER;
+	for (int i = 0; i < count; i++){
+		int step = step_table[s->index];
+		int diff = in[i] - s->predictor;
+		int code = 0;
+
+		if (diff < 0){
+			code = 8;
+			diff = -diff;
+		}
+		if (diff >= step){
+			code |= 4;
+			diff -= step;
+		}
+		if (diff >= step >> 1){
+			code |= 2;
+			diff -= step >> 1;
+		}
+		if (diff >= step >> 2)
+			code |= 1;
+		adpcm_step(s, code);
+
+		if (i & 1)
+			*p++ |= code << 4;
+		else
+			*p = code;
+	}
+	return ADPCM_BYTES(count);
+}
+
+// returns the samples, or -1 if it is not a whole frame
+int adpcm_decode(const uint8_t *in, int length, int16_t *out, int max, int *rate){
+	struct adpcm_state s;
+
+	if (length < ADPCM_HEADER || in[0] != 'A' || in[1] != 'D')
+		return -1;
+	int count = in[6] | (in[7] << 8);
+	if (length < ADPCM_BYTES(count) || in[3] > 88)
+		return -1;
+	if (count > max)
+		count = max;
+	if (rate)
+		*rate = in[2] * 1000;
+
+	s.index = in[3];
+	s.predictor = (int16_t)(in[4] | (in[5] << 8));
+	for (int i = 0; i < count; i++){
+		int code = in[ADPCM_HEADER + i / 2];
+		out[i] = adpcm_step(&s, i & 1 ? code >> 4 : code & 15);
+	}
+	return count;
+}
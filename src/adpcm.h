@@ -0,0 +1,27 @@
+/*
+	IMA ADPCM, the audio codec of the web clients, both ways
+
+	Each frame carries the coder's state in its header, so frames can be
+	decoded on their own:
+		byte 0,1	'A','D'
+		byte 2		sample rate in kHz
+		byte 3		step index
+		byte 4,5	predictor, int16 little endian
+		byte 6,7	samples, little endian
+		then the samples as 4 bit codes, the first in the low nibble
+	web/adpcm.js is the browser's side of the same.
+*/
+
+#include <stdint.h>
+
+#define ADPCM_HEADER 8
+#define ADPCM_BYTES(samples) (ADPCM_HEADER + ((samples) + 1) / 2)
+
+struct adpcm_state {
+	int predictor;
+	int index;
+};
+
+int adpcm_encode(struct adpcm_state *s, int rate, const int16_t *in, int count,
+	uint8_t *out);
+int adpcm_decode(const uint8_t *in, int length, int16_t *out, int max, int *rate);
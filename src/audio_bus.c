@@ -0,0 +1,205 @@
+/*
+	The audio bus, the sbitx's side. See audio_bus.h for the layout.
+
+	audio_bus_write() is called by the DSP thread with each block of the
+	IF and of the audio from sound_process(). It converts them to floats,
+	mixes the IF down to I/Q and runs the decimation filters straight
+	into the rings of the shared memory, then wakes up the readers.
+
+	audio_bus_poll() picks up the AUDIO_BUS setting and creates or
+	removes the shared memory.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <complex.h>
+#include <fftw3.h>
+#include "sdr.h"
+#include "sdr_ui.h"
+#include "sound.h"
+#include "dsp_utils.h"
+#include "audio_bus.h"
+
+#define BUS_RATE 96000
+#define IQ_TAPS 47				// +/- 20 kHz of the IF
+#define A48_TAPS 31
+#define A12_TAPS 127
+#define HISTORY 128				// a power of two, larger than the filters
+
+static struct audio_bus *bus = NULL;
+static int bus_size = 0;
+static volatile int bus_busy = 0;
+static int bus_failed = 0;
+static uint64_t bus_samples = 0;	// 96000 sps samples written
+
+static float iq_coeff[IQ_TAPS], a48_coeff[A48_TAPS], a12_coeff[A12_TAPS];
+static float hist_i[HISTORY], hist_q[HISTORY], hist_audio[HISTORY];
+
+// the filter output at the sample n, the newest of the history
+static float fir(const float *hist, uint64_t n, const float *coeff, int taps){
+	float sum = 0;
+
+	for (int i = 0; i < taps; i++)
+		sum += hist[(n - i) & (HISTORY - 1)] * coeff[i];
+	return sum;
+}
+
+static int stream_init(struct audio_bus_stream *s, int rate, int channels,
+	int taps, int frames, int offset){
+	s->rate = rate;
+	s->channels = channels;
+	s->decimation = BUS_RATE / rate;
+	s->delay = (taps - 1) / 2;
+	s->frames = frames;
+	s->offset = offset;
+	s->written = 0;
+	return offset + frames * channels * sizeof(float);
+}
+
+static void bus_create(){
+	struct audio_bus head;
+
+	memset(&head, 0, sizeof(head));
+	int size = (sizeof(head) + 63) & ~63;
+	size = stream_init(head.streams + AUDIO_BUS_IQ, BUS_RATE, 2, IQ_TAPS, 1 << 18, size);
+	size = stream_init(head.streams + AUDIO_BUS_48K, 48000, 1, A48_TAPS, 1 << 17, size);
+	size = stream_init(head.streams + AUDIO_BUS_12K, 12000, 1, A12_TAPS, 1 << 15, size);
+
+	int fd = shm_open(AUDIO_BUS_SHM, O_CREAT | O_RDWR, 0644);
+	if (fd < 0){
+		perror("audio bus");
+		return;
+	}
+	if (ftruncate(fd, size) < 0){
+		perror("audio bus");
+		close(fd);
+		return;
+	}
+	struct audio_bus *b = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (b == MAP_FAILED){
+		perror("audio bus");
+		return;
+	}
+
+	memcpy(b, &head, sizeof(head));
+	b->size = size;
+	b->pid = getpid();
+	b->n_blocks = AUDIO_BUS_BLOCKS;
+	b->version = AUDIO_BUS_VERSION;
+	__atomic_store_n(&b->magic, AUDIO_BUS_MAGIC, __ATOMIC_RELEASE);
+
+	bus_samples = 0;
+	memset(hist_i, 0, sizeof(hist_i));
+	memset(hist_q, 0, sizeof(hist_q));
+	memset(hist_audio, 0, sizeof(hist_audio));
+	bus_size = size;
+	__atomic_store_n(&bus, b, __ATOMIC_RELEASE);
+	write_console(FONT_LOG, "Audio bus is at /dev/shm" AUDIO_BUS_SHM "\n");
+}
+
+static void bus_remove(){
+	struct audio_bus *b = bus;
+
+	__atomic_store_n(&bus, NULL, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&bus_busy, __ATOMIC_SEQ_CST))
+		usleep(1000);
+	b->magic = 0;
+	munmap(b, bus_size);
+	shm_unlink(AUDIO_BUS_SHM);
+}
+
+// called from the DSP thread with each block
+void audio_bus_write(int32_t *if_samples, int32_t *audio, int count, int in_tx){
+	__atomic_store_n(&bus_busy, 1, __ATOMIC_SEQ_CST);
+	struct audio_bus *b = __atomic_load_n(&bus, __ATOMIC_SEQ_CST);
+	if (!b){
+		__atomic_store_n(&bus_busy, 0, __ATOMIC_RELEASE);
+		return;
+	}
+
+	struct audio_bus_stream *iq = b->streams + AUDIO_BUS_IQ;
+	struct audio_bus_stream *a48 = b->streams + AUDIO_BUS_48K;
+	struct audio_bus_stream *a12 = b->streams + AUDIO_BUS_12K;
+	float *iq_ring = (float *)((char *)b + iq->offset);
+	float *a48_ring = (float *)((char *)b + a48->offset);
+	float *a12_ring = (float *)((char *)b + a12->offset);
+	uint64_t iq_n = iq->written, a48_n = a48->written, a12_n = a12->written;
+
+	uint64_t start = bus_samples;
+
+	for (int i = 0; i < count; i++){
+		uint64_t n = bus_samples++;
+		int h = n & (HISTORY - 1);
+
+		float complex z = quarter_mix(if_samples[i] / 1073741824.0f, n);
+		hist_i[h] = crealf(z);
+		hist_q[h] = cimagf(z);
+		hist_audio[h] = audio[i] / 2147483648.0f;
+
+		float *f = iq_ring + (iq_n++ & (iq->frames - 1)) * 2;
+		f[0] = 2 * fir(hist_i, n, iq_coeff, IQ_TAPS);
+		f[1] = 2 * fir(hist_q, n, iq_coeff, IQ_TAPS);
+		if (!(n & 1))
+			a48_ring[a48_n++ & (a48->frames - 1)] = fir(hist_audio, n, a48_coeff, A48_TAPS);
+		if (!(n & 7))
+			a12_ring[a12_n++ & (a12->frames - 1)] = fir(hist_audio, n, a12_coeff, A12_TAPS);
+	}
+
+	//the frames are in, now the block that points at them
+	struct audio_bus_block *block = b->blocks + b->blocks_written % b->n_blocks;
+	block->sample_index = sound_sample_index();
+	block->time = sound_sample_time(block->sample_index);
+	block->start = start;
+	block->count = count;
+	block->in_tx = in_tx;
+	__atomic_store_n(&b->blocks_written, b->blocks_written + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&iq->written, iq_n, __ATOMIC_RELEASE);
+	__atomic_store_n(&a48->written, a48_n, __ATOMIC_RELEASE);
+	__atomic_store_n(&a12->written, a12_n, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&b->sequence, 1, __ATOMIC_RELEASE);
+	syscall(SYS_futex, &b->sequence, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+
+	__atomic_store_n(&bus_busy, 0, __ATOMIC_RELEASE);
+}
+
+// picks up the AUDIO_BUS setting, from modem_poll()
+void audio_bus_poll(){
+	const char *value = field_str("AUDIO_BUS");
+	int on = value && !strcmp(value, "ON");
+
+	//a failure is not tried again until the setting is switched off and on
+	if (on && !bus && !bus_failed){
+		bus_create();
+		bus_failed = !bus;
+	}
+	else if (!on){
+		if (bus)
+			bus_remove();
+		bus_failed = 0;
+	}
+}
+
+void audio_bus_init(){
+	lowpass_design(iq_coeff, IQ_TAPS, 20000, BUS_RATE, 1);
+	lowpass_design(a48_coeff, A48_TAPS, 20000, BUS_RATE, 1);
+	lowpass_design(a12_coeff, A12_TAPS, 5000, BUS_RATE, 1);
+	//a stale one from a crashed sbitx
+	shm_unlink(AUDIO_BUS_SHM);
+}
+
+// at the exit, the readers see the pid gone
+void audio_bus_close(){
+	if (bus)
+		shm_unlink(AUDIO_BUS_SHM);
+}
@@ -0,0 +1,83 @@
+#pragma once
+/*
+	The audio bus: the IF and the receiver's audio in shared memory
+
+	With the AUDIO_BUS setting on (\audio_bus ON), the sbitx publishes
+	its signals in the POSIX shared memory AUDIO_BUS_SHM
+	(/dev/shm/sbitx_audio) for any number of local programs to read
+	without copies or extra ALSA devices. This header is all a reader
+	needs, it describes the layout.
+
+	There are three streams, each a ring of float frames:
+	AUDIO_BUS_IQ	the IF as I/Q pairs at 96000 sps. The IF is mixed down
+								from 24 kHz (the tuned frequency) and filtered to
+								+/- 20 kHz.
+	AUDIO_BUS_48K	the demodulated audio at 48000 sps, low passed at 20 kHz
+	AUDIO_BUS_12K	the demodulated audio at 12000 sps, low passed at 5 kHz
+	The samples are scaled to +/-1.0. While transmitting, the audio is
+	the monitor and the IF is what the receiver picks up.
+
+	Frame f of a stream stands for the sample f * decimation of the 96000
+	sps samples written to the bus. The blocks[] table maps these to the
+	capture sample index of the sbitx (the one the modems work with) and
+	the wall clock: a block covers the bus samples from start to
+	start + count. Only the last AUDIO_BUS_BLOCKS blocks are kept. The
+	filters delay each stream by delay samples at 96000 sps.
+
+	The sbitx writes the frames of a block, then its blocks[] entry, then
+	advances the written counts and increments sequence. To read:
+	1. shm_open(AUDIO_BUS_SHM, O_RDONLY, 0) and mmap() size bytes of it,
+		 check the magic and the version.
+	2. Keep your own count of the frames read, start at written.
+	3. Wait for more with
+		 syscall(SYS_futex, &bus->sequence, FUTEX_WAIT, last_sequence, &timeout)
+		 (a shared futex, it wakes up when a block is written).
+	4. Read the frames between your count and written straight from the
+		 ring at bus + offset, the frame n is at n & (frames - 1).
+	5. If written has moved more than frames past the start of what you
+		 read, you fell behind and that data has been overwritten.
+	The bus is removed when the setting is switched off or the sbitx exits,
+	readers should go back to step 1 when pid is gone.
+*/
+
+#include <stdint.h>
+
+#define AUDIO_BUS_SHM "/sbitx_audio"
+#define AUDIO_BUS_MAGIC 0x53425553		//"SBUS"
+#define AUDIO_BUS_VERSION 1
+
+#define AUDIO_BUS_IQ 0
+#define AUDIO_BUS_48K 1
+#define AUDIO_BUS_12K 2
+#define AUDIO_BUS_STREAMS 3
+#define AUDIO_BUS_BLOCKS 256
+
+struct audio_bus_stream {
+	uint32_t rate;					// frames per second
+	uint32_t channels;			// floats per frame
+	uint32_t decimation;		// 96000 sps samples per frame
+	uint32_t delay;					// of the filter, in 96000 sps samples
+	uint32_t frames;				// in the ring, a power of two
+	uint32_t offset;				// of the ring, in bytes from the start of the bus
+	volatile uint64_t written;	// frames written since the bus started
+};
+
+struct audio_bus_block {
+	int64_t sample_index;		// capture sample index of the first sample
+	uint64_t start;					// 96000 sps samples on the bus before this block
+	double time;						// CLOCK_REALTIME secs of the first sample
+	uint32_t count;					// 96000 sps samples in the block
+	uint32_t in_tx;
+};
+
+struct audio_bus {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;					// of the whole shared memory, in bytes
+	uint32_t pid;						// of the sbitx
+	volatile uint32_t sequence;	// incremented with each block
+	uint32_t n_blocks;
+	volatile uint64_t blocks_written;	// block b is at blocks[b % n_blocks]
+	struct audio_bus_stream streams[AUDIO_BUS_STREAMS];
+	struct audio_bus_block blocks[AUDIO_BUS_BLOCKS];
+};
@@ -0,0 +1,652 @@
+/*
+	CW skimmer
+
+	Decodes every CW signal in the IF at once and spots the callsigns.
+	It is switched on with the CW_SKIM setting (\cw_skim ON) and works
+	in any mode, alongside the CW decoder of modem_cw.c that follows
+	only the signal at the pitch.
+
+	1. skimmer_rx() is called by the DSP thread with each block of the
+	IF and pushes it into an if_ring (see dsp_utils.h).
+
+	2. The channelizer thread runs a 1024 point fft of the IF every 256
+	samples (2.7 msec). Each bin is 94 Hz wide and is a channel, this
+	is narrow enough to separate the signals of a busy contest and
+	fast enough to follow 50 wpm. For each bin it tracks the noise
+	floor and the peaks. Every 100 msec a bin that peaks well above
+	its floor and above its neighbours is given a decoder, which
+	also keeps the bins on either side from getting one.
+
+	3. A decoder works on the power of its bin, once a frame:
+	- The envelope is smoothed to about a third of a dit and sliced
+	  halfway between its tracked mark and space levels, with some
+	  hysteresis.
+	- The marks and spaces shorter than a third of a dit are taken as
+	  noise and merged with their neighbours.
+	- The speed is estimated from the last 16 marks and spaces: the
+	  dit is the average of those between the shortest (the second
+	  shortest, to skip a glitch) and twice that.
+	- Each mark is a dit or a dah, the elements walk down the binary
+	  tree of the morse code (morse_rx_lookup() of modem_cw.c) and a
+	  space of over two dits ends the letter, over five dits ends the
+	  word.
+	A decoder is closed after 10 seconds of no signal.
+
+	4. A word that looks like a callsign (a prefix, a digit and a
+	suffix of letters) is spotted the second time it is decoded on the
+	same channel. A strong signal is copied on the next channels too,
+	these copies are one spot, of the strongest channel. Each spot is queued for skimmer_poll(), on the user
+	interface's tick, to go to the console and to
+	~/sbitx/data/cw_spots.txt with the frequency, the speed and the
+	signal to noise ratio, and is not repeated for 10 minutes.
+	\skimstat lists the signals being decoded and the cpu taken.
+
+	The IF is at 24 kHz, upper sideband (see radio_tune_to() in sbitx.c).
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <math.h>
+#include <time.h>
+#include <complex.h>
+#include <fftw3.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "sdr.h"
+#include "sdr_ui.h"
+#include "dsp_utils.h"
+#include "modem_cw.h"
+
+#define SKIM_BLOCK IF_BLOCK
+#define SKIM_RING 128			// about 1.3 seconds of the IF
+#define SKIM_IF_RATE 96000
+#define SKIM_IF 24000
+
+#define SKIM_NFFT 1024
+#define SKIM_HOP 256
+#define SKIM_FRAMES (SKIM_BLOCK / SKIM_HOP)
+#define SKIM_BINS (SKIM_NFFT / 2)
+#define SKIM_FRAME_RATE ((float)SKIM_IF_RATE / SKIM_HOP)
+#define SKIM_BIN_HZ ((float)SKIM_IF_RATE / SKIM_NFFT)
+#define SKIM_LOW_BIN 16			// 1.5 kHz to 46.5 kHz of the IF
+#define SKIM_HIGH_BIN (SKIM_BINS - 16)
+
+#define SKIM_MAX_CHANNELS 96
+#define SKIM_OPEN 10.0f				// peak over the floor, in power, to open
+#define SKIM_SCAN 37					// frames between the scans, 100 msec
+#define SKIM_CLOSE 3750				// frames of no signal, 10 seconds
+#define SKIM_HISTORY 16				// marks and spaces for the speed
+#define SKIM_MIN_DIT 7.0f			// frames, 60 wpm
+#define SKIM_MAX_DIT 90.0f		// 5 wpm
+#define SKIM_WORDS 8
+#define SKIM_RECENT 128
+#define SKIM_RESPOT (10 * 60)	// seconds
+#define SKIM_MERGE 2					// bins, the copies of a call this close are one spot
+
+static struct if_ring skim_ring;
+static int skim_active = 0;
+static volatile int skim_restart = 0;	// the channelizer thread resets
+
+struct skim_channel {
+	int in_use;
+	int bin;
+	long opened;
+
+	// the envelope and the slicer
+	float env, mark, space;
+	int key;
+	int quiet;
+
+	// the timing, in frames
+	long down_at, up_at;
+	int pending;					// a mark waiting to see if the space is real
+	float history[SKIM_HISTORY];
+	int history_pos, history_count;
+	float dit;
+
+	// the letters and words
+	int code;
+	int word_ended;
+	char word[16];
+	int word_len;
+	char words[SKIM_WORDS][16];
+	int words_pos;
+	char text[40];
+
+	// the frequency within the bin, from the marks
+	double side_sum;
+	int side_count;
+	char spotted[16];
+};
+
+static struct skim_channel channels[SKIM_MAX_CHANNELS];
+static pthread_mutex_t channels_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// the bins
+static float *fft_in;
+static fftwf_complex *fft_out;
+static fftwf_plan fft_plan;
+static float fft_window[SKIM_NFFT];
+static float if_history[SKIM_NFFT - SKIM_HOP + SKIM_BLOCK];
+static float power[SKIM_BINS], smooth[SKIM_BINS], peak[SKIM_BINS], noise[SKIM_BINS];
+static unsigned char bin_taken[SKIM_BINS];
+static long frame;
+static int skim_dial, skim_shift;
+
+struct skim_recent {
+	char call[16];
+	int khz;
+	time_t at;
+};
+static struct skim_recent recent[SKIM_RECENT];
+static int recent_pos;
+
+// the spots on their way to the user interface
+#define SKIM_REPORTS 64
+struct skim_report {
+	time_t at;
+	double khz;
+	char call[16];
+	int wpm, snr;
+};
+static struct skim_report reports[SKIM_REPORTS];
+static int report_head = 0, report_tail = 0;
+
+// stats
+static long long chan_ns;
+static int spots, opened, closed, most_channels;
+static pthread_t skim_thread;
+
+/* ---- the spots ---- */
+
+// a prefix of one to three with a letter in it, a digit and upto four
+// letters, with an optional /portable etc.
+static int is_callsign(const char *word){
+	char base[16];
+	int best = 0;
+
+	//the longest part between the slashes is the callsign
+	for (const char *p = word; *p; ){
+		int n = strcspn(p, "/");
+		if (n > best && n < sizeof(base)){
+			best = n;
+			memcpy(base, p, n);
+			base[n] = 0;
+		}
+		p += n;
+		if (*p == '/')
+			p++;
+	}
+	if (best < 3 || best > 8)
+		return 0;
+
+	int digit = -1;
+	for (int i = 0; base[i]; i++){
+		if (!isalnum(base[i]))
+			return 0;
+		if (isdigit(base[i]))
+			digit = i;
+	}
+	if (digit < 1 || digit > 3 || best - digit - 1 < 1 || best - digit - 1 > 4)
+		return 0;
+	for (int i = digit + 1; base[i]; i++)
+		if (!isalpha(base[i]))
+			return 0;
+	for (int i = 0; i < digit; i++)
+		if (isalpha(base[i]))
+			return 1;
+	return 0;
+}
+
+static int channel_snr(struct skim_channel *c){
+	if (c->space <= 0)
+		return 99;
+	return (int)lrintf(20 * log10f(c->mark / c->space));
+}
+
+// the channel has copied the call lately
+static int channel_copied(struct skim_channel *c, const char *call){
+	if (!strcmp(c->spotted, call))
+		return 1;
+	for (int i = 0; i < SKIM_WORDS; i++)
+		if (!strcmp(c->words[i], call))
+			return 1;
+	return 0;
+}
+
+static void channel_spot(struct skim_channel *c, const char *call){
+	time_t now = time_sbitx();
+
+	//a strong signal is copied on the next bins too, the spot is
+	//of the strongest channel with the call
+	for (int i = 0; i < SKIM_MAX_CHANNELS; i++){
+		struct skim_channel *o = channels + i;
+		if (o->in_use && o != c && abs(o->bin - c->bin) <= SKIM_MERGE
+			&& o->mark > c->mark && channel_copied(o, call))
+			c = o;
+	}
+
+	//the frequency of the carrier, from the sides of the bin
+	float side = c->side_count ? c->side_sum / c->side_count : 0;
+	double hz = (c->bin + side) * SKIM_BIN_HZ - SKIM_IF - skim_shift;
+	double khz = (skim_dial + hz) / 1000.0;
+
+	for (int i = 0; i < SKIM_RECENT; i++)
+		if (!strcmp(recent[i].call, call) && abs(recent[i].khz - (int)khz) <= 1
+			&& now - recent[i].at < SKIM_RESPOT)
+			return;
+	strcpy(recent[recent_pos].call, call);
+	recent[recent_pos].khz = (int)khz;
+	recent[recent_pos].at = now;
+	recent_pos = (recent_pos + 1) % SKIM_RECENT;
+
+	int next = (report_head + 1) % SKIM_REPORTS;
+	if (next == __atomic_load_n(&report_tail, __ATOMIC_ACQUIRE))
+		return;
+	struct skim_report *r = reports + report_head;
+	r->at = now;
+	r->khz = khz;
+	strcpy(r->call, call);
+	r->wpm = (int)lrintf(1200.0f / (c->dit * 1000.0f / SKIM_FRAME_RATE));
+	r->snr = channel_snr(c);
+	__atomic_store_n(&report_head, next, __ATOMIC_RELEASE);
+	spots++;
+}
+
+static void skim_report(struct skim_report *r){
+	char buff[200], path[200];
+	struct tm *t = gmtime(&r->at);
+
+	sprintf(buff, "%02d%02d CW %9.1f %-10s %2d wpm %+3d dB\n",
+		t->tm_hour, t->tm_min, r->khz, r->call, r->wpm, r->snr);
+	write_console(FONT_LOG, buff);
+
+	sprintf(path, "%s/sbitx/data/cw_spots.txt", getenv("HOME"));
+	FILE *pf = fopen(path, "a");
+	if (pf){
+		fprintf(pf, "%02d%02d%02d %02d%02d %9.1f %-10s %2d %3d\n",
+			t->tm_year % 100, t->tm_mon + 1, t->tm_mday, t->tm_hour, t->tm_min,
+			r->khz, r->call, r->wpm, r->snr);
+		fclose(pf);
+	}
+}
+
+static void channel_word(struct skim_channel *c){
+	if (!c->word_len)
+		return;
+	c->word[c->word_len] = 0;
+
+	//a callsign is spotted when it has been copied twice
+	if (is_callsign(c->word) && strcmp(c->word, c->spotted)){
+		for (int i = 0; i < SKIM_WORDS; i++)
+			if (!strcmp(c->words[i], c->word)){
+				channel_spot(c, c->word);
+				strcpy(c->spotted, c->word);
+				break;
+			}
+	}
+	strcpy(c->words[c->words_pos], c->word);
+	c->words_pos = (c->words_pos + 1) % SKIM_WORDS;
+	c->word_len = 0;
+}
+
+static void channel_letter(struct skim_channel *c, char letter){
+	int n = strlen(c->text);
+	if (n >= sizeof(c->text) - 1){
+		memmove(c->text, c->text + 1, n);
+		n--;
+	}
+	c->text[n] = letter;
+	c->text[n + 1] = 0;
+
+	if (letter == ' ')
+		channel_word(c);
+	else if (c->word_len < sizeof(c->word) - 1)
+		c->word[c->word_len++] = letter;
+}
+
+/* ---- the decoders ---- */
+
+// the dit is the cluster of the shortest marks and spaces
+static void channel_timing(struct skim_channel *c, float frames){
+	c->history[c->history_pos] = frames;
+	c->history_pos = (c->history_pos + 1) % SKIM_HISTORY;
+	if (c->history_count < SKIM_HISTORY)
+		c->history_count++;
+	if (c->history_count < 4)
+		return;
+
+	float least = 1e9, second = 1e9;
+	for (int i = 0; i < c->history_count; i++){
+		float h = c->history[i];
+		if (h < least){
+			second = least;
+			least = h;
+		}
+		else if (h < second)
+			second = h;
+	}
+	float sum = 0;
+	int n = 0;
+	for (int i = 0; i < c->history_count; i++)
+		if (c->history[i] >= least && c->history[i] <= 2 * second){
+			sum += c->history[i];
+			n++;
+		}
+	c->dit = sum / n;
+	if (c->dit < SKIM_MIN_DIT)
+		c->dit = SKIM_MIN_DIT;
+	if (c->dit > SKIM_MAX_DIT)
+		c->dit = SKIM_MAX_DIT;
+}
+
+static void channel_element(struct skim_channel *c, int mark){
+	channel_timing(c, mark);
+	c->code = c->code * 2 + (mark > 2 * c->dit);
+	if (c->code > 1023)
+		c->code = 0;	//deeper than the morse table
+	c->word_ended = 0;
+}
+
+static void channel_open(struct skim_channel *c, int bin){
+	memset(c, 0, sizeof(*c));
+	c->in_use = 1;
+	c->bin = bin;
+	c->opened = frame;
+	c->mark = sqrtf(peak[bin]);
+	c->space = sqrtf(noise[bin]);
+	c->env = c->space;
+	c->dit = 20;		// 22 wpm until we know better
+	c->code = 1;
+	c->word_ended = 1;
+	c->down_at = c->up_at = frame;
+	for (int i = bin - 1; i <= bin + 1; i++)
+		bin_taken[i] = 1;
+	opened++;
+}
+
+static void channel_close(struct skim_channel *c){
+	channel_word(c);
+	for (int i = c->bin - 1; i <= c->bin + 1; i++)
+		bin_taken[i] = 0;
+	c->in_use = 0;
+	closed++;
+}
+
+static void channel_frame(struct skim_channel *c){
+	int b = c->bin;
+	float a = sqrtf(power[b]);
+
+	//smooth over about a third of a dit
+	float k = 3.0f / c->dit;
+	if (k > 0.7f)
+		k = 0.7f;
+	c->env += (a - c->env) * k;
+
+	float swing = c->mark - c->space;
+	if (!c->key && c->env > c->space + swing * 0.6f){
+		c->key = 1;
+		//a short space is noise in the middle of a mark
+		if (c->pending && frame - c->up_at < c->dit * 0.3f)
+			c->pending = 0;
+		else {
+			if (c->pending)
+				channel_element(c, c->pending);
+			c->pending = 0;
+			if (!c->word_ended || frame - c->up_at < 3 * c->dit)
+				channel_timing(c, frame - c->up_at);
+			c->down_at = frame;
+		}
+	}
+	else if (c->key && c->env < c->space + swing * 0.4f){
+		c->key = 0;
+		int mark = frame - c->down_at;
+		//a short mark is noise in the middle of a space
+		if (mark >= c->dit * 0.3f){
+			c->pending = mark;
+			c->up_at = frame;
+		}
+	}
+
+	//follow the levels of the marks and the spaces
+	if (c->key){
+		c->mark += (c->env - c->mark) * (c->env > c->mark ? 0.2f : 0.02f);
+		float p0 = power[b] + 1e-20f, pl = power[b - 1] + 1e-20f, pr = power[b + 1] + 1e-20f;
+		float l0 = logf(p0), ll = logf(pl), lr = logf(pr);
+		float d = ll - 2 * l0 + lr;
+		if (d < 0 && p0 >= pl && p0 >= pr){
+			c->side_sum += 0.5f * (ll - lr) / d;
+			c->side_count++;
+		}
+		c->quiet = 0;
+	}
+	else {
+		c->space += (c->env - c->space) * (c->env < c->space ? 0.2f : 0.02f);
+		int gap = frame - c->up_at;
+		if (c->pending && gap >= c->dit * 0.3f){
+			channel_element(c, c->pending);
+			c->pending = 0;
+		}
+		if (!c->pending && c->code > 1 && gap > 2 * c->dit){
+			//the code is walked the same way as modem_cw's tree
+			const char *letters = morse_rx_lookup(c->code);
+			if (!letters)
+				channel_letter(c, '*');
+			else
+				for (; *letters; letters++)
+					channel_letter(c, *letters);
+			c->code = 1;
+		}
+		else if (!c->pending && c->code == 0 && gap > 2 * c->dit){
+			channel_letter(c, '*');
+			c->code = 1;
+		}
+		if (!c->word_ended && c->code == 1 && gap > 5 * c->dit){
+			channel_letter(c, ' ');
+			c->word_ended = 1;
+		}
+		c->quiet++;
+	}
+
+	//keep the mark level above the space, for a faded signal
+	if (c->mark < c->space * 1.5f)
+		c->mark = c->space * 1.5f;
+}
+
+/* ---- the channelizer ---- */
+
+static void skim_reset(){
+	pthread_mutex_lock(&channels_lock);
+	for (int i = 0; i < SKIM_MAX_CHANNELS; i++)
+		if (channels[i].in_use)
+			channel_close(channels + i);
+	pthread_mutex_unlock(&channels_lock);
+	memset(if_history, 0, sizeof(if_history));
+	memset(smooth, 0, sizeof(smooth));
+	memset(peak, 0, sizeof(peak));
+	memset(noise, 0, sizeof(noise));
+	memset(bin_taken, 0, sizeof(bin_taken));
+	frame = 0;
+	skim_dial = freq_hdr;
+	skim_shift = if_shift();
+}
+
+// opens a decoder on each new peak well above the noise
+static void skim_scan(){
+	int in_use = 0;
+	struct skim_channel *free_channel = channels;
+
+	for (int b = SKIM_LOW_BIN; b < SKIM_HIGH_BIN; b++){
+		if (bin_taken[b] || peak[b] < SKIM_OPEN * noise[b])
+			continue;
+		if (peak[b] < peak[b - 1] || peak[b] < peak[b + 1])
+			continue;
+		while (free_channel < channels + SKIM_MAX_CHANNELS && free_channel->in_use)
+			free_channel++;
+		if (free_channel == channels + SKIM_MAX_CHANNELS)
+			break;
+		channel_open(free_channel, b);
+	}
+
+	for (int i = 0; i < SKIM_MAX_CHANNELS; i++){
+		struct skim_channel *c = channels + i;
+		if (!c->in_use)
+			continue;
+		if (c->quiet > SKIM_CLOSE)
+			channel_close(c);
+		else
+			in_use++;
+	}
+	if (in_use > most_channels)
+		most_channels = in_use;
+}
+
+static void skim_process(struct if_block *b){
+	int keep = SKIM_NFFT - SKIM_HOP;
+	int count = b->count - b->count % SKIM_HOP;
+
+	if (__atomic_load_n(&skim_restart, __ATOMIC_ACQUIRE)){
+		skim_reset();
+		__atomic_store_n(&skim_restart, 0, __ATOMIC_RELEASE);
+	}
+	else if (skim_dial != freq_hdr || skim_shift != if_shift())
+		skim_reset();
+
+	for (int i = 0; i < count; i++)
+		if_history[keep + i] = b->samples[i] / 200000000.0f;
+	int frames = count / SKIM_HOP;
+	for (int f = 0; f < frames; f++){
+		float *in = fft_in + f * SKIM_NFFT, *h = if_history + f * SKIM_HOP;
+		for (int i = 0; i < SKIM_NFFT; i++)
+			in[i] = h[i] * fft_window[i];
+	}
+	fftwf_execute(fft_plan);
+	memmove(if_history, if_history + frames * SKIM_HOP, keep * sizeof(float));
+
+	pthread_mutex_lock(&channels_lock);
+	for (int f = 0; f < frames; f++){
+		fftwf_complex *out = fft_out + f * (SKIM_BINS + 1);
+
+		for (int k = SKIM_LOW_BIN - 2; k < SKIM_HIGH_BIN + 2; k++){
+			float p = crealf(out[k]) * crealf(out[k]) + cimagf(out[k]) * cimagf(out[k]);
+			power[k] = p;
+
+			//the peak falls in a few seconds, the noise follows what is
+			//left once the marks are kept out of it and creeps up otherwise
+			float s = smooth[k] += (p - smooth[k]) * 0.3f;
+			if (s > peak[k])
+				peak[k] = s;
+			else
+				peak[k] *= 0.999f;
+			if (frame < 64)
+				noise[k] += (s - noise[k]) * 0.1f;
+			else if (s < 3 * noise[k])
+				noise[k] += (s - noise[k]) * 0.005f;
+			else
+				noise[k] *= 1.002f;
+		}
+
+		for (int i = 0; i < SKIM_MAX_CHANNELS; i++)
+			if (channels[i].in_use)
+				channel_frame(channels + i);
+		if (frame % SKIM_SCAN == 0 && frame > 100)
+			skim_scan();
+		frame++;
+	}
+	pthread_mutex_unlock(&channels_lock);
+}
+
+void *skim_thread_function(void *ptr){
+	while(1){
+		usleep(10000);
+
+		struct if_block *b;
+		while ((b = if_ring_next(&skim_ring))){
+			long long start = thread_ns();
+			skim_process(b);
+			chan_ns += thread_ns() - start;
+			if_ring_done(&skim_ring);
+		}
+	}
+}
+
+void skimmer_rx(int32_t *samples, int count){
+	if (skim_active)
+		if_ring_push(&skim_ring, samples, count);
+}
+
+// picks up the CW_SKIM setting and reports the spots, from modem_poll()
+void skimmer_poll(){
+	const char *value = field_str("CW_SKIM");
+	int on = value && !strcmp(value, "ON");
+
+	while (report_tail != __atomic_load_n(&report_head, __ATOMIC_ACQUIRE)){
+		skim_report(reports + report_tail);
+		__atomic_store_n(&report_tail, (report_tail + 1) % SKIM_REPORTS, __ATOMIC_RELEASE);
+	}
+
+	if (on == skim_active)
+		return;
+	//the channelizer thread resets before it takes the first new block
+	if (on)
+		__atomic_store_n(&skim_restart, 1, __ATOMIC_RELEASE);
+	skim_active = on;
+}
+
+void skimmer_reset_stats(){
+	chan_ns = 0;
+	spots = opened = closed = most_channels = 0;
+	if_ring_reset_stats(&skim_ring);
+}
+
+void skimmer_status(){
+	char buff[300];
+
+	if (!skim_active){
+		write_console(FONT_LOG, "\nCW skimmer is off, turn it on with \\cw_skim ON\n");
+		return;
+	}
+
+	double elapsed_ns = if_ring_elapsed_ns(&skim_ring);
+
+	pthread_mutex_lock(&channels_lock);
+	int in_use = 0;
+	for (int i = 0; i < SKIM_MAX_CHANNELS; i++)
+		in_use += channels[i].in_use;
+	sprintf(buff, "\nCW skimmer over %.0f secs: %.1f%% cpu, %d signals (most %d), "
+		"%d opened %d closed, %d spots, %d IF overflows\n",
+		elapsed_ns / 1e9, (100.0 * chan_ns) / elapsed_ns, in_use, most_channels,
+		opened, closed, spots, skim_ring.overflows);
+	write_console(FONT_LOG, buff);
+
+	for (int i = 0; i < SKIM_MAX_CHANNELS; i++){
+		struct skim_channel *c = channels + i;
+		if (!c->in_use || !c->text[0])
+			continue;
+		double hz = c->bin * SKIM_BIN_HZ - SKIM_IF - skim_shift;
+		int wpm = (int)lrintf(1200.0f / (c->dit * 1000.0f / SKIM_FRAME_RATE));
+		sprintf(buff, "%9.1f %2d wpm %+3d dB %s\n", (skim_dial + hz) / 1000.0,
+			wpm, channel_snr(c), c->text);
+		write_console(FONT_LOG, buff);
+	}
+	pthread_mutex_unlock(&channels_lock);
+}
+
+void skimmer_init(){
+	if_ring_init(&skim_ring, SKIM_RING);
+	for (int i = 0; i < SKIM_NFFT; i++)
+		fft_window[i] = 0.5f - 0.5f * cosf(2 * M_PI * i / SKIM_NFFT);
+
+	int n = SKIM_NFFT;
+	fft_in = (float *)fftwf_malloc(SKIM_FRAMES * SKIM_NFFT * sizeof(float));
+	fft_out = (fftwf_complex *)fftwf_malloc(SKIM_FRAMES * (SKIM_BINS + 1) * sizeof(fftwf_complex));
+	fft_plan = fftwf_plan_many_dft_r2c(1, &n, SKIM_FRAMES, fft_in, NULL, 1, SKIM_NFFT,
+		fft_out, NULL, 1, SKIM_BINS + 1, FFTW_ESTIMATE);
+
+	skim_reset();
+	skimmer_reset_stats();
+	pthread_create(&skim_thread, NULL, skim_thread_function, (void*)NULL);
+}
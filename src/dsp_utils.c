@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <complex.h>
+#include <fftw3.h>
+#include "sdr.h"
+#include "sound.h"
+#include "dsp_utils.h"
+
+long long thread_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+double monotonic_now(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// designed in double, the zeros of a halfband come out as zeros
+void lowpass_design(float *coeff, int taps, float cutoff, float rate, int blackman){
+	double fc = cutoff / rate;
+	int m = taps - 1;
+	double sum = 0;
+	for (int i = 0; i < taps; i++){
+		double n = i - m / 2.0;
+		double sinc = n == 0 ? 2 * fc : sin(2 * M_PI * fc * n) / (M_PI * n);
+		double w;
+		if (blackman)
+			w = 0.42 - 0.5 * cos(2 * M_PI * i / m) + 0.08 * cos(4 * M_PI * i / m);
+		else
+			w = 0.54 - 0.46 * cos(2 * M_PI * i / m);
+		coeff[i] = sinc * w;
+		sum += coeff[i];
+	}
+	for (int i = 0; i < taps; i++)
+		coeff[i] /= sum;
+}
+
+int if_shift(){
+	if (rx_list->mode == MODE_CW)
+		return get_pitch();
+	else if (rx_list->mode == MODE_CWR)
+		return -get_pitch();
+	return 0;
+}
+
+void if_ring_init(struct if_ring *r, int size){
+	r->blocks = (struct if_block *)malloc(size * sizeof(struct if_block));
+	r->size = size;
+	r->head = r->tail = 0;
+	if_ring_reset_stats(r);
+}
+
+// from the DSP thread
+void if_ring_push(struct if_ring *r, int32_t *samples, int count){
+	int next = (r->head + 1) % r->size;
+	if (next == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)){
+		r->overflows++;
+		return;
+	}
+	if (count > IF_BLOCK)
+		count = IF_BLOCK;
+
+	struct if_block *b = r->blocks + r->head;
+	memcpy(b->samples, samples, count * sizeof(int32_t));
+	b->count = count;
+	b->index = sound_sample_index();
+	b->t = sound_sample_time(b->index);
+	__atomic_store_n(&r->head, next, __ATOMIC_RELEASE);
+}
+
+struct if_block *if_ring_next(struct if_ring *r){
+	if (r->tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE))
+		return NULL;
+	return r->blocks + r->tail;
+}
+
+void if_ring_done(struct if_ring *r){
+	__atomic_store_n(&r->tail, (r->tail + 1) % r->size, __ATOMIC_RELEASE);
+}
+
+void if_ring_reset_stats(struct if_ring *r){
+	r->overflows = 0;
+	r->since = monotonic_now();
+}
+
+double if_ring_elapsed_ns(struct if_ring *r){
+	double ns = (monotonic_now() - r->since) * 1e9;
+	return ns < 1 ? 1 : ns;
+}
@@ -0,0 +1,71 @@
+#ifndef DSP_UTILS_H
+#define DSP_UTILS_H
+
+#include <stdint.h>
+#include <complex.h>
+
+// the helpers shared by the receivers that run off the IF
+
+long long thread_ns();		//cpu time of the calling thread
+double monotonic_now();		//CLOCK_MONOTONIC in seconds
+
+// windowed sinc, cutoff is in Hz at the sampling rate,
+// a Blackman window if blackman is set, else a Hamming window
+void lowpass_design(float *coeff, int taps, float cutoff, float rate, int blackman);
+
+// the IF moves with the LO offset in CW modes
+int if_shift();
+
+/*
+	The receivers that run off the IF (or the demodulated audio) on
+	their own threads are handed the blocks through an if_ring, a lock
+	free ring with the DSP thread as the only writer and the receiver's
+	thread as the only reader. if_ring_push() only copies the block, if
+	the receiver falls behind the block is dropped and counted, the DSP
+	never waits. The rings are set up by the *_init() of the receivers,
+	on the main thread, which is also where fftw planning has to happen.
+*/
+#define IF_BLOCK 1024
+
+struct if_block {
+	int32_t samples[IF_BLOCK];
+	int count;
+	long long index;		// capture sample index of the first sample
+	double t;						// its CLOCK_REALTIME, from the sample clock
+};
+
+struct if_ring {
+	struct if_block *blocks;
+	int size;
+	int head, tail;
+	int overflows;			// blocks dropped since the stats were reset
+	double since;				// monotonic_now() of the reset of the stats
+};
+
+void if_ring_init(struct if_ring *r, int size);
+void if_ring_push(struct if_ring *r, int32_t *samples, int count);
+struct if_block *if_ring_next(struct if_ring *r);	// the oldest, NULL if none
+void if_ring_done(struct if_ring *r);					// frees the oldest
+void if_ring_reset_stats(struct if_ring *r);
+// since the reset of the stats, the receivers give their cpu as a
+// percentage of one core over this
+double if_ring_elapsed_ns(struct if_ring *r);
+
+// plain complex multiply, without the inf/nan checks of the C library
+static inline float complex cmul(float complex a, float complex b){
+	float ar = crealf(a), ai = cimagf(a), br = crealf(b), bi = cimagf(b);
+	return (ar * br - ai * bi) + I * (ar * bi + ai * br);
+}
+
+// mixing down by a quarter of the sampling rate is
+// a multiplication by 1, -j, -1, j, n is the sample count
+static inline float complex quarter_mix(float x, unsigned n){
+	switch(n & 3){
+	case 0: return x;
+	case 1: return -I * x;
+	case 2: return -x;
+	default: return I * x;
+	}
+}
+
+#endif  // DSP_UTILS_H
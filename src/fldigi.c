@@ -0,0 +1,652 @@
+/*
+	fldigi client
+
+	fldigi is the proxy for the RTTY and PSK31 modems when the native
+	ones are off. It is driven through its XML-RPC interface on port 7362.
+
+	The client runs on its own thread and keeps one HTTP/1.1 connection
+	open to fldigi. The rest of the sbitx never waits on fldigi:
+	the calls below only leave what is wanted in the shared state
+	and pick up what the thread has fetched.
+
+	1. fldigi_set_modem(), fldigi_set_carrier() record the settings.
+	They are sent when they change and again after a reconnect.
+	2. fldigi_send_text() queues the text to transmit. All the text
+	queued between the requests goes as a single text.add_tx, text
+	that fldigi faults FLDIGI_TEXT_TRIES times in a row is dropped.
+	3. fldigi_trx() asks to switch between tx and rx.
+	4. fldigi_read_text() returns the text decoded by fldigi and
+	fldigi_trx_state() its last reported tx/rx state. While these are
+	being called, fldigi is polled every 250 msec.
+
+	Everything that is due goes out together as one system.multicall,
+	so a poll with a change of the carrier and some text is a single
+	round trip. The socket is non-blocking and the thread steps
+	through connecting, sending and waiting for the reply, giving up
+	on an unresponsive fldigi after 2 seconds and trying to connect
+	again 2 seconds later.
+
+	\fldigistat shows the round trip times.
+*/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "sdr_ui.h"
+#include "fldigi.h"
+
+#define FLDIGI_PORT 7362
+#define FLDIGI_POLL 250				// msec between the polls
+#define FLDIGI_TIMEOUT 2000		// msec to connect or reply
+#define FLDIGI_RETRY 2000			// msec before connecting again
+#define FLDIGI_WANTED 1000		// msec after the last read to keep polling
+#define FLDIGI_TX_TEXT 1024
+#define FLDIGI_RX_TEXT 4096
+#define FLDIGI_CALLS 8
+#define FLDIGI_TEXT_TRIES 3		// faults of text.add_tx before the text is dropped
+
+enum {FLDIGI_CLOSED, FLDIGI_CONNECTING, FLDIGI_READY, FLDIGI_SENDING,
+	FLDIGI_WAITING};
+
+enum {CALL_MODEM, CALL_CARRIER, CALL_CLEAR, CALL_TEXT, CALL_TRX,
+	CALL_RX_DATA, CALL_TRX_STATE};
+
+// shared with the rest of the sbitx, under fldigi_lock
+static pthread_mutex_t fldigi_lock = PTHREAD_MUTEX_INITIALIZER;
+static char want_modem[32];
+static char sent_modem[32];
+static int want_carrier = -1, sent_carrier = -1;
+static int want_trx = -1;						// 1 for main.tx, 0 for main.rx
+static int want_clear = 0;
+static char tx_text[FLDIGI_TX_TEXT];
+static int tx_text_len = 0;
+static char rx_text[FLDIGI_RX_TEXT];
+static int rx_text_len = 0;
+static char trx_state[16];
+static long long polled_at = 0;			// last time the rx side was read
+static int flushed = 0;							// drop the text fldigi has buffered
+
+// the thread's own
+static int fldigi_socket = -1;
+static int state = FLDIGI_CLOSED;
+static long long state_since, retry_at, poll_at;
+static char calls[FLDIGI_TX_TEXT * 5 + 4000];
+static int calls_len;
+static char request[sizeof(calls) + 500];
+static int request_len, request_sent;
+static char reply[65536];
+static int reply_len;
+static int batch[FLDIGI_CALLS];
+static int batch_calls;
+static int batch_text, batch_trx, batch_carrier, batch_flushed;
+static int text_faults;
+static char batch_modem[32];
+
+// stats, since the last report
+static long long stat_rtt_sum, stat_rtt_max;
+static int stat_batches, stat_calls, stat_chars, stat_dropped, stat_connects, stat_failures;
+static int stat_timeouts;
+
+static long long now_msec(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static long long now_usec(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/* ---- Base64 decoding, fldigi returns the received text as base64 --- */
+
+static int b64_value(int c){
+	if (c >= 'A' && c <= 'Z')
+		return c - 'A';
+	if (c >= 'a' && c <= 'z')
+		return c - 'a' + 26;
+	if (c >= '0' && c <= '9')
+		return c - '0' + 52;
+	if (c == '+')
+		return 62;
+	if (c == '/')
+		return 63;
+	return -1;
+}
+
+static int b64_decode(const char *src, const char *end, char *dst, int max){
+	int bits = 0, n_bits = 0, len = 0;
+
+	for (; src < end && *src != '='; src++){
+		int v = b64_value(*src);
+		if (v < 0)
+			continue;	//line breaks
+		bits = (bits << 6) | v;
+		n_bits += 6;
+		if (n_bits >= 8){
+			n_bits -= 8;
+			if (len < max)
+				dst[len++] = (bits >> n_bits) & 0xff;
+		}
+	}
+	return len;
+}
+
+/* ---- The request ---- */
+
+static void calls_add(const char *s){
+	int len = strlen(s);
+	if (calls_len + len < sizeof(calls)){
+		memcpy(calls + calls_len, s, len);
+		calls_len += len;
+	}
+}
+
+static void request_add_call(int kind, const char *method, const char *param){
+	batch[batch_calls++] = kind;
+	calls_add("<value><struct>"
+		"<member><name>methodName</name><value>");
+	calls_add(method);
+	calls_add("</value></member>"
+		"<member><name>params</name><value><array><data>");
+	if (param)
+		calls_add(param);
+	calls_add("</data></array></value></member></struct></value>\n");
+}
+
+static void request_add_string(char *param, const char *text, int len){
+	char *p = param;
+
+	p += sprintf(p, "<value><string>");
+	for (int i = 0; i < len; i++){
+		switch(text[i]){
+		case '<': p += sprintf(p, "&lt;"); break;
+		case '>': p += sprintf(p, "&gt;"); break;
+		case '&': p += sprintf(p, "&amp;"); break;
+		default: *p++ = text[i];
+		}
+	}
+	sprintf(p, "</string></value>");
+}
+
+// gathers all that is due into one system.multicall,
+// returns 0 if there is nothing to send
+static int request_build(long long now){
+	char param[FLDIGI_TX_TEXT * 5 + 100];
+	const char *head = "<?xml version=\"1.0\"?>\n"
+		"<methodCall><methodName>system.multicall</methodName>\n"
+		"<params><param><value><array><data>\n";
+	const char *tail = "</data></array></value></param></params></methodCall>\n";
+
+	batch_calls = 0;
+	calls_len = 0;
+	batch_text = 0;
+	batch_trx = -1;
+	batch_carrier = -1;
+	batch_modem[0] = 0;
+
+	pthread_mutex_lock(&fldigi_lock);
+	int poll_rx = now - polled_at < FLDIGI_WANTED && now >= poll_at;
+	if (want_modem[0] && strcmp(want_modem, sent_modem)){
+		strcpy(batch_modem, want_modem);
+		sprintf(param, "<value><string>%s</string></value>", want_modem);
+		request_add_call(CALL_MODEM, "modem.set_by_name", param);
+	}
+	if (want_carrier >= 0 && want_carrier != sent_carrier){
+		batch_carrier = want_carrier;
+		sprintf(param, "<value><i4>%d</i4></value>", want_carrier);
+		request_add_call(CALL_CARRIER, "modem.set_carrier", param);
+	}
+	if (want_clear)
+		request_add_call(CALL_CLEAR, "text.clear_tx", NULL);
+	if (tx_text_len){
+		batch_text = tx_text_len;
+		request_add_string(param, tx_text, tx_text_len);
+		request_add_call(CALL_TEXT, "text.add_tx", param);
+	}
+	if (want_trx >= 0){
+		batch_trx = want_trx;
+		request_add_call(CALL_TRX, want_trx ? "main.tx" : "main.rx", NULL);
+	}
+	if (poll_rx || (batch_calls && now - polled_at < FLDIGI_WANTED)){
+		request_add_call(CALL_RX_DATA, "rx.get_data", NULL);
+		request_add_call(CALL_TRX_STATE, "main.get_trx_state", NULL);
+	}
+	batch_flushed = flushed;
+	pthread_mutex_unlock(&fldigi_lock);
+
+	if (!batch_calls)
+		return 0;
+
+	calls[calls_len] = 0;
+	request_len = sprintf(request,
+		"POST / HTTP/1.1\r\n"
+		"Host: 127.0.0.1:%d\r\n"
+		"User-Agent: sbitx\r\n"
+		"Content-Type: text/xml\r\n"
+		"Content-Length: %d\r\n\r\n%s%s%s", FLDIGI_PORT, 
+		(int)(strlen(head) + calls_len + strlen(tail)), head, calls, tail);
+	request_sent = 0;
+	reply_len = 0;
+	return 1;
+}
+
+/* ---- The reply ---- */
+
+static const char *skip_tag(const char *p, const char *tag){
+	while (*p && isspace(*p))
+		p++;
+	int len = strlen(tag);
+	return strncmp(p, tag, len) ? NULL : p + len;
+}
+
+// the length of the complete reply, 0 if more is to come, -1 if bad
+static int reply_complete(){
+	reply[reply_len] = 0;
+	char *body = strstr(reply, "\r\n\r\n");
+	if (!body)
+		return 0;
+	body += 4;
+	char *length = strcasestr(reply, "Content-Length:");
+	if (!length || length > body)
+		return -1;
+	int content_length = atoi(length + strlen("Content-Length:"));
+	if (body - reply + content_length > sizeof(reply) - 1)
+		return -1;
+	if (reply + reply_len < body + content_length)
+		return 0;
+	return body - reply + content_length;
+}
+
+// walks through the results of the multicall in the order of the calls
+static void reply_parse(){
+	char text[FLDIGI_RX_TEXT];
+	int text_len = 0;
+	char state_now[16];
+	int ok[FLDIGI_CALLS] = {0};	// 1 for a result, -1 for a fault
+
+	state_now[0] = 0;
+	const char *p = strstr(reply, "<methodResponse>");
+	if (p)
+		p = strstr(p, "<data>");
+	if (p)
+		p += strlen("<data>");
+
+	for (int i = 0; i < batch_calls; i++){
+		ok[i] = 0;
+		if (!p || !(p = skip_tag(p, "<value>")))
+			break;
+		//a fault is a struct in place of the array of the one result
+		const char *q = skip_tag(p, "<array>");
+		if (!q){
+			ok[i] = -1;
+			p = strstr(p, "</struct>");
+			if (p)
+				p = strstr(p, "</value>");
+			if (p)
+				p += strlen("</value>");
+			continue;
+		}
+		p = q;
+		const char *end = strstr(p, "</array>");
+		if (!end)
+			break;
+		ok[i] = 1;
+		q = strstr(p, "<value>");
+		if (q && q < end){
+			q += strlen("<value>");
+			const char *r;
+			if ((r = skip_tag(q, "<base64>")) || (r = skip_tag(q, "<string>")))
+				q = r;
+			const char *v_end = strchr(q, '<');
+			if (batch[i] == CALL_RX_DATA && v_end)
+				text_len = b64_decode(q, v_end, text, sizeof(text));
+			else if (batch[i] == CALL_TRX_STATE && v_end){
+				int len = v_end - q;
+				if (len > sizeof(state_now) - 1)
+					len = sizeof(state_now) - 1;
+				memcpy(state_now, q, len);
+				state_now[len] = 0;
+			}
+		}
+		p = strstr(end, "</value>");
+		if (p)
+			p += strlen("</value>");
+	}
+
+	pthread_mutex_lock(&fldigi_lock);
+	for (int i = 0; i < batch_calls; i++){
+		//the text that fldigi keeps refusing would be sent forever
+		if (ok[i] < 0 && batch[i] == CALL_TEXT && ++text_faults >= FLDIGI_TEXT_TRIES){
+			memmove(tx_text, tx_text + batch_text, tx_text_len - batch_text);
+			tx_text_len -= batch_text;
+			stat_dropped += batch_text;
+			text_faults = 0;
+		}
+		if (ok[i] <= 0)
+			continue;
+		switch(batch[i]){
+		case CALL_MODEM:
+			strcpy(sent_modem, batch_modem);
+			break;
+		case CALL_CARRIER:
+			sent_carrier = batch_carrier;
+			break;
+		case CALL_CLEAR:
+			want_clear = 0;
+			break;
+		case CALL_TEXT:
+			//more may have been added since
+			memmove(tx_text, tx_text + batch_text, tx_text_len - batch_text);
+			tx_text_len -= batch_text;
+			stat_chars += batch_text;
+			text_faults = 0;
+			break;
+		case CALL_TRX:
+			if (want_trx == batch_trx)
+				want_trx = -1;
+			break;
+		case CALL_RX_DATA:
+			//the text decoded before a change of the mode is dropped
+			if (batch_flushed != flushed || batch_flushed)
+				break;
+			if (text_len > FLDIGI_RX_TEXT - rx_text_len)
+				text_len = FLDIGI_RX_TEXT - rx_text_len;
+			memcpy(rx_text + rx_text_len, text, text_len);
+			rx_text_len += text_len;
+			break;
+		case CALL_TRX_STATE:
+			//the state is stale if a switch went out after this was sent
+			if (want_trx < 0)
+				strcpy(trx_state, state_now);
+			break;
+		}
+	}
+	if (batch_flushed == flushed)
+		flushed = 0;
+	pthread_mutex_unlock(&fldigi_lock);
+}
+
+/* ---- The connection ---- */
+
+static void fldigi_close(int failed){
+	if (fldigi_socket >= 0)
+		close(fldigi_socket);
+	fldigi_socket = -1;
+	state = FLDIGI_CLOSED;
+	if (failed){
+		retry_at = now_msec() + FLDIGI_RETRY;
+		stat_failures++;
+	}
+
+	//fldigi may have restarted, everything is set again
+	pthread_mutex_lock(&fldigi_lock);
+	sent_modem[0] = 0;
+	sent_carrier = -1;
+	trx_state[0] = 0;
+	pthread_mutex_unlock(&fldigi_lock);
+}
+
+static void fldigi_connect(){
+	struct sockaddr_in addr;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(FLDIGI_PORT);
+	addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+	fldigi_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (fldigi_socket < 0){
+		fldigi_close(1);
+		return;
+	}
+	int one = 1;
+	setsockopt(fldigi_socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	stat_connects++;
+	state_since = now_msec();
+	if (connect(fldigi_socket, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+		state = FLDIGI_READY;
+	else if (errno == EINPROGRESS)
+		state = FLDIGI_CONNECTING;
+	else
+		fldigi_close(1);
+}
+
+static int fldigi_needed(long long now){
+	int needed;
+
+	pthread_mutex_lock(&fldigi_lock);
+	needed = now - polled_at < FLDIGI_WANTED
+		|| (want_modem[0] && strcmp(want_modem, sent_modem))
+		|| (want_carrier >= 0 && want_carrier != sent_carrier)
+		|| want_clear || tx_text_len || want_trx >= 0;
+	pthread_mutex_unlock(&fldigi_lock);
+	return needed;
+}
+
+static void *fldigi_thread_function(void *ptr){
+	long long sent_at = 0;
+
+	while(1){
+		long long now = now_msec();
+		struct pollfd pfd;
+		pfd.fd = fldigi_socket;
+		pfd.events = 0;
+		pfd.revents = 0;
+
+		switch(state){
+		case FLDIGI_CLOSED:
+			if (now >= retry_at && fldigi_needed(now))
+				fldigi_connect();
+			break;
+		case FLDIGI_CONNECTING:
+			pfd.events = POLLOUT;
+			break;
+		case FLDIGI_READY:
+			if (request_build(now)){
+				state = FLDIGI_SENDING;
+				state_since = now;
+				sent_at = now_usec();
+				pfd.events = POLLOUT;
+			}
+			else
+				pfd.events = POLLIN;	//only to notice a close by fldigi
+			break;
+		case FLDIGI_SENDING:
+			pfd.events = POLLOUT;
+			break;
+		case FLDIGI_WAITING:
+			pfd.events = POLLIN;
+			break;
+		}
+
+		if (state == FLDIGI_CLOSED){
+			usleep(10000);
+			continue;
+		}
+		if (poll(&pfd, 1, 10) < 0)
+			continue;
+
+		if (state != FLDIGI_READY && now - state_since > FLDIGI_TIMEOUT){
+			stat_timeouts++;
+			fldigi_close(1);
+			continue;
+		}
+
+		if (state == FLDIGI_CONNECTING && pfd.revents){
+			int err = 0;
+			socklen_t len = sizeof(err);
+			getsockopt(fldigi_socket, SOL_SOCKET, SO_ERROR, &err, &len);
+			if (err)
+				fldigi_close(1);
+			else
+				state = FLDIGI_READY;
+		}
+		else if (state == FLDIGI_READY && pfd.revents){
+			//fldigi closed the idle connection
+			fldigi_close(0);
+		}
+		else if (state == FLDIGI_SENDING && pfd.revents){
+			int e = send(fldigi_socket, request + request_sent,
+				request_len - request_sent, MSG_NOSIGNAL);
+			if (e < 0 && errno != EAGAIN && errno != EINTR)
+				fldigi_close(1);
+			else if (e > 0 && (request_sent += e) == request_len){
+				state = FLDIGI_WAITING;
+				state_since = now;
+			}
+		}
+		else if (state == FLDIGI_WAITING && pfd.revents){
+			int e = recv(fldigi_socket, reply + reply_len,
+				sizeof(reply) - 1 - reply_len, 0);
+			if (e == 0 || (e < 0 && errno != EAGAIN && errno != EINTR)){
+				fldigi_close(1);
+				continue;
+			}
+			if (e < 0)
+				continue;
+			reply_len += e;
+			int complete = reply_complete();
+			if (complete < 0){
+				fldigi_close(1);
+				continue;
+			}
+			if (!complete)
+				continue;
+
+			long long rtt = now_usec() - sent_at;
+			stat_rtt_sum += rtt;
+			if (rtt > stat_rtt_max)
+				stat_rtt_max = rtt;
+			stat_batches++;
+			stat_calls += batch_calls;
+
+			reply_parse();
+			state = FLDIGI_READY;
+			for (int i = 0; i < batch_calls; i++)
+				if (batch[i] == CALL_RX_DATA)
+					poll_at = now + FLDIGI_POLL;
+			//HTTP/1.0 servers close after each reply
+			reply[complete] = 0;
+			if (strcasestr(reply, "Connection: close"))
+				fldigi_close(0);
+		}
+	}
+	return NULL;
+}
+
+/* ---- Called by the rest of the sbitx ---- */
+
+void fldigi_set_modem(char *mode){
+	pthread_mutex_lock(&fldigi_lock);
+	if (strcmp(want_modem, mode)){
+		strncpy(want_modem, mode, sizeof(want_modem) - 1);
+		trx_state[0] = 0;
+	}
+	pthread_mutex_unlock(&fldigi_lock);
+}
+
+void fldigi_set_carrier(int pitch){
+	pthread_mutex_lock(&fldigi_lock);
+	want_carrier = pitch;
+	pthread_mutex_unlock(&fldigi_lock);
+}
+
+// returns the number of bytes that could be queued
+int fldigi_send_text(char *text, int len){
+	pthread_mutex_lock(&fldigi_lock);
+	if (len > FLDIGI_TX_TEXT - tx_text_len)
+		len = FLDIGI_TX_TEXT - tx_text_len;
+	memcpy(tx_text + tx_text_len, text, len);
+	tx_text_len += len;
+	pthread_mutex_unlock(&fldigi_lock);
+	return len;
+}
+
+// drops the text that is yet to be sent, here and in fldigi
+void fldigi_clear_text(){
+	pthread_mutex_lock(&fldigi_lock);
+	tx_text_len = 0;
+	want_clear = 1;
+	pthread_mutex_unlock(&fldigi_lock);
+}
+
+void fldigi_trx(int tx){
+	pthread_mutex_lock(&fldigi_lock);
+	want_trx = tx;
+	trx_state[0] = 0;
+	pthread_mutex_unlock(&fldigi_lock);
+}
+
+// the state fldigi last reported ("RX", "TX", ..) or an empty
+// string if it is not known yet
+void fldigi_trx_state(char *state_now){
+	pthread_mutex_lock(&fldigi_lock);
+	polled_at = now_msec();
+	strcpy(state_now, trx_state);
+	pthread_mutex_unlock(&fldigi_lock);
+}
+
+// returns the length of the text received since the last call
+int fldigi_read_text(char *text, int max){
+	int len;
+
+	pthread_mutex_lock(&fldigi_lock);
+	polled_at = now_msec();
+	len = rx_text_len < max ? rx_text_len : max;
+	memcpy(text, rx_text, len);
+	memmove(rx_text, rx_text + len, rx_text_len - len);
+	rx_text_len -= len;
+	pthread_mutex_unlock(&fldigi_lock);
+	return len;
+}
+
+// throws away what has been decoded so far, on a change of the mode
+void fldigi_flush(){
+	pthread_mutex_lock(&fldigi_lock);
+	rx_text_len = 0;
+	flushed++;
+	pthread_mutex_unlock(&fldigi_lock);
+}
+
+void fldigi_status(){
+	char buff[300];
+	static char *states[] = {"not connected", "connecting", "connected",
+		"sending", "waiting"};
+
+	sprintf(buff, "\nfldigi %s: %d round trips of %d calls, "
+		"%lld msec avg %lld max, %d chars sent %d dropped, "
+		"%d connects %d failed %d timed out\n",
+		states[state], stat_batches, stat_calls,
+		stat_batches ? stat_rtt_sum / stat_batches / 1000 : 0,
+		stat_rtt_max / 1000, stat_chars, stat_dropped, stat_connects,
+		stat_failures, stat_timeouts);
+	write_console(FONT_LOG, buff);
+	stat_rtt_sum = stat_rtt_max = 0;
+	stat_batches = stat_calls = stat_chars = stat_dropped = 0;
+	stat_connects = stat_failures = stat_timeouts = 0;
+}
+
+void fldigi_init(){
+	static int started = 0;
+	static pthread_t fldigi_thread;
+
+	if (started)
+		return;
+	pthread_create(&fldigi_thread, NULL, fldigi_thread_function, NULL);
+	started = 1;
+}
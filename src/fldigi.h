@@ -0,0 +1,10 @@
+void fldigi_init();
+void fldigi_set_modem(char *mode);
+void fldigi_set_carrier(int pitch);
+int fldigi_send_text(char *text, int len);
+void fldigi_clear_text();
+void fldigi_trx(int tx);
+void fldigi_trx_state(char *state_now);
+int fldigi_read_text(char *text, int max);
+void fldigi_flush();
+void fldigi_status();
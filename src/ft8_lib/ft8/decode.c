@@ -5,6 +5,7 @@
 #include "unpack.h"
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <math.h>
 
 /// Compute log likelihood log(p(1) / p(0)) of 174 message bits for later use in soft-decision LDPC decoding
@@ -397,6 +398,11 @@ static void ftx_normalize_logl(float* log174)
 }
 
 bool ft8_decode(const waterfall_t* wf, const candidate_t* cand, message_t* message, int max_iterations, decode_status_t* status)
+{
+    return ft8_decode_ap(wf, cand, NULL, message, max_iterations, status);
+}
+
+bool ft8_decode_ap(const waterfall_t* wf, const candidate_t* cand, const ftx_apriori_t* ap, message_t* message, int max_iterations, decode_status_t* status)
 {
     float log174[FTX_LDPC_N]; // message bits encoded as likelihood
     if (wf->protocol == PROTO_FT4)
@@ -410,6 +416,33 @@ bool ft8_decode(const waterfall_t* wf, const candidate_t* cand, message_t* messa
 
     ftx_normalize_logl(log174);
 
+    // The received bits are kept to count the hard errors of the decode
+    float received[FTX_LDPC_N];
+    if (ap)
+    {
+        // Known bits are made a little more certain than the best received bit
+        float ap_mag = 0;
+        for (int i = 0; i < FTX_LDPC_N; ++i)
+        {
+            received[i] = log174[i];
+            if (fabsf(log174[i]) > ap_mag)
+                ap_mag = fabsf(log174[i]);
+        }
+        ap_mag *= 1.01f;
+
+        // The first 77 bits of the (systematic) codeword are the message itself
+        for (int i = 0; i < 77; ++i)
+        {
+            uint8_t mask = 0x80 >> (i % 8);
+            if (!(ap->mask[i / 8] & mask))
+                continue;
+            uint8_t bit = ap->bits[i / 8];
+            if (wf->protocol == PROTO_FT4)
+                bit ^= kFT4_XOR_sequence[i / 8];
+            log174[i] = (bit & mask) ? ap_mag : -ap_mag;
+        }
+    }
+
     uint8_t plain174[FTX_LDPC_N]; // message bits (0/1)
     bp_decode(log174, max_iterations, plain174, &status->ldpc_errors);
     // ldpc_decode(log174, max_iterations, plain174, &status->ldpc_errors);
@@ -419,6 +452,16 @@ bool ft8_decode(const waterfall_t* wf, const candidate_t* cand, message_t* messa
         return false;
     }
 
+    status->hard_errors = 0;
+    if (ap)
+    {
+        for (int i = 0; i < FTX_LDPC_N; ++i)
+        {
+            if ((received[i] > 0) != (plain174[i] != 0))
+                ++status->hard_errors;
+        }
+    }
+
     // Extract payload + CRC (first FTX_LDPC_K bits) packed into a byte array
     uint8_t a91[FTX_LDPC_K_BYTES];
     pack_bits(plain174, FTX_LDPC_K, a91);
@@ -51,8 +51,17 @@ typedef struct
     uint16_t crc_extracted;  ///< CRC value recovered from the message
     uint16_t crc_calculated; ///< CRC value calculated over the payload
     int unpack_status;       ///< Return value of the unpack routine
+    int hard_errors;         ///< Number of received bits that disagree with the decoded codeword
 } decode_status_t;
 
+/// A-priori (AP) knowledge of the message bits, e.g. the callsigns of a QSO in progress.
+/// The known bits are given to the LDPC decoder as near-certain, which recovers weaker signals.
+typedef struct
+{
+    uint8_t bits[10]; ///< Expected 77-bit message, packed as by pack77() (before the FT4 scrambling)
+    uint8_t mask[10]; ///< Bits set here mark the bits of the message that are known
+} ftx_apriori_t;
+
 /// Localize top N candidates in frequency and time according to their sync strength (looking at Costas symbols)
 /// We treat and organize the candidate list as a min-heap (empty initially).
 /// @param[in] power Waterfall data collected during message slot
@@ -72,4 +81,15 @@ int ft8_find_sync(const waterfall_t* power, int num_candidates, candidate_t heap
 /// @return True if the decoding was successful, false otherwise (check status for details)
 bool ft8_decode(const waterfall_t* power, const candidate_t* cand, message_t* message, int max_iterations, decode_status_t* status);
 
+/// Same as ft8_decode(), with some of the message bits known in advance.
+/// A-priori decodes are less certain, check status->hard_errors before trusting them.
+/// @param[in] power Waterfall data collected during message slot
+/// @param[in] cand Candidate to decode
+/// @param[in] ap Known message bits, NULL for a plain decode
+/// @param[out] message message_t structure that will receive the decoded message
+/// @param[in] max_iterations Maximum allowed LDPC iterations
+/// @param[out] status decode_status_t structure that will be filled with the status of various decoding steps
+/// @return True if the decoding was successful, false otherwise (check status for details)
+bool ft8_decode_ap(const waterfall_t* power, const candidate_t* cand, const ftx_apriori_t* ap, message_t* message, int max_iterations, decode_status_t* status);
+
 #endif // _INCLUDE_DECODE_H_
@@ -0,0 +1,435 @@
+/*
+	Wideband FT8/FT4 decoder
+
+	The FT8 modem only hears the 3 kHz of audio that comes out of the
+	demodulator. This decoder taps the 96 kHz IF itself and decodes
+	several sub-bands at the same time, in the background, whatever
+	the current mode is. A typical use is to watch the FT8 and the FT4
+	windows of a band together (they are 6 kHz apart on 20m).
+
+	The channels are set with the FTX_CHANNELS setting as a list of
+	offset:protocol pairs. The offset is in Hz from the dial frequency.
+		\ftx_channels 0:FT8,6000:FT4
+	An empty setting turns the wideband decoder off.
+	\ftxstat prints the cpu used by each channel.
+
+	1. ft8_wide_rx() is called by the DSP thread with each block of the IF
+	and pushes it into an if_ring (see dsp_utils.h).
+
+	2. The channelizer thread reads the ring and for each channel
+	mixes the virtual dial of the channel down, low-pass filters and
+	decimates it to 12000 samples/sec in two steps (96k->24k->12k).
+	The result is shifted back up to produce USB audio of 200-3000 Hz,
+	the same as the modem gets.
+	The audio is collected into a slot buffer. The slots are timed
+	on the capture sample clock of the IF blocks (sound_sample_time()),
+	15 seconds for FT8 and 7.5 seconds for FT4.
+
+	3. At the end of each slot the buffer is handed over to the decoder
+	thread, the channelizer goes on with the other buffer of the channel.
+	If the decoder is still busy with the previous slot of the channel,
+	the slot is dropped and counted as an overrun.
+
+	4. The decoder thread runs at a lower priority and reports
+	each decode with its absolute RF frequency on the console.
+
+	The IF is at 24 kHz, upper sideband (see radio_tune_to() in sbitx.c).
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <math.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <time.h>
+#include <complex.h>
+#include <fftw3.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "sdr.h"
+#include "sdr_ui.h"
+#include "modem_ft8.h"
+#include "sound.h"
+#include "dsp_utils.h"
+
+#define FTX_MAX_CHANNELS 6
+#define WIDE_RING 128		// about 1.3 seconds of the IF
+#define WIDE_RATE 96000
+#define WIDE_IF 24000
+
+// the first stage only has to stop the aliases landing beyond 22 kHz
+#define FIR1_TAPS 32
+#define FIR1_CUTOFF 4000
+#define FIR1_DECIMATE 4
+
+// the second stage sets the channel width, it has to reject
+// the lower sideband completely as we take the real part later
+#define FIR2_TAPS 256
+#define FIR2_CUTOFF 1700
+#define FIR2_DECIMATE 2
+
+// the passband is centered here in the audio
+#define CHANNEL_CENTER 1650
+
+static struct if_ring wide_ring;
+
+struct ftx_channel {
+	int enabled;
+	int offset;				//of the virtual dial from the dial, in Hz
+	bool is_ft8;
+	float slot_time;
+
+	// channelizer state
+	float complex osc, rot;				// mixes the channel down to zero
+	float complex up_osc, up_rot;	// and back up to the audio
+	float complex fir1[2 * FIR1_TAPS], fir2[2 * FIR2_TAPS];
+	int fir1_pos, fir2_pos, fir1_phase, fir2_phase;
+	int mix_hz;
+
+	// slot being collected
+	float *buff[2];
+	int fill;
+	int n_samples;
+	long slot;
+	int valid;
+	int dial;
+	double last_t;
+
+	// slot handed over to the decoder
+	volatile int ready;
+	int ready_samples;
+	long ready_slot;
+	long ready_rf;
+	bool ready_is_ft8;
+	float ready_slot_time;
+
+	// stats
+	long long chan_ns, decode_ns, decode_ns_last, decode_ns_max;
+	int decodes, slots, overruns, skipped, candidates;
+};
+
+static struct ftx_channel channels[FTX_MAX_CHANNELS];
+static int n_channels = 0;
+static int wide_active = 0;
+static void *ft8_wide_monitor, *ft4_wide_monitor;
+static float fir1_coeff[FIR1_TAPS], fir2_coeff[FIR2_TAPS];
+static char channels_spec[100];
+
+// the channels as last set, the channelizer thread picks them up
+// when the generation moves on, the lock is only held to copy them
+static struct {
+	int n;
+	int offset[FTX_MAX_CHANNELS];
+	bool is_ft8[FTX_MAX_CHANNELS];
+} wide_config;
+static unsigned wide_config_gen = 0, wide_config_applied = 0;
+static pthread_mutex_t wide_config_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t wide_thread, wide_decode_thread;
+
+static void channel_reset(struct ftx_channel *c){
+	c->osc = 1;
+	c->up_osc = 1;
+	c->up_rot = cexpf(I * 2 * M_PI * CHANNEL_CENTER / (WIDE_RATE / (FIR1_DECIMATE * FIR2_DECIMATE)));
+	memset(c->fir1, 0, sizeof(c->fir1));
+	memset(c->fir2, 0, sizeof(c->fir2));
+	c->fir1_pos = c->fir2_pos = c->fir1_phase = c->fir2_phase = 0;
+	c->mix_hz = 0;
+	c->n_samples = 0;
+	c->slot = -1;
+	c->valid = 0;
+	c->last_t = 0;
+}
+
+static void channel_tune(struct ftx_channel *c){
+	c->mix_hz = WIDE_IF + c->offset + if_shift() + CHANNEL_CENTER;
+	c->rot = cexpf(-I * 2 * M_PI * c->mix_hz / WIDE_RATE);
+}
+
+// a new slot has started, pass on the one just collected
+static void channel_slot_end(struct ftx_channel *c, long slot, double t){
+	int min_samples = (c->is_ft8 ? 13 : 6) * 12000;
+
+	if (c->slot >= 0 && c->valid && c->n_samples >= min_samples){
+		c->slots++;
+		if (c->ready >= 0)
+			c->overruns++;
+		else {
+			c->ready_samples = c->n_samples;
+			c->ready_slot = c->slot;
+			c->ready_rf = (long)c->dial + c->offset;
+			c->ready_is_ft8 = c->is_ft8;
+			c->ready_slot_time = c->slot_time;
+			__atomic_store_n(&c->ready, c->fill, __ATOMIC_RELEASE);
+			c->fill ^= 1;
+		}
+	}
+
+	c->slot = slot;
+	c->n_samples = 0;
+	c->dial = freq_hdr;
+	channel_tune(c);
+	// we can't use a slot that we joined late
+	c->valid = (t - slot * c->slot_time) < 0.1;
+}
+
+static void channel_process(struct ftx_channel *c, struct if_block *b){
+	long slot = (long)floor(b->t / c->slot_time);
+
+	if (slot != c->slot)
+		channel_slot_end(c, slot, b->t);
+	// a gap in the IF (like a transmission) or a retuning spoils the slot
+	else if (fabs(b->t - c->last_t - IF_BLOCK / (double)WIDE_RATE) > 0.1
+		|| c->dial != freq_hdr)
+		c->valid = 0;
+	c->last_t = b->t;
+
+	int max_samples = (int)(c->slot_time * 12000);
+	float *out = c->buff[c->fill];
+
+	for (int i = 0; i < b->count; i++){
+		float complex z = (b->samples[i] / 200000000.0f) * c->osc;
+		c->osc = cmul(c->osc, c->rot);
+
+		c->fir1[c->fir1_pos] = c->fir1[c->fir1_pos + FIR1_TAPS] = z;
+		if (++c->fir1_pos == FIR1_TAPS)
+			c->fir1_pos = 0;
+		if (++c->fir1_phase < FIR1_DECIMATE)
+			continue;
+		c->fir1_phase = 0;
+
+		float complex *h = c->fir1 + c->fir1_pos;
+		float complex y = 0;
+		for (int k = 0; k < FIR1_TAPS; k++)
+			y += fir1_coeff[k] * h[k];
+
+		c->fir2[c->fir2_pos] = c->fir2[c->fir2_pos + FIR2_TAPS] = y;
+		if (++c->fir2_pos == FIR2_TAPS)
+			c->fir2_pos = 0;
+		if (++c->fir2_phase < FIR2_DECIMATE)
+			continue;
+		c->fir2_phase = 0;
+
+		h = c->fir2 + c->fir2_pos;
+		y = 0;
+		for (int k = 0; k < FIR2_TAPS; k++)
+			y += fir2_coeff[k] * h[k];
+
+		if (c->n_samples < max_samples)
+			out[c->n_samples++] = 2 * crealf(cmul(y, c->up_osc));
+		c->up_osc = cmul(c->up_osc, c->up_rot);
+	}
+
+	//keep the oscillators from drifting in amplitude
+	c->osc /= cabsf(c->osc);
+	c->up_osc /= cabsf(c->up_osc);
+}
+
+// on the channelizer thread, the decoder only uses the ready_ copies
+// of a channel so it can go on with a slot of the old setting
+static void ft8_wide_apply(){
+	pthread_mutex_lock(&wide_config_lock);
+	unsigned gen = wide_config_gen;
+	int n = wide_config.n;
+	for (int i = 0; i < n; i++){
+		struct ftx_channel *c = channels + i;
+		c->offset = wide_config.offset[i];
+		c->is_ft8 = wide_config.is_ft8[i];
+	}
+	pthread_mutex_unlock(&wide_config_lock);
+
+	for (int i = 0; i < n; i++){
+		struct ftx_channel *c = channels + i;
+		c->slot_time = c->is_ft8 ? 15 : 7.5;
+		channel_reset(c);
+		c->enabled = 1;
+	}
+	for (int i = n; i < FTX_MAX_CHANNELS; i++)
+		channels[i].enabled = 0;
+	n_channels = n;
+	wide_config_applied = gen;
+}
+
+void *ft8_wide_thread_function(void *ptr){
+	while(1){
+		usleep(5000);
+
+		if (__atomic_load_n(&wide_config_gen, __ATOMIC_ACQUIRE) != wide_config_applied)
+			ft8_wide_apply();
+
+		struct if_block *b;
+		while ((b = if_ring_next(&wide_ring))){
+			for (int i = 0; i < n_channels; i++){
+				long long start = thread_ns();
+				channel_process(channels + i, b);
+				channels[i].chan_ns += thread_ns() - start;
+			}
+			if_ring_done(&wide_ring);
+		}
+	}
+}
+
+struct wide_decode_ctx {
+	char time_str[20];
+	const char *protocol;
+	long rf;
+	int decodes;
+};
+
+static void ft8_wide_on_decode(void *ctx, const char *text, int score, int snr,
+	float freq_hz, float time_sec){
+	struct wide_decode_ctx *c = (struct wide_decode_ctx *)ctx;
+	char buff[200];
+
+	// these go to the log rather than the FT8 console lines,
+	// a click on them shouldn't start a qso on the dial frequency
+	sprintf(buff, "%s %s %+03d %9.3f ~  %s\n", c->time_str, c->protocol, snr,
+		(c->rf + freq_hz) / 1000.0, text);
+	write_console(FONT_LOG, buff);
+	c->decodes++;
+}
+
+void *ft8_wide_decode_function(void *ptr){
+	//stay out of the way of the modem and the user interface
+	setpriority(PRIO_PROCESS, syscall(SYS_gettid), 10);
+
+	while(1){
+		usleep(10000);
+
+		for (int i = 0; i < FTX_MAX_CHANNELS; i++){
+			struct ftx_channel *c = channels + i;
+			int ready = __atomic_load_n(&c->ready, __ATOMIC_ACQUIRE);
+			if (ready < 0)
+				continue;
+
+			struct wide_decode_ctx ctx;
+			time_t slot_start = (time_t)(c->ready_slot * c->ready_slot_time);
+			struct tm *t = gmtime(&slot_start);
+			sprintf(ctx.time_str, "%02d%02d%02d", t->tm_hour, t->tm_min, t->tm_sec);
+			ctx.protocol = c->ready_is_ft8 ? "FT8" : "FT4";
+			ctx.rf = c->ready_rf;
+			ctx.decodes = 0;
+
+			//we have until the next slot of this channel is collected
+			double deadline = sound_monotonic_time((c->ready_slot + 2) * c->ready_slot_time);
+
+			struct ftx_decode_stats stats;
+			long long start = thread_ns();
+			ftx_decode(c->ready_is_ft8 ? ft8_wide_monitor : ft4_wide_monitor,
+				c->buff[ready], c->ready_samples, deadline, ft8_wide_on_decode, &ctx,
+				&stats);
+			long long elapsed = thread_ns() - start;
+			c->skipped += stats.skipped;
+			c->candidates += stats.candidates;
+
+			c->decode_ns += elapsed;
+			c->decode_ns_last = elapsed;
+			if (elapsed > c->decode_ns_max)
+				c->decode_ns_max = elapsed;
+			c->decodes += ctx.decodes;
+			__atomic_store_n(&c->ready, -1, __ATOMIC_RELEASE);
+		}
+	}
+}
+
+void ft8_wide_rx(int32_t *samples, int count){
+	if (wide_active)
+		if_ring_push(&wide_ring, samples, count);
+}
+
+// parses a list like "0:FT8,6000:FT4", the channelizer thread takes it up
+static void ft8_wide_configure(const char *spec){
+	char buff[100], *p, *save;
+	int n = 0;
+
+	pthread_mutex_lock(&wide_config_lock);
+	strncpy(buff, spec, sizeof(buff) - 1);
+	buff[sizeof(buff) - 1] = 0;
+	for (p = strtok_r(buff, ", ", &save); p && n < FTX_MAX_CHANNELS;
+		p = strtok_r(NULL, ", ", &save)){
+		char *colon = strchr(p, ':');
+		if (!colon){
+			printf("FTX channel %s is not offset:protocol\n", p);
+			continue;
+		}
+		int offset = atoi(p);
+		if (offset < -20000 || offset > 20000){
+			printf("FTX channel %s is outside the IF\n", p);
+			continue;
+		}
+		wide_config.offset[n] = offset;
+		wide_config.is_ft8[n] = strcasecmp(colon + 1, "FT4") != 0;
+		n++;
+	}
+	wide_config.n = n;
+	__atomic_add_fetch(&wide_config_gen, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&wide_config_lock);
+	wide_active = n > 0;
+	ft8_wide_reset_stats();
+}
+
+// picks up changes to the FTX_CHANNELS setting, from modem_poll()
+void ft8_wide_poll(){
+	const char *spec = field_str("FTX_CHANNELS");
+	if (!spec || !strcmp(spec, channels_spec))
+		return;
+	strncpy(channels_spec, spec, sizeof(channels_spec) - 1);
+	ft8_wide_configure(channels_spec);
+}
+
+void ft8_wide_reset_stats(){
+	for (int i = 0; i < FTX_MAX_CHANNELS; i++){
+		struct ftx_channel *c = channels + i;
+		c->chan_ns = c->decode_ns = c->decode_ns_last = c->decode_ns_max = 0;
+		c->decodes = c->slots = c->overruns = c->skipped = c->candidates = 0;
+	}
+	if_ring_reset_stats(&wide_ring);
+}
+
+void ft8_wide_status(){
+	char buff[200];
+	double elapsed_ns = if_ring_elapsed_ns(&wide_ring);
+
+	if (!n_channels){
+		write_console(FONT_LOG, "\nNo wideband FT8/FT4 channels, set them with \\ftx_channels\n");
+		return;
+	}
+
+	sprintf(buff, "\nWideband FTX over %.0f secs, %d IF overflows\n",
+		elapsed_ns / 1e9, wide_ring.overflows);
+	write_console(FONT_LOG, buff);
+	for (int i = 0; i < n_channels; i++){
+		struct ftx_channel *c = channels + i;
+		sprintf(buff, "%s %+6d Hz: filter %.1f%% decode %.1f%% cpu, %lld ms/slot (max %lld), "
+			"%d slots %d decodes %d overruns, %d/%d candidates skipped\n",
+			c->is_ft8 ? "FT8" : "FT4", c->offset,
+			(100.0 * c->chan_ns) / elapsed_ns, (100.0 * c->decode_ns) / elapsed_ns,
+			c->decode_ns_last / 1000000, c->decode_ns_max / 1000000,
+			c->slots, c->decodes, c->overruns, c->skipped, c->candidates);
+		write_console(FONT_LOG, buff);
+	}
+}
+
+void ft8_wide_init(){
+	if_ring_init(&wide_ring, WIDE_RING);
+	ft8_wide_monitor = ftx_monitor_new(true);
+	ft4_wide_monitor = ftx_monitor_new(false);
+
+	lowpass_design(fir1_coeff, FIR1_TAPS, FIR1_CUTOFF, WIDE_RATE, 0);
+	lowpass_design(fir2_coeff, FIR2_TAPS, FIR2_CUTOFF, WIDE_RATE / FIR1_DECIMATE, 1);
+
+	for (int i = 0; i < FTX_MAX_CHANNELS; i++){
+		channels[i].buff[0] = (float *)malloc(FT8_MAX_BUFF * sizeof(float));
+		channels[i].buff[1] = (float *)malloc(FT8_MAX_BUFF * sizeof(float));
+		channels[i].ready = -1;
+		channels[i].fill = 0;
+	}
+	channels_spec[0] = 0;
+	ft8_wide_reset_stats();
+
+	pthread_create(&wide_thread, NULL, ft8_wide_thread_function, (void*)NULL);
+	pthread_create(&wide_decode_thread, NULL, ft8_wide_decode_function, (void*)NULL);
+}
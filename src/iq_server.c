@@ -0,0 +1,531 @@
+/*
+	IQ streaming server
+
+	Streams the IF around the dial frequency as I/Q to remote sdr
+	programs, over TCP (\iq_server ON, on port IQ_PORT) and/or to a
+	UDP multicast group (IQ_MCAST set to address:port@rate, like
+	239.255.0.1:5007@12000, empty to stop). The TCP port listens on
+	the address of IQ_BIND, only the sbitx itself (127.0.0.1) by
+	default, 0.0.0.0 opens it to the network.
+
+	1. iq_server_rx() is called by the DSP thread with each block of
+	the IF and pushes it into an if_ring (see dsp_utils.h), with its
+	capture sample index and time.
+
+	2. The server thread mixes the IF down from 24 kHz (the dial) to
+	I/Q and decimates it by halves with halfband filters: 48000,
+	24000, 12000 and 6000 samples per second, a span of that many
+	Hz centered on the dial. The stages are only run as far as the
+	slowest rate that someone is listening to. About 80% of the span
+	is free of aliases.
+
+	3. Each subscriber gets the rate it asked for, a TCP client sends
+	a line "rate 12000\n" (48000 by default). The frames are queued per
+	client and written as the socket takes them, the frames that find
+	a client's queue full are dropped and counted, a slow client
+	does not hold up the others.
+
+	Each frame is a header followed by count pairs of float32 I and Q,
+	everything is little endian:
+		uint32 magic 'SBIQ' (0x51494253)
+		uint32 sequence				frames sent to this subscriber so far,
+												a gap means frames were dropped
+		int64	sample_index		capture sample (96000 sps) of the first sample
+		double time						CLOCK_REALTIME secs of the first sample
+		uint64 freq						frequency in Hz of the center of the span, the
+												dial less the pitch in CW (see if_shift())
+		uint32 rate						samples per second
+		uint32 count
+	A multicast frame is split into datagrams of up to IQ_MCAST_SAMPLES,
+	each with its own header.
+
+	\iqstat shows the subscribers with their bytes/s and dropped frames.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+#include <limits.h>
+#include <complex.h>
+#include <fftw3.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "sdr.h"
+#include "sdr_ui.h"
+#include "dsp_utils.h"
+
+#define IQ_MAGIC 0x51494253
+#define IQ_BLOCK IF_BLOCK
+#define IQ_RING 64						// 0.7 seconds of the IF
+#define IQ_STAGES 4						// 48000, 24000, 12000 and 6000 sps
+#define IQ_TAPS 47
+#define IQ_CLIENTS 8
+#define IQ_OUT (512 * 1024)		// bytes queued per client, over a second
+#define IQ_MCAST_SAMPLES 168	// fits a datagram in 1400 bytes
+#define IQ_RETRY 5000				// msec before listening again after a failure
+
+struct iq_header {
+	uint32_t magic;
+	uint32_t sequence;
+	int64_t sample_index;
+	double time;
+	uint64_t freq;
+	uint32_t rate;
+	uint32_t count;
+} __attribute__((packed));
+
+struct iq_client {
+	int socket;							// -1 when the slot is free
+	struct sockaddr_in addr;
+	int is_mcast;
+	int stage;
+	uint32_t sequence;
+	char *out;
+	int out_len, out_sent;
+	char cmd[64];
+	int cmd_len;
+	long long bytes, frames, dropped;	// since the last report
+};
+
+// the tap
+static struct if_ring iq_ring;
+static volatile int iq_tap_on = 0;
+
+// the settings, from iq_server_poll()
+static volatile int tcp_wanted = 0;
+static char bind_wanted[32];
+static volatile int bind_changed = 0;
+static char mcast_wanted[64];
+static volatile int mcast_changed = 0;
+static volatile long iq_freq = 0;
+static pthread_mutex_t settings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// the server thread's own
+static struct iq_client clients[IQ_CLIENTS + 1];	// the last is the multicast
+static int listen_socket = -1;
+static long long listen_at = 0;		// msec, a failed listen waits until then
+static float taps[IQ_TAPS];
+static int nonzero[IQ_TAPS], n_nonzero;
+static complex float stage_in[IQ_STAGES][IQ_BLOCK + IQ_TAPS];
+static complex float stage_out[IQ_STAGES][IQ_BLOCK / 2];
+static int stage_count[IQ_STAGES];
+static unsigned mix_phase = 0;
+static pthread_t iq_thread;
+
+static long long now_msec(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// a halfband low pass, every other tap but the middle is zero
+static void halfband_init(){
+	lowpass_design(taps, IQ_TAPS, 1, 4, 1);
+	n_nonzero = 0;
+	for (int i = 0; i < IQ_TAPS; i++)
+		if (fabs(taps[i]) > 1e-9)
+			nonzero[n_nonzero++] = i;
+}
+
+// decimates the stage's input by two, the input is after IQ_TAPS - 1 of history
+static void halfband(int stage, int count){
+	complex float *in = stage_in[stage];
+	complex float *out = stage_out[stage];
+
+	for (int j = 0; j < count / 2; j++){
+		complex float sum = 0;
+		complex float *x = in + 2 * j;
+		for (int k = 0; k < n_nonzero; k++)
+			sum += x[nonzero[k]] * taps[nonzero[k]];
+		out[j] = sum;
+	}
+	memmove(in, in + count, (IQ_TAPS - 1) * sizeof(complex float));
+	stage_count[stage] = count / 2;
+}
+
+/* ---- The subscribers ---- */
+
+static void client_close(struct iq_client *c){
+	if (c->socket >= 0)
+		close(c->socket);
+	c->socket = -1;
+	free(c->out);
+	c->out = NULL;
+}
+
+static int rate_stage(int rate){
+	int stage = 0;
+	while (stage < IQ_STAGES - 1 && (48000 >> (stage + 1)) >= rate)
+		stage++;
+	return stage;
+}
+
+static void client_command(struct iq_client *c, char *line){
+	int rate;
+	if (sscanf(line, "rate %d", &rate) == 1 && rate > 0)
+		c->stage = rate_stage(rate);
+}
+
+static void client_read(struct iq_client *c){
+	char buff[256];
+
+	int e = recv(c->socket, buff, sizeof(buff), MSG_DONTWAIT);
+	if (e == 0 || (e < 0 && errno != EAGAIN && errno != EINTR)){
+		client_close(c);
+		return;
+	}
+	for (int i = 0; i < e; i++){
+		if (buff[i] == '\n' || c->cmd_len == sizeof(c->cmd) - 1){
+			c->cmd[c->cmd_len] = 0;
+			client_command(c, c->cmd);
+			c->cmd_len = 0;
+		}
+		else if (buff[i] != '\r')
+			c->cmd[c->cmd_len++] = buff[i];
+	}
+}
+
+static void client_write(struct iq_client *c){
+	if (c->out_sent == c->out_len)
+		return;
+	int e = send(c->socket, c->out + c->out_sent, c->out_len - c->out_sent,
+		MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (e < 0 && errno != EAGAIN && errno != EINTR){
+		client_close(c);
+		return;
+	}
+	if (e > 0){
+		c->out_sent += e;
+		c->bytes += e;
+	}
+	if (c->out_sent == c->out_len)
+		c->out_sent = c->out_len = 0;
+}
+
+static void client_accept(){
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+
+	int s = accept(listen_socket, (struct sockaddr *)&addr, &len);
+	if (s < 0)
+		return;
+	for (int i = 0; i < IQ_CLIENTS; i++){
+		struct iq_client *c = clients + i;
+		if (c->socket >= 0)
+			continue;
+		memset(c, 0, sizeof(*c));
+		c->socket = s;
+		c->addr = addr;
+		c->out = malloc(IQ_OUT);
+		fcntl(s, F_SETFL, O_NONBLOCK);
+		int one = 1;
+		setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		return;
+	}
+	close(s);
+}
+
+static void header_fill(struct iq_header *h, struct iq_client *c,
+	struct if_block *b, int offset, int count){
+	int decimation = 2 << c->stage;
+
+	h->magic = IQ_MAGIC;
+	h->sequence = c->sequence++;
+	h->sample_index = b->index + (long long)offset * decimation;
+	h->time = b->t + (double)offset * decimation / 96000;
+	h->freq = iq_freq;
+	h->rate = 48000 >> c->stage;
+	h->count = count;
+}
+
+// queues the block's frame for a tcp client, or drops it if there is no room
+static void client_frame(struct iq_client *c, struct if_block *b){
+	int count = stage_count[c->stage];
+	int size = sizeof(struct iq_header) + count * 2 * sizeof(float);
+
+	c->frames++;
+	if (c->out_sent){
+		memmove(c->out, c->out + c->out_sent, c->out_len - c->out_sent);
+		c->out_len -= c->out_sent;
+		c->out_sent = 0;
+	}
+	if (c->out_len + size > IQ_OUT){
+		c->dropped++;
+		c->sequence++;
+		return;
+	}
+	header_fill((struct iq_header *)(c->out + c->out_len), c, b, 0, count);
+	memcpy(c->out + c->out_len + sizeof(struct iq_header), stage_out[c->stage],
+		count * 2 * sizeof(float));
+	c->out_len += size;
+}
+
+static void mcast_frame(struct iq_client *c, struct if_block *b){
+	char packet[sizeof(struct iq_header) + IQ_MCAST_SAMPLES * 2 * sizeof(float)];
+	int count = stage_count[c->stage];
+
+	c->frames++;
+	for (int i = 0; i < count; i += IQ_MCAST_SAMPLES){
+		int n = count - i < IQ_MCAST_SAMPLES ? count - i : IQ_MCAST_SAMPLES;
+		header_fill((struct iq_header *)packet, c, b, i, n);
+		memcpy(packet + sizeof(struct iq_header), stage_out[c->stage] + i,
+			n * 2 * sizeof(float));
+		int size = sizeof(struct iq_header) + n * 2 * sizeof(float);
+		if (sendto(c->socket, packet, size, MSG_DONTWAIT,
+			(struct sockaddr *)&c->addr, sizeof(c->addr)) == size)
+			c->bytes += size;
+		else
+			c->dropped++;
+	}
+}
+
+static void mcast_open(const char *spec){
+	struct iq_client *c = clients + IQ_CLIENTS;
+	char host[64];
+	int port = 5007, rate = 12000;
+
+	client_close(c);
+	if (!spec[0])
+		return;
+
+	strncpy(host, spec, sizeof(host) - 1);
+	host[sizeof(host) - 1] = 0;
+	char *p = strchr(host, '@');
+	if (p){
+		*p++ = 0;
+		rate = atoi(p);
+	}
+	p = strchr(host, ':');
+	if (p){
+		*p++ = 0;
+		port = atoi(p);
+	}
+
+	memset(c, 0, sizeof(*c));
+	c->socket = -1;
+	c->is_mcast = 1;
+	c->addr.sin_family = AF_INET;
+	c->addr.sin_port = htons(port);
+	if (!inet_aton(host, &c->addr.sin_addr) || rate <= 0){
+		printf("IQ_MCAST %s is not an address:port@rate\n", spec);
+		return;
+	}
+	c->stage = rate_stage(rate);
+	c->socket = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+	unsigned char ttl = 1;
+	setsockopt(c->socket, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+}
+
+static void listen_open(const char *bind_addr){
+	struct sockaddr_in addr;
+
+	listen_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	int one = 1;
+	setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(IQ_PORT);
+	if (!inet_aton(bind_addr, &addr.sin_addr)){
+		printf("IQ_BIND %s is not an address\n", bind_addr);
+		close(listen_socket);
+		listen_socket = -1;
+		listen_at = LLONG_MAX;	//until IQ_BIND is changed
+		return;
+	}
+	if (bind(listen_socket, (struct sockaddr *)&addr, sizeof(addr)) < 0
+		|| listen(listen_socket, 4) < 0){
+		perror("iq server");
+		close(listen_socket);
+		listen_socket = -1;
+		listen_at = now_msec() + IQ_RETRY;
+	}
+}
+
+static void listen_close(){
+	if (listen_socket >= 0)
+		close(listen_socket);
+	listen_socket = -1;
+	for (int i = 0; i < IQ_CLIENTS; i++)
+		client_close(clients + i);
+}
+
+/* ---- The stream ---- */
+
+static void iq_process(struct if_block *b){
+	int last = -1;
+
+	for (int i = 0; i <= IQ_CLIENTS; i++)
+		if (clients[i].socket >= 0 && clients[i].stage > last)
+			last = clients[i].stage;
+	if (last < 0)
+		return;
+
+	//down from a quarter of the sampling rate, the gain of 2
+	//makes up for the image that the filter takes out
+	complex float *in = stage_in[0] + IQ_TAPS - 1;
+	int count = b->count & ~1;
+	for (int i = 0; i < count; i++)
+		in[i] = quarter_mix(b->samples[i] / 536870912.0f, mix_phase++);
+	halfband(0, count);
+	for (int s = 1; s <= last; s++){
+		memcpy(stage_in[s] + IQ_TAPS - 1, stage_out[s - 1],
+			stage_count[s - 1] * sizeof(complex float));
+		halfband(s, stage_count[s - 1]);
+	}
+	//the stages that were not run are stale
+	for (int s = last + 1; s < IQ_STAGES; s++)
+		stage_count[s] = 0;
+
+	for (int i = 0; i < IQ_CLIENTS; i++)
+		if (clients[i].socket >= 0)
+			client_frame(clients + i, b);
+	if (clients[IQ_CLIENTS].socket >= 0)
+		mcast_frame(clients + IQ_CLIENTS, b);
+}
+
+static void *iq_thread_function(void *ptr){
+	struct pollfd fds[IQ_CLIENTS + 1];
+
+	while (1){
+		//the settings
+		if (bind_changed){
+			listen_close();
+			bind_changed = 0;
+			listen_at = 0;
+		}
+		if (tcp_wanted && listen_socket < 0 && now_msec() >= listen_at){
+			char bind_addr[32];
+			pthread_mutex_lock(&settings_lock);
+			strcpy(bind_addr, bind_wanted);
+			pthread_mutex_unlock(&settings_lock);
+			listen_open(bind_addr);
+		}
+		else if (!tcp_wanted){
+			if (listen_socket >= 0)
+				listen_close();
+			listen_at = 0;
+		}
+		if (mcast_changed){
+			char spec[64];
+			pthread_mutex_lock(&settings_lock);
+			strcpy(spec, mcast_wanted);
+			mcast_changed = 0;
+			pthread_mutex_unlock(&settings_lock);
+			mcast_open(spec);
+		}
+
+		int active = clients[IQ_CLIENTS].socket >= 0;
+		for (int i = 0; i < IQ_CLIENTS; i++)
+			if (clients[i].socket >= 0)
+				active = 1;
+		iq_tap_on = active;
+
+		//wait on the sockets for 5 msec, the IF blocks come every 10
+		int n = 0;
+		if (listen_socket >= 0){
+			fds[n].fd = listen_socket;
+			fds[n++].events = POLLIN;
+		}
+		for (int i = 0; i < IQ_CLIENTS; i++){
+			if (clients[i].socket < 0)
+				continue;
+			fds[n].fd = clients[i].socket;
+			fds[n++].events = POLLIN | (clients[i].out_len > clients[i].out_sent ? POLLOUT : 0);
+		}
+		if (n)
+			poll(fds, n, 5);
+		else
+			usleep(5000);
+
+		if (listen_socket >= 0)
+			client_accept();
+		for (int i = 0; i < IQ_CLIENTS; i++){
+			if (clients[i].socket >= 0)
+				client_read(clients + i);
+			if (clients[i].socket >= 0)
+				client_write(clients + i);
+		}
+
+		struct if_block *b;
+		while ((b = if_ring_next(&iq_ring))){
+			iq_process(b);
+			if_ring_done(&iq_ring);
+		}
+	}
+	return NULL;
+}
+
+/* ---- Called by the rest of the sbitx ---- */
+
+void iq_server_rx(int32_t *samples, int count){
+	if (iq_tap_on)
+		if_ring_push(&iq_ring, samples, count);
+}
+
+// picks up the IQ_SERVER, IQ_BIND and IQ_MCAST settings, from modem_poll()
+void iq_server_poll(){
+	const char *value = field_str("IQ_SERVER");
+	tcp_wanted = value && !strcmp(value, "ON");
+	//the span is centered on the IF, the dial is off it by the pitch in CW
+	iq_freq = field_int("FREQ") - if_shift();
+
+	const char *bind_addr = field_str("IQ_BIND");
+	if (!bind_addr || !*bind_addr)
+		bind_addr = "127.0.0.1";
+	const char *mcast = field_str("IQ_MCAST");
+	if (!mcast)
+		mcast = "";
+	pthread_mutex_lock(&settings_lock);
+	if (strcmp(bind_addr, bind_wanted)){
+		strncpy(bind_wanted, bind_addr, sizeof(bind_wanted) - 1);
+		bind_changed = 1;
+	}
+	if (strcmp(mcast, mcast_wanted)){
+		strncpy(mcast_wanted, mcast, sizeof(mcast_wanted) - 1);
+		mcast_changed = 1;
+	}
+	pthread_mutex_unlock(&settings_lock);
+}
+
+// the stats are since the last report
+void iq_server_status(){
+	char buff[200];
+	double secs = if_ring_elapsed_ns(&iq_ring) / 1e9;
+	int listed = 0;
+
+	for (int i = 0; i <= IQ_CLIENTS; i++){
+		struct iq_client *c = clients + i;
+		if (c->socket < 0)
+			continue;
+		sprintf(buff, "\n%s %s:%d %d sps %.0f kB/s, %lld of %lld frames dropped",
+			c->is_mcast ? "multicast" : "tcp", inet_ntoa(c->addr.sin_addr),
+			ntohs(c->addr.sin_port), 48000 >> c->stage,
+			secs > 0 ? c->bytes / secs / 1000 : 0, c->dropped, c->frames);
+		write_console(FONT_LOG, buff);
+		c->bytes = c->frames = c->dropped = 0;
+		listed++;
+	}
+	sprintf(buff, "\niq server: %d subscribers, %d IF blocks lost\n", listed,
+		iq_ring.overflows);
+	write_console(FONT_LOG, buff);
+	if_ring_reset_stats(&iq_ring);
+}
+
+void iq_server_init(){
+	if_ring_init(&iq_ring, IQ_RING);
+	for (int i = 0; i <= IQ_CLIENTS; i++)
+		clients[i].socket = -1;
+	halfband_init();
+	pthread_create(&iq_thread, NULL, iq_thread_function, NULL);
+}
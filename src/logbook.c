@@ -27,6 +27,7 @@
 #include "sdr.h"
 #include "sdr_ui.h"
 #include "logbook.h"
+#include "wsjtx.h"
 
 #include <sqlite3.h>
 
@@ -323,6 +324,8 @@ void logbook_add(char *contact_callsign, char *rst_sent, char *exchange_sent,
 	sqlite3_exec(db, statement, 0,0, &err_msg);
 	
 	logbook_refill(NULL);
+	wsjtx_logged(log_time, atol(freq), mode, contact_callsign, rst_sent, rst_recv,
+		exchange_sent, exchange_recv, comments);
 }
 
 void logbook_refill(const char *query) {
@@ -15,10 +15,22 @@
 	The modem_poll is called about 10 to 20 times a second from 
 	the 'user interface' thread.
 
-	The key is physically read from the GPIO by calling key_poll() through
-	modem_poll and the value is stored as cw_key_state.
-
-	The cw_get_sample just reads this cw_key_state instead of polling the GPIO.
+	The key is physically read from the GPIO by the keyer thread, every
+	half a millisecond on the monotonic clock, at a real time priority.
+	It doesn't wait on the user interface, a redraw of the waterfall 
+	or the logbook can't stretch the dits. Each change of the key
+	(debounced over two reads) is queued with the time it happened.
+	It reads the key while the mode is CW or CWR (cw_keyer_enable()),
+	not while the ui polls, and queues a key up as the mode changes.
+
+	The cw_get_sample pops these edges into cw_key_state on the sample
+	clock of the DSP. Each edge is applied a fixed delay (a block of the
+	DSP and a little) after it happened, so the keying keeps the timing
+	of the hand instead of that of the blocks. The first edge after
+	the transmitter comes on is late, the lag is carried to the next
+	edges until the key has been up for a while so no element is cut
+	short. \cwstat reports how late the keyer woke up and how late 
+	the edges were applied.
 
 	the cw_read_key() routine returns the next dash/dot/space/, etc to be sent
 	the word 'symbol' is used to denote a dot, dash, a gaps that are dot, dash or
@@ -220,6 +232,50 @@ struct morse_rx morse_rx_table[] = {
 	{"ur", "..-.-."},
 };
 
+/*
+	The tables above are searched once at cw_init() to build direct lookups.
+	A received code is walked down a binary tree: it starts at 1, each dot
+	doubles the index and each dash doubles it and adds one. With up to
+	MORSE_RX_DEPTH symbols, the index fits in morse_rx_index[]. 
+	The first entry of a code in morse_rx_table wins, as the linear search did.
+*/
+#define MORSE_RX_DEPTH 9
+static char *morse_rx_index[2 << MORSE_RX_DEPTH];
+static char *morse_tx_index[128];
+
+static int morse_tree_index(const char *code){
+	int index = 1;
+	int depth = 0;
+
+	for (; *code; code++){
+		if (*code != '.' && *code != '-')
+			return 0;
+		if (++depth > MORSE_RX_DEPTH)
+			return 0;
+		index = index * 2 + (*code == '-');
+	}
+	return index;
+}
+
+static void morse_index_init(){
+	for (int i = 0; i < sizeof(morse_rx_table)/sizeof(struct morse_rx); i++){
+		int index = morse_tree_index(morse_rx_table[i].code);
+		if (index > 1 && !morse_rx_index[index])
+			morse_rx_index[index] = morse_rx_table[i].c;
+	}
+	//the linear search let the last entry of a character win
+	for (int i = 0; i < sizeof(morse_tx_table)/sizeof(struct morse_tx); i++)
+		if ((unsigned char)morse_tx_table[i].c < 128)
+			morse_tx_index[(unsigned char)morse_tx_table[i].c] = morse_tx_table[i].code;
+}
+
+// the letters of a code walked down the tree as above, NULL if none
+const char *morse_rx_lookup(int index){
+	if (index < 2 || index >= (2 << MORSE_RX_DEPTH))
+		return NULL;
+	return morse_rx_index[index];
+}
+
 struct bin {
 	float coeff;
 	float sine;
@@ -269,10 +325,10 @@ static unsigned long millis_now = 0;
 
 static int cw_key_state = 0;
 static int cw_period;
-static struct vfo cw_tone, cw_env;
+static struct vfo cw_tone;
 static int keydown_count=0;
 static int keyup_count = 0;
-static float cw_envelope = 1;		//used to shape the envelope
+static uint8_t cw_machine_mode = CW_STRAIGHT;	//mode of the last state machine run
 static int cw_tx_until = 0;			//delay switching to rx, expect more txing
 static int data_tx_until = 0;
 
@@ -286,6 +342,70 @@ static uint8_t cw_next_symbol = CW_IDLE;
 static uint8_t cw_last_symbol = CW_IDLE;
 static uint8_t cw_mode = CW_STRAIGHT;
 static int cw_bytes_available = 0; //chars available in the tx queue
+
+/* the keyer thread and its queue of edges to the DSP thread */
+#define KEYER_PERIOD_NS 500000	// how often the key is read
+#define KEYER_QUEUE 64
+#define KEYER_DELAY 0.013				// secs, a block of the DSP and a little
+#define KEYER_IDLE 0.2					// secs of key up before the lag is dropped
+
+struct key_edge {
+	double t;			// CLOCK_MONOTONIC secs
+	int key;
+};
+
+static struct key_edge keyer_queue[KEYER_QUEUE];
+static int keyer_head = 0, keyer_tail = 0;
+static volatile int keyer_key = CW_IDLE;		// the latest debounced state
+static volatile int keyer_input = CW_STRAIGHT;
+static volatile int keyer_enabled = 0;			// in CW or CWR, see cw_keyer_enable()
+static int keyer_started = 0;
+static pthread_t keyer_thread;
+
+// on the DSP thread
+static long long cw_sample = 0;					// index of the sample being generated
+static long long cw_block_seen = -1;
+static long long keyer_lag = 0;					// samples that the edges are held back
+static int keyer_idle = 0;
+
+// stats
+static long long keyer_wakeups, keyer_late_ns, keyer_late_ns_max;
+static int keyer_edges, keyer_overflows, keyer_realtime;
+static int edges_late;
+static long long edges_late_max;
+static unsigned long poll_last, poll_gap_max;
+
+/*
+	The keying envelope is a raised cosine rendered into a table. The rise 
+	takes CW_RISE_MAX samples (2.5 msec), shortened to a quarter of a dot 
+	at very high speeds. cw_poll() renders a new shape into the spare 
+	table when the wpm changes and then switches the DSP over to it.
+	The envelope steps one entry up for every sample of keydown and
+	one down for every sample of keyup.
+*/
+#define CW_RISE_MAX 240
+struct cw_shape {
+	int wpm;
+	int len;
+	float rise[CW_RISE_MAX + 1];
+};
+static struct cw_shape cw_shapes[2];
+static struct cw_shape *volatile cw_shape = cw_shapes;
+static int cw_env_step = 0;
+
+static void cw_shape_update(int wpm){
+	if (cw_shape->wpm == wpm)
+		return;
+
+	struct cw_shape *s = cw_shape == cw_shapes ? cw_shapes + 1 : cw_shapes;
+	int period = (12 * 9600) / wpm;
+
+	s->wpm = wpm;
+	s->len = period / 4 < CW_RISE_MAX ? period / 4 : CW_RISE_MAX;
+	for (int i = 0; i <= s->len; i++)
+		s->rise[i] = (1 - cos((M_PI * i) / s->len)) / 2;
+	__atomic_store_n(&cw_shape, s, __ATOMIC_RELEASE);
+}
 #define CW_MAX_SYMBOLS 12
 char cw_key_letter[CW_MAX_SYMBOLS];
 
@@ -341,20 +461,154 @@ static int cw_read_key(){
 	get_tx_data_byte(&c);
 	symbol_next = morse_tx_table->code; // point to the first symbol, by default
 
-	for (int i = 0; i < sizeof(morse_tx_table)/sizeof(struct morse_tx); i++)
-		if (morse_tx_table[i].c == tolower(c)){
-			symbol_next = morse_tx_table[i].code;
-			char buff[5];
-			buff[0] = toupper(c);
-			buff[1] = 0;
-			write_console(FONT_CW_TX, buff);
-		}
+	int lower = tolower((unsigned char)c);
+	if (lower < 128 && morse_tx_index[lower]){
+		symbol_next = morse_tx_index[lower];
+		char buff[5];
+		buff[0] = toupper(c);
+		buff[1] = 0;
+		write_console(FONT_CW_TX, buff);
+	}
 	if (symbol_next)
 		return cw_get_next_symbol(); 
 	else
 		return CW_IDLE;
 }
 
+/* ---- the keyer thread ---- */
+
+static double timespec_secs(const struct timespec *ts){
+	return ts->tv_sec + ts->tv_nsec / 1e9;
+}
+
+// returns 0 if the queue is full
+static int keyer_queue_edge(double t, int key){
+	int head = keyer_head, next_head = (head + 1) % KEYER_QUEUE;
+	if (next_head == __atomic_load_n(&keyer_tail, __ATOMIC_ACQUIRE)){
+		keyer_overflows++;
+		return 0;
+	}
+	keyer_queue[head].t = t;
+	keyer_queue[head].key = key;
+	__atomic_store_n(&keyer_head, next_head, __ATOMIC_RELEASE);
+	return 1;
+}
+
+void *keyer_thread_function(void *ptr){
+	struct sched_param sch;
+	struct timespec next, now;
+	int last = CW_IDLE, bouncing = -1;
+	double bounce_t = 0;
+
+	//just below the sound thread
+	sch.sched_priority = sched_get_priority_max(SCHED_FIFO) - 1;
+	keyer_realtime = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sch) == 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while(1){
+		//only while in CW, otherwise check back now and then
+		if (!keyer_enabled){
+			//the DSP has to see the key go up, or it would stay keyed
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (last != CW_IDLE && keyer_queue_edge(timespec_secs(&now), CW_IDLE))
+				last = CW_IDLE;
+			keyer_key = last;
+			bouncing = -1;
+			usleep(20000);
+			clock_gettime(CLOCK_MONOTONIC, &next);
+			continue;
+		}
+
+		//wake up on the ticks, not after a period, so they don't drift
+		next.tv_nsec += KEYER_PERIOD_NS;
+		if (next.tv_nsec >= 1000000000){
+			next.tv_nsec -= 1000000000;
+			next.tv_sec++;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		long long late = (now.tv_sec - next.tv_sec) * 1000000000LL 
+			+ now.tv_nsec - next.tv_nsec;
+		keyer_wakeups++;
+		keyer_late_ns += late;
+		if (late > keyer_late_ns_max)
+			keyer_late_ns_max = late;
+		//after a long stall, don't try to catch up
+		if (late > 10 * KEYER_PERIOD_NS)
+			next = now;
+
+		int key = key_read(keyer_input);
+		if (key == last){
+			bouncing = -1;
+			continue;
+		}
+		//the new state has to hold for two reads, it is timed from the first
+		if (key != bouncing){
+			bouncing = key;
+			bounce_t = timespec_secs(&now);
+			continue;
+		}
+
+		if (!keyer_queue_edge(bounce_t, key))
+			continue;
+		keyer_key = last = key;
+		bouncing = -1;
+		keyer_edges++;
+	}
+}
+
+// called for each sample on the DSP thread, applies the edges that are due
+static void cw_keyer_apply(){
+	long long block = sound_sample_index();
+	if (block != cw_block_seen){
+		cw_block_seen = block;
+		cw_sample = block;
+	}
+	else
+		cw_sample++;
+
+	while (keyer_tail != __atomic_load_n(&keyer_head, __ATOMIC_ACQUIRE)){
+		struct key_edge *e = keyer_queue + keyer_tail;
+		long long due = sound_monotonic_sample(e->t + KEYER_DELAY) + keyer_lag;
+		if (due > cw_sample)
+			break;
+		//the transmitter just came on or the DSP was held up
+		if (due < cw_sample){
+			keyer_lag += cw_sample - due;
+			edges_late++;
+			if (cw_sample - due > edges_late_max)
+				edges_late_max = cw_sample - due;
+		}
+		cw_key_state = e->key;
+		keyer_idle = 0;
+		__atomic_store_n(&keyer_tail, (keyer_tail + 1) % KEYER_QUEUE, __ATOMIC_RELEASE);
+	}
+
+	if (keyer_lag && cw_key_state == CW_IDLE && ++keyer_idle > KEYER_IDLE * 96000){
+		keyer_lag = 0;
+		keyer_idle = 0;
+	}
+}
+
+// the stats are since the last report
+void cw_status(){
+	char buff[300];
+
+	sprintf(buff, "\nCW keyer %s: %lld reads, woke up late by %lld usec avg %lld max, "
+		"%d edges %d applied late (max %lld msec) %d lost, "
+		"longest gap between the ui polls %lu msec\n",
+		keyer_realtime ? "real time" : "normal priority",
+		keyer_wakeups, keyer_wakeups ? keyer_late_ns / keyer_wakeups / 1000 : 0,
+		keyer_late_ns_max / 1000, keyer_edges, edges_late, 
+		(edges_late_max * 1000) / 96000, keyer_overflows, poll_gap_max);
+	write_console(FONT_LOG, buff);
+	keyer_wakeups = keyer_late_ns = keyer_late_ns_max = 0;
+	keyer_edges = edges_late = keyer_overflows = 0;
+	edges_late_max = 0;
+	poll_gap_max = 0;
+}
+
 // Function prototype for the state machine handler
 void handle_cw_state_machine(uint8_t, uint8_t);
 
@@ -363,7 +617,10 @@ void handle_cw_state_machine(uint8_t, uint8_t);
 float cw_tx_get_sample() {
   float sample = 0;
   uint8_t state_machine_mode;
-  uint8_t symbol_now;
+  uint8_t symbol_now = CW_IDLE;
+  struct cw_shape *shape = __atomic_load_n(&cw_shape, __ATOMIC_ACQUIRE);
+
+  cw_keyer_apply();
   
   if ((keydown_count == 0) && (keyup_count == 0)) {
     // note current time to use with UI value of CW_DELAY to control break-in
@@ -379,6 +636,7 @@ float cw_tx_get_sample() {
     cw_current_symbol = CW_IDLE;
   } else
     state_machine_mode = cw_mode;
+  cw_machine_mode = state_machine_mode;
   
   // iambic modes require polling key during keydown/keyup
   // other modes only check when idle
@@ -396,17 +654,19 @@ float cw_tx_get_sample() {
 
   // key the transmitter with some shaping
   // at 20 wpm  a CW_DOT starts with keydown_count = 5760
+  if (cw_env_step > shape->len)
+    cw_env_step = shape->len;
   if (keydown_count > 0) {
-    if(cw_envelope < 0.999)
-      cw_envelope = ((vfo_read(&cw_env)/FLOAT_SCALE) + 1)/2;
+    if (cw_env_step < shape->len)
+      cw_env_step++;
     keydown_count--;
   } else {  // countdown all the keydown_count before doing keyup_count
-    if(cw_envelope > 0.001)
-      cw_envelope = ((vfo_read(&cw_env)/FLOAT_SCALE) + 1)/2;
+    if (cw_env_step > 0)
+      cw_env_step--;
     if (keyup_count > 0)
       keyup_count--;
   }
-  sample = (vfo_read(&cw_tone) / FLOAT_SCALE) * cw_envelope;
+  sample = (vfo_read(&cw_tone) / FLOAT_SCALE) * shape->rise[cw_env_step];
   
   // keep extending 'cw_tx_until' while we're sending
   if ((symbol_now == CW_DOWN) || (symbol_now == CW_DOT) ||
@@ -421,6 +681,71 @@ float cw_tx_get_sample() {
   return sample / 8;
 }
 
+// the number of samples from now on that the state machine won't change,
+// the iambic modes watch the paddles through the elements, the others
+// only look at the key once an element is complete
+static int cw_tx_steady(int count){
+  if (cw_machine_mode == CW_IAMBIC || cw_machine_mode == CW_IAMBICB)
+    return 0;
+
+  int steady = keydown_count + keyup_count;
+  if (steady == 0){
+    // idle, until something is keyed or typed
+    if (cw_key_state != CW_IDLE || cw_bytes_available || symbol_next)
+      return 0;
+    steady = count;
+    if (keyer_tail != __atomic_load_n(&keyer_head, __ATOMIC_ACQUIRE)){
+      struct key_edge *e = keyer_queue + keyer_tail;
+      long long due = sound_monotonic_sample(e->t + KEYER_DELAY) + keyer_lag;
+      if (due - cw_sample - 1 < steady)
+        steady = due - cw_sample - 1;
+    }
+  }
+  if (steady > count)
+    steady = count;
+  return steady > 0 ? steady : 0;
+}
+
+// generates the cw for a whole block, the runs of samples where the
+// keying can't change are filled straight from the tone and the envelope
+void cw_tx_get_block(float *samples, int count){
+  int i = 0;
+
+  while (i < count){
+    samples[i++] = cw_tx_get_sample();
+
+    int run = cw_tx_steady(count - i);
+    if (!run)
+      continue;
+
+    struct cw_shape *shape = __atomic_load_n(&cw_shape, __ATOMIC_ACQUIRE);
+    int down = keydown_count < run ? keydown_count : run;
+    int end = i + run;
+
+    if (down)
+      cw_tx_until = millis_now + get_cw_delay();
+    if (cw_bytes_available != 0)
+      cw_tx_until = millis_now + 1000;
+    keydown_count -= down;
+    if (keyup_count)
+      keyup_count -= run - down;
+    cw_sample += run;
+    if (keyer_lag && cw_key_state == CW_IDLE)
+      keyer_idle += run;
+
+    for (int j = i + down; i < j; i++){
+      if (cw_env_step < shape->len)
+        cw_env_step++;
+      samples[i] = (vfo_read(&cw_tone) / FLOAT_SCALE) * shape->rise[cw_env_step] / 8;
+    }
+    for (; i < end; i++){
+      if (cw_env_step > 0)
+        cw_env_step--;
+      samples[i] = (vfo_read(&cw_tone) / FLOAT_SCALE) * shape->rise[cw_env_step] / 8;
+    }
+  }
+}
+
 
 // This function implements the KB2ML sBitx keyer state machine for each CW mode
 // State machine uses mode, current state and input to determine keydown_count
@@ -1063,11 +1388,11 @@ static void cw_rx_match_letter(struct cw_decoder *p){
 	}	
 
 	p->next_symbol = 0;
-	for (int i = 0; i < sizeof(morse_rx_table)/sizeof(struct morse_rx); i++)
-		if (!strcmp(code, morse_rx_table[i].code)){
-			write_console(FONT_CW_RX, morse_rx_table[i].c);
-			return;
-		}
+	char *letter = morse_rx_index[morse_tree_index(code)];
+	if (letter){
+		write_console(FONT_CW_RX, letter);
+		return;
+	}
 	//un-decoded phrases
 	write_console(FONT_CW_RX, code);
 
@@ -1252,23 +1577,44 @@ void cw_init(){
 	cw_rx_bin_init(&decoder.signal, INIT_TONE, N_BINS, SAMPLING_FREQ);
 	
 	//init cw tx with some reasonable values
-  //cw_env shapes the envelope of the cw waveform
-  //frequency was at 50 (20 ms rise time), changed it to 200 (4 ms rise time)
-  //to improve cw performance at higher speeds
-	vfo_start(&cw_env, 200, 49044); //start in the third quardrant, 270 degree
+	morse_index_init();
+
+  //the envelope was a 200 Hz vfo (2.5 msec rise), now rendered into a table
+	cw_shape_update(INIT_WPM);
 	vfo_start(&cw_tone, 700, 0);
 	cw_period = 9600; 		// At 96ksps, 0.1sec = 1 dot at 12wpm
 	cw_key_letter[0] = 0;
 	keydown_count = 0;
 	keyup_count = 0;
-	cw_envelope = 0;
+	cw_env_step = 0;
+
+	if (!keyer_started){
+		pthread_create(&keyer_thread, NULL, keyer_thread_function, NULL);
+		keyer_started = 1;
+	}
+}
+
+// the key is read only in CW and CWR, called as the mode changes
+void cw_keyer_enable(int on){
+	keyer_input = get_cw_input_method();
+	poll_last = 0;
+	keyer_enabled = on;
 }
 
 void cw_poll(int bytes_available, int tx_is_on){
 	cw_bytes_available = bytes_available;
-	cw_key_state = key_poll();
+	keyer_input = get_cw_input_method();
+
+	//the gaps between the polls are what the keying would suffer without
+	//the keyer thread
+	unsigned long now = millis();
+	if (poll_last && now - poll_last > poll_gap_max)
+		poll_gap_max = now - poll_last;
+	poll_last = now;
+
 	int wpm  = field_int("WPM");
 	cw_period = (12 * 9600)/wpm;
+	cw_shape_update(wpm);
 
 	//retune the rx pitch if needed
 	int cw_rx_pitch = field_int("PITCH");
@@ -1284,7 +1630,9 @@ void cw_poll(int bytes_available, int tx_is_on){
 	// TX ON if bytes are avaiable (from macro/keyboard) or key is pressed
 	// of we are in the middle of symbol (dah/dit) transmission 
 	
-	if (!tx_is_on && (cw_bytes_available || cw_key_state || (symbol_next && *symbol_next)) > 0){
+	int key_pending = keyer_key != CW_IDLE
+		|| keyer_tail != __atomic_load_n(&keyer_head, __ATOMIC_ACQUIRE);
+	if (!tx_is_on && (cw_bytes_available || key_pending || (symbol_next && *symbol_next)) > 0){
 		tx_on(TX_SOFT);
 		millis_now = millis();
 		cw_tx_until = get_cw_delay() + millis_now;
@@ -1,9 +1,13 @@
 void cw_rx(int *samples, int count);
 float cw_tx_get_sample();
+void cw_tx_get_block(float *samples, int count);
 void cw_init();
 void cw_abort();
 void cw_tx(char *message, int freq);
 void cw_poll(int bytes_available, int tx_is_on);
+void cw_keyer_enable(int on);
+void cw_status();
+const char *morse_rx_lookup(int index);
 float cw_next_sample();
 
 #define N_BINS 128
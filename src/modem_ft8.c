@@ -13,7 +13,9 @@
 #include <unistd.h>
 #include "sdr.h"
 #include "sdr_ui.h"
+#include "sound.h"
 #include "modem_ft8.h"
+#include "wsjtx.h"
 
 #include "ft8_lib/common/common.h"
 #include "ft8_lib/common/wave.h"
@@ -22,14 +24,11 @@
 #include "ft8_lib/ft8/decode.h"
 #include "ft8_lib/ft8/encode.h"
 #include "ft8_lib/ft8/constants.h"
-#include "ft8_lib/fft/kiss_fftr.h"
 
 static int32_t ft8_rx_buff[FT8_MAX_BUFF];
 static float ft8_rx_buffer[FT8_MAX_BUFF];
-static float ft8_tx_buff[FT8_MAX_BUFF];
 static char ft8_tx_text[128];
 static int ft8_rx_buff_index = 0;
-static int ft8_tx_buff_index = 0;
 static int	ft8_tx_nsamples = 0;
 static int ft8_do_decode = 0;
 static int	ft8_do_tx = 0;
@@ -37,6 +36,7 @@ static int	ft8_pitch = 0;
 static int	ft8_mode = FT8_SEMI;
 static pthread_t ft8_thread;
 static int ft8_tx1st = 1;
+static int ft8_qso_pitch = 0; //where the station we are working is
 void ft8_tx(char *message, int freq);
 void ft8_interpret(char *received, char *transmit);
 extern void call_wipe();
@@ -44,10 +44,31 @@ extern void call_wipe();
 // how to handle a command option
 #define FT8_START_QSO 1
 #define FT8_CONTINUE_QSO 0
-static unsigned int wallclock =0;
+static long ft8_rx_slot = -1;			// slot number of the samples being collected
+static long ft8_decode_slot = -1;		// of the samples handed to the decoder
+static int ft8_rx_start = 0;				// index of the first sample received in the slot
+static int ft8_rx_triggered = 0;
+static double ft8_time_offset = 0;	// secs, the FT8_DT_OFFSET setting
+static int ft8_dt_count = 0;				// the DT of the decodes, see ft8_status()
+static double ft8_dt_sum = 0, ft8_dt_sum2 = 0;
 static const int kMin_score = 10; // Minimum sync score threshold for candidates
 static const int kMax_candidates = 120;
 static const int kLDPC_iterations = 20;
+static const int kMin_LDPC_iterations = 5; // when running out of time
+
+// how far into the next slot can the decoding go on
+#define FT8_REPLY_LATENESS 0.5
+// the transmissions start this far into the slot
+#define FT8_TX_DELAY 0.5
+
+// a-priori (AP) decoding of the replies in a qso. Only a few candidates
+// that failed the normal decode and are close to the qso partner (or
+// to our own transmit pitch) are retried, with the callsigns and
+// the expected roger/73 fixed in advance
+#define FT8_AP_MAX 5
+static const int kMax_AP_candidates = 4;
+static const float kAP_freq_tolerance = 20;
+static const int kMax_AP_hard_errors = 36;
 
 static const int kMax_decoded_messages = 50;
 
@@ -99,7 +120,8 @@ static void synth_gfsk(const uint8_t* symbols, int n_sym, float f0, float symbol
     // Compute the smoothed frequency waveform.
     // Length = (nsym+2)*n_spsym samples, first and last symbols extended
     float dphi_peak = 2 * M_PI * hmod / n_spsym;
-    float dphi[n_wave + 2 * n_spsym];
+    // at 96000 samples/sec this is too much for the stack
+    float *dphi = (float *)malloc((n_wave + 2 * n_spsym) * sizeof(float));
 
     // Shift frequency up by f0
     for (int i = 0; i < n_wave + 2 * n_spsym; ++i)
@@ -107,7 +129,7 @@ static void synth_gfsk(const uint8_t* symbols, int n_sym, float f0, float symbol
         dphi[i] = 2 * M_PI * f0 / signal_rate;
     }
 
-    float pulse[3 * n_spsym];
+    float *pulse = (float *)malloc(3 * n_spsym * sizeof(float));
     gfsk_pulse(n_spsym, symbol_bt, pulse);
 
     for (int i = 0; i < n_sym; ++i)
@@ -133,6 +155,8 @@ static void synth_gfsk(const uint8_t* symbols, int n_sym, float f0, float symbol
         signal[k] = sinf(phi);
         phi = fmodf(phi + dphi[k + n_spsym], 2 * M_PI);
     }
+    free(dphi);
+    free(pulse);
 
     // Apply envelope shaping to the first and last symbols
     int n_ramp = n_spsym / 8;
@@ -145,10 +169,10 @@ static void synth_gfsk(const uint8_t* symbols, int n_sym, float f0, float symbol
 }
 
 
-int sbitx_ft8_encode(char *message, int32_t freq,  float *signal, bool is_ft4)
+// packs the message and encodes it into FSK tones, 
+// the tones array has space for FT4_NN (or FT8_NN) symbols
+static int ftx_tones(char *message, uint8_t *tones, bool is_ft4)
 {
-    float frequency = 1.0 * freq;
-
     // First, pack the text data into binary message
     uint8_t packed[FTX_LDPC_K_BYTES];
     int rc = pack77(message, packed);
@@ -159,17 +183,26 @@ int sbitx_ft8_encode(char *message, int32_t freq,  float *signal, bool is_ft4)
         return -1;
     }
 
+    // Second, encode the binary message as a sequence of FSK tones
+    if (is_ft4)
+        ft4_encode(packed, tones);
+    else
+        ft8_encode(packed, tones);
+    return 0;
+}
+
+int sbitx_ft8_encode(char *message, int32_t freq,  float *signal, bool is_ft4)
+{
+    float frequency = 1.0 * freq;
+
     int num_tones = (is_ft4) ? FT4_NN : FT8_NN;
     float symbol_period = (is_ft4) ? FT4_SYMBOL_PERIOD : FT8_SYMBOL_PERIOD;
     float symbol_bt = (is_ft4) ? FT4_SYMBOL_BT : FT8_SYMBOL_BT;
     float slot_time = (is_ft4) ? FT4_SLOT_TIME : FT8_SLOT_TIME;
 
-    // Second, encode the binary message as a sequence of FSK tones
     uint8_t tones[num_tones]; // Array of 79 tones (symbols)
-    if (is_ft4)
-        ft4_encode(packed, tones);
-    else
-        ft8_encode(packed, tones);
+    if (ftx_tones(message, tones, is_ft4) < 0)
+        return -1;
 
     // Third, convert the FSK tones into an audio signal
     int sample_rate = 12000;
@@ -245,7 +278,9 @@ typedef struct
 } monitor_config_t;
 
 /// FT4/FT8 monitor object that manages DSP processing of incoming audio data
-/// and prepares a waterfall object
+/// and prepares a waterfall object.
+/// The monitor is allocated once at startup and reused for every slot. All the
+/// STFT frames of a slot are transformed in one batched FFTW plan.
 typedef struct
 {
     float symbol_period; ///< FT4/FT8 symbol period in seconds
@@ -254,15 +289,32 @@ typedef struct
     int nfft;            ///< FFT size
     float fft_norm;      ///< FFT normalization factor
     float* window;       ///< Window function for STFT analysis (nfft samples)
-    float* last_frame;   ///< Current STFT analysis frame (nfft samples)
     waterfall_t wf;      ///< Waterfall object
     float max_mag;       ///< Maximum detected magnitude (debug stats)
+    float ns_per_iteration; ///< Measured cost of a candidate per LDPC iteration
 
-    // KISS FFT housekeeping variables
-    void* fft_work;        ///< Work area required by Kiss FFT
-    kiss_fftr_cfg fft_cfg; ///< Kiss FFT housekeeping object
+    // FFTW housekeeping variables
+    int max_frames;         ///< Number of STFT frames in a full slot
+    float* frames;          ///< Windowed analysis frames (max_frames * nfft)
+    fftwf_complex* spectra; ///< Transformed frames (max_frames * (nfft/2 + 1))
+    fftwf_plan plan;        ///< Batched r2c plan over all the frames
 } monitor_t;
 
+// FFTW planning is not thread safe, so both monitors are
+// set up from ft8_init() before the decoder thread starts
+static monitor_t ft8_monitor, ft4_monitor;
+
+// log2() good to 0.02 dB, well within the
+// 0.5 dB steps of the waterfall. It uses the float exponent directly
+// and fits a quadratic to the mantissa
+static inline float fast_log2f(float x)
+{
+    union { float f; uint32_t i; } u = { x };
+    float exponent = (float)(int)((u.i >> 23) & 0xff) - 128.0f;
+    u.i = (u.i & 0x007fffff) | 0x3f800000; // mantissa in [1, 2)
+    return exponent + (-0.34484843f * u.f + 2.02466578f) * u.f - 0.67487759f;
+}
+
 static void monitor_init(monitor_t* me, const monitor_config_t* cfg)
 {
     float slot_time = (cfg->protocol == PROTO_FT4) ? FT4_SLOT_TIME : FT8_SLOT_TIME;
@@ -278,23 +330,11 @@ static void monitor_init(monitor_t* me, const monitor_config_t* cfg)
     for (int i = 0; i < me->nfft; ++i)
     {
         // window[i] = 1;
-        me->window[i] = hann_i(i, me->nfft);
+        me->window[i] = me->fft_norm * hann_i(i, me->nfft);
         // me->window[i] = blackman_i(i, me->nfft);
         // me->window[i] = hamming_i(i, me->nfft);
         // me->window[i] = (i < len_window) ? hann_i(i, len_window) : 0;
     }
-    me->last_frame = (float *)malloc(me->nfft * sizeof(me->last_frame[0]));
-
-    size_t fft_work_size;
-    kiss_fftr_alloc(me->nfft, 0, 0, &fft_work_size);
-
-    //LOG(LOG_INFO, "Block size = %d\n", me->block_size);
-    //LOG(LOG_INFO, "Subblock size = %d\n", me->subblock_size);
-    //LOG(LOG_INFO, "N_FFT = %d\n", me->nfft);
-    LOG(LOG_DEBUG, "FFT work area = %zu\n", fft_work_size);
-
-    me->fft_work = malloc(fft_work_size);
-    me->fft_cfg = kiss_fftr_alloc(me->nfft, 0, me->fft_work, &fft_work_size);
 
     const int max_blocks = (int)(slot_time / symbol_period);
     const int num_bins = (int)(cfg->sample_rate * symbol_period / 2);
@@ -302,51 +342,63 @@ static void monitor_init(monitor_t* me, const monitor_config_t* cfg)
     me->wf.protocol = cfg->protocol;
     me->symbol_period = symbol_period;
 
+    // one plan transforms every frame of the slot in a single call
+    int n = me->nfft;
+    int nspectrum = me->nfft / 2 + 1;
+    me->max_frames = max_blocks * cfg->time_osr;
+    me->frames = (float *)fftwf_malloc(me->max_frames * n * sizeof(float));
+    me->spectra = (fftwf_complex *)fftwf_malloc(me->max_frames * nspectrum * sizeof(fftwf_complex));
+    me->plan = fftwf_plan_many_dft_r2c(1, &n, me->max_frames,
+        me->frames, NULL, 1, n,
+        me->spectra, NULL, 1, nspectrum, FFTW_ESTIMATE);
+
+    LOG(LOG_DEBUG, "FFT frames = %d x %d\n", me->max_frames, me->nfft);
+
     me->max_mag = -120.0f;
+    me->ns_per_iteration = 0;
 }
 
 static void monitor_free(monitor_t* me)
 {
+    fftwf_destroy_plan(me->plan);
+    fftwf_free(me->spectra);
+    fftwf_free(me->frames);
     waterfall_free(&me->wf);
-    free(me->fft_work);
-    free(me->last_frame);
     free(me->window);
 }
 
-// Compute FFT magnitudes (log wf) for a frame in the signal and update waterfall data
-static void monitor_process(monitor_t* me, const float* frame)
+// Compute FFT magnitudes (log wf) for all the frames of a slot and fill the waterfall
+static void monitor_process(monitor_t* me, const float* signal, int num_samples)
 {
-    // Check if we can still store more waterfall data
-    if (me->wf.num_blocks >= me->wf.max_blocks)
-        return;
-
-    int offset = me->wf.num_blocks * me->wf.block_stride;
-    int frame_pos = 0;
-
-    // Loop over block subdivisions
-    for (int time_sub = 0; time_sub < me->wf.time_osr; ++time_sub)
+    int num_blocks = num_samples / me->block_size;
+    if (num_blocks > me->wf.max_blocks)
+        num_blocks = me->wf.max_blocks;
+    int num_frames = num_blocks * me->wf.time_osr;
+
+    // Each frame ends one subblock after the previous one,
+    // the samples before the start of the slot are taken as silence
+    for (int k = 0; k < num_frames; k++)
     {
-        kiss_fft_scalar timedata[me->nfft];
-        kiss_fft_cpx freqdata[me->nfft / 2 + 1];
-
-        // Shift the new data into analysis frame
-        for (int pos = 0; pos < me->nfft - me->subblock_size; ++pos)
-        {
-            me->last_frame[pos] = me->last_frame[pos + me->subblock_size];
-        }
-        for (int pos = me->nfft - me->subblock_size; pos < me->nfft; ++pos)
-        {
-            me->last_frame[pos] = frame[frame_pos];
-            ++frame_pos;
-        }
-
-        // Compute windowed analysis frame
+        float* frame = me->frames + k * me->nfft;
+        int start = (k + 1) * me->subblock_size - me->nfft;
         for (int pos = 0; pos < me->nfft; ++pos)
         {
-            timedata[pos] = me->fft_norm * me->window[pos] * me->last_frame[pos];
+            int i = start + pos;
+            frame[pos] = (i < 0) ? 0 : me->window[pos] * signal[i];
         }
+    }
+    if (num_frames < me->max_frames)
+        memset(me->frames + num_frames * me->nfft, 0,
+            (me->max_frames - num_frames) * me->nfft * sizeof(float));
 
-        kiss_fftr(me->fft_cfg, timedata, freqdata);
+    fftwf_execute(me->plan);
+
+    int nspectrum = me->nfft / 2 + 1;
+    int offset = 0;
+    float max_mag2 = 0;
+    for (int k = 0; k < num_frames; k++)
+    {
+        const fftwf_complex* freqdata = me->spectra + k * nspectrum;
 
         // Loop over two possible frequency bin offsets (for averaging)
         for (int freq_sub = 0; freq_sub < me->wf.freq_osr; ++freq_sub)
@@ -354,8 +406,11 @@ static void monitor_process(monitor_t* me, const float* frame)
             for (int bin = 0; bin < me->wf.num_bins; ++bin)
             {
                 int src_bin = (bin * me->wf.freq_osr) + freq_sub;
-                float mag2 = (freqdata[src_bin].i * freqdata[src_bin].i) + (freqdata[src_bin].r * freqdata[src_bin].r);
-                float db = 10.0f * log10f(1E-12f + mag2);
+                float re = crealf(freqdata[src_bin]);
+                float im = cimagf(freqdata[src_bin]);
+                float mag2 = re * re + im * im;
+                // 10 * log10(x) = 3.0103 * log2(x)
+                float db = 3.0103f * fast_log2f(1E-12f + mag2);
                 // Scale decibels to unsigned 8-bit range and clamp the value
                 // Range 0-240 covers -120..0 dB in 0.5 dB steps
                 int scaled = (int)(2 * db + 240);
@@ -363,13 +418,14 @@ static void monitor_process(monitor_t* me, const float* frame)
                 me->wf.mag[offset] = (scaled < 0) ? 0 : ((scaled > 255) ? 255 : scaled);
                 ++offset;
 
-                if (db > me->max_mag)
-                    me->max_mag = db;
+                if (mag2 > max_mag2)
+                    max_mag2 = mag2;
             }
         }
     }
 
-    ++me->wf.num_blocks;
+    me->wf.num_blocks = num_blocks;
+    me->max_mag = 10.0f * log10f(1E-12f + max_mag2);
 }
 
 static void monitor_reset(monitor_t* me)
@@ -378,50 +434,141 @@ static void monitor_reset(monitor_t* me)
     me->max_mag = 0;
 }
 
-static int sbitx_ft8_decode(float *signal, int num_samples, bool is_ft8)
+static double monotonic_now()
 {
-    int sample_rate = 12000;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-    LOG(LOG_DEBUG, "Sample rate %d Hz, %d samples, %.3f seconds\n", sample_rate, num_samples, (double)num_samples / sample_rate);
+struct ft8_apriori {
+	int count;
+	ftx_apriori_t hypothesis[FT8_AP_MAX];
+	int n_pitches;
+	float pitch[2];
+};
 
-    // Compute FFT over the whole signal and store it
-    monitor_t mon;
-    monitor_config_t mon_cfg = {
-        .f_min = 100,
-        .f_max = 3000,
-        .sample_rate = sample_rate,
-        .time_osr = kTime_osr,
-        .freq_osr = kFreq_osr,
-        .protocol = is_ft8 ? PROTO_FT8 : PROTO_FT4
-    };
+static void ap_mask(ftx_apriori_t *ap, int from, int to){
+	for (int i = from; i < to; i++)
+		ap->mask[i / 8] |= 0x80 >> (i % 8);
+}
 
-		//timestamp the packets
-		//the time is shifted back by the time it took to capture these sameples
-		time_t	rawtime = (time_sbitx() / 15) * 15; //round to the earlier slot
-		char time_str[20], response[100];
-		struct tm *t = gmtime(&rawtime);
-		sprintf(time_str, "%02d%02d%02d", t->tm_hour, t->tm_min, t->tm_sec);
+// only the standard messages (i3 = 1) have the callsigns where we expect them
+static bool ap_pack(ftx_apriori_t *ap, const char *text){
+	memset(ap, 0, sizeof(*ap));
+	pack77(text, ap->bits);
+	return ((ap->bits[9] >> 3) & 0x07) == 1;
+}
 
-		int i;
-		char mycallsign_upper[20];
-		char mycallsign[20];
-		get_field_value("#mycallsign", mycallsign);
-		for (i = 0; i < strlen(mycallsign); i++)
-			mycallsign_upper[i] = toupper(mycallsign[i]);
-		mycallsign_upper[i] = 0;	
+/*
+	The known bits of the replies we expect. Once we are working someone,
+	their callsign and the RRR, RR73 or 73 that end the qso are tried.
+	Lastly, only our own callsign is known (as in someone answering our cq
+	or calling us after the qso). The message is 28 bits each of the 
+	callsigns (with a bit of /R), 16 bits of report and the 3 bit type.
+*/
+static void ap_setup(struct ft8_apriori *ap, const char *mycall, 
+	const char *dxcall, int partner_pitch, int tx_pitch){
+	char text[40], my[13], dx[13];
+	int i;
+
+	ap->count = 0;
+	ap->n_pitches = 0;
+	if (!mycall[0] || strlen(mycall) > 12 || strlen(dxcall) > 12)
+		return;
+	for (i = 0; mycall[i]; i++)
+		my[i] = toupper(mycall[i]);
+	my[i] = 0;
+	for (i = 0; dxcall[i]; i++)
+		dx[i] = toupper(dxcall[i]);
+	dx[i] = 0;
+
+	if (dx[0]){
+		sprintf(text, "%s %s", my, dx);
+		if (ap_pack(ap->hypothesis + ap->count, text)){
+			ap_mask(ap->hypothesis + ap->count, 0, 58);
+			ap_mask(ap->hypothesis + ap->count, 74, 77);
+			ap->count++;
+		}
+		const char *endings[] = {"RRR", "RR73", "73"};
+		for (i = 0; i < 3 && ap->count; i++){
+			sprintf(text, "%s %s %s", my, dx, endings[i]);
+			if (ap_pack(ap->hypothesis + ap->count, text)){
+				ap_mask(ap->hypothesis + ap->count, 0, 77);
+				ap->count++;
+			}
+		}
+	}
+
+	// any second callsign will do, only the first is kept
+	sprintf(text, "%s K1ABC", my);
+	if (ap_pack(ap->hypothesis + ap->count, text)){
+		ap_mask(ap->hypothesis + ap->count, 0, 29);
+		ap_mask(ap->hypothesis + ap->count, 74, 77);
+		ap->count++;
+	}
 
-    monitor_init(&mon, &mon_cfg);
+	if (partner_pitch > 0 && dx[0])
+		ap->pitch[ap->n_pitches++] = partner_pitch;
+	if (tx_pitch > 0)
+		ap->pitch[ap->n_pitches++] = tx_pitch;
+}
 
-    // Process the waveform data frame by frame - you could have a live loop here with data from an audio device
-    for (int frame_pos = 0; frame_pos + mon.block_size <= num_samples; frame_pos += mon.block_size)
-        monitor_process(&mon, signal + frame_pos);
+static bool ap_near(const struct ft8_apriori *ap, float freq_hz){
+	for (int i = 0; i < ap->n_pitches; i++)
+		if (fabsf(freq_hz - ap->pitch[i]) <= kAP_freq_tolerance)
+			return true;
+	return false;
+}
+
+// try each of the hypotheses in turn, a wrong one rarely decodes
+// and the hard errors catch the ones that converge on noise
+static bool ap_decode(monitor_t *mon, const candidate_t *cand, 
+	const struct ft8_apriori *ap, message_t *message, int iterations){
+	decode_status_t status;
+
+	for (int i = 0; i < ap->count; i++){
+		if (ft8_decode_ap(&mon->wf, cand, ap->hypothesis + i, message, 
+			iterations, &status) && status.hard_errors <= kMax_AP_hard_errors)
+			return true;
+	}
+	return false;
+}
+
+/*
+	Decodes a slot's worth of 12 kHz audio with the given monitor,
+	each new (de-duplicated) message is passed to the callback.
+	The monitor is owned by the caller, so that different threads
+	can decode at the same time using their own monitors.
+
+	The deadline (CLOCK_MONOTONIC seconds, 0 for none) is when the 
+	results are needed. The candidates are tried strongest first. When the
+	time left can't cover the remaining candidates at the measured cost,
+	the LDPC iterations are cut down, and when even that isn't enough, 
+	the weakest candidates are skipped. What was left out goes into stats.
+	The a-priori retries come out of the same time, one is only made
+	if the candidates still pending can get at least their fewest
+	iterations after it.
+*/
+static int ftx_decode_monitor(monitor_t *mon, float *signal, int num_samples,
+	double deadline, const struct ft8_apriori *ap, ftx_decode_callback callback,
+	void *ctx, struct ftx_decode_stats *stats)
+{
+    double started = monotonic_now();
+    struct ftx_decode_stats st = {0};
+    st.min_iterations = kLDPC_iterations;
+
+    // Compute FFT over the whole signal and store it
+    monitor_reset(mon);
+    monitor_process(mon, signal, num_samples);
     
-//    LOG(LOG_DEBUG, "Waterfall accumulated %d symbols\n", mon.wf.num_blocks);
-//    LOG(LOG_INFO, "Max magnitude: %.1f dB\n", mon.max_mag);
+//    LOG(LOG_DEBUG, "Waterfall accumulated %d symbols\n", mon->wf.num_blocks);
+//    LOG(LOG_INFO, "Max magnitude: %.1f dB\n", mon->max_mag);
 
     // Find top candidates by Costas sync score and localize them in time and frequency
     candidate_t candidate_list[kMax_candidates];
-    int num_candidates = ft8_find_sync(&mon.wf, kMax_candidates, candidate_list, kMin_score);
+    int num_candidates = ft8_find_sync(&mon->wf, kMax_candidates, candidate_list, kMin_score);
+    st.candidates = num_candidates;
 
     // Hash table for decoded messages (to check for duplicates)
     int num_decoded = 0;
@@ -434,20 +581,66 @@ static int sbitx_ft8_decode(float *signal, int num_samples, bool is_ft8)
         decoded_hashtable[i] = NULL;
     }
 
-		int n_decodes = 0;
-    // Go over candidates and attempt to decode messages
+    // Go over candidates (sorted by the sync score) and attempt to decode messages
     for (int idx = 0; idx < num_candidates; ++idx)
     {
         const candidate_t* cand = &candidate_list[idx];
         if (cand->score < kMin_score)
             continue;
 
-        float freq_hz = (cand->freq_offset + (float)cand->freq_sub / mon.wf.freq_osr) / mon.symbol_period;
-        float time_sec = (cand->time_offset + (float)cand->time_sub / mon.wf.time_osr) * mon.symbol_period;
+        int iterations = kLDPC_iterations;
+        double before = monotonic_now();
+        if (deadline > 0 && mon->ns_per_iteration > 0){
+            double left = (deadline - before) * 1e9;
+            int pending = num_candidates - idx;
+            if (left < pending * mon->ns_per_iteration * kLDPC_iterations)
+                iterations = left / (pending * mon->ns_per_iteration);
+            if (iterations < kMin_LDPC_iterations)
+                iterations = kMin_LDPC_iterations;
+            //not even the weakest effort fits, leave the rest
+            if (left < iterations * mon->ns_per_iteration){
+                st.skipped = pending;
+                break;
+            }
+            if (iterations < kLDPC_iterations)
+                st.reduced++;
+            if (iterations < st.min_iterations)
+                st.min_iterations = iterations;
+        }
+        st.tried++;
+
+        float freq_hz = (cand->freq_offset + (float)cand->freq_sub / mon->wf.freq_osr) / mon->symbol_period;
+        float time_sec = (cand->time_offset + (float)cand->time_sub / mon->wf.time_osr) * mon->symbol_period;
 
         message_t message;
         decode_status_t status;
-        if (!ft8_decode(&mon.wf, cand, &message, kLDPC_iterations, &status)){
+        bool ok = ft8_decode(&mon->wf, cand, &message, iterations, &status);
+
+        // keep a running average of the cost, the failures use up
+        // all the iterations and they are the bulk of the candidates
+        float cost = (monotonic_now() - before) * 1e9 / iterations;
+        if (mon->ns_per_iteration > 0)
+            mon->ns_per_iteration = 0.95f * mon->ns_per_iteration + 0.05f * cost;
+        else
+            mon->ns_per_iteration = cost;
+
+        bool ap_wanted = !ok && ap && ap->count && st.ap_tried < kMax_AP_candidates
+            && ap_near(ap, freq_hz);
+        if (ap_wanted && deadline > 0 && mon->ns_per_iteration > 0){
+            double left = (deadline - monotonic_now()) * 1e9;
+            int pending = num_candidates - idx - 1;
+            if (left < (ap->count * iterations + pending * kMin_LDPC_iterations)
+                * mon->ns_per_iteration)
+                ap_wanted = false;
+        }
+        if (ap_wanted){
+            st.ap_tried++;
+            ok = ap_decode(mon, cand, ap, &message, iterations);
+            if (ok)
+                st.ap_decoded++;
+        }
+
+        if (!ok){
             // printf("000000 %3d %+4.2f %4.0f ~  ---\n", cand->score, time_sec, freq_hz);
             if (status.ldpc_errors > 0)
                 LOG(LOG_DEBUG, "LDPC decode: %d errors\n", status.ldpc_errors);
@@ -484,34 +677,118 @@ static int sbitx_ft8_decode(float *signal, int num_samples, bool is_ft8)
            decoded_hashtable[idx_hash] = &decoded[idx_hash];
            ++num_decoded;
 
-			char buff[1000];
-            sprintf(buff, "%s %3d %+03d %-4.0f ~  %s\n", time_str, 
-			  cand->score, cand->snr, freq_hz, message.text);
-			//For troubleshooting you can display the time offset - n1qm
-			//sprintf(buff, "%s %d %+03d %-4.0f ~  %s\n", time_str, cand->time_offset,
-			//  cand->snr, freq_hz, message.text);
-			if (strstr(buff, mycallsign_upper)){
-				write_console(FONT_FT8_REPLY, buff);
-				ft8_process(buff, FT8_CONTINUE_QSO);
-			}
-			else 
-				write_console(FONT_FT8_RX, buff);
-			n_decodes++;
+           callback(ctx, message.text, cand->score, cand->snr, freq_hz, time_sec);
         }
     }
     //LOG(LOG_INFO, "Decoded %d messages\n", num_decoded);
 
-    monitor_free(&mon);
+    st.decoded = num_decoded;
+    st.msec = (monotonic_now() - started) * 1000;
+    if (deadline > 0)
+        st.margin_msec = (deadline - monotonic_now()) * 1000;
+    if (stats)
+        *stats = st;
+    return num_decoded;
+}
+
+struct ft8_console_ctx {
+	char time_str[20];
+	char mycallsign_upper[20];
+	time_t slot;
+	bool is_ft8;
+};
+
+// the decodes of the modem are shown on the console and
+// the ones addressed to us are fed to the qso state machine
+static void ft8_console_decode(void *ctx, const char *text, int score, int snr,
+	float freq_hz, float time_sec)
+{
+	struct ft8_console_ctx *c = (struct ft8_console_ctx *)ctx;
+	char buff[1000];
+
+	double dt = time_sec - FT8_TX_DELAY;
+	ft8_dt_count++;
+	ft8_dt_sum += dt;
+	ft8_dt_sum2 += dt * dt;
+	wsjtx_decode(c->slot, snr, dt, freq_hz, c->is_ft8, text);
+
+	sprintf(buff, "%s %3d %+03d %-4.0f ~  %s\n", c->time_str, 
+	  score, snr, freq_hz, text);
+	//For troubleshooting you can display the time offset - n1qm
+	//sprintf(buff, "%s %d %+03d %-4.0f ~  %s\n", c->time_str, cand->time_offset,
+	//  snr, freq_hz, text);
+	if (strstr(buff, c->mycallsign_upper)){
+		write_console(FONT_FT8_REPLY, buff);
+		ft8_process(buff, FT8_CONTINUE_QSO);
+	}
+	else 
+		write_console(FONT_FT8_RX, buff);
+}
+
+// the deadline is CLOCK_MONOTONIC seconds, 0 to decode everything
+int sbitx_ft8_decode(float *signal, int num_samples, bool is_ft8, double deadline,
+	struct ftx_decode_stats *stats)
+{
+    int sample_rate = 12000;
+
+    LOG(LOG_DEBUG, "Sample rate %d Hz, %d samples, %.3f seconds\n", sample_rate, num_samples, (double)num_samples / sample_rate);
+
+    monitor_t *mon = is_ft8 ? &ft8_monitor : &ft4_monitor;
+		struct ft8_console_ctx ctx;
+
+		//timestamp the packets
+		//the time is shifted back by the time it took to capture these sameples
+		time_t	rawtime = (time_sbitx() / 15) * 15; //round to the earlier slot
+		struct tm *t = gmtime(&rawtime);
+		sprintf(ctx.time_str, "%02d%02d%02d", t->tm_hour, t->tm_min, t->tm_sec);
+		ctx.slot = rawtime;
+		ctx.is_ft8 = is_ft8;
+
+		int i;
+		char mycallsign[20];
+		get_field_value("#mycallsign", mycallsign);
+		for (i = 0; i < strlen(mycallsign); i++)
+			ctx.mycallsign_upper[i] = toupper(mycallsign[i]);
+		ctx.mycallsign_upper[i] = 0;	
+
+		struct ft8_apriori ap;
+		ap_setup(&ap, field_str("MYCALLSIGN"), field_str("CALL"), ft8_qso_pitch, 
+			field_int("TX_PITCH"));
 
-    return n_decodes;
+    int n = ftx_decode_monitor(mon, signal, num_samples, deadline, &ap,
+			ft8_console_decode, &ctx, stats);
+		wsjtx_flush();
+		return n;
+}
+
+// monitors for other decoders (like the wideband one) that run 
+// on their own threads. Call these from the main thread only.
+void *ftx_monitor_new(bool is_ft8)
+{
+	monitor_config_t mon_cfg = {
+		.f_min = 100,
+		.f_max = 3000,
+		.sample_rate = 12000,
+		.time_osr = kTime_osr,
+		.freq_osr = kFreq_osr,
+		.protocol = is_ft8 ? PROTO_FT8 : PROTO_FT4
+	};
+	monitor_t *mon = (monitor_t *)malloc(sizeof(monitor_t));
+	monitor_init(mon, &mon_cfg);
+	return mon;
+}
+
+int ftx_decode(void *monitor, float *signal, int num_samples, double deadline,
+	ftx_decode_callback callback, void *ctx, struct ftx_decode_stats *stats)
+{
+	return ftx_decode_monitor((monitor_t *)monitor, signal, num_samples, 
+		deadline, NULL, callback, ctx, stats);
 }
 
 //this variable is a count of number of repititions left for the 
 //current message, it is not the user setting of the same number
 static int ft8_repeat = 5;
 
-int sbitx_ft8_encode(char *message, int32_t freq,  float *signal, bool is_ft4);
-
 void ft8_setmode(int config){
 	switch(config){
 		case FT8_MANUAL:
@@ -529,17 +806,236 @@ void ft8_setmode(int config){
 	}
 }
 
-static void ft8_start_tx(int offset_seconds){
+/*
+	The transmission is rendered ahead of time at the 96000 samples/sec 
+	of the sound card, straight from the GFSK phase, so that there are
+	no images of a lower sample rate to filter out. The sound thread
+	(in ft8_next_sample()) works out the capture sample on which it has 
+	to start, to be on air FT8_TX_DELAY into the slot. The start is
+	reported back through ft8_tx_late and printed from ft8_poll().
+*/
+#define FT8_TX_RATE 96000
+#define FT8_TX_SAMPLES ((int)(FT8_NN * FT8_SYMBOL_PERIOD * FT8_TX_RATE + 0.5))
+
+static float *ft8_tx_wave = NULL;
+static char ft8_tx_wave_text[128];
+static int ft8_tx_wave_pitch = -1;
+static time_t ft8_tx_slot = 0;
+static double ft8_tx_at;					// CLOCK_REALTIME when it should be on air
+static long long ft8_tx_start = -1;	// capture sample where it begins
+static int ft8_tx_reported = 1;
+static double ft8_tx_late;				// seconds, as measured on the sample clock
+static int ft8_tx_cut;						// samples lost to a late start
+
+static int ft8_render_tx(){
+	uint8_t tones[FT8_NN];
+
+	//repeats go out as rendered the first time
+	if (ft8_tx_wave_pitch == ft8_pitch && !strcmp(ft8_tx_wave_text, ft8_tx_text))
+		return FT8_TX_SAMPLES;
+	if (ftx_tones(ft8_tx_text, tones, false) < 0)
+		return 0;
+	if (!ft8_tx_wave)
+		ft8_tx_wave = (float *)malloc(FT8_TX_SAMPLES * sizeof(float));
+	synth_gfsk(tones, FT8_NN, ft8_pitch, FT8_SYMBOL_BT, FT8_SYMBOL_PERIOD,
+		FT8_TX_RATE, ft8_tx_wave);
+	strcpy(ft8_tx_wave_text, ft8_tx_text);
+	ft8_tx_wave_pitch = ft8_pitch;
+	return FT8_TX_SAMPLES;
+}
+
+/*
+	More than one FT8 signal can go out in the same slot, for fox/hound 
+	and the like. Besides the message of ft8_tx() there are upto 
+	FT8_MAX_STREAMS streams, each at its own pitch and amplitude with a 
+	queue of messages, one of which is sent in each transmit slot.
+	The head message of every stream is rendered ahead on the UI thread
+	(in ft8_stream_prepare()), the start of the transmission only adds 
+	them up, the sound thread still just reads out one wave.
+	The sum of several tones has peaks that can drive the PA into
+	compression. Any limiting of the sum would put intermodulation
+	products around the signals, so the sum is only scaled, linearly,
+	down to the same peak as a single signal.
+*/
+#define FT8_MAX_STREAMS 5
+#define FT8_STREAM_QUEUE 8
+
+struct ft8_stream {
+	int pitch;				// 0 if the stream is not in use
+	int amplitude;		// percent of a single signal
+	char queue[FT8_STREAM_QUEUE][40];
+	int head, count;
+	float *wave;			// the head message rendered
+	int wave_ready;
+};
+static struct ft8_stream ft8_streams[FT8_MAX_STREAMS];
+static float *ft8_tx_sum = NULL;
+static float *ft8_tx_out = NULL;	// what the sound thread reads
+
+static int ft8_stream_render(struct ft8_stream *s){
+	uint8_t tones[FT8_NN];
+
+	if (ftx_tones(s->queue[s->head], tones, false) < 0)
+		return -1;
+	if (!s->wave)
+		s->wave = (float *)malloc(FT8_TX_SAMPLES * sizeof(float));
+	synth_gfsk(tones, FT8_NN, s->pitch, FT8_SYMBOL_BT, FT8_SYMBOL_PERIOD,
+		FT8_TX_RATE, s->wave);
+	s->wave_ready = 1;
+	return 0;
+}
+
+// renders one waiting message per call, to keep each poll short
+static void ft8_stream_prepare(){
+	for (int i = 0; i < FT8_MAX_STREAMS; i++){
+		struct ft8_stream *s = ft8_streams + i;
+		if (s->pitch && s->count && !s->wave_ready){
+			if (ft8_stream_render(s) < 0){
+				//drop what can't be encoded
+				s->head = (s->head + 1) % FT8_STREAM_QUEUE;
+				s->count--;
+			}
+			return;
+		}
+	}
+}
+
+static int ft8_streams_pending(){
+	for (int i = 0; i < FT8_MAX_STREAMS; i++)
+		if (ft8_streams[i].pitch && ft8_streams[i].count)
+			return 1;
+	return 0;
+}
+
+// adds a message to the stream at the pitch, the stream is opened if needed
+int ft8_stream_queue(int pitch, int amplitude, char *message){
+	struct ft8_stream *s = NULL;
+
+	if (pitch < 100 || pitch > 3000 || amplitude <= 0 || amplitude > 100)
+		return -1;
+	for (int i = 0; i < FT8_MAX_STREAMS; i++)
+		if (ft8_streams[i].pitch == pitch)
+			s = ft8_streams + i;
+	for (int i = 0; !s && i < FT8_MAX_STREAMS; i++)
+		if (!ft8_streams[i].pitch){
+			s = ft8_streams + i;
+			s->head = s->count = s->wave_ready = 0;
+		}
+	if (!s || s->count == FT8_STREAM_QUEUE)
+		return -1;
+
+	s->pitch = pitch;
+	s->amplitude = amplitude;
+	char *q = s->queue[(s->head + s->count) % FT8_STREAM_QUEUE];
+	strncpy(q, message, sizeof(s->queue[0]) - 1);
+	q[sizeof(s->queue[0]) - 1] = 0;
+	for (char *p = q; *p; p++)
+		*p = toupper(*p);
+	s->count++;
+	return 0;
+}
+
+void ft8_stream_clear(){
+	for (int i = 0; i < FT8_MAX_STREAMS; i++){
+		ft8_streams[i].pitch = 0;
+		ft8_streams[i].count = 0;
+		ft8_streams[i].wave_ready = 0;
+	}
+}
+
+void ft8_stream_list(){
+	char buff[200];
+	int n = 0;
+
+	for (int i = 0; i < FT8_MAX_STREAMS; i++){
+		struct ft8_stream *s = ft8_streams + i;
+		if (!s->pitch)
+			continue;
+		sprintf(buff, "\n%04d Hz %3d%%", s->pitch, s->amplitude);
+		write_console(FONT_LOG, buff);
+		for (int j = 0; j < s->count; j++){
+			sprintf(buff, "%s %s", j ? "," : ":", 
+				s->queue[(s->head + j) % FT8_STREAM_QUEUE]);
+			write_console(FONT_LOG, buff);
+		}
+		n++;
+	}
+	write_console(FONT_LOG, n ? "\n" : "\nNo FT8 streams queued\n");
+}
+
+// adds up the signals of this slot, returns the number of samples
+static int ft8_mix_tx(int with_main){
+	int n_main = with_main ? ft8_render_tx() : 0;
+	int n_signals = n_main ? 1 : 0;
+
+	if (!ft8_tx_sum)
+		ft8_tx_sum = (float *)malloc(FT8_TX_SAMPLES * sizeof(float));
+	if (n_main)
+		memcpy(ft8_tx_sum, ft8_tx_wave, FT8_TX_SAMPLES * sizeof(float));
+	else
+		memset(ft8_tx_sum, 0, FT8_TX_SAMPLES * sizeof(float));
+
+	for (int i = 0; i < FT8_MAX_STREAMS; i++){
+		struct ft8_stream *s = ft8_streams + i;
+		if (!s->pitch || !s->count)
+			continue;
+		if (s->wave_ready || !ft8_stream_render(s)){
+			float a = s->amplitude / 100.0f;
+			for (int j = 0; j < FT8_TX_SAMPLES; j++)
+				ft8_tx_sum[j] += a * s->wave[j];
+			n_signals++;
+		}
+		s->head = (s->head + 1) % FT8_STREAM_QUEUE;
+		s->count--;
+		s->wave_ready = 0;
+	}
+
+	if (!n_signals)
+		return 0;
+	//a single signal goes out as it is
+	if (n_signals == 1 && n_main){
+		ft8_tx_out = ft8_tx_wave;
+		return FT8_TX_SAMPLES;
+	}
+
+	//only scaled down if it would clip, a stream on its own keeps its amplitude
+	float peak = 0;
+	for (int j = 0; j < FT8_TX_SAMPLES; j++)
+		if (fabsf(ft8_tx_sum[j]) > peak)
+			peak = fabsf(ft8_tx_sum[j]);
+	if (peak > 1.0f)
+		for (int j = 0; j < FT8_TX_SAMPLES; j++)
+			ft8_tx_sum[j] /= peak;
+	ft8_tx_out = ft8_tx_sum;
+	return FT8_TX_SAMPLES;
+}
+
+static void ft8_start_tx(int with_main){
 	char buff[1000];
 	//timestamp the packets for display log
 	time_t	rawtime = time_sbitx();
 	struct tm *t = gmtime(&rawtime);
 
-  sprintf(buff, "%02d%02d%02d  TX +00 %04d ~  %s\n", t->tm_hour, t->tm_min, t->tm_sec, ft8_pitch, ft8_tx_text);
-	write_console(FONT_FT8_TX, buff);
+	if (with_main){
+		sprintf(buff, "%02d%02d%02d  TX +00 %04d ~  %s\n", t->tm_hour, t->tm_min, 
+			t->tm_sec, ft8_pitch, ft8_tx_text);
+		write_console(FONT_FT8_TX, buff);
+	}
+	for (int i = 0; i < FT8_MAX_STREAMS; i++)
+		if (ft8_streams[i].pitch && ft8_streams[i].count){
+			struct ft8_stream *s = ft8_streams + i;
+			sprintf(buff, "%02d%02d%02d  TX +00 %04d ~  %s\n", t->tm_hour, t->tm_min, 
+				t->tm_sec, s->pitch, s->queue[s->head]);
+			write_console(FONT_FT8_TX, buff);
+		}
 
-	ft8_tx_nsamples = sbitx_ft8_encode(ft8_tx_text, ft8_pitch, ft8_tx_buff, false); 
-	ft8_tx_buff_index = offset_seconds * 96000;
+	int n = ft8_mix_tx(with_main);
+	ft8_tx_slot = (rawtime / 15) * 15;
+	ft8_tx_at = ft8_tx_slot + FT8_TX_DELAY + ft8_time_offset;
+	ft8_tx_start = -1;
+	ft8_tx_reported = 0;
+	//this lets the sound thread go
+	ft8_tx_nsamples = n;
 }
 
 // the ft8_tx() only schedules the transmission
@@ -603,22 +1099,57 @@ void *ft8_thread_function(void *ptr){
 			continue;
 
 		ft8_do_decode = 0;
-		sbitx_ft8_decode(ft8_rx_buffer, ft8_rx_buff_index, true);
-		//let the next batch begin
-		ft8_rx_buff_index = 0;
+
+		//the decodes are needed in time to reply in the very next slot,
+		//the transmission can start a little late (see ft8_start_tx)
+		double deadline = sound_monotonic_time((ft8_decode_slot + 1) * 15.0
+			+ ft8_time_offset) + FT8_REPLY_LATENESS;
+
+		struct ftx_decode_stats stats;
+		sbitx_ft8_decode(ft8_rx_buffer, ft8_rx_buff_index, true, deadline, &stats);
+		if (stats.skipped || stats.reduced)
+			printf("FT8 decode ran out of time: %d of %d candidates skipped, "
+				"%d with LDPC iterations cut down to %d, %.0f msec\n",
+				stats.skipped, stats.candidates, stats.reduced, 
+				stats.min_iterations, stats.msec);
 	}
 }
 
 // the ft8 sampling is at 12000, the incoming samples are at
 // 96000 samples/sec
+// the slots are timed by when the samples were captured (on the sample clock), 
+// not by when they reached here. The first sample of the buffer is the
+// start of the slot, this makes the DT of the decodes exact
 void ft8_rx(int32_t *samples, int count){
 
 	int decimation_ratio = 96000/12000;
 
+	double t = sound_sample_time(sound_sample_index()) - ft8_time_offset;
+	long slot = (long)floor(t / 15);
+	double into_slot = t - slot * 15.0;
+	int at = (int)(into_slot * 12000 + 0.5);
+
+	if (slot != ft8_rx_slot){
+		ft8_rx_slot = slot;
+		ft8_rx_start = at;
+		ft8_rx_triggered = 0;
+		ft8_rx_buff_index = 0;
+	}
+
 	//if there is an overflow, then reset to the begining
-	if (ft8_rx_buff_index + (count/decimation_ratio) >= FT8_MAX_BUFF){
+	if (at + (count/decimation_ratio) >= FT8_MAX_BUFF){
 		ft8_rx_buff_index = 0;		
 		printf("Buffer Overflow\n");
+		return;
+	}
+
+	//follow the sample clock over the start of the slot or
+	//any samples lost, the gaps are left silent
+	if (abs(at - ft8_rx_buff_index) > 2){
+		if (at > ft8_rx_buff_index)
+			memset(ft8_rx_buffer + ft8_rx_buff_index, 0, 
+				(at - ft8_rx_buff_index) * sizeof(float));
+		ft8_rx_buff_index = at;
 	}
 
 	//down convert to 12000 Hz sampling rate
@@ -626,30 +1157,43 @@ void ft8_rx(int32_t *samples, int count){
 		//ft8_rx_buff[ft8_rx_buff_index++] = samples[i];
 		ft8_rx_buffer[ft8_rx_buff_index++] = samples[i] / 200000000.0f;
 
-	int now = time_sbitx();
-	if (now != wallclock)	
-		wallclock = now;
-	else 
-		return;
-
-	int slot_second = wallclock % 15;
-	if (slot_second == 0)
-		ft8_rx_buff_index = 0;
-
-//	printf("ft8 decoding trigger index %d, slot_second %d\n", ft8_rx_buff_index, slot_second);
 	//we should have atleast 12 seconds of samples to decode
-	if (ft8_rx_buff_index >= 13 * 12000 && slot_second > 13)
+	if (!ft8_rx_triggered && into_slot >= 14 
+		&& ft8_rx_buff_index - ft8_rx_start >= 12 * 12000){
+		ft8_rx_triggered = 1;
+		ft8_decode_slot = slot;
 		ft8_do_decode = 1;
+	}
 }
 
 void ft8_poll(int seconds, int tx_is_on){
 	static int last_second = 0;
+	static int offset_second = -1;
+
+	ft8_stream_prepare();
+
+	if (seconds != offset_second){
+		ft8_time_offset = field_int("FT8_DT_OFFSET") / 1000.0;
+		offset_second = seconds;
+	}
 
 	//if we are already transmitting, we continue 
 	//until we run out of ft8 sampels
 	if (tx_is_on){
 		//tx_off should not abort repeats from modem_poll, when called from here
 		int ft8_repeat_save = ft8_repeat;
+		if (ft8_tx_start >= 0 && !ft8_tx_reported){
+			if (ft8_tx_cut)
+				printf("FT8 TX started %.3f sec late, the first %d msec are cut off\n",
+					ft8_tx_late + (double)ft8_tx_cut / FT8_TX_RATE, 
+					(ft8_tx_cut * 1000) / FT8_TX_RATE);
+			else
+				printf("FT8 TX on air at %.3f sec into the slot (%+.2f msec), "
+					"%.1f msec after the capture\n", 
+					FT8_TX_DELAY + ft8_tx_late, ft8_tx_late * 1000, 
+					sound_tx_latency() * 1000);
+			ft8_tx_reported = 1;
+		}
 		if (ft8_tx_nsamples == 0){
 			tx_off();
 			ft8_repeat = ft8_repeat_save;
@@ -657,33 +1201,99 @@ void ft8_poll(int seconds, int tx_is_on){
 		return;
 	}
 	
-	if (!ft8_repeat || seconds == last_second)
+	if ((!ft8_repeat && !ft8_streams_pending()) || seconds == last_second)
 		return;
 
 	//we poll for this only once every second
 	//we are here only if we are rx-ing and we have a pending transmission 
 	last_second = seconds = seconds % 60;
 
+	//the transmission ends before the slot does, don't go again in the same slot
+	if ((time_sbitx() / 15) * 15 == ft8_tx_slot)
+		return;
+
 	if (
 		(ft8_tx1st == 1 && ((seconds >= 0  && seconds < 15) ||
 			(seconds >=30 && seconds < 45))) ||
 		(ft8_tx1st == 0 && ((seconds >= 15 && seconds < 30)|| 
 			(seconds >= 45 && seconds < 59)))){
 		tx_on(TX_SOFT);
-		ft8_start_tx(seconds % 15);
-		ft8_repeat--;
+		ft8_start_tx(ft8_repeat > 0);
+		if (ft8_repeat > 0)
+			ft8_repeat--;
 	} 
 }
 
+/*
+	The DT of the decodes in the slot are measured on the sample clock. 
+	Most stations keep good time, so their average DT is the error of 
+	our own clock (less the FT8_DT_OFFSET already applied). The spread 
+	of the DT shows how steady our timing is.
+*/
+void ft8_status(){
+	char buff[200];
+
+	if (!ft8_dt_count){
+		write_console(FONT_LOG, "\nNo FT8 decodes yet to measure the DT\n");
+		return;
+	}
+	double mean = ft8_dt_sum / ft8_dt_count;
+	double var = ft8_dt_sum2 / ft8_dt_count - mean * mean;
+	sprintf(buff, "\nFT8 DT of %d decodes: average %+.3f sec, spread %.3f sec, "
+		"offset %d msec\n", ft8_dt_count, mean, var > 0 ? sqrt(var) : 0, 
+		field_int("FT8_DT_OFFSET"));
+	write_console(FONT_LOG, buff);
+}
+
+// moves the FT8_DT_OFFSET by the average DT, for both the receive and transmit
+void ft8_dt_calibrate(){
+	char buff[100];
+
+	if (ft8_dt_count < 20){
+		write_console(FONT_LOG, "\nNeed at least 20 FT8 decodes to calibrate the DT\n");
+		return;
+	}
+	ft8_status();
+	int offset = field_int("FT8_DT_OFFSET") + (int)(1000 * ft8_dt_sum / ft8_dt_count);
+	sprintf(buff, "%d", offset);
+	field_set("FT8_DT_OFFSET", buff);
+	sprintf(buff, "FT8_DT_OFFSET is now %d msec\n", offset);
+	write_console(FONT_LOG, buff);
+	ft8_dt_count = 0;
+	ft8_dt_sum = ft8_dt_sum2 = 0;
+}
+
+// called from the sound thread for each sample of the transmit block
 float ft8_next_sample(){
-		float sample = 0;
-		if (ft8_tx_buff_index/8 < ft8_tx_nsamples){
-			sample = ft8_tx_buff[ft8_tx_buff_index/8]/7;
-			ft8_tx_buff_index++;
-		}
-		else //stop transmitting ft8 
-			ft8_tx_nsamples = 0;
-		return sample;
+	static long long block = -1;
+	static int in_block = 0;
+
+	long long index = sound_sample_index();
+	if (index != block){
+		block = index;
+		in_block = 0;
+	}
+	index += in_block++;
+
+	if (!ft8_tx_nsamples)
+		return 0;
+
+	//the output of this sample will be heard a fixed latency after its capture
+	if (ft8_tx_start < 0){
+		ft8_tx_start = sound_time_sample(ft8_tx_at - sound_tx_latency());
+		ft8_tx_cut = index > ft8_tx_start ? index - ft8_tx_start : 0;
+		ft8_tx_late = sound_sample_time(ft8_tx_start) + sound_tx_latency() - ft8_tx_at;
+	}
+
+	long long i = index - ft8_tx_start;
+	if (i < 0)
+		return 0;
+	if (i >= ft8_tx_nsamples){
+		//stop transmitting ft8 
+		ft8_tx_nsamples = 0;
+		return 0;
+	}
+	return ft8_tx_out[i] / 7;
 }
 
 /* these are used to process the current message */
@@ -759,6 +1369,7 @@ void ft8_on_start_qso(char *message){
 		ft8_tx1st = 0; //we tx on 2nd and 4ht slots for msgs on 1st and 3rd
 	else
 		ft8_tx1st = 1;
+	ft8_qso_pitch = rx_pitch;
 
 	if (!strcmp(m1, "CQ")){
 		if (m4[0]){
@@ -857,6 +1468,10 @@ void ft8_process(char *message, int operation){
 		return;
 	}
 
+	//keep up with the other station if it moves
+	if (!strcmp(m2, call))
+		ft8_qso_pitch = rx_pitch;
+
 
 	if (!strcmp(m3, "73")){
 		ft8_abort();
@@ -888,9 +1503,26 @@ void ft8_process(char *message, int operation){
 	}
 }
 
+// sets up the waterfall monitors, this has to be done
+// from the main thread (before any decoding) as fftw planning isn't thread safe
+void ft8_decoder_init(){
+	monitor_config_t mon_cfg = {
+		.f_min = 100,
+		.f_max = 3000,
+		.sample_rate = 12000,
+		.time_osr = kTime_osr,
+		.freq_osr = kFreq_osr,
+		.protocol = PROTO_FT8
+	};
+	monitor_init(&ft8_monitor, &mon_cfg);
+	mon_cfg.protocol = PROTO_FT4;
+	monitor_init(&ft4_monitor, &mon_cfg);
+}
+
 void ft8_init(){
+	ft8_decoder_init();
+
 	ft8_rx_buff_index = 0;
-	ft8_tx_buff_index = 0;
 	ft8_tx_nsamples = 0;
 	pthread_create( &ft8_thread, NULL, ft8_thread_function, (void*)NULL);
 }
@@ -899,3 +1531,8 @@ void ft8_abort(){
 	ft8_tx_nsamples = 0;
 	ft8_repeat = 0;
 }
+
+// lets the transmission in progress finish, but sends no more
+void ft8_stop_repeat(){
+	ft8_repeat = 0;
+}
@@ -1,8 +1,49 @@
+#include <stdbool.h>
+#include <stdint.h>
+
 #define FT8_MAX_BUFF (12000 * 18) 
 void ft8_rx(int32_t *samples, int count);
 void ft8_init();
+void ft8_decoder_init();
+int sbitx_ft8_encode(char *message, int32_t freq, float *signal, bool is_ft4);
+
+// how much of the work a decode got through before its deadline
+struct ftx_decode_stats {
+	int candidates;			// found by the sync search
+	int tried;
+	int skipped;				// weakest candidates left out
+	int reduced;				// candidates tried with fewer LDPC iterations
+	int min_iterations;
+	int decoded;
+	int ap_tried;				// candidates retried with the qso's known bits
+	int ap_decoded;
+	float msec;
+	float margin_msec;	// left before the deadline
+};
+
+// called with each new message found in a slot
+typedef void (*ftx_decode_callback)(void *ctx, const char *text, int score, 
+	int snr, float freq_hz, float time_sec);
+int sbitx_ft8_decode(float *signal, int num_samples, bool is_ft8, double deadline,
+	struct ftx_decode_stats *stats);
+void *ftx_monitor_new(bool is_ft8);
+int ftx_decode(void *monitor, float *signal, int num_samples, double deadline,
+	ftx_decode_callback callback, void *ctx, struct ftx_decode_stats *stats);
 void ft8_abort();
+void ft8_stop_repeat();
 void ft8_tx(char *message, int freq);
 void ft8_poll(int seconds, int tx_is_on);
 float ft8_next_sample();
 void ft8_process(char *message, int operation);
+void ft8_status();
+int ft8_stream_queue(int pitch, int amplitude, char *message);
+void ft8_stream_clear();
+void ft8_stream_list();
+void ft8_dt_calibrate();
+
+// wideband decoding of the IF, see ft8_wideband.c
+void ft8_wide_init();
+void ft8_wide_rx(int32_t *samples, int count);
+void ft8_wide_poll();
+void ft8_wide_status();
+void ft8_wide_reset_stats();
@@ -0,0 +1,505 @@
+/*
+	Multi-channel BPSK31 decoder
+
+	Instead of passing PSK31 to fldigi, this decodes every PSK31 signal
+	in the passband at the same time. It is switched on with the
+	PSK_RX setting (\psk_rx ON) and works in the PSK31 mode, fldigi
+	is still used to transmit.
+
+	1. psk_rx() is called from modem_rx() with each block of the
+	demodulated audio and pushes it into an if_ring (see dsp_utils.h).
+
+	2. The psk thread decimates the audio to 8000 samples/sec, this is
+	shared by all the channels.
+	A spectrum of the shared audio, averaged over a few seconds, finds
+	the signals. A channel is opened on each new one and closed after
+	it has been quiet for PSK_IDLE_SECS.
+
+	3. Each channel mixes its signal down to zero, filters it in
+	two steps to 500 samples/sec (16 samples a symbol) and:
+	- recovers the symbol clock from the dips in the amplitude at the
+	  phase reversals,
+	- compares the phase of each symbol with the previous one, a
+	  reversal is a 0 and no change is a 1,
+	- tracks the frequency from the square of that phase difference,
+	- measures the quality as the average of cos(2 x phase difference),
+	  it is 1 for a clean signal and around 0 on noise, this is the
+	  squelch,
+	- collects the bits into the Varicode characters (separated by 00).
+
+	4. The text of each channel is collected into a line, the lines
+	go to the console (and the web UI) with the frequency in front.
+
+	\pskstat lists the channels with the cpu each one takes.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <complex.h>
+#include <fftw3.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "sdr.h"
+#include "sdr_ui.h"
+#include "dsp_utils.h"
+#include "modem_psk.h"
+
+#define PSK_BLOCK IF_BLOCK
+#define PSK_RING 64
+#define PSK_IN_RATE 96000
+#define PSK_RATE 8000
+#define PSK_DECIMATE (PSK_IN_RATE / PSK_RATE)
+#define PSK_CHAN_DECIMATE 16
+#define PSK_SPS 16				// samples per symbol, at 500 samples/sec
+#define PSK_BAUD 31.25f
+
+#define PSK_MAX_CHANNELS 32
+#define PSK_FFT 1024			// 7.8 Hz bins
+#define PSK_MIN_FREQ 200
+#define PSK_MAX_FREQ 3000
+#define PSK_SPACING 30		// Hz, between the channels
+#define PSK_SNR 4.0f			// over the noise, for a new channel
+#define PSK_SQUELCH 0.5f
+#define PSK_IDLE_SECS 30
+#define PSK_LINE 64
+
+// 96000 -> 8000 of the audio, the radio has already filtered it to 3 kHz
+#define FIR0_TAPS 96
+#define FIR0_CUTOFF 3200
+
+// 8000 -> 500, only has to keep out the aliases
+#define FIR1_TAPS 64
+#define FIR1_CUTOFF 100
+
+// the channel filter, a little wider than the signal
+#define FIR2_TAPS 64
+#define FIR2_CUTOFF 35
+
+static const char *varicode[128] = {
+	"1010101011", "1011011011", "1011101101", "1101110111", "1011101011",
+	"1101011111", "1011101111", "1011111101", "1011111111", "11101111",
+	"11101", "1101101111", "1011011101", "11111", "1101110101",
+	"1110101011", "1011110111", "1011110101", "1110101101", "1110101111",
+	"1101011011", "1101101011", "1101101101", "1101010111", "1101111011",
+	"1101111101", "1110110111", "1101010101", "1101011101", "1110111011",
+	"1011111011", "1101111111", "1", "111111111", "101011111",
+	"111110101", "111011011", "1011010101", "1010111011", "101111111",
+	"11111011", "11110111", "101101111", "111011111", "1110101",
+	"110101", "1010111", "110101111", "10110111", "10111101",
+	"11101101", "11111111", "101110111", "101011011", "101101011",
+	"110101101", "110101011", "110110111", "11110101", "110111101",
+	"111101101", "1010101", "111010111", "1010101111", "1010111101",
+	"1111101", "11101011", "10101101", "10110101", "1110111",
+	"11011011", "11111101", "101010101", "1111111", "111111101",
+	"101111101", "11010111", "10111011", "11011101", "10101011",
+	"11010101", "111011101", "10101111", "1101111", "1101101",
+	"101010111", "110110101", "101011101", "101110101", "101111011",
+	"1010101101", "111110111", "111101111", "111111011", "1010111111",
+	"101101101", "1011011111", "1011", "1011111", "101111",
+	"101101", "11", "111101", "1011011", "101011",
+	"1101", "111101011", "10111111", "11011", "111011",
+	"1111", "111", "111111", "110111111", "10101",
+	"10111", "101", "110111", "1111011", "1101011",
+	"11011111", "1011101", "111010101", "1010110111", "110111011",
+	"1010110101", "1011010111", "1110110101"
+};
+
+// the characters, by their varicode read as a binary number
+static char varicode_char[1024];
+
+static struct if_ring psk_ring;
+static int psk_active = 0;
+
+struct psk_channel {
+	int in_use;
+	float freq;
+	float complex osc, rot;
+	float complex fir1[2 * FIR1_TAPS], fir2[2 * FIR2_TAPS];
+	int fir1_pos, fir1_phase, fir2_pos;
+
+	// symbol clock
+	float amp[PSK_SPS];
+	int clock, sample_at, since, symbols;
+	float complex prev;
+
+	float quality;
+	unsigned int bits;
+	char line[PSK_LINE + 1];
+	int line_len;
+	double last_char, last_good;
+
+	// stats
+	long long ns;
+	int chars;
+};
+
+static struct psk_channel channels[PSK_MAX_CHANNELS];
+static float fir0_coeff[FIR0_TAPS], fir1_coeff[FIR1_TAPS], fir2_coeff[FIR2_TAPS];
+static float fir0[2 * FIR0_TAPS];
+static int fir0_pos, fir0_phase;
+
+// the shared spectrum
+static float *fft_in;
+static fftwf_complex *fft_out;
+static fftwf_plan fft_plan;
+static float fft_window[PSK_FFT];
+static float spectrum[PSK_FFT / 2];
+static int fft_fill = 0, spectra = 0;
+
+static long long shared_ns;
+static pthread_mutex_t channels_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t psk_thread;
+
+static void channel_tune(struct psk_channel *c, float freq){
+	c->freq = freq;
+	c->rot = cexpf(-I * 2 * M_PI * freq / PSK_RATE);
+}
+
+static void channel_flush(struct psk_channel *c){
+	char buff[PSK_LINE + 20];
+
+	if (!c->line_len)
+		return;
+	c->line[c->line_len] = 0;
+	sprintf(buff, "%4.0f: %s\n", c->freq, c->line);
+	write_console(FONT_FLDIGI_RX, buff);
+	c->line_len = 0;
+}
+
+static struct psk_channel *channel_open(float freq){
+	for (int i = 0; i < PSK_MAX_CHANNELS; i++){
+		struct psk_channel *c = channels + i;
+		if (c->in_use)
+			continue;
+		memset(c, 0, sizeof(*c));
+		c->osc = 1;
+		c->prev = 1;
+		channel_tune(c, freq);
+		c->last_good = monotonic_now();
+		c->in_use = 1;
+		return c;
+	}
+	return NULL;
+}
+
+static void channel_close(struct psk_channel *c){
+	channel_flush(c);
+	c->in_use = 0;
+}
+
+static void channel_char(struct psk_channel *c, char ch){
+	if (ch == '\r')
+		return;
+	c->chars++;
+	c->last_char = monotonic_now();
+	if (ch == '\n'){
+		channel_flush(c);
+		return;
+	}
+	if (ch < ' ')
+		return;
+	c->line[c->line_len++] = ch;
+	if (c->line_len == PSK_LINE)
+		channel_flush(c);
+}
+
+// a symbol every PSK_SPS samples
+static void channel_symbol(struct psk_channel *c, float complex z){
+	float complex d = cmul(z, conjf(c->prev));
+	float power = crealf(d) * crealf(d) + cimagf(d) * cimagf(d);
+	c->prev = z;
+	if (power <= 0)
+		return;
+
+	//the square of the phase difference removes the data
+	float complex d2 = cmul(d, d);
+	float q = crealf(d2) / power;
+	c->quality = 0.95f * c->quality + 0.05f * q;
+
+	//keep on the frequency, a quarter of the baud either way at most
+	if (c->quality > 0.3f){
+		float err = cargf(d2) / 2 * PSK_BAUD / (2 * M_PI);
+		channel_tune(c, c->freq + 0.05f * err);
+	}
+
+	//no phase reversal is a 1
+	int bit = crealf(d) > 0;
+	c->bits = (c->bits << 1) | bit;
+	if ((c->bits & 3) == 0){
+		unsigned int code = c->bits >> 2;
+		if (code && code < 1024 && varicode_char[code]
+			&& c->quality > PSK_SQUELCH)
+			channel_char(c, varicode_char[code]);
+		c->bits = 0;
+	}
+	else if (c->bits >= 4096)
+		c->bits = 0;
+}
+
+// called with each sample of the shared 8000 samples/sec
+static void channel_process(struct psk_channel *c, float x){
+	float complex z = x * c->osc;
+	c->osc = cmul(c->osc, c->rot);
+
+	c->fir1[c->fir1_pos] = c->fir1[c->fir1_pos + FIR1_TAPS] = z;
+	if (++c->fir1_pos == FIR1_TAPS)
+		c->fir1_pos = 0;
+	if (++c->fir1_phase < PSK_CHAN_DECIMATE)
+		return;
+	c->fir1_phase = 0;
+
+	float complex *h = c->fir1 + c->fir1_pos;
+	float complex y = 0;
+	for (int k = 0; k < FIR1_TAPS; k++)
+		y += fir1_coeff[k] * h[k];
+
+	c->fir2[c->fir2_pos] = c->fir2[c->fir2_pos + FIR2_TAPS] = y;
+	if (++c->fir2_pos == FIR2_TAPS)
+		c->fir2_pos = 0;
+	h = c->fir2 + c->fir2_pos;
+	y = 0;
+	for (int k = 0; k < FIR2_TAPS; k++)
+		y += fir2_coeff[k] * h[k];
+
+	//the amplitude peaks in the middle of the symbols
+	float *a = c->amp + c->clock;
+	*a = 0.98f * *a + 0.02f * cabsf(y);
+
+	if (c->clock == c->sample_at && c->since >= PSK_SPS / 2){
+		channel_symbol(c, y);
+		c->since = 0;
+		//move the sampling point towards the peak, a step at a time
+		if (++c->symbols % 16 == 0){
+			int best = c->sample_at;
+			for (int i = 0; i < PSK_SPS; i++)
+				if (c->amp[i] > c->amp[best])
+					best = i;
+			int diff = (best - c->sample_at + PSK_SPS) % PSK_SPS;
+			if (diff && diff < PSK_SPS / 2)
+				c->sample_at = (c->sample_at + 1) % PSK_SPS;
+			else if (diff)
+				c->sample_at = (c->sample_at + PSK_SPS - 1) % PSK_SPS;
+		}
+	}
+	c->since++;
+	c->clock = (c->clock + 1) % PSK_SPS;
+}
+
+// opens channels on the new signals and closes the quiet ones
+static void psk_scan(){
+	float smooth[PSK_FFT / 2], sorted[PSK_FFT / 2];
+	float bin_hz = (float)PSK_RATE / PSK_FFT;
+	int lo = (int)(PSK_MIN_FREQ / bin_hz), hi = (int)(PSK_MAX_FREQ / bin_hz);
+	double now = monotonic_now();
+
+	for (int i = 0; i < PSK_MAX_CHANNELS; i++){
+		struct psk_channel *c = channels + i;
+		if (!c->in_use)
+			continue;
+		if (c->quality > PSK_SQUELCH)
+			c->last_good = now;
+		else if (now - c->last_good > PSK_IDLE_SECS)
+			channel_close(c);
+		//two channels that have pulled onto the same signal
+		for (int j = 0; j < i; j++)
+			if (c->in_use && channels[j].in_use
+				&& fabsf(channels[j].freq - c->freq) < PSK_SPACING / 2)
+				channel_close(c);
+		if (c->in_use && c->line_len && now - c->last_char > 3)
+			channel_flush(c);
+	}
+
+	//the idle signal is two lines 31 Hz apart, the smoothing fills in between
+	for (int k = lo; k <= hi; k++){
+		smooth[k] = 0;
+		for (int j = -2; j <= 2; j++)
+			smooth[k] += spectrum[k + j];
+		sorted[k - lo] = smooth[k];
+	}
+	int n = hi - lo + 1;
+	for (int i = 1; i < n; i++){
+		float v = sorted[i];
+		int j = i;
+		for (; j > 0 && sorted[j - 1] > v; j--)
+			sorted[j] = sorted[j - 1];
+		sorted[j] = v;
+	}
+	float noise = sorted[n / 2];
+
+	for (int k = lo + 3; k <= hi - 3; k++){
+		if (smooth[k] < PSK_SNR * noise)
+			continue;
+		int peak = 1;
+		for (int j = -3; j <= 3 && peak; j++)
+			if (smooth[k + j] > smooth[k])
+				peak = 0;
+		if (!peak)
+			continue;
+
+		float y0 = smooth[k - 1], y1 = smooth[k], y2 = smooth[k + 1];
+		float den = y0 - 2 * y1 + y2;
+		float freq = (k + (den < 0 ? 0.5f * (y0 - y2) / den : 0)) * bin_hz;
+
+		int taken = 0;
+		for (int i = 0; i < PSK_MAX_CHANNELS; i++)
+			if (channels[i].in_use && fabsf(channels[i].freq - freq) < PSK_SPACING)
+				taken = 1;
+		if (!taken)
+			channel_open(freq);
+	}
+}
+
+static void psk_process(struct if_block *b){
+	float x[PSK_BLOCK / PSK_DECIMATE + 1];
+	int n = 0;
+	long long start = thread_ns();
+
+	//the shared part, decimation and the spectrum
+	for (int i = 0; i < b->count; i++){
+		fir0[fir0_pos] = fir0[fir0_pos + FIR0_TAPS] = b->samples[i] / 200000000.0f;
+		if (++fir0_pos == FIR0_TAPS)
+			fir0_pos = 0;
+		if (++fir0_phase < PSK_DECIMATE)
+			continue;
+		fir0_phase = 0;
+
+		float *h = fir0 + fir0_pos;
+		float y = 0;
+		for (int k = 0; k < FIR0_TAPS; k++)
+			y += fir0_coeff[k] * h[k];
+		x[n++] = y;
+
+		fft_in[fft_fill] = y * fft_window[fft_fill];
+		if (++fft_fill == PSK_FFT){
+			fft_fill = 0;
+			fftwf_execute(fft_plan);
+			for (int k = 0; k < PSK_FFT / 2; k++){
+				float p = crealf(fft_out[k]) * crealf(fft_out[k])
+					+ cimagf(fft_out[k]) * cimagf(fft_out[k]);
+				spectrum[k] = 0.8f * spectrum[k] + 0.2f * p;
+			}
+			//about every 1.3 seconds
+			if (++spectra % 10 == 0)
+				psk_scan();
+		}
+	}
+	shared_ns += thread_ns() - start;
+
+	for (int j = 0; j < PSK_MAX_CHANNELS; j++){
+		struct psk_channel *c = channels + j;
+		if (!c->in_use)
+			continue;
+		start = thread_ns();
+		for (int i = 0; i < n; i++)
+			channel_process(c, x[i]);
+		//keep the oscillator from drifting in amplitude
+		c->osc /= cabsf(c->osc);
+		c->ns += thread_ns() - start;
+	}
+}
+
+void *psk_thread_function(void *ptr){
+	while(1){
+		usleep(10000);
+
+		struct if_block *b;
+		while ((b = if_ring_next(&psk_ring))){
+			pthread_mutex_lock(&channels_lock);
+			psk_process(b);
+			pthread_mutex_unlock(&channels_lock);
+			if_ring_done(&psk_ring);
+		}
+	}
+}
+
+void psk_rx(int32_t *samples, int count){
+	if_ring_push(&psk_ring, samples, count);
+}
+
+int psk_on(){
+	return psk_active;
+}
+
+// picks up the PSK_RX setting, from modem_poll()
+void psk_poll(){
+	const char *value = field_str("PSK_RX");
+	int on = value && !strcmp(value, "ON");
+
+	if (on == psk_active)
+		return;
+	//the channels are started afresh each time
+	pthread_mutex_lock(&channels_lock);
+	for (int i = 0; i < PSK_MAX_CHANNELS; i++)
+		if (channels[i].in_use)
+			channel_close(channels + i);
+	memset(spectrum, 0, sizeof(spectrum));
+	pthread_mutex_unlock(&channels_lock);
+	psk_active = on;
+}
+
+void psk_reset_stats(){
+	for (int i = 0; i < PSK_MAX_CHANNELS; i++)
+		channels[i].ns = 0;
+	shared_ns = 0;
+	if_ring_reset_stats(&psk_ring);
+}
+
+void psk_status(){
+	char buff[200];
+	int n = 0;
+
+	if (!psk_active){
+		write_console(FONT_LOG, "\nPSK31 decoder is off, turn it on with \\psk_rx ON\n");
+		return;
+	}
+
+	double elapsed_ns = if_ring_elapsed_ns(&psk_ring);
+
+	pthread_mutex_lock(&channels_lock);
+	double total = shared_ns;
+	for (int i = 0; i < PSK_MAX_CHANNELS; i++){
+		struct psk_channel *c = channels + i;
+		if (!c->in_use)
+			continue;
+		if (!n++)
+			write_console(FONT_LOG, "\n");
+		sprintf(buff, "PSK31 %4.0f Hz: quality %.2f, %d chars, %.2f%% cpu\n",
+			c->freq, c->quality, c->chars, (100.0 * c->ns) / elapsed_ns);
+		write_console(FONT_LOG, buff);
+		total += c->ns;
+	}
+	pthread_mutex_unlock(&channels_lock);
+	sprintf(buff, "\nPSK31 over %.0f secs: %d channels, shared %.2f%% total %.2f%% cpu, "
+		"%d overflows\n", elapsed_ns / 1e9, n, (100.0 * shared_ns) / elapsed_ns,
+		(100.0 * total) / elapsed_ns, psk_ring.overflows);
+	write_console(FONT_LOG, buff);
+}
+
+void psk_init(){
+	if_ring_init(&psk_ring, PSK_RING);
+	for (int i = 0; i < 128; i++){
+		unsigned int code = 0;
+		for (const char *p = varicode[i]; *p; p++)
+			code = (code << 1) | (*p == '1');
+		varicode_char[code] = i;
+	}
+
+	lowpass_design(fir0_coeff, FIR0_TAPS, FIR0_CUTOFF, PSK_IN_RATE, 1);
+	lowpass_design(fir1_coeff, FIR1_TAPS, FIR1_CUTOFF, PSK_RATE, 1);
+	lowpass_design(fir2_coeff, FIR2_TAPS, FIR2_CUTOFF, PSK_RATE / PSK_CHAN_DECIMATE, 1);
+
+	fft_in = (float *)fftwf_malloc(PSK_FFT * sizeof(float));
+	fft_out = (fftwf_complex *)fftwf_malloc((PSK_FFT / 2 + 1) * sizeof(fftwf_complex));
+	int n = PSK_FFT;
+	fft_plan = fftwf_plan_many_dft_r2c(1, &n, 1, fft_in, NULL, 1, PSK_FFT,
+		fft_out, NULL, 1, PSK_FFT / 2 + 1, FFTW_ESTIMATE);
+	for (int i = 0; i < PSK_FFT; i++)
+		fft_window[i] = 0.5f - 0.5f * cosf(2 * M_PI * i / PSK_FFT);
+
+	psk_reset_stats();
+	pthread_create(&psk_thread, NULL, psk_thread_function, (void*)NULL);
+}
@@ -0,0 +1,6 @@
+void psk_init();
+void psk_rx(int32_t *samples, int count);
+void psk_poll();
+int psk_on();
+void psk_status();
+void psk_reset_stats();
@@ -0,0 +1,392 @@
+/*
+	RTTY modem, 45.45 baud Baudot, the ITA2 figures
+
+	This replaces fldigi for RTTY when the RTTY_NATIVE setting is ON.
+	The shift is set by RTTY_SHIFT (170 Hz usually), the signal is
+	centered on the pitch with the mark above the space, as it comes
+	out of the upper sideband.
+
+	Rxing:
+	rtty_rx() is called from modem_rx() on the DSP thread with each
+	block of the demodulated audio, it has to be light.
+	1. The audio is decimated to 8000 samples/sec.
+	2. The mark and the space are each mixed down to zero and summed
+	over one bit (a moving sum, the matched filter for the keyed tones).
+	3. Each of the two levels is tracked (in the middle of the bits)
+	for when its tone is on and when it is off and the decision weighs
+	the tones by how far apart these are. This is the automatic threshold correction, it keeps
+	working when one of the tones fades.
+	4. A start bit (the edge from mark to space) starts a character,
+	the five bits are sampled in the middle and the stop bit has to be
+	a mark, else the character is dropped.
+	5. The letters and figures shift is followed, a space unshifts
+	to the letters (USOS), as most stations send it.
+	The text goes to the console as it is decoded, like the CW.
+
+	Txing:
+	rtty_next_sample() is called from modem_next_sample() for each of
+	the 96000 samples/sec, it generates the mark and space tones with
+	a continuous phase (AFSK on the upper sideband, on the air it is
+	the same as FSK). It reads the text to send with
+	get_tx_data_byte(), the shifts are inserted as needed.
+	A "^r" at the end of a macro (as for fldigi) returns to receive
+	once it has been sent. rtty_tx_poll() is called from modem_poll() and
+	turns the transmitter on and off.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <math.h>
+#include <complex.h>
+#include <fftw3.h>
+#include <wiringPi.h>
+#include "sdr.h"
+#include "sdr_ui.h"
+#include "dsp_utils.h"
+#include "modem_rtty.h"
+
+#define RTTY_BAUD 45.45
+#define RTTY_IN_RATE 96000
+#define RTTY_RATE 8000
+#define RTTY_DECIMATE (RTTY_IN_RATE / RTTY_RATE)
+#define RTTY_BIT_LEN 176		// samples a bit at 8000 samples/sec
+#define RTTY_SQUELCH 3.0f		// of the peaks over the floors
+#define RTTY_TRACK 0.1f		// a few characters to follow the fading
+#define RTTY_HANG 3000			// msecs of no text before going back to rx
+
+// the radio has already filtered the audio to 3 kHz
+#define FIR_TAPS 64
+#define FIR_CUTOFF 3000
+
+#define BAUDOT_LTRS 31
+#define BAUDOT_FIGS 27
+
+static const char baudot_ltrs[32] = {
+	0, 'E', '\n', 'A', ' ', 'S', 'I', 'U', '\r', 'D', 'R', 'J', 'N', 'F', 'C', 'K',
+	'T', 'Z', 'L', 'W', 'H', 'Y', 'P', 'Q', 'O', 'B', 'G', 0, 'M', 'X', 'V', 0
+};
+// ITA2, J is the bell, D (who are you) and F, G, H (national use) print nothing
+static const char baudot_figs[32] = {
+	0, '3', '\n', '-', ' ', '\'', '8', '7', '\r', 0, '4', 0, ',', 0, ':', '(',
+	'5', '+', ')', '2', 0, '6', '0', '1', '9', '?', 0, 0, '.', '/', '=', 0
+};
+
+static int rtty_native = 0;
+static int rtty_shift = 170;
+static int rtty_pitch = 0;
+
+/* rx state */
+static float fir_coeff[FIR_TAPS];
+static float fir[2 * FIR_TAPS];
+static int fir_pos, fir_phase;
+static float complex mark_osc, mark_rot, space_osc, space_rot;
+static float complex mark_hist[RTTY_BIT_LEN], space_hist[RTTY_BIT_LEN];
+static double complex mark_sum, space_sum;
+static int hist_pos;
+static float mark_peak, mark_floor, space_peak, space_floor;
+static int rx_last, rx_bit, rx_bits, rx_shift_figs, rx_idle;
+static float rx_wait;
+
+/* tx state */
+#define TX_QUEUE 8
+static double tx_phase, tx_mark_step, tx_space_step;
+static double tx_bit_time;			// samples into the current bit
+static double tx_samples_per_bit = RTTY_IN_RATE / RTTY_BAUD;
+static int tx_frame[8];					// start, 5 bits and stop
+static int tx_frame_bit = 8;		// past the end, nothing being sent
+static int tx_queue[TX_QUEUE], tx_queue_head, tx_queue_count;
+static int tx_figs, tx_caret, tx_end;
+static int tx_preamble;
+static int tx_bytes_available;
+static unsigned long tx_last_data;
+
+static void rtty_tune(){
+	float mark = rtty_pitch + rtty_shift / 2.0f;
+	float space = rtty_pitch - rtty_shift / 2.0f;
+
+	mark_rot = cexpf(-I * 2 * M_PI * mark / RTTY_RATE);
+	space_rot = cexpf(-I * 2 * M_PI * space / RTTY_RATE);
+	tx_mark_step = 2 * M_PI * mark / RTTY_IN_RATE;
+	tx_space_step = 2 * M_PI * space / RTTY_IN_RATE;
+}
+
+static void rtty_rx_char(int code){
+	char buff[2];
+
+	if (code == BAUDOT_LTRS){
+		rx_shift_figs = 0;
+		return;
+	}
+	if (code == BAUDOT_FIGS){
+		rx_shift_figs = 1;
+		return;
+	}
+	char c = rx_shift_figs ? baudot_figs[code] : baudot_ltrs[code];
+	//unshift on space
+	if (c == ' ')
+		rx_shift_figs = 0;
+	if (!c || c == '\r')
+		return;
+	buff[0] = c;
+	buff[1] = 0;
+	write_console(FONT_FLDIGI_RX, buff);
+}
+
+// the levels of each tone, on and off, are tracked once a bit, in the
+// middle of the bits when a character is coming in
+static void rtty_track(float ml, float sl){
+	if (ml > sl){
+		mark_peak += (ml - mark_peak) * RTTY_TRACK;
+		space_floor += (sl - space_floor) * RTTY_TRACK;
+	}
+	else {
+		space_peak += (sl - space_peak) * RTTY_TRACK;
+		mark_floor += (ml - mark_floor) * RTTY_TRACK;
+	}
+}
+
+// a sample of the audio at 8000 samples/sec
+static void rtty_rx_sample(float x){
+	float complex m = x * mark_osc, s = x * space_osc;
+	mark_osc = cmul(mark_osc, mark_rot);
+	space_osc = cmul(space_osc, space_rot);
+
+	mark_sum += m - mark_hist[hist_pos];
+	space_sum += s - space_hist[hist_pos];
+	mark_hist[hist_pos] = m;
+	space_hist[hist_pos] = s;
+	if (++hist_pos == RTTY_BIT_LEN)
+		hist_pos = 0;
+
+	float ml = cabs(mark_sum), sl = cabs(space_sum);
+
+	//the decision weighs each tone by its own swing
+	float mark_swing = mark_peak - mark_floor;
+	float space_swing = space_peak - space_floor;
+	float v = (ml - mark_floor) * mark_swing - (sl - space_floor) * space_swing
+		- 0.5f * (mark_swing * mark_swing - space_swing * space_swing);
+	int bit = v > 0;
+
+	//the middle of the start bit is half a bit after the edge
+	if (rx_bit < 0){
+		if (++rx_idle >= RTTY_BIT_LEN){
+			rtty_track(ml, sl);
+			rx_idle = 0;
+		}
+		if (rx_last && !bit){
+			rx_bit = 0;
+			rx_bits = 0;
+			rx_wait = RTTY_BIT_LEN / 2.0f;
+		}
+	}
+	else if (--rx_wait <= 0){
+		rx_wait += RTTY_RATE / RTTY_BAUD;
+		rtty_track(ml, sl);
+
+		if (rx_bit == 0 && bit)
+			rx_bit = -1;	//a glitch, not a start bit
+		else if (rx_bit >= 1 && rx_bit <= 5){
+			rx_bits |= bit << (rx_bit - 1);
+			rx_bit++;
+		}
+		else if (rx_bit == 6){
+			int squelched = mark_peak < RTTY_SQUELCH * mark_floor
+				&& space_peak < RTTY_SQUELCH * space_floor;
+			if (bit && !squelched)
+				rtty_rx_char(rx_bits);
+			rx_bit = -1;
+		}
+		else
+			rx_bit++;
+	}
+	rx_last = bit;
+}
+
+void rtty_rx(int32_t *samples, int count){
+	for (int i = 0; i < count; i++){
+		fir[fir_pos] = fir[fir_pos + FIR_TAPS] = samples[i] / 200000000.0f;
+		if (++fir_pos == FIR_TAPS)
+			fir_pos = 0;
+		if (++fir_phase < RTTY_DECIMATE)
+			continue;
+		fir_phase = 0;
+
+		float *h = fir + fir_pos;
+		float y = 0;
+		for (int k = 0; k < FIR_TAPS; k++)
+			y += fir_coeff[k] * h[k];
+		rtty_rx_sample(y);
+	}
+	//keep the oscillators from drifting in amplitude
+	mark_osc /= cabsf(mark_osc);
+	space_osc /= cabsf(space_osc);
+}
+
+/* ---- tx ---- */
+
+static void tx_push(int code){
+	if (tx_queue_count < TX_QUEUE)
+		tx_queue[(tx_queue_head + tx_queue_count++) % TX_QUEUE] = code;
+}
+
+// turns a character into baudot codes, with a shift if needed
+static void tx_encode(char c){
+	char buff[2];
+
+	//the "^r" at the end of a macro
+	if (tx_caret){
+		tx_caret = 0;
+		if (c == 'r' || c == 'R'){
+			tx_end = 1;
+			return;
+		}
+	}
+	if (c == '^'){
+		tx_caret = 1;
+		return;
+	}
+
+	c = toupper(c);
+	if (c == '\n'){
+		tx_push(8);
+		tx_push(2);
+	}
+	else if (c == ' '){
+		tx_push(4);
+		tx_figs = 0;	//the other end unshifts on space
+	}
+	else {
+		int code;
+		for (code = 0; code < 32; code++)
+			if (baudot_ltrs[code] == c || baudot_figs[code] == c)
+				break;
+		if (code == 32 || !c)
+			return;
+		int figs = baudot_ltrs[code] != c;
+		if (figs != tx_figs){
+			tx_push(figs ? BAUDOT_FIGS : BAUDOT_LTRS);
+			tx_figs = figs;
+		}
+		tx_push(code);
+	}
+	buff[0] = c;
+	buff[1] = 0;
+	write_console(FONT_FLDIGI_TX, buff);
+}
+
+static void tx_next_frame(){
+	if (!tx_queue_count && tx_bytes_available > 0 && !tx_preamble){
+		char c;
+		if (get_tx_data_byte(&c)){
+			tx_encode(c);
+			tx_bytes_available--;
+		}
+	}
+	if (!tx_queue_count){
+		tx_frame_bit = 8;
+		return;
+	}
+
+	int code = tx_queue[tx_queue_head];
+	tx_queue_head = (tx_queue_head + 1) % TX_QUEUE;
+	tx_queue_count--;
+	tx_frame[0] = 0;
+	for (int i = 0; i < 5; i++)
+		tx_frame[i + 1] = (code >> i) & 1;
+	tx_frame[6] = 1;
+	tx_frame[7] = 1;	// the second half of the 1.5 bit stop
+	tx_frame_bit = 0;
+}
+
+// called for each sample at 96000 samples/sec, from the DSP thread
+float rtty_next_sample(){
+	int mark = 1;
+
+	if (tx_preamble > 0)
+		tx_preamble--;
+	else {
+		if (tx_frame_bit < 8)
+			mark = tx_frame[tx_frame_bit];
+		//the last half bit is the end of the stop
+		double bit_len = tx_frame_bit == 7 ? tx_samples_per_bit / 2 : tx_samples_per_bit;
+		if (++tx_bit_time >= bit_len){
+			tx_bit_time -= bit_len;
+			if (tx_frame_bit < 8)
+				tx_frame_bit++;
+			if (tx_frame_bit == 8)
+				tx_next_frame();
+		}
+	}
+	tx_phase += mark ? tx_mark_step : tx_space_step;
+	if (tx_phase > 2 * M_PI)
+		tx_phase -= 2 * M_PI;
+	return sin(tx_phase) / 7;
+}
+
+int rtty_on(){
+	return rtty_native;
+}
+
+// picks up the settings, called in all the modes
+void rtty_poll(){
+	const char *value = field_str("RTTY_NATIVE");
+	rtty_native = value && !strcmp(value, "ON");
+
+	int shift = field_int("RTTY_SHIFT");
+	if (shift >= 50 && shift <= 1000 && (shift != rtty_shift || get_pitch() != rtty_pitch)){
+		rtty_shift = shift;
+		rtty_pitch = get_pitch();
+		rtty_tune();
+	}
+}
+
+// turns the transmitter on and off, called in the RTTY mode
+void rtty_tx_poll(int bytes_available, int tx_is_on){
+	unsigned long now = millis();
+
+	tx_bytes_available = bytes_available;
+	if (bytes_available || tx_queue_count || tx_frame_bit < 8)
+		tx_last_data = now;
+
+	if (!tx_is_on && bytes_available > 0){
+		//a little of the mark before the first character
+		tx_queue_count = 0;
+		tx_end = tx_caret = 0;
+		tx_figs = 0;
+		tx_push(BAUDOT_LTRS);
+		tx_frame_bit = 8;
+		tx_bit_time = 0;
+		tx_preamble = RTTY_IN_RATE / 4;
+		tx_on(TX_SOFT);
+		tx_last_data = now;
+	}
+	else if (tx_is_on && !bytes_available && !tx_queue_count && tx_frame_bit == 8
+		&& (tx_end || now - tx_last_data > RTTY_HANG)){
+		tx_end = 0;
+		tx_off();
+	}
+}
+
+void rtty_abort(){
+	tx_queue_count = 0;
+	tx_end = 1;
+}
+
+void rtty_init(){
+	lowpass_design(fir_coeff, FIR_TAPS, FIR_CUTOFF, RTTY_IN_RATE, 0);
+
+	mark_osc = space_osc = 1;
+	mark_sum = space_sum = 0;
+	memset(mark_hist, 0, sizeof(mark_hist));
+	memset(space_hist, 0, sizeof(space_hist));
+	mark_peak = space_peak = 0;
+	mark_floor = space_floor = 0;
+	rx_bit = -1;
+	rx_last = 1;
+	rx_shift_figs = 0;
+	rtty_pitch = get_pitch();
+	rtty_tune();
+}
@@ -0,0 +1,7 @@
+void rtty_init();
+void rtty_rx(int32_t *samples, int count);
+void rtty_poll();
+void rtty_tx_poll(int bytes_available, int tx_is_on);
+float rtty_next_sample();
+int rtty_on();
+void rtty_abort();
@@ -27,6 +27,10 @@
 #include "sound.h"
 #include "modem_ft8.h"
 #include "modem_cw.h"
+#include "modem_psk.h"
+#include "modem_rtty.h"
+#include "fldigi.h"
+#include "wsjtx.h"
 
 typedef float float32_t;
 
@@ -69,310 +73,50 @@ int qso_state = QSO_STATE_ZOMBIE;
 static int current_mode = -1;
 static unsigned long millis_now = 0;
 
-/* ---- Base64 Encoding/Decoding Table --- */
-char b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-
-/* decodeblock - decode 4 '6-bit' characters into 3 8-bit binary bytes */
-void decodeblock(unsigned char in[], char *clrstr) {
-  unsigned char out[4];
-  out[0] = in[0] << 2 | in[1] >> 4;
-  out[1] = in[1] << 4 | in[2] >> 2;
-  out[2] = in[2] << 6 | in[3] >> 0;
-  out[3] = '\0';
-  strncat(clrstr, out, sizeof(out));
-}
-
-void b64_decode(char *b64src, char *clrdst) {
-  int c, phase, i;
-  unsigned char in[4];
-  char *p;
-
-  clrdst[0] = '\0';
-  phase = 0; i=0;
-  while(b64src[i]) {
-    c = (int) b64src[i];
-    if(c == '=') {
-      decodeblock(in, clrdst); 
-      break;
-    }
-    p = strchr(b64, c);
-    if(p) {
-      in[phase] = p - b64;
-      phase = (phase + 1) % 4;
-      if(phase == 0) {
-        decodeblock(in, clrdst);
-        in[0]=in[1]=in[2]=in[3]=0;
-      }
-    }
-    i++;
-  }
-}
-
-/* encodeblock - encode 3 8-bit binary bytes as 4 '6-bit' characters */
-void encodeblock( unsigned char in[], char b64str[], int len ) {
-    unsigned char out[5];
-    out[0] = b64[ in[0] >> 2 ];
-    out[1] = b64[ ((in[0] & 0x03) << 4) | ((in[1] & 0xf0) >> 4) ];
-    out[2] = (unsigned char) (len > 1 ? b64[ ((in[1] & 0x0f) << 2) |
-             ((in[2] & 0xc0) >> 6) ] : '=');
-    out[3] = (unsigned char) (len > 2 ? b64[ in[2] & 0x3f ] : '=');
-    out[4] = '\0';
-    strncat(b64str, out, sizeof(out));
-}
-
-/* encode - base64 encode a stream, adding padding if needed */
-void b64_encode(char *clrstr, char *b64dst) {
-  unsigned char in[3];
-  int i, len = 0;
-  int j = 0;
-
-  b64dst[0] = '\0';
-  while(clrstr[j]) {
-    len = 0;
-    for(i=0; i<3; i++) {
-     in[i] = (unsigned char) clrstr[j];
-     if(clrstr[j]) {
-        len++; j++;
-      }
-      else in[i] = 0;
-    }
-    if( len ) {
-      encodeblock( in, b64dst, len );
-    }
-  }
-}
-
-/*******************************************************
-**********           FLDIGI xml                  *******
-********************************************************/
-/*
-An almost trivial xml, just enough to work fldigi
-*/
-
-char fldigi_mode[100];
-long fldigi_retry_at = 0;
-/*
-An almost trivial xml, just enough to work fldigi
-*/
-
-int fldigi_call_i(char *action, int param, char *result){
-  char buffer[10000], q[10000], xml[1000];
-  struct sockaddr_in serverAddr;
-  struct sockaddr_storage serverStorage;
-  socklen_t addr_size;
-	struct timeval timeout;
-
-  serverAddr.sin_family = AF_INET;
-  serverAddr.sin_port = htons(7362);
-  serverAddr.sin_addr.s_addr = inet_addr("127.0.0.1");
-  memset(serverAddr.sin_zero, '\0', sizeof serverAddr.sin_zero);  
-	
-	int fldigi_socket = socket(AF_INET, SOCK_STREAM, 0);
-/*	timeout.tv_sec = 0;
-	timeout.tv_usec = 1000;
-	setsockopt(fldigi_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
-	setsockopt(fldigi_socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
-*/
-	*result = 0; //start with a null string so it is returned if nothing is read
-
-  if (connect(fldigi_socket, (struct sockaddr *)&serverAddr, sizeof(serverAddr)) < 0) {
-		//puts("unable to connect to the flidigi\n");        
-		close(fldigi_socket);
-		return -1;
-   }
-
-	sprintf(xml, 
-"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
-"<methodCall><methodName>%s</methodName>\n"
-"<params>\n<param><value><i4>%d</i4></value></param> </params></methodCall>\n",
-		action, param);
-
-	sprintf(q, 
-		"POST / HTTP/1.1\n"
-		"Host: 127.0.0.1:7362\n"
-		"User-Agent: sbitx/v0.01\n" 
-		"Accept:\n" 
-		"Content-Length: %d\n"
-		"Content-Type: application/x-www-form-urlencoded\n\n"
-		"%s\n",
-		(int)strlen(xml), xml);
- 
-  if (send(fldigi_socket, q, strlen(q), 0) < 0) {
-		puts("Unable to request fldigi");
-		close(fldigi_socket);
-		return -1;
-  } 
-	char buff[10000]; //large, large
-	int e = recv(fldigi_socket, buff, sizeof(buff), 0);
-	if(e < 0) {
-//		puts("Unable to recv from fldigi");
-		close(fldigi_socket);
-		return -1;
-  }
-	buff[e] = 0;
-	result[0] = 0;
-
-	//now check if we got the data in base64
-	char *p = strstr(buff, "<base64>");
-	if (p){
-		p += strlen("<base64"); //skip past the tag
-		char *r =  strchr(p, '<'); //find the end
-		if (r){
-			*r = 0; //terminate the base64 at the end tag
-			int len =  (strlen(p) * 6)/8;
-			b64_decode(p, result);
-			result[len] = 0;
-		}
-	}
-	else
-		strcpy(result, buff);
-  close(fldigi_socket);
-
-	return 0;
-}
-
-int fldigi_call(char *action, char *param, char *result){
-  char buffer[10000], q[10000], xml[1000];
-  struct sockaddr_in serverAddr;
-  struct sockaddr_storage serverStorage;
-  socklen_t addr_size;
-	struct timeval timeout;
-
-  serverAddr.sin_family = AF_INET;
-  serverAddr.sin_port = htons(7362);
-  serverAddr.sin_addr.s_addr = inet_addr("127.0.0.1");
-  memset(serverAddr.sin_zero, '\0', sizeof serverAddr.sin_zero);  
-	*result = 0;
-	
-	int fldigi_socket = socket(AF_INET, SOCK_STREAM, 0);
-/*	timeout.tv_sec = 0;
-	timeout.tv_usec = 500;
-	setsockopt(fldigi_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
-	setsockopt(fldigi_socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
-*/
-  if (connect(fldigi_socket, (struct sockaddr *)&serverAddr, sizeof(serverAddr)) < 0) {
-		//puts("unable to connect to the flidigi\n");        
-		close(fldigi_socket);
-		return -1;
-   }
-
-	sprintf(xml, 
-"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
-"<methodCall><methodName>%s</methodName>\n"
-"<params>\n<param><value><string>%s</string></value></param> </params></methodCall>\n",
-		action, param);
-
-	sprintf(q, 
-		"POST / HTTP/1.1\n"
-		"Host: 127.0.0.1:7362\n"
-		"User-Agent: sbitx/v0.01\n" 
-		"Accept:\n" 
-		"Content-Length: %d\n"
-		"Content-Type: application/x-www-form-urlencoded\n\n"
-		"%s\n",
-		(int)strlen(xml), xml);
- 
-  if (send(fldigi_socket, q, strlen(q), 0) < 0) {
-		puts("Unable to request fldigi");
-		close(fldigi_socket);
-		return -1;
-  } 
-	char buff[10000]; //large, large
-	int e = recv(fldigi_socket, buff, sizeof(buff), 0);
-	if(e < 0) {
-//		puts("Unable to recv from fldigi");
-		close(fldigi_socket);
-		return -1;
-  }
-	buff[e] = 0;
-	result[0] = 0;
-
-	//now check if we got the data in base64
-	char *p = strstr(buff, "<base64>");
-	if (p){
-		p += strlen("<base64>"); //skip past the tag
-		char *r =  strchr(p, '<'); //find the end
-		if (r){
-			*r = 0; //terminate the base64 at the end tag
-			int len =  (strlen(p) * 6)/8;
-			b64_decode(p, result);
-			result[len] = 0;
-		}
-	}
-	//maybe it is not base64 encoded
-	else if (p = strstr(buff, "<value>")){
-		p += strlen("<value>");
-		char *r = strchr(p, '<');
-		if (r){
-			*r = 0;
-			strcpy(result, p);
-		} 
-	}
-	else
-		strcpy(result, buff);
-  close(fldigi_socket);
-
-	return 0;
-}
-
-
 /*******************************************************
 **********      Modem dispatch routines          *******
 ********************************************************/
-int fldigi_in_tx = 0;
+int fldigi_in_tx = 0;		// fldigi has reported TX
+static int fldigi_tx_asked = 0;
 static int rx_poll_count = 0;
 static int sps, deci, s_timer ;
 
 
+//fldigi.c polls fldigi on its own thread, this only picks up the text
 void fldigi_read(){
-	char buffer[10000];
-
-	//poll only every 250msec
-	if (fldigi_retry_at > millis())
-		return;
+	char buffer[1000];
 
-	if(!fldigi_call("rx.get_data", "", buffer)){		
-		if (strlen(buffer)){
-				if (buffer[0] != '<' )
-					buffer[1] = 0;
-				write_console(FONT_FLDIGI_RX, buffer);
-//				printf("fldigi rx.get_data{%s}\n", buffer);
-		}
+	int len = fldigi_read_text(buffer, sizeof(buffer) - 1);
+	if (len > 0){
+		buffer[len] = 0;
+		write_console(FONT_FLDIGI_RX, buffer);
 	}
-	fldigi_retry_at = millis() + 250;
 }
 
 void fldigi_set_mode(char *mode){
-	char buffer[1000];
-	if (strcmp(fldigi_mode, mode)){
-		if(fldigi_call("modem.set_by_name", mode, buffer) == 0){
-			fldigi_retry_at = millis() + 2000;
-			strcpy(fldigi_mode, mode);
-		}
-	}
+	fldigi_set_modem(mode);
 }
 
+//all the text typed since the last poll goes to fldigi together
 void fldigi_tx_more_data(){
-	char c;
-	if (get_tx_data_byte(&c)){
-		char buff[10], resp[1000];
-		buff[0] = c;
-		buff[1] = 0;
-		fldigi_call("text.add_tx", buff, resp);
+	char buff[200];
+	int len = 0;
+
+	while (len < sizeof(buff) - 1 && get_tx_data_byte(buff + len))
+		len++;
+	if (len){
+		buff[len] = 0;
+		fldigi_send_text(buff, len);
 		write_console(FONT_FLDIGI_TX, buff);
 	}
 }
 
 static int fldigi_tx_stop(){	
-	char buffer[10000];
-
-	if (!fldigi_call("main.rx", "", buffer)){
-		fldigi_in_tx = 0;
-		sound_input(0);
-		return 0;
-	}
-	else
-		return -1;
+	fldigi_trx(0);
+	fldigi_in_tx = 0;
+	fldigi_tx_asked = 0;
+	sound_input(0);
+	return 0;
 }
 
 void modem_set_pitch(int pitch, int mode){
@@ -384,9 +128,7 @@ void modem_set_pitch(int pitch, int mode){
 		case MODE_FT8:
 		case MODE_PSK31:
 		case MODE_RTTY:
-			char response[1000];
-			
-			fldigi_call_i("modem.set_carrier", pitch, response);
+			fldigi_set_carrier(pitch);
 			break;
 	}
 }
@@ -400,7 +142,8 @@ void modem_rx(int mode, int32_t *samples, int count){
 	char buff[10000];
 
 	if (get_pitch() != last_pitch  
-		&& (mode == MODE_CW || mode == MODE_CWR || mode == MODE_RTTY || mode == MODE_PSK31))
+		&& (mode == MODE_CW || mode == MODE_CWR || mode == MODE_PSK31
+		|| (mode == MODE_RTTY && !rtty_on())))
 		modem_set_pitch(get_pitch(),mode);
 
 	s = samples;
@@ -409,10 +152,19 @@ void modem_rx(int mode, int32_t *samples, int count){
 		ft8_rx(samples, count);
 		break;
 	case MODE_RTTY:
+		if (rtty_on()){
+			rtty_rx(samples, count);
+			break;
+		}
 		fldigi_set_mode("RTTY");
 		fldigi_read();
 		break;
 	case MODE_PSK31:
+		//the built-in decoder takes all the channels of the passband
+		if (psk_on()){
+			psk_rx(samples, count);
+			break;
+		}
 		fldigi_set_mode("BPSK31");
 		fldigi_read();
 		break;
@@ -427,7 +179,14 @@ void modem_init(){
 	// init the ft8
 	cw_init();
 	ft8_init();
-	strcpy(fldigi_mode, "");
+	ft8_wide_init();
+	wspr_init();
+	skimmer_init();
+	psk_init();
+	rtty_init();
+	fldigi_init();
+	audio_bus_init();
+	iq_server_init();
 
 /*
 	//for now, launch fldigi in the background, if not already running
@@ -450,14 +209,19 @@ void modem_poll(int mode){
 	millis_now = millis();
 	int bytes_available = get_tx_data_length();
 
+	ft8_wide_poll();
+	wspr_poll();
+	skimmer_poll();
+	psk_poll();
+	rtty_poll();
+	audio_bus_poll();
+	wsjtx_poll();
+	iq_server_poll();
+
 	if (current_mode != mode){
 		//flush out the past decodes
 		current_mode = mode;
-		int l;
-		do{
-			int e = fldigi_call("rx.get_data", "", buffer);	
-			l = strlen(buffer);
-		}while(l > 0);
+		fldigi_flush();
 
 		//clear the text buffer	
 		abort_tx();
@@ -472,6 +236,7 @@ void modem_poll(int mode){
 
 		if (current_mode == MODE_CW || current_mode == MODE_CWR)
 			cw_init();
+		cw_keyer_enable(current_mode == MODE_CW || current_mode == MODE_CWR);
 	}
 
 	switch(mode){
@@ -486,24 +251,29 @@ void modem_poll(int mode){
 
 	case MODE_RTTY:
 	case MODE_PSK31:
-		fldigi_call("main.get_trx_state", "", buffer);
-		//we will let the keyboard decide this
-		if (tx_is_on && !fldigi_in_tx){
-			if (!fldigi_call("main.tx", "", buffer)){
-				fldigi_in_tx = 1;	
-				sound_input(1);
-			}
-			else
-				puts("*fldigi tx failed");
+		if (mode == MODE_RTTY && rtty_on()){
+			rtty_tx_poll(bytes_available, tx_is_on);
+			break;
+		}
+		fldigi_trx_state(buffer);
+		//we will let the keyboard decide this, fldigi is only taken
+		//to be in tx once its state says so
+		if (tx_is_on && !fldigi_tx_asked){
+			fldigi_trx(1);
+			fldigi_tx_asked = 1;
 		}	
+		else if (tx_is_on && !fldigi_in_tx && !strcmp(buffer, "TX")){
+			fldigi_in_tx = 1;	
+			sound_input(1);
+		}
 		//switch to rx if the sbitx is set to manual or the fldigi has gone back to rx 
-		else if ((tx_is_on && !strcmp(buffer, "RX")) || (!tx_is_on && fldigi_in_tx)){
+		else if ((fldigi_in_tx && !strcmp(buffer, "RX")) || (!tx_is_on && fldigi_tx_asked)){
 			if (fldigi_tx_stop() == -1)
 				puts("*fldigi rx failed");
 		}
 		if (tx_is_on && bytes_available > 0)
 			fldigi_tx_more_data();	
-		else 
+		else if (mode != MODE_PSK31 || !psk_on())
 			fldigi_read();		
 
 	break; 
@@ -523,10 +293,28 @@ float modem_next_sample(int mode){
 	case MODE_CWR:
 		sample = cw_tx_get_sample();
 		break;
+	case MODE_RTTY:
+		sample = rtty_next_sample();
+		break;
 	}
 	return sample;
 }
 
+//a whole block of the modem's tx audio, cw is generated in runs
+void modem_next_block(int mode, float *samples, int count){
+	if (mode == MODE_CW || mode == MODE_CWR){
+		cw_tx_get_block(samples, count);
+		return;
+	}
+	for (int i = 0; i < count; i++)
+		samples[i] = modem_next_sample(mode);
+}
+
+
+//the modes that generate their own tx audio in the voice modes
+int modem_tx_audio(){
+	return current_mode == MODE_RTTY && rtty_on();
+}
 
 void modem_abort(){
 	char c;	
@@ -540,7 +328,15 @@ void modem_abort(){
 		ft8_abort();
 		break;
 	case MODE_RTTY:
+		if (rtty_on()){
+			rtty_abort();
+			break;
+		}
+		fldigi_clear_text();
+		fldigi_tx_stop();
+		break;
 	case MODE_PSK31:
+		fldigi_clear_text();
 		fldigi_tx_stop();
 		break;
 	case MODE_CW:
@@ -13,10 +13,13 @@
 #include <fcntl.h>
 #include <complex.h>
 #include <fftw3.h>
+#include <pthread.h>
 #include "sdr.h"
 #include "sdr_ui.h"
 
 static int welcome_socket = -1, data_socket = -1;
+// remote_write() comes from any thread that writes the console
+static pthread_mutex_t data_lock = PTHREAD_MUTEX_INITIALIZER;
 #define MAX_DATA 1000
 static char incoming_data[MAX_DATA];
 static int incoming_ptr;
@@ -60,14 +63,30 @@ void remote_init() {
 }
 
 void remote_write(char *message) {
-    if (data_socket < 0)
-        return;
+    pthread_mutex_lock(&data_lock);
+    if (data_socket >= 0 && send(data_socket, message, strlen(message), 0) < 0) {
+        close(data_socket);
+        data_socket = -1;
+    }
+    pthread_mutex_unlock(&data_lock);
+}
 
-    int e = send(data_socket, message, strlen(message), 0);
-    if (e >= 0)
-        return;
-    close(data_socket);
-    data_socket = -1;
+// with the data_lock held
+static void remote_closed(int len) {
+    if (len == 0) {
+        // The recv function returned 0 -> the client closed the connection. Added by w9JES
+        puts("Client closed the connection. Restarting to listen...");
+        close(data_socket);
+        data_socket = -1;
+    } else {
+        // An error occurred, check if it's EAGAIN or EWOULDBLOCK to keep the connection open. Modifed by W9JES
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return; // No data available right now, try again later
+        // For other errors, close the socket.
+        puts("Connection error. Dropping the connection...");
+        close(data_socket);
+        data_socket = -1;
+    }
 }
 
 void remote_slice() {
@@ -76,21 +95,26 @@ void remote_slice() {
     int e, len;
     char buffer[1024];
 
+    pthread_mutex_lock(&data_lock);
     if (data_socket == -1) {
         addr_size = sizeof server_storage;
         e = accept(welcome_socket, (struct sockaddr *) &server_storage, &addr_size);
-        if (e == -1)
-            return;
-        puts("Accepted telnet connection\n");
-        incoming_ptr = 0;
-        data_socket = e;
-        fcntl(data_socket, F_SETFL, fcntl(data_socket, F_GETFL) | O_NONBLOCK);
+        if (e != -1) {
+            puts("Accepted telnet connection\n");
+            incoming_ptr = 0;
+            data_socket = e;
+            fcntl(data_socket, F_SETFL, fcntl(data_socket, F_GETFL) | O_NONBLOCK);
 
-        // init the console
-        remote_init();
+            // init the console
+            remote_init();
+        }
+        pthread_mutex_unlock(&data_lock);
     } else { 
         //this section was changed by W9JES
-        len = recv(data_socket, buffer, sizeof(buffer), 0);
+        len = recv(data_socket, buffer, sizeof(buffer) - 1, 0);
+        if (len <= 0)
+            remote_closed(len);
+        pthread_mutex_unlock(&data_lock);
         if (len > 0) {
             buffer[len] = '\0'; // Ensure the buffer is null-terminated. Changed by W9JES
             printf("Received on remote : [%s]\n", buffer);
@@ -104,19 +128,6 @@ void remote_slice() {
             } else if(strlen(buffer)) {
                 remote_execute(buffer);
             }
-        } else if (len == 0) {
-            // The recv function returned 0 -> the client closed the connection. Added by w9JES
-            puts("Client closed the connection. Restarting to listen...");
-            close(data_socket);
-            data_socket = -1;
-        } else {
-            // An error occurred, check if it's EAGAIN or EWOULDBLOCK to keep the connection open. Modifed by W9JES
-            if (errno == EAGAIN || errno == EWOULDBLOCK)
-                return; // No data available right now, try again later
-            // For other errors, close the socket.
-            puts("Connection error. Dropping the connection...");
-            close(data_socket);
-            data_socket = -1;
         }
     }
 }
@@ -23,6 +23,7 @@
 #include "si5351.h"
 #include "ini.h"
 #include "para_eq.h"
+#include "webserver.h"
 
 #define DEBUG 0
 
@@ -191,8 +192,6 @@ struct power_settings band_power[] = {
 #define TUNING_SHIFT (0)
 #define MDS_LEVEL (-135)
 
-struct Queue qremote;
-
 void radio_tune_to(u_int32_t f)
 {
 	if (rx_list->mode == MODE_CW)
@@ -442,14 +441,60 @@ int calculate_s_meter(struct rx *r, double rx_gain)
 	return (s_units * 100) + additional_db;
 }
 
-int remote_audio_output(int16_t *samples)
+/*
+	The audio of the remote clients is written once by the DSP into a
+	ring and each client reads it with its own cursor, no client takes
+	the samples from another. A client that falls behind by nearly the
+	whole ring skips ahead and counts the samples it lost. The margin left
+	is several blocks, the DSP can't overwrite what is being read.
+*/
+#define REMOTE_AUDIO_RING 16384 // a power of two, a second at 16000 sps
+#define REMOTE_AUDIO_KEEP 1600	// a client that skips ahead is left this far behind
+#define REMOTE_AUDIO_WAKE 320	// the webserver is woken every 20 msec of audio
+
+static int16_t remote_audio[REMOTE_AUDIO_RING];
+static uint64_t remote_audio_written = 0;
+static uint64_t remote_audio_woken = 0;
+
+// called from the DSP, with every step-th sample
+static void remote_audio_write(int32_t *samples, int count, int step)
 {
-	int length = q_length(&qremote);
-	for (int i = 0; i < length; i++)
+	uint64_t w = remote_audio_written;
+
+	for (int i = 0; i < count; i += step)
+		remote_audio[w++ & (REMOTE_AUDIO_RING - 1)] = samples[i] / 32786;
+	__atomic_store_n(&remote_audio_written, w, __ATOMIC_RELEASE);
+
+	if (w - remote_audio_woken >= REMOTE_AUDIO_WAKE)
 	{
-		samples[i] = q_read(&qremote) / 32786;
+		remote_audio_woken = w;
+		if (web_audio_listeners())
+			web_wake();
 	}
-	return length;
+}
+
+// reads what was written since the cursor, a new client's cursor is
+// REMOTE_AUDIO_NEW. lag is left with the samples still unread.
+int remote_audio_read(uint64_t *cursor, int16_t *samples, int max, int *lag, int *dropped)
+{
+	uint64_t w = __atomic_load_n(&remote_audio_written, __ATOMIC_ACQUIRE);
+
+	if (*cursor > w)
+		*cursor = w;
+	if (w - *cursor > REMOTE_AUDIO_RING - REMOTE_AUDIO_KEEP)
+	{
+		*dropped += w - REMOTE_AUDIO_KEEP - *cursor;
+		*cursor = w - REMOTE_AUDIO_KEEP;
+	}
+
+	int n = w - *cursor;
+	if (n > max)
+		n = max;
+	for (int i = 0; i < n; i++)
+		samples[i] = remote_audio[(*cursor + i) & (REMOTE_AUDIO_RING - 1)];
+	*cursor += n;
+	*lag = w - *cursor;
+	return n;
 }
 
 // Helper function to get available space in a queue
@@ -1148,6 +1193,13 @@ void rx_linear(int32_t *input_rx, int32_t *input_mic,
 	int i = 0;
 	double i_sample;
 
+	// the wideband FT8/FT4, the WSPR decoders, the CW skimmer and
+	// the IQ server get the raw IF
+	ft8_wide_rx(input_rx, MAX_BINS / 2);
+	wspr_rx(input_rx, MAX_BINS / 2);
+	skimmer_rx(input_rx, MAX_BINS / 2);
+	iq_server_rx(input_rx, MAX_BINS / 2);
+
 	// STEP 1: First add the previous M samples
 	// memcpy to replace for loop, ffts are 16 bytes
 	memcpy(fft_in, fft_m, MAX_BINS / 2 * 8 * 2);
@@ -1449,11 +1501,8 @@ void rx_linear(int32_t *input_rx, int32_t *input_mic,
 			}
 		}
 
-		// Push the samples to the remote audio queue, decimated to 16000 samples/sec
-		//for (i = 0; i < MAX_BINS / 2; i += 6)
-		//{
-		//	q_write(&qremote, output_speaker[i]);
-		//}
+		// Push the samples to the remote audio ring, decimated to 16000 samples/sec
+		// remote_audio_write(output_speaker, MAX_BINS / 2, 6);
 	}
 
 	if (mute_count)
@@ -1490,14 +1539,10 @@ void rx_linear(int32_t *input_rx, int32_t *input_mic,
         }
     }
 }
-// Push the samples to the remote audio queue, decimated to 16000 samples/sec
-// Moved after EQ processing so qremote gets the equalized audio when applicable
-	if (rx_list->output == 0) {
-		for (i = 0; i < MAX_BINS / 2; i += 6)
-		{
-			q_write(&qremote, output_speaker[i]);
-		}
-	}
+// Push the samples to the remote audio ring, decimated to 16000 samples/sec
+// Moved after EQ processing so the remote audio gets the equalized audio when applicable
+	if (rx_list->output == 0)
+		remote_audio_write(output_speaker, MAX_BINS / 2, 6);
 }
 void read_power()
 {
@@ -1663,6 +1708,10 @@ void tx_process(
 	int m = 0;
 	int j = 0;
 
+	static float modem_block[MAX_BINS / 2];
+	if (r->mode == MODE_CW || r->mode == MODE_CWR || r->mode == MODE_FT8)
+		modem_next_block(r->mode, modem_block, MAX_BINS / 2);
+
 	// double max = -10.0, min = 10.0;
 	// gather the samples into a time domain array
 	for (i = MAX_BINS / 2; i < MAX_BINS; i++)
@@ -1673,7 +1722,10 @@ void tx_process(
 		else if (r->mode == MODE_CALIBRATE)
 			i_sample = (1.0 * (vfo_read(&tone_a))) / 30000000000.0;
 		else if (r->mode == MODE_CW || r->mode == MODE_CWR || r->mode == MODE_FT8)
-			i_sample = modem_next_sample(r->mode) / 3;
+			i_sample = modem_block[j] / 3;
+		// the native RTTY is sent as AFSK from the USB, kept under the voice clip
+		else if (r->mode == MODE_USB && modem_tx_audio())
+			i_sample = modem_next_sample(MODE_RTTY) / 4;
 		else if (r->mode == MODE_AM)
 		{
 			// double modulation = (1.0 * vfo_read(&tone_a)) / 1073741824.0;
@@ -1737,10 +1789,8 @@ void tx_process(
 		m++;
 	}
 
-	// push the samples to the remote audio queue, decimated to 16000 samples/sec
-	for (i = 0; i < MAX_BINS / 2; i += 6) {
-		q_write(&qremote, output_speaker[i]);
-	}
+	// push the samples to the remote audio ring, decimated to 16000 samples/sec
+	remote_audio_write(output_speaker, MAX_BINS / 2, 6);
 
 	// convert to frequency
 	fftw_execute(plan_fwd);
@@ -1933,6 +1983,7 @@ void sound_process(
 	{
 		rx_linear(input_rx, input_mic, output_speaker, output_tx, n_samples);
 	}
+	audio_bus_write(input_rx, output_speaker, n_samples, in_tx);
 
 	if (pf_record)
 	{
@@ -2286,7 +2337,6 @@ void setup()
 	vfo_init_phase_table();
 	setup_oscillators();
 	//initialize the queues
-	q_init(&qremote, 8000);
 	q_init(&qbrowser_mic, 32000); // Initialize browser microphone queue with much larger buffer
 	
 	// Initialize jitter buffer
@@ -15,6 +15,7 @@ The initial sync between the gui values, the core radio values, settings, et al
 #include <sys/types.h>
 #include <stdint.h>
 #include <ctype.h>
+#include <pthread.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
 #include <ncurses.h>
@@ -42,6 +43,9 @@ The initial sync between the gui values, the core radio values, settings, et al
 #include "hamlib.h"
 #include "remote.h"
 #include "modem_ft8.h"
+#include "modem_psk.h"
+#include "modem_cw.h"
+#include "fldigi.h"
 #include "i2cbb.h"
 #include "webserver.h"
 #include "logbook.h"
@@ -58,8 +62,6 @@ extern struct rx *rx_list;
 void ft8_process(char *received, int operation);
 void change_band(char *request);
 void highlight_band_field(int new_band);
-/* command  buffer for commands received from the remote */
-struct Queue q_remote_commands;
 struct Queue q_tx_text;
 int eq_is_enabled = 0;
 int rx_eq_is_enabled = 0;
@@ -418,7 +420,7 @@ struct field
 	int step;
 	int section;
 	char is_dirty;
-	char update_remote;
+	unsigned version; // of the last change sent to the remote clients
 	void *data;
 };
 
@@ -935,6 +937,41 @@ struct field main_controls[] = {
 	 "ON/OFF", 0, 0, 0, FT8_CONTROL},
 	{"#ft8_repeat", NULL, 1000, -1000, 50, 50, "FT8_REPEAT", 40, "5", FIELD_NUMBER, FONT_FIELD_VALUE,
 	 "", 1, 10, 1, FT8_CONTROL},
+	// wideband FT8/FT4 decoding of the IF, as offset:protocol list
+	{"#ftx_channels", NULL, 1000, -1000, 400, 149, "FTX_CHANNELS", 70, "", FIELD_TEXT, FONT_SMALL,
+	 "", 0, 60, 1, 0},
+	// msecs that our clock is ahead of the band, set by \ft8cal
+	{"#ft8_dt_offset", NULL, 1000, -1000, 50, 50, "FT8_DT_OFFSET", 40, "0", FIELD_NUMBER, FONT_FIELD_VALUE,
+	 "", -2000, 2000, 1, 0},
+	// decodes the WSPR window of the IF in the background
+	{"#wspr_rx", NULL, 1000, -1000, 50, 50, "WSPR_RX", 40, "OFF", FIELD_TOGGLE, FONT_FIELD_VALUE,
+	 "ON/OFF", 0, 0, 0, 0},
+	// spots the callsigns of all the CW signals in the IF
+	{"#cw_skim", NULL, 1000, -1000, 50, 50, "CW_SKIM", 40, "OFF", FIELD_TOGGLE, FONT_FIELD_VALUE,
+	 "ON/OFF", 0, 0, 0, 0},
+	// decodes all the PSK31 signals of the passband instead of fldigi
+	{"#psk_rx", NULL, 1000, -1000, 50, 50, "PSK_RX", 40, "OFF", FIELD_TOGGLE, FONT_FIELD_VALUE,
+	 "ON/OFF", 0, 0, 0, 0},
+	// sends and receives RTTY without fldigi, the shift is in Hz
+	{"#rtty_native", NULL, 1000, -1000, 50, 50, "RTTY_NATIVE", 40, "OFF", FIELD_TOGGLE, FONT_FIELD_VALUE,
+	 "ON/OFF", 0, 0, 0, 0},
+	{"#rtty_shift", NULL, 1000, -1000, 50, 50, "RTTY_SHIFT", 40, "170", FIELD_NUMBER, FONT_FIELD_VALUE,
+	 "", 50, 1000, 10, 0},
+	// publishes the IF and the audio in shared memory, see audio_bus.h
+	{"#audio_bus", NULL, 1000, -1000, 50, 50, "AUDIO_BUS", 40, "OFF", FIELD_TOGGLE, FONT_FIELD_VALUE,
+	 "ON/OFF", 0, 0, 0, 0},
+	// sends the FT8 decodes to GridTracker, JTAlert, etc. as WSJT-X does
+	{"#wsjtx_udp", NULL, 1000, -1000, 50, 50, "WSJTX_UDP", 40, "OFF", FIELD_TOGGLE, FONT_FIELD_VALUE,
+	 "ON/OFF", 0, 0, 0, 0},
+	{"#wsjtx_addr", NULL, 1000, -1000, 400, 149, "WSJTX_ADDR", 70, "127.0.0.1:2237", FIELD_TEXT, FONT_SMALL,
+	 "", 0, 32, 1, 0},
+	// streams the IQ around the dial over TCP (port 5006) and multicast (address:port@rate)
+	{"#iq_server", NULL, 1000, -1000, 50, 50, "IQ_SERVER", 40, "OFF", FIELD_TOGGLE, FONT_FIELD_VALUE,
+	 "ON/OFF", 0, 0, 0, 0},
+	{"#iq_bind", NULL, 1000, -1000, 400, 149, "IQ_BIND", 70, "127.0.0.1", FIELD_TEXT, FONT_SMALL,
+	 "", 0, 32, 1, 0},
+	{"#iq_mcast", NULL, 1000, -1000, 400, 149, "IQ_MCAST", 70, "", FIELD_TEXT, FONT_SMALL,
+	 "", 0, 32, 1, 0},
 
 	{"#telneturl", NULL, 1000, -1000, 400, 149, "TELNETURL", 70, "dxc.nc7j.com:7373", FIELD_TEXT, FONT_SMALL,
 	 "", 0, 32, 1, 0},
@@ -1041,12 +1078,72 @@ void tx_off();
 // char *console_lines[MAX_CONSOLE_LINES];
 int last_log = 0;
 
-struct field *get_field(const char *cmd)
+/*
+	The fields are looked up through two hash tables of active_layout,
+	one by the cmd and one by the label (ignoring the case). As with the
+	linear search they replace, the first of the duplicates wins.
+
+	The changes for the remote clients go into a journal: each change
+	gets the next version and each client keeps the version it has
+	seen. remote_field_updates() batches all that changed since into
+	one message.
+*/
+
+#define FIELD_HASH 1024		// a power of two, well over twice the fields
+#define FIELD_JOURNAL 1024	// a power of two
+
+static short field_by_cmd[FIELD_HASH];	 // index + 1 in active_layout, 0 if empty
+static short field_by_label[FIELD_HASH];
+
+static struct
+{
+	unsigned version;
+	short index;
+} field_journal[FIELD_JOURNAL];
+static unsigned field_version = 0;
+static pthread_mutex_t field_journal_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned field_hash(const char *s, int ignore_case)
 {
+	unsigned h = 2166136261u;
+	for (; *s; s++)
+		h = (h ^ (unsigned char)(ignore_case ? tolower(*s) : *s)) * 16777619u;
+	return h;
+}
+
+// built once by main(), before any thread can look a field up
+static void field_index_init()
+{
+	memset(field_by_cmd, 0, sizeof(field_by_cmd));
+	memset(field_by_label, 0, sizeof(field_by_label));
 	for (int i = 0; active_layout[i].cmd[0] > 0; i++)
-		if (!strcmp(active_layout[i].cmd, cmd))
-			return active_layout + i;
-	return NULL;
+	{
+		unsigned h = field_hash(active_layout[i].cmd, 0);
+		while (field_by_cmd[h & (FIELD_HASH - 1)] &&
+			   strcmp(active_layout[field_by_cmd[h & (FIELD_HASH - 1)] - 1].cmd, active_layout[i].cmd))
+			h++;
+		if (!field_by_cmd[h & (FIELD_HASH - 1)])
+			field_by_cmd[h & (FIELD_HASH - 1)] = i + 1;
+
+		h = field_hash(active_layout[i].label, 1);
+		while (field_by_label[h & (FIELD_HASH - 1)] &&
+			   strcasecmp(active_layout[field_by_label[h & (FIELD_HASH - 1)] - 1].label, active_layout[i].label))
+			h++;
+		if (!field_by_label[h & (FIELD_HASH - 1)])
+			field_by_label[h & (FIELD_HASH - 1)] = i + 1;
+	}
+}
+
+struct field *get_field(const char *cmd)
+{
+	for (unsigned h = field_hash(cmd, 0);; h++)
+	{
+		int i = field_by_cmd[h & (FIELD_HASH - 1)];
+		if (!i)
+			return NULL;
+		if (!strcmp(active_layout[i - 1].cmd, cmd))
+			return active_layout + i - 1;
+	}
 }
 
 // set the field directly to a particuarl value, programmatically
@@ -1138,10 +1235,14 @@ int set_field(const char *id, const char *value)
 
 struct field *get_field_by_label(const char *label)
 {
-	for (int i = 0; active_layout[i].cmd[0] > 0; i++)
-		if (!strcasecmp(active_layout[i].label, label))
-			return active_layout + i;
-	return NULL;
+	for (unsigned h = field_hash(label, 1);; h++)
+	{
+		int i = field_by_label[h & (FIELD_HASH - 1)];
+		if (!i)
+			return NULL;
+		if (!strcasecmp(active_layout[i - 1].label, label))
+			return active_layout + i - 1;
+	}
 }
 
 const char *field_str(const char *label)
@@ -1194,35 +1295,70 @@ int get_field_value_by_label(char *label, char *value)
 	return 0;
 }
 
-int remote_update_field(int i, char *text)
+// journals the change of the field for the remote clients
+void field_changed(struct field *f)
 {
-	struct field *f = active_layout + i;
+	pthread_mutex_lock(&field_journal_lock);
+	f->version = ++field_version;
+	field_journal[f->version & (FIELD_JOURNAL - 1)].version = f->version;
+	field_journal[f->version & (FIELD_JOURNAL - 1)].index = f - active_layout;
+	pthread_mutex_unlock(&field_journal_lock);
+	web_wake();
+}
 
-	if (f->cmd[0] == 0)
-		return -1;
+// the version of the last change, a client whose cursor is here is up to date
+unsigned remote_field_version()
+{
+	return __atomic_load_n(&field_version, __ATOMIC_ACQUIRE);
+}
 
-	// always send status afresh
-	if (!strcmp(f->label, "STATUS"))
-	{
-		// send time
-		time_t now = time_sbitx();
-		struct tm *tmp = gmtime(&now);
-		sprintf(text, "STATUS %04d/%02d/%02d %02d:%02d:%02dZ",
-				tmp->tm_year + 1900, tmp->tm_mon + 1, tmp->tm_mday, tmp->tm_hour, tmp->tm_min, tmp->tm_sec);
-		return 1;
-	}
+static int field_update_add(char *buff, int len, int max, struct field *f)
+{
+	int n = snprintf(buff + len, max - len, "%s %s\n", f->label, f->value);
+	if (n >= max - len)
+		return len;
+	// the lines are the fields, a newline in a value goes as a space
+	for (char *p = buff + len + strlen(f->label) + 1; p < buff + len + n - 1; p++)
+		if (*p == '\n')
+			*p = ' ';
+	return len + n;
+}
 
-	strcpy(text, f->label);
-	strcat(text, " ");
-	strcat(text, f->value);
-	int update = f->update_remote;
-	f->update_remote = 0;
+/* the fields changed since the client's cursor as one message of
+"FIELDS\n" and a "label value" line for each, the cursor is then
+moved up. A new client (REMOTE_FIELDS_NEW) gets all the fields. The
+status (the time) is always sent afresh. The buffer should take all
+the fields, 64K. */
+int remote_field_updates(unsigned *cursor, char *buff, int max)
+{
+	time_t now = time_sbitx();
+	struct tm *tmp = gmtime(&now);
+	int len = snprintf(buff, max, "FIELDS\nSTATUS %04d/%02d/%02d %02d:%02d:%02dZ\n",
+					   tmp->tm_year + 1900, tmp->tm_mon + 1, tmp->tm_mday, tmp->tm_hour, tmp->tm_min, tmp->tm_sec);
 
-	// debug on
-	// if (!strcmp(f->cmd, "#text_in") && strlen(f->value))
-	// printf("#text_in [%s] %d\n", f->value, update);
-	// debug off
-	return update;
+	pthread_mutex_lock(&field_journal_lock);
+	unsigned upto = field_version;
+	// the journal has wrapped around since the client last looked
+	if (*cursor == REMOTE_FIELDS_NEW || upto - *cursor >= FIELD_JOURNAL)
+	{
+		for (int i = 0; active_layout[i].cmd[0] > 0; i++)
+			if (strcmp(active_layout[i].label, "STATUS"))
+				len = field_update_add(buff, len, max, active_layout + i);
+	}
+	else
+	{
+		for (unsigned v = *cursor + 1; v != upto + 1; v++)
+		{
+			struct field *f = active_layout + field_journal[v & (FIELD_JOURNAL - 1)].index;
+			// it changed again later, it will be sent then
+			if (f->version != v || !strcmp(f->label, "STATUS"))
+				continue;
+			len = field_update_add(buff, len, max, f);
+		}
+	}
+	*cursor = upto;
+	pthread_mutex_unlock(&field_journal_lock);
+	return len;
 }
 
 // log is a special field that essentially is a like text
@@ -1333,6 +1469,7 @@ void web_write(int style, char *data)
 	web_add_string("</");
 	web_add_string(tag);
 	web_add_string(">");
+	web_wake();
 }
 
 int console_init_next_line()
@@ -3912,7 +4049,7 @@ void update_field(struct field *f)
 {
 	if (f->y >= 0)
 		f->is_dirty = 1;
-	f->update_remote = 1;
+	field_changed(f);
 }
 
 static void hover_field(struct field *f)
@@ -3938,7 +4075,7 @@ static void edit_field(struct field *f, int action)
 	if (f->fn)
 	{
 		f->is_dirty = 1;
-		f->update_remote = 1;
+		field_changed(f);
 		if (f->fn(f, NULL, FIELD_EDIT, action, 0, 0))
 			return;
 	}
@@ -4030,7 +4167,7 @@ static void edit_field(struct field *f, int action)
 	sprintf(buff, "%s %s", f->label, f->value);
 	do_control_action(buff);
 	f->is_dirty = 1;
-	f->update_remote = 1;
+	field_changed(f);
 	//	update_field(f);
 	settings_updated++;
 }
@@ -4310,14 +4447,175 @@ int do_waterfall(struct field *f, cairo_t *gfx, int event, int a, int b, int c)
 	return 0;
 }
 
+/* The commands of the remote clients (the web and telnet) are queued
+whole, as struct remote_command, for ui_tick() to carry out. Any thread
+may queue, a command is never split or mixed up with another's. The
+queue is a bounded ring where each slot has a sequence number: a
+producer claims a position by moving the head with a compare and swap,
+fills the slot and then sets its sequence to say it is ready. A command
+with a request id is answered "ACK id" (or "NAK id" when the queue is
+full) on the connection it came from, once it has been carried out. */
+#define REMOTE_COMMANDS 64 // a power of two
+
+static struct
+{
+	unsigned seq;
+	struct remote_command cmd;
+} remote_commands[REMOTE_COMMANDS];
+static unsigned remote_commands_head = 0, remote_commands_tail = 0;
+
+static struct
+{
+	int count, refused;
+	int64_t wait_ns, wait_max, exec_ns, exec_max;
+} remote_command_stats[2];
+
+static int64_t remote_now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void remote_commands_init()
+{
+	for (int i = 0; i < REMOTE_COMMANDS; i++)
+		remote_commands[i].seq = i;
+}
+
+static void remote_reply(struct remote_command *rc, char *reply)
+{
+	char buff[100];
+
+	if (!rc->id)
+		return;
+	if (rc->source == REMOTE_WEB)
+	{
+		sprintf(buff, "%s %u", reply, rc->id);
+		web_command_reply(rc->client, buff);
+	}
+	else
+	{
+		sprintf(buff, "%s %u\n", reply, rc->id);
+		remote_write(buff);
+	}
+}
+
+// queues the command, returns -1 if the queue is full
+int remote_command(struct remote_command *rc)
+{
+	unsigned pos = __atomic_load_n(&remote_commands_head, __ATOMIC_RELAXED);
+
+	rc->queued_ns = remote_now_ns();
+	while (1)
+	{
+		unsigned seq = __atomic_load_n(&remote_commands[pos & (REMOTE_COMMANDS - 1)].seq, __ATOMIC_ACQUIRE);
+		int diff = (int)(seq - pos);
+		if (diff == 0)
+		{
+			if (__atomic_compare_exchange_n(&remote_commands_head, &pos, pos + 1, 1,
+											__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if (diff < 0)
+		{
+			__atomic_add_fetch(&remote_command_stats[rc->source].refused, 1, __ATOMIC_RELAXED);
+			return -1;
+		}
+		else
+			pos = __atomic_load_n(&remote_commands_head, __ATOMIC_RELAXED);
+	}
+	remote_commands[pos & (REMOTE_COMMANDS - 1)].cmd = *rc;
+	__atomic_store_n(&remote_commands[pos & (REMOTE_COMMANDS - 1)].seq, pos + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+// takes the oldest command, only ui_tick() does this
+static int remote_command_next(struct remote_command *rc)
+{
+	unsigned pos = remote_commands_tail;
+	unsigned seq = __atomic_load_n(&remote_commands[pos & (REMOTE_COMMANDS - 1)].seq, __ATOMIC_ACQUIRE);
+
+	if (seq != pos + 1)
+		return 0;
+	*rc = remote_commands[pos & (REMOTE_COMMANDS - 1)].cmd;
+	__atomic_store_n(&remote_commands[pos & (REMOTE_COMMANDS - 1)].seq, pos + REMOTE_COMMANDS, __ATOMIC_RELEASE);
+	remote_commands_tail = pos + 1;
+	return 1;
+}
+
+static void remote_command_run(struct remote_command *rc)
+{
+	int64_t start = remote_now_ns();
+
+	// echo the keystrokes for chatty modes like cw/rtty/psk31/etc
+	if (rc->type == REMOTE_CMD_KEY)
+		for (int i = 0; rc->args[i] > 0; i++)
+			edit_field(get_field("#text_in"), rc->args[i]);
+	else
+	{
+		cmd_exec(rc->args);
+		settings_updated = 1; // save the settings
+	}
+	remote_reply(rc, "ACK");
+
+	int64_t stop = remote_now_ns();
+	int source = rc->source;
+	remote_command_stats[source].count++;
+	remote_command_stats[source].wait_ns += start - rc->queued_ns;
+	remote_command_stats[source].exec_ns += stop - start;
+	if (start - rc->queued_ns > remote_command_stats[source].wait_max)
+		remote_command_stats[source].wait_max = start - rc->queued_ns;
+	if (stop - start > remote_command_stats[source].exec_max)
+		remote_command_stats[source].exec_max = stop - start;
+}
+
+// the time the remote commands waited in the queue and took to carry out
+static void remote_command_status()
+{
+	static const char *sources[] = {"web", "telnet"};
+	char buff[200];
+
+	for (int i = 0; i < 2; i++)
+	{
+		int n = remote_command_stats[i].count;
+		sprintf(buff, "\n%s: %d commands, %d refused, queued %.3f/%.3f msec, "
+					  "carried out in %.3f/%.3f msec (average/worst)",
+				sources[i], n, remote_command_stats[i].refused,
+				n ? remote_command_stats[i].wait_ns / n / 1e6 : 0,
+				remote_command_stats[i].wait_max / 1e6,
+				n ? remote_command_stats[i].exec_ns / n / 1e6 : 0,
+				remote_command_stats[i].exec_max / 1e6);
+		write_console(FONT_LOG, buff);
+	}
+	write_console(FONT_LOG, "\n");
+	memset(remote_command_stats, 0, sizeof(remote_command_stats));
+}
+
+// a telnet line, "@id command" asks for a reply
 void remote_execute(char *cmd)
 {
+	struct remote_command rc;
 
-	if (q_remote_commands.overflow)
-		q_empty(&q_remote_commands);
-	while (*cmd)
-		q_write(&q_remote_commands, *cmd++);
-	q_write(&q_remote_commands, 0);
+	rc.source = REMOTE_TELNET;
+	rc.client = 0;
+	rc.id = 0;
+	if (cmd[0] == '@')
+	{
+		rc.id = strtoul(cmd + 1, &cmd, 10);
+		while (*cmd == ' ')
+			cmd++;
+	}
+	rc.type = REMOTE_CMD_EXEC;
+	if (!strncmp(cmd, "key ", 4))
+	{
+		rc.type = REMOTE_CMD_KEY;
+		cmd += 4;
+	}
+	strncpy(rc.args, cmd, sizeof(rc.args) - 1);
+	rc.args[sizeof(rc.args) - 1] = 0;
+	if (remote_command(&rc))
+		remote_reply(&rc, "NAK");
 }
 
 void call_wipe()
@@ -4448,7 +4746,6 @@ int do_status(struct field *f, cairo_t *gfx, int event, int a, int b, int c)
 		int line_height = font_table[f->font_index].height;
 		strcpy(f->value, buff);
 		f->is_dirty = 1;
-		f->update_remote = 1;
 		sprintf(buff, "sBitx %s %s %04d/%02d/%02d %02d:%02d:%02dZ",
 				get_field("#mycallsign")->value, get_field("#mygrid")->value,
 				tmp->tm_year + 1900, tmp->tm_mon + 1, tmp->tm_mday, tmp->tm_hour, tmp->tm_min, tmp->tm_sec);
@@ -4505,7 +4802,7 @@ int do_text(struct field *f, cairo_t *gfx, int event, int a, int b, int c)
 			f->value[l] = 0;
 		}
 		f->is_dirty = 1;
-		f->update_remote = 1;
+		field_changed(f);
 		f_last_text = f;
 		return 1;
 	}
@@ -6329,8 +6626,12 @@ void check_read_ina260_cadence(float *voltage, float *current)
 }
 
 int key_poll() {
+  return key_read(get_cw_input_method());
+}
+
+// reads the key or the paddles, this is called from the keyer thread
+int key_read(int input_method) {
   int key = CW_IDLE;
-  int input_method = get_cw_input_method();
  
   // Handle straight key input
   if (input_method == CW_STRAIGHT) {
@@ -6601,47 +6902,59 @@ int web_get_console(char *buff, int max)
 	return i;
 }
 
-void web_get_spectrum(char *buff)
+// the spectrum as levels of 0 to 95, or the modulation while
+// transmitting, a span of 0 follows the SPAN setting
+int web_spectrum_bins(uint8_t *bins, int span, int *tx)
 {
-
-	int n_bins = (int)((1.0 * spectrum_span) / 46.875);
+	if (span <= 0 || span > spectrum_span)
+		span = spectrum_span;
+	int n_bins = (int)((1.0 * span) / 46.875);
 	// the center frequency is at the center of the lower sideband,
 	// i.e, three-fourth way up the bins.
 	int starting_bin = (3 * MAX_BINS) / 4 - n_bins / 2;
 	int ending_bin = starting_bin + n_bins;
 
-	int j = 3;
+	int j = 0;
+	*tx = in_tx;
 	if (in_tx)
 	{
-		strcpy(buff, "TX ");
 		for (int i = 0; i < MOD_MAX; i++)
 		{
 			int y = (2 * mod_display[i]) + 32;
 			if (y > 127)
-				buff[j++] = 127;
+				bins[j++] = 95;
 			else if (y > 0 && y <= 95)
-				buff[j++] = y + 32;
+				bins[j++] = y;
 			else
-				buff[j++] = ' ';
+				bins[j++] = 0;
 		}
 	}
 	else
 	{
-		strcpy(buff, "RX ");
 		for (int i = starting_bin; i <= ending_bin; i++)
 		{
 			int y = spectrum_plot[i] + waterfall_offset;
 			if (y > 95)
-				buff[j++] = 127;
+				bins[j++] = 95;
 			else if (y >= 0)
-				buff[j++] = y + 32;
+				bins[j++] = y;
 			else
-				buff[j++] = ' ';
+				bins[j++] = 0;
 		}
 	}
+	return j;
+}
+
+void web_get_spectrum(char *buff)
+{
+	uint8_t bins[MAX_BINS];
+	int tx;
 
-	buff[j++] = 0;
-	return;
+	int n = web_spectrum_bins(bins, 0, &tx);
+	strcpy(buff, tx ? "TX " : "RX ");
+	for (int i = 0; i < n; i++)
+		buff[i + 3] = bins[i] + 32;
+	buff[n + 3] = 0;
 }
 
 void set_radio_mode(char *mode)
@@ -6819,27 +7132,9 @@ gboolean ui_tick(gpointer gook)
 
 	ticks++;
 
-	while (q_length(&q_remote_commands) > 0)
-	{
-		// read each command until the
-		char remote_cmd[1000];
-		int c, i;
-		for (i = 0; i < sizeof(remote_cmd) - 2 && (c = q_read(&q_remote_commands)) > 0; i++)
-		{
-			remote_cmd[i] = c;
-		}
-		remote_cmd[i] = 0;
-
-		// echo the keystrokes for chatty modes like cw/rtty/psk31/etc
-		if (!strncmp(remote_cmd, "key ", 4))
-			for (int i = 4; remote_cmd[i] > 0; i++)
-				edit_field(get_field("#text_in"), remote_cmd[i]);
-		else
-		{
-			cmd_exec(remote_cmd);
-			settings_updated = 1; // save the settings
-		}
-	}
+	struct remote_command rc;
+	while (remote_command_next(&rc))
+		remote_command_run(&rc);
 
 	for (struct field *f = active_layout; f->cmd[0] > 0; f++)
 	{
@@ -7126,7 +7421,7 @@ int get_tx_data_byte(char *c)
 			f->value[i] = f->value[i + 1];
 	}
 	f->is_dirty = 1;
-	f->update_remote = 1;
+	field_changed(f);
 	// update_field(f);
 	return length;
 }
@@ -7868,6 +8163,59 @@ void cmd_exec(char *cmd)
 	}
 	else if (!strcmp(exec, "abort"))
 		abort_tx();
+	else if (!strcmp(exec, "ftxstat")){
+		ft8_status();
+		ft8_wide_status();
+	}
+	else if (!strcmp(exec, "ft8cal"))
+		ft8_dt_calibrate();
+	else if (!strcmp(exec, "wsprstat"))
+		wspr_status();
+	else if (!strcmp(exec, "pskstat"))
+		psk_status();
+	else if (!strcmp(exec, "skimstat"))
+		skimmer_status();
+	else if (!strcmp(exec, "cwstat"))
+		cw_status();
+	else if (!strcmp(exec, "fldigistat"))
+		fldigi_status();
+	else if (!strcmp(exec, "iqstat"))
+		iq_server_status();
+	else if (!strcmp(exec, "webstat"))
+	{
+		web_spectrum_status();
+		web_audio_status();
+		web_wake_status();
+	}
+	else if (!strcmp(exec, "cmdstat"))
+		remote_command_status();
+	// \ftxq <pitch> [<amplitude>%] <message> queues another FT8 signal
+	else if (!strcmp(exec, "ftxq"))
+	{
+		int pitch, amplitude = 100, n = 0;
+		if (!args[0])
+			ft8_stream_list();
+		else if (!strcmp(args, "clear"))
+			ft8_stream_clear();
+		else if (sscanf(args, "%d %n", &pitch, &n) < 1 || !args[n])
+			write_console(FONT_LOG, "\nUsage: \\ftxq <pitch> [<amplitude>%] <message>\n");
+		else
+		{
+			char *message = args + n;
+			n = 0;
+			sscanf(message, "%d%%%n", &amplitude, &n);
+			if (n > 0)
+			{
+				message += n;
+				while (*message == ' ')
+					message++;
+			}
+			else
+				amplitude = 100;
+			if (ft8_stream_queue(pitch, amplitude, message) < 0)
+				write_console(FONT_LOG, "\nCan't queue that on an FT8 stream\n");
+		}
+	}
 	else if (!strcmp(exec, "rtc"))
 		rtc_read();
 	else if (!strcmp(exec, "txcal"))
@@ -8187,6 +8535,7 @@ int main(int argc, char *argv[])
 
 	puts(VER_STR);
 	active_layout = main_controls;
+	field_index_init();
 
 	// ensure_single_instance();
 
@@ -8198,7 +8547,7 @@ int main(int argc, char *argv[])
 	hw_init();
 	console_init();
 
-	q_init(&q_remote_commands, 1000); // not too many commands
+	remote_commands_init();
 	q_init(&q_tx_text, 100);		  // best not to have a very large q
 	setup();
 	// --- Check time against NTP server
@@ -8342,6 +8691,8 @@ void cleanup_on_exit() {
 	// Close the frequency keypad if it's running
 	system("/home/pi/sbitx/src/cleanup_keypad.sh");
 	
+	audio_bus_close();
+
 	// Add any other cleanup tasks here
 	printf("Cleaning up resources before exit\n");
 }
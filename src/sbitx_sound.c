@@ -5,6 +5,7 @@
 #include <fftw3.h>
 #include <sys/time.h>
 #include <time.h>
+#include <math.h>
 #include "sound.h"
 #include "wiringPi.h"
 #include "sdr.h"
@@ -513,6 +514,22 @@ int sound_start_capture(char *device){
 		return(-1);
 	}
 
+	//timestamp the captured periods on the monotonic clock, see sound_clock_capture()
+	snd_pcm_sw_params_t *capture_swparams;
+	snd_pcm_sw_params_alloca(&capture_swparams);
+	e = snd_pcm_sw_params_current(pcm_capture_handle, capture_swparams);
+	if (e == 0)
+		e = snd_pcm_sw_params_set_tstamp_mode(pcm_capture_handle, capture_swparams, 
+			SND_PCM_TSTAMP_ENABLE);
+	if (e == 0)
+		e = snd_pcm_sw_params_set_tstamp_type(pcm_capture_handle, capture_swparams, 
+			SND_PCM_TSTAMP_TYPE_MONOTONIC);
+	if (e == 0)
+		e = snd_pcm_sw_params(pcm_capture_handle, capture_swparams);
+	if (e < 0)
+		fprintf(stderr, "*No capture timestamps, the sample clock will be rough: %s\n", 
+			snd_strerror(e));
+
 #if DEBUG > 0
 	printf("Capture Buffer Size: %d\n",snd_pcm_avail(pcm_capture_handle));
 	puts("All hw params set for PCM sound capture");
@@ -685,6 +702,96 @@ unsigned long sbitx_millis(){
 	return sound_millis;
 }
 
+/*
+	The capture sample clock. Each block read from the codec is numbered
+	by the index of its first sample and timed by the ALSA timestamp of its
+	capture, not by when this thread got around to reading it. The
+	timestamps jitter by a period or so, they are smoothed by a slow loop
+	that follows the codec's crystal. 
+
+	The output samples computed from a block are heard sound_tx_latency()
+	after the block was captured, as long as the playback doesn't run dry
+	this doesn't change. With both, the modems can put a transmission
+	on air at an exact time.
+*/
+static long long clock_index = 0;		// of the first sample of the current block
+static double clock_captured = 0;		// CLOCK_MONOTONIC time of that sample
+static double clock_realtime = 0;		// CLOCK_REALTIME - CLOCK_MONOTONIC
+static double clock_latency = 0;		// seconds from the capture to the output
+static int clock_block = 0;					// samples in the current block
+
+static double timespec_secs(const struct timespec *ts){
+	return ts->tv_sec + ts->tv_nsec / 1e9;
+}
+
+static void sound_clock_capture(int n_samples){
+	snd_pcm_uframes_t avail;
+	snd_htimestamp_t tstamp;
+	struct timespec mono, real;
+
+	clock_gettime(CLOCK_MONOTONIC, &mono);
+	clock_gettime(CLOCK_REALTIME, &real);
+	clock_realtime = timespec_secs(&real) - timespec_secs(&mono);
+
+	//the timestamp is of the last period the driver saw, 
+	//avail samples have come in after the block that we just read
+	double captured = timespec_secs(&mono);
+	if (snd_pcm_htimestamp(pcm_capture_handle, &avail, &tstamp) == 0
+		&& (tstamp.tv_sec || tstamp.tv_nsec))
+		captured = timespec_secs(&tstamp) - (double)avail / rate;
+	captured -= (double)n_samples / rate;
+
+	double expected = clock_captured + (double)clock_block / rate;
+	clock_index += clock_block;
+	clock_block = n_samples;
+
+	//start over after an overrun, the samples lost aren't counted
+	if (clock_captured == 0 || fabs(captured - expected) > 0.02)
+		clock_captured = captured;
+	else
+		clock_captured = expected + (captured - expected) / 64;
+}
+
+// called just before the output of the current block is queued
+static void sound_clock_play(){
+	snd_pcm_sframes_t delay;
+	struct timespec mono;
+
+	if (snd_pcm_delay(pcm_play_handle, &delay) < 0)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &mono);
+	double latency = timespec_secs(&mono) + (double)delay / rate - clock_captured;
+	if (clock_latency == 0 || fabs(latency - clock_latency) > 0.005)
+		clock_latency = latency;
+	else
+		clock_latency += (latency - clock_latency) / 64;
+}
+
+long long sound_sample_index(){
+	return clock_index;
+}
+
+double sound_sample_time(long long index){
+	return clock_captured + clock_realtime + (double)(index - clock_index) / rate;
+}
+
+long long sound_time_sample(double t){
+	return clock_index + llround((t - clock_captured - clock_realtime) * rate);
+}
+
+long long sound_monotonic_sample(double t){
+	return clock_index + llround((t - clock_captured) * rate);
+}
+
+// for the deadlines of the slots timed by sound_sample_time()
+double sound_monotonic_time(double t){
+	return t - clock_realtime;
+}
+
+double sound_tx_latency(){
+	return clock_latency;
+}
+
 int sound_loop(){
 	int32_t		*line_in, *line_out, *data_in, *data_out, 
 						*input_i, *output_i, *input_q, *output_q;
@@ -759,6 +866,7 @@ int sound_loop(){
 		printf("Delta Time: %d, Available output sample storage: %d\n", delta_time, snd_pcm_avail(pcm_play_handle));
 #endif		
 		samples_read += pcmreturn;
+		sound_clock_capture(pcmreturn);
 		
 		i = 0; 
 		j = 0;
@@ -825,6 +933,7 @@ int sound_loop(){
 	int offset = 0;
 	int play_write_errors = 0;
 	int pswitch = 0;
+	sound_clock_play();
 		
 	while(framesize > 0)
 	{
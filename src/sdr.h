@@ -204,7 +204,38 @@ int get_tx_data_byte(char *c);
 int	get_tx_data_length();
 void modem_poll(int mode);
 float modem_next_sample(int mode);
+void modem_next_block(int mode, float *samples, int count);
 void modem_abort();
+int modem_tx_audio();
+
+/* from ft8_wideband.c */
+void ft8_wide_rx(int32_t *samples, int count);
+
+/* from wspr.c */
+void wspr_init();
+void wspr_rx(int32_t *samples, int count);
+void wspr_poll();
+void wspr_status();
+void wspr_reset_stats();
+
+/* from audio_bus.c */
+void audio_bus_init();
+void audio_bus_write(int32_t *if_samples, int32_t *audio, int count, int in_tx);
+void audio_bus_poll();
+void audio_bus_close();
+
+/* from iq_server.c */
+void iq_server_init();
+void iq_server_rx(int32_t *samples, int count);
+void iq_server_poll();
+void iq_server_status();
+
+/* from cw_skimmer.c */
+void skimmer_init();
+void skimmer_rx(int32_t *samples, int count);
+void skimmer_poll();
+void skimmer_status();
+void skimmer_reset_stats();
 
 int is_in_tx();
 
@@ -241,6 +272,7 @@ time_t time_sbitx();
 #define CW_BUG 6
 
 int key_poll();
+int key_read(int input_method);
 int key_poll2();
 int get_cw_delay();
 int	get_data_delay();
@@ -263,6 +295,7 @@ FILE *wav_start_writing(const char* path);
 #define MULTICAST_ADDR "224.0.0.1"
 #define MULTICAST_PORT 5005
 #define MULTICAST_MAX_BUFFER_SIZE 1024
+#define IQ_PORT 5006
 
 // S-Meter
 int get_rx_gain(void);
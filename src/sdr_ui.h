@@ -1,3 +1,7 @@
+#pragma once
+#include <stdint.h>
+#include <limits.h>
+
 void setup();
 void loop();
 void display();
@@ -8,11 +12,30 @@ int get_field_value(char *id, char *value);
 int get_field_value_by_label(char *label, char *value);
 extern int spectrum_plot[];
 void remote_execute(char *command);
-int remote_update_field(int i, char *text);
+
+// a command from a remote client, queued for the ui to carry out
+#define REMOTE_WEB 0
+#define REMOTE_TELNET 1
+#define REMOTE_CMD_EXEC 0	// args is a command for cmd_exec()
+#define REMOTE_CMD_KEY 1	// args are keystrokes for the text box
+struct remote_command {
+	int type;
+	int source;
+	unsigned long client;	// the web connection the reply goes to
+	unsigned id;			// the client's request id, 0 wants no reply
+	int64_t queued_ns;
+	char args[1000];
+};
+int remote_command(struct remote_command *rc);
+#define REMOTE_FIELDS_NEW UINT_MAX
+int remote_field_updates(unsigned *cursor, char *buff, int max);
+unsigned remote_field_version();
 void web_get_spectrum(char *buff);
+int web_spectrum_bins(uint8_t *bins, int span, int *tx);
 void save_user_settings(int forced);
 int web_get_console(char *buff, int max);
-int remote_audio_output(int16_t *samples);
+#define REMOTE_AUDIO_NEW UINT64_MAX
+int remote_audio_read(uint64_t *cursor, int16_t *samples, int max, int *lag, int *dropped);
 const char *field_str(const char *label);
 int field_int(char *label);
 int is_in_tx();
@@ -28,6 +28,14 @@ void sound_mixer(char *card_name, char *element, int make_on);
 void sound_input(int loop);
 unsigned long sbitx_millis();
 
+//the capture sample clock, call these from sound_process() 
+long long sound_sample_index();					//of the first sample of the block
+double sound_sample_time(long long index);	//CLOCK_REALTIME secs of a sample
+long long sound_time_sample(double t);
+long long sound_monotonic_sample(double t);	//of a CLOCK_MONOTONIC time
+double sound_monotonic_time(double t);		//CLOCK_MONOTONIC of a CLOCK_REALTIME time
+double sound_tx_latency();								//secs from capture to output
+
 //volume control normalizer
 extern int input_volume;
 //void set_input_volume(int volume);
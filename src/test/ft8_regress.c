@@ -0,0 +1,474 @@
+/*
+	Regression and benchmark harness for the sBitx FT8/FT4 decoder.
+
+	It runs sbitx_ft8_decode() (the same code that the radio runs) over a
+	directory of recorded slots. Each slot is a 12000 samples/sec, 16-bit mono
+	.wav file with a .txt file of the same name that lists the expected
+	decodes, one per line, in the usual WSJT-X format:
+		000000 -10  0.2 1234 ~  CQ K1ABC FN42
+	Only the message text after the '~' is compared.
+
+	For every slot it reports the decodes found, missed and false decodes,
+	the wall time taken and the peak memory of the process. A JSON summary is
+	written to stdout (or to a file with -o). The exit status is non-zero when
+	the results fall below the thresholds or regress against a baseline JSON
+	produced earlier by this same program.
+
+	usage: ft8_regress [options] <corpus directory>
+		-4              decode FT4 (7.5 sec slots) instead of FT8
+		-o file         write the JSON report to this file
+		-b file         baseline JSON report to compare against
+		-r recall       minimum acceptable recall (0..1)
+		-t msec         maximum acceptable average time per slot
+		-R drop         maximum drop in recall from the baseline (default 0.02)
+		-T percent      maximum increase in time from the baseline (default 25)
+		-d msec         give each slot this much time, like the radio does
+		                when the reply is due (default no deadline)
+		-a calls        decode as if in a qso, "MYCALL DXCALL PITCH" (the
+		                DXCALL may be - for none), this turns on the
+		                a-priori decoding around PITCH
+		-g count        generate a synthetic corpus of count slots in the
+		                directory instead of testing (no recordings needed)
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include "../sdr_ui.h"
+#include "../modem_ft8.h"
+#include "../ft8_lib/common/wave.h"
+#include "../ft8_lib/ft8/constants.h"
+
+#define MAX_DECODES 200
+#define MAX_SLOTS 5000
+
+static char decodes[MAX_DECODES][40];
+static int n_decodes = 0;
+static char qso_mycall[20], qso_dxcall[20];
+static int qso_pitch = 0;
+
+/*
+	The decoder is linked without the rest of the radio,
+	these stand in for the user interface and the transmitter
+*/
+
+void write_console(int style, char *text){
+	if (style != FONT_FT8_RX && style != FONT_FT8_REPLY)
+		return;
+	char *p = strchr(text, '~');
+	if (!p || n_decodes >= MAX_DECODES)
+		return;
+	p++;
+	while (*p == ' ')
+		p++;
+	strncpy(decodes[n_decodes], p, sizeof(decodes[0]) - 1);
+	decodes[n_decodes][sizeof(decodes[0]) - 1] = 0;
+	char *q = strchr(decodes[n_decodes], '\n');
+	if (q)
+		*q = 0;
+	n_decodes++;
+}
+
+int get_field_value(char *id, char *value){
+	//a callsign that will never match, this keeps ft8_process() out of it
+	if (!strcmp(id, "#mycallsign"))
+		strcpy(value, "QQ0QQQ");
+	else
+		value[0] = 0;
+	return 0;
+}
+
+int get_field_value_by_label(char *label, char *value){
+	value[0] = 0;
+	return 0;
+}
+
+const char *field_str(const char *label){
+	if (!strcmp(label, "MYCALLSIGN"))
+		return qso_mycall;
+	if (!strcmp(label, "CALL"))
+		return qso_dxcall;
+	return "";
+}
+
+int field_int(char *label){
+	if (!strcmp(label, "TX_PITCH"))
+		return qso_pitch;
+	return 0;
+}
+
+int field_set(const char *label, const char *new_value){
+	return 0;
+}
+
+time_t time_sbitx(){
+	return 0;
+}
+
+long long sound_sample_index(){
+	return 0;
+}
+
+double sound_sample_time(long long index){
+	return 0;
+}
+
+long long sound_time_sample(double t){
+	return 0;
+}
+
+double sound_monotonic_time(double t){
+	return t;
+}
+
+double sound_tx_latency(){
+	return 0;
+}
+
+void tx_on(int trigger){}
+void tx_off(){}
+void modem_abort(){}
+void call_wipe(){}
+void enter_qso(){}
+void wsjtx_decode(time_t slot, int snr, float dt, float freq_hz,
+	bool is_ft8, const char *text){}
+void wsjtx_flush(){}
+
+/* the hashed callsigns are reported as <...> by the decoder */
+static void normalize(char *msg){
+	char out[64], *p, *save;
+	out[0] = 0;
+	for (p = strtok_r(msg, " \t\r\n", &save); p; p = strtok_r(NULL, " \t\r\n", &save)){
+		if (out[0])
+			strcat(out, " ");
+		if (p[0] == '<' && p[strlen(p)-1] == '>')
+			strcat(out, "<...>");
+		else
+			strncat(out, p, sizeof(out) - strlen(out) - 8);
+	}
+	strcpy(msg, out);
+}
+
+static int load_expected(const char *path, char expected[][40]){
+	char line[200];
+	int count = 0;
+
+	FILE *pf = fopen(path, "r");
+	if (!pf)
+		return -1;
+	while (fgets(line, sizeof(line), pf) && count < MAX_DECODES){
+		char *p = strchr(line, '~');
+		if (!p)
+			continue;
+		strncpy(expected[count], p + 1, 39);
+		expected[count][39] = 0;
+		normalize(expected[count]);
+		if (expected[count][0])
+			count++;
+	}
+	fclose(pf);
+	return count;
+}
+
+static int in_list(const char *msg, char list[][40], int count){
+	for (int i = 0; i < count; i++)
+		if (!strcmp(msg, list[i]))
+			return 1;
+	return 0;
+}
+
+static double now_msec(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static long peak_kb(){
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss;
+}
+
+static int compare_names(const void *a, const void *b){
+	return strcmp(*(char **)a, *(char **)b);
+}
+
+// picks a number out of our own json reports, no need for a parser
+static int json_number(const char *path, const char *key, double *value){
+	char pattern[64];
+	FILE *pf = fopen(path, "r");
+	if (!pf)
+		return -1;
+	fseek(pf, 0, SEEK_END);
+	long size = ftell(pf);
+	rewind(pf);
+	char *buff = malloc(size + 1);
+	int n = fread(buff, 1, size, pf);
+	fclose(pf);
+	buff[n] = 0;
+	sprintf(pattern, "\"%s\":", key);
+	//the summary is at the end, after the per slot entries
+	char *p = strstr(buff, "\"summary\"");
+	if (p)
+		p = strstr(p, pattern);
+	if (p)
+		*value = atof(p + strlen(pattern));
+	free(buff);
+	return p ? 0 : -1;
+}
+
+/*
+	writes count slots of synthetic traffic with their expected decodes,
+	each slot has a few stations at different pitches and signal levels
+	buried in white noise, so that the suite can run without recordings
+*/
+static int generate_corpus(const char *dir, int count, bool is_ft8){
+	static const char *calls[] = {"K1ABC", "W9JES", "VU2ESE", "N1QM", "OZ7BX",
+		"W2JON", "KF7YDU", "W4WHL", "G4XYZ", "JA1AAA", "DL2ABC", "VK3XY"};
+	static const char *grids[] = {"FN42", "EN52", "MK97", "FN31", "JO65", "FN20",
+		"DN17", "EM73", "IO91", "PM95", "JO62", "QF22"};
+	int n_calls = sizeof(calls)/sizeof(calls[0]);
+	int slot_samples = (is_ft8 ? 15 : 7.5) * 12000;
+	float *signal = malloc(slot_samples * sizeof(float));
+	float *tone = malloc(FT8_MAX_BUFF * sizeof(float));
+	char path[1000], msg[40];
+
+	srand(1);
+	for (int slot = 0; slot < count; slot++){
+		sprintf(path, "%s/synth_%04d.txt", dir, slot);
+		FILE *pf = fopen(path, "w");
+		if (!pf){
+			perror(path);
+			return -1;
+		}
+		memset(signal, 0, slot_samples * sizeof(float));
+		int n_stations = 3 + rand() % 6;
+		for (int s = 0; s < n_stations; s++){
+			int a = rand() % n_calls, b = (a + 1 + rand() % (n_calls - 1)) % n_calls;
+			switch(rand() % 3){
+			case 0:
+				sprintf(msg, "CQ %s %s", calls[a], grids[a]);
+				break;
+			case 1:
+				sprintf(msg, "%s %s %s", calls[a], calls[b], grids[b]);
+				break;
+			default:
+				sprintf(msg, "%s %s %+03d", calls[a], calls[b], -(rand() % 20));
+				break;
+			}
+			// keep the stations 100 Hz apart
+			int pitch = 300 + (s * 300) + rand() % 200;
+			//from about -8 dB to -20 dB SNR in 2500 Hz
+			float amplitude = 0.1f * powf(10, -(rand() % 13) / 20.0f);
+			int n = sbitx_ft8_encode(msg, pitch, tone, !is_ft8);
+			if (n < 0)
+				continue;
+			//the encoder centers the FT4 burst in the slot,
+			//the transmitters start it 0.5 sec into the slot
+			int skip = 0;
+			if (!is_ft8)
+				skip = (n - (int)(FT4_NN * FT4_SYMBOL_PERIOD * 12000)) / 2 - 6000;
+			for (int i = 0; i + skip < n && i < slot_samples; i++)
+				signal[i] += amplitude * tone[i + skip];
+			fprintf(pf, "000000   0  0.0 %4d ~  %s\n", pitch, msg);
+		}
+		for (int i = 0; i < slot_samples; i++)
+			signal[i] += 0.25f * ((float)rand() / RAND_MAX - 0.5f);
+		fclose(pf);
+		sprintf(path, "%s/synth_%04d.wav", dir, slot);
+		save_wav(signal, slot_samples, 12000, path);
+	}
+	free(tone);
+	free(signal);
+	printf("Wrote %d slots to %s\n", count, dir);
+	return 0;
+}
+
+int main(int argc, char **argv){
+	bool is_ft8 = true;
+	const char *json_path = NULL, *baseline_path = NULL;
+	double min_recall = 0, max_msec = 0, max_recall_drop = 0.02, max_time_growth = 25;
+	double budget_msec = 0;
+	int generate = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "4o:b:r:t:R:T:g:d:a:")) != -1){
+		switch(opt){
+		case '4': is_ft8 = false; break;
+		case 'o': json_path = optarg; break;
+		case 'b': baseline_path = optarg; break;
+		case 'r': min_recall = atof(optarg); break;
+		case 't': max_msec = atof(optarg); break;
+		case 'R': max_recall_drop = atof(optarg); break;
+		case 'T': max_time_growth = atof(optarg); break;
+		case 'g': generate = atoi(optarg); break;
+		case 'd': budget_msec = atof(optarg); break;
+		case 'a':
+			if (sscanf(optarg, "%19s %19s %d", qso_mycall, qso_dxcall, &qso_pitch) != 3){
+				fprintf(stderr, "%s: -a needs \"MYCALL DXCALL PITCH\"\n", argv[0]);
+				return 2;
+			}
+			if (!strcmp(qso_dxcall, "-"))
+				qso_dxcall[0] = 0;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-4] [-o report.json] [-b baseline.json] "
+				"[-r min_recall] [-t max_msec] [-R recall_drop] [-T time_growth%%] "
+				"[-g count] [-d msec] [-a \"MYCALL DXCALL PITCH\"] corpus_dir\n", argv[0]);
+			return 2;
+		}
+	}
+	if (optind >= argc){
+		fprintf(stderr, "%s: corpus directory is missing\n", argv[0]);
+		return 2;
+	}
+	const char *dir = argv[optind];
+
+	if (generate)
+		return generate_corpus(dir, generate, is_ft8) ? 2 : 0;
+
+	DIR *d = opendir(dir);
+	if (!d){
+		perror(dir);
+		return 2;
+	}
+	static char *names[MAX_SLOTS];
+	int n_slots = 0;
+	struct dirent *de;
+	while ((de = readdir(d)) && n_slots < MAX_SLOTS){
+		int len = strlen(de->d_name);
+		if (len > 4 && !strcmp(de->d_name + len - 4, ".wav"))
+			names[n_slots++] = strdup(de->d_name);
+	}
+	closedir(d);
+	qsort(names, n_slots, sizeof(char *), compare_names);
+
+	ft8_decoder_init();
+
+	static float signal[FT8_MAX_BUFF];
+	static char expected[MAX_DECODES][40];
+	int total_expected = 0, total_found = 0, total_false = 0, n_tested = 0;
+	int total_skipped = 0, total_ap = 0;
+	double total_msec = 0, worst_msec = 0;
+	char path[1000];
+
+	FILE *json = json_path ? fopen(json_path, "w") : stdout;
+	if (!json){
+		perror(json_path);
+		return 2;
+	}
+	fprintf(json, "{\n  \"protocol\": \"%s\",\n  \"slots\": [\n", is_ft8 ? "FT8" : "FT4");
+
+	for (int i = 0; i < n_slots; i++){
+		snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+		int num_samples = FT8_MAX_BUFF, sample_rate = 0;
+		if (load_wav(signal, &num_samples, &sample_rate, path) || sample_rate != 12000){
+			fprintf(stderr, "%s: not a 12000 Hz, 16-bit mono slot, skipped\n", path);
+			continue;
+		}
+		strcpy(path + strlen(path) - 4, ".txt");
+		int n_expected = load_expected(path, expected);
+		if (n_expected < 0){
+			fprintf(stderr, "%s: no expected decodes, skipped\n", path);
+			continue;
+		}
+
+		n_decodes = 0;
+		struct ftx_decode_stats stats;
+		double start = now_msec();
+		double deadline = budget_msec > 0 ? (start + budget_msec) / 1000.0 : 0;
+		sbitx_ft8_decode(signal, num_samples, is_ft8, deadline, &stats);
+		double msec = now_msec() - start;
+
+		int found = 0, false_decodes = 0;
+		for (int j = 0; j < n_decodes; j++){
+			normalize(decodes[j]);
+			if (in_list(decodes[j], expected, n_expected))
+				found++;
+			else {
+				false_decodes++;
+				fprintf(stderr, "%s: false decode '%s'\n", names[i], decodes[j]);
+			}
+		}
+		for (int j = 0; j < n_expected; j++)
+			if (!in_list(expected[j], decodes, n_decodes))
+				fprintf(stderr, "%s: missed '%s'\n", names[i], expected[j]);
+
+		fprintf(json, "%s    {\"file\": \"%s\", \"expected\": %d, \"found\": %d, "
+			"\"false\": %d, \"msec\": %.2f, \"skipped\": %d, \"peak_kb\": %ld}",
+			n_tested ? ",\n" : "", names[i], n_expected, found, false_decodes,
+			msec, stats.skipped, peak_kb());
+		total_skipped += stats.skipped;
+		total_ap += stats.ap_decoded;
+
+		total_expected += n_expected;
+		total_found += found;
+		total_false += false_decodes;
+		total_msec += msec;
+		if (msec > worst_msec)
+			worst_msec = msec;
+		n_tested++;
+	}
+
+	double recall = total_expected ? (double)total_found / total_expected : 0;
+	double avg_msec = n_tested ? total_msec / n_tested : 0;
+
+	fprintf(json, "\n  ],\n  \"summary\": {\"slots\": %d, \"expected\": %d, "
+		"\"found\": %d, \"false\": %d, \"recall\": %.4f, \"avg_msec\": %.2f, "
+		"\"worst_msec\": %.2f, \"skipped\": %d, \"ap_decoded\": %d, "
+		"\"peak_kb\": %ld}\n}\n",
+		n_tested, total_expected, total_found, total_false, recall, avg_msec,
+		worst_msec, total_skipped, total_ap, peak_kb());
+	if (json != stdout)
+		fclose(json);
+
+	fprintf(stderr, "%d slots, %d/%d decoded (recall %.1f%%), %d false, "
+		"%.1f msec/slot average, %.1f worst\n", n_tested, total_found,
+		total_expected, recall * 100, total_false, avg_msec, worst_msec);
+
+	//now, check the thresholds
+	int failed = 0;
+	if (!n_tested){
+		fprintf(stderr, "FAIL: no slots were tested\n");
+		failed = 1;
+	}
+	if (recall < min_recall){
+		fprintf(stderr, "FAIL: recall %.3f is below %.3f\n", recall, min_recall);
+		failed = 1;
+	}
+	if (max_msec > 0 && avg_msec > max_msec){
+		fprintf(stderr, "FAIL: %.1f msec per slot is over %.1f\n", avg_msec, max_msec);
+		failed = 1;
+	}
+	if (baseline_path){
+		double base_recall, base_msec;
+		if (json_number(baseline_path, "recall", &base_recall)
+			|| json_number(baseline_path, "avg_msec", &base_msec)){
+			fprintf(stderr, "FAIL: can't read the baseline %s\n", baseline_path);
+			failed = 1;
+		}
+		else {
+			//the reports carry 4 decimals of the recall
+			if (recall < base_recall - max_recall_drop - 0.0001){
+				fprintf(stderr, "FAIL: recall dropped from %.3f to %.3f\n",
+					base_recall, recall);
+				failed = 1;
+			}
+			if (avg_msec > base_msec * (1 + max_time_growth / 100)){
+				fprintf(stderr, "FAIL: time per slot went up from %.1f to %.1f msec\n",
+					base_msec, avg_msec);
+				failed = 1;
+			}
+		}
+	}
+	return failed;
+}
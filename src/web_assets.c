@@ -0,0 +1,359 @@
+/*
+	The web ui's files, served from memory
+
+	web_assets_init() reads every file under the web root into memory,
+	except cgi-bin/ and scripts/ which are run rather than served. Each
+	file is also compressed with gzip and brotli, and a form is kept only
+	if it is smaller than the plain one. Each file gets a strong ETag,
+	made from a hash of its content.
+
+	web_assets_serve() picks the smallest form that the browser's
+	Accept-Encoding allows, and answers If-None-Match with 304 Not
+	Modified. Cache-Control is no-cache, so a browser that connects again
+	revalidates each file for a few hundred bytes instead of fetching it
+	again. It still sees a changed file at once. Files not in memory are
+	left to mg_http_serve_dir().
+
+	web_assets_poll() reloads the files that inotify reports as changed,
+	from the webserver's loop. The serving is also done on that thread,
+	so nothing needs locking.
+*/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <zlib.h>
+#include <brotli/encode.h>
+#include "web_assets.h"
+
+#define MAX_ASSETS 512
+#define MAX_WATCHES 16
+#define MAX_ASSET_SIZE (8 * 1024 * 1024)
+
+#define FORM_PLAIN 0
+#define FORM_GZIP 1
+#define FORM_BROTLI 2
+#define FORMS 3
+
+struct web_asset {
+	char *uri;							// as requested, like /index.html
+	char *path;
+	const char *mime;
+	char *body[FORMS];			// NULL for a form that didn't save anything
+	size_t length[FORMS];
+	char etag[FORMS][32];
+};
+
+struct web_watch {
+	int wd;
+	char dir[1024];
+	char uri[256];					// of the directory, with the trailing /
+};
+
+static struct web_asset assets[MAX_ASSETS];
+static int n_assets = 0;
+static struct web_watch watches[MAX_WATCHES];
+static int n_watches = 0;
+static int inotify_fd = -1;
+static web_asset_transform asset_transform = NULL;
+
+static const char *form_encoding[FORMS] = {NULL, "gzip", "br"};
+static const char *form_suffix[FORMS] = {"", "-gz", "-br"};
+
+static const struct {
+	const char *ext, *mime;
+} mime_types[] = {
+	{".html", "text/html; charset=utf-8"},
+	{".js", "text/javascript; charset=utf-8"},
+	{".css", "text/css; charset=utf-8"},
+	{".json", "application/json"},
+	{".svg", "image/svg+xml"},
+	{".png", "image/png"},
+	{".jpg", "image/jpeg"},
+	{".jpeg", "image/jpeg"},
+	{".gif", "image/gif"},
+	{".ico", "image/x-icon"},
+	{".wasm", "application/wasm"},
+	{".txt", "text/plain; charset=utf-8"},
+	{".md", "text/plain; charset=utf-8"},
+	{NULL, NULL}
+};
+
+static const char *mime_type(const char *path){
+	const char *ext = strrchr(path, '.');
+
+	if (ext)
+		for (int i = 0; mime_types[i].ext; i++)
+			if (!strcasecmp(ext, mime_types[i].ext))
+				return mime_types[i].mime;
+	return "application/octet-stream";
+}
+
+static uint64_t content_hash(const char *s, size_t n){
+	uint64_t h = 14695981039346656037ULL;
+	for (size_t i = 0; i < n; i++)
+		h = (h ^ (unsigned char)s[i]) * 1099511628211ULL;
+	return h;
+}
+
+static char *gzip(const char *in, size_t n, size_t *out_length){
+	z_stream z;
+	memset(&z, 0, sizeof(z));
+	if (deflateInit2(&z, 9, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+		return NULL;
+
+	size_t max = deflateBound(&z, n);
+	char *out = malloc(max);
+	z.next_in = (Bytef *)in;
+	z.avail_in = n;
+	z.next_out = (Bytef *)out;
+	z.avail_out = max;
+	int e = deflate(&z, Z_FINISH);
+	*out_length = z.total_out;
+	deflateEnd(&z);
+	if (e != Z_STREAM_END){
+		free(out);
+		return NULL;
+	}
+	return out;
+}
+
+static char *brotli(const char *in, size_t n, size_t *out_length){
+	size_t max = BrotliEncoderMaxCompressedSize(n);
+	if (!max)
+		return NULL;
+	char *out = malloc(max);
+	*out_length = max;
+	if (!BrotliEncoderCompress(9, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_GENERIC,
+		n, (const uint8_t *)in, out_length, (uint8_t *)out)){
+		free(out);
+		return NULL;
+	}
+	return out;
+}
+
+static struct web_asset *asset_find(const char *uri){
+	for (int i = 0; i < n_assets; i++)
+		if (!strcmp(assets[i].uri, uri))
+			return assets + i;
+	return NULL;
+}
+
+static void asset_free(struct web_asset *a){
+	for (int f = 0; f < FORMS; f++){
+		free(a->body[f]);
+		a->body[f] = NULL;
+	}
+}
+
+// (re)loads a file, returns 0 if it isn't served from memory
+static int asset_load(const char *path, const char *uri){
+	struct stat st;
+
+	if (stat(path, &st) || !S_ISREG(st.st_mode) || st.st_size > MAX_ASSET_SIZE)
+		return 0;
+	FILE *pf = fopen(path, "rb");
+	if (!pf)
+		return 0;
+	char *content = malloc(st.st_size + 1);
+	size_t length = fread(content, 1, st.st_size, pf);
+	fclose(pf);
+	content[length] = 0;
+
+	if (asset_transform){
+		size_t new_length;
+		char *changed = asset_transform(path, content, length, &new_length);
+		if (changed){
+			free(content);
+			content = changed;
+			length = new_length;
+		}
+	}
+
+	struct web_asset *a = asset_find(uri);
+	if (a)
+		asset_free(a);
+	else if (n_assets < MAX_ASSETS){
+		a = assets + n_assets++;
+		a->uri = strdup(uri);
+		a->path = strdup(path);
+	}
+	else {
+		free(content);
+		return 0;
+	}
+
+	a->mime = mime_type(path);
+	a->body[FORM_PLAIN] = content;
+	a->length[FORM_PLAIN] = length;
+	a->body[FORM_GZIP] = gzip(content, length, &a->length[FORM_GZIP]);
+	a->body[FORM_BROTLI] = brotli(content, length, &a->length[FORM_BROTLI]);
+	uint64_t h = content_hash(content, length);
+	for (int f = 0; f < FORMS; f++){
+		if (f != FORM_PLAIN && a->body[f] && a->length[f] >= length){
+			free(a->body[f]);
+			a->body[f] = NULL;
+		}
+		snprintf(a->etag[f], sizeof(a->etag[f]), "\"%016llx%s\"",
+			(unsigned long long)h, form_suffix[f]);
+	}
+	return 1;
+}
+
+static void asset_remove(const char *uri){
+	struct web_asset *a = asset_find(uri);
+	if (!a)
+		return;
+	asset_free(a);
+	free(a->uri);
+	free(a->path);
+	*a = assets[--n_assets];
+}
+
+static void assets_load_dir(const char *dir, const char *uri){
+	char path[1024], file_uri[512];
+	DIR *d = opendir(dir);
+	if (!d)
+		return;
+
+	if (inotify_fd >= 0 && n_watches < MAX_WATCHES){
+		struct web_watch *w = watches + n_watches;
+		w->wd = inotify_add_watch(inotify_fd, dir,
+			IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE);
+		if (w->wd >= 0){
+			snprintf(w->dir, sizeof(w->dir), "%s", dir);
+			snprintf(w->uri, sizeof(w->uri), "%s", uri);
+			n_watches++;
+		}
+	}
+
+	struct dirent *e;
+	while ((e = readdir(d)) != NULL){
+		if (e->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+		snprintf(file_uri, sizeof(file_uri), "%s%s", uri, e->d_name);
+		struct stat st;
+		if (stat(path, &st))
+			continue;
+		if (S_ISDIR(st.st_mode)){
+			//these are run, not served
+			if (!strcmp(file_uri, "/cgi-bin") || !strcmp(file_uri, "/scripts"))
+				continue;
+			strcat(file_uri, "/");
+			assets_load_dir(path, file_uri);
+		}
+		else
+			asset_load(path, file_uri);
+	}
+	closedir(d);
+}
+
+void web_assets_init(const char *root, web_asset_transform transform){
+	size_t plain = 0, best = 0;
+
+	asset_transform = transform;
+	inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	assets_load_dir(root, "/");
+
+	for (int i = 0; i < n_assets; i++){
+		size_t smallest = assets[i].length[FORM_PLAIN];
+		for (int f = 1; f < FORMS; f++)
+			if (assets[i].body[f] && assets[i].length[f] < smallest)
+				smallest = assets[i].length[f];
+		plain += assets[i].length[FORM_PLAIN];
+		best += smallest;
+	}
+	printf("web: %d files, %zu KB, %zu KB compressed\n", n_assets,
+		plain / 1024, best / 1024);
+}
+
+// reloads what changed on the disk, from the webserver's loop
+void web_assets_poll(){
+	char buff[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	char path[1024], uri[512];
+
+	if (inotify_fd < 0)
+		return;
+	int n;
+	while ((n = read(inotify_fd, buff, sizeof(buff))) > 0){
+		for (char *p = buff; p < buff + n;){
+			struct inotify_event *e = (struct inotify_event *)p;
+			p += sizeof(struct inotify_event) + e->len;
+			if (!e->len || e->name[0] == '.')
+				continue;
+			for (int i = 0; i < n_watches; i++){
+				if (watches[i].wd != e->wd)
+					continue;
+				snprintf(path, sizeof(path), "%s/%s", watches[i].dir, e->name);
+				snprintf(uri, sizeof(uri), "%s%s", watches[i].uri, e->name);
+				if (e->mask & (IN_DELETE | IN_MOVED_FROM))
+					asset_remove(uri);
+				else if (asset_load(path, uri))
+					printf("web: reloaded %s\n", uri);
+			}
+		}
+	}
+}
+
+static int accepts(struct mg_str *header, const char *coding){
+	if (!header)
+		return 0;
+	size_t n = strlen(coding);
+	for (size_t i = 0; i + n <= header->len; i++)
+		if (!strncasecmp(header->buf + i, coding, n)
+			&& (i == 0 || header->buf[i - 1] == ' ' || header->buf[i - 1] == ',')
+			&& (i + n == header->len || header->buf[i + n] == ','
+				|| header->buf[i + n] == ';' || header->buf[i + n] == ' '))
+			return 1;
+	return 0;
+}
+
+// returns 0 if it isn't in memory, to be served from the disk
+int web_assets_serve(struct mg_connection *c, struct mg_http_message *hm){
+	char uri[512];
+
+	int n = mg_url_decode(hm->uri.buf, hm->uri.len, uri, sizeof(uri) - 16, 0);
+	if (n <= 0 || strstr(uri, ".."))
+		return 0;
+	if (uri[n - 1] == '/')
+		strcat(uri, "index.html");
+	struct web_asset *a = asset_find(uri);
+	if (!a)
+		return 0;
+
+	struct mg_str *accept = mg_http_get_header(hm, "Accept-Encoding");
+	int form = FORM_PLAIN;
+	if (a->body[FORM_BROTLI] && accepts(accept, "br"))
+		form = FORM_BROTLI;
+	else if (a->body[FORM_GZIP] && accepts(accept, "gzip"))
+		form = FORM_GZIP;
+
+	char encoding[64] = "";
+	if (form_encoding[form])
+		snprintf(encoding, sizeof(encoding), "Content-Encoding: %s\r\n",
+			form_encoding[form]);
+
+	struct mg_str *match = mg_http_get_header(hm, "If-None-Match");
+	if (match && (memmem(match->buf, match->len, a->etag[form], strlen(a->etag[form]))
+		|| (match->len == 1 && match->buf[0] == '*'))){
+		mg_printf(c, "HTTP/1.1 304 Not Modified\r\nETag: %s\r\n"
+			"Cache-Control: no-cache\r\nVary: Accept-Encoding\r\n"
+			"Content-Length: 0\r\n\r\n", a->etag[form]);
+		return 1;
+	}
+
+	mg_printf(c, "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nETag: %s\r\n"
+		"Cache-Control: no-cache\r\nVary: Accept-Encoding\r\n%s"
+		"Content-Length: %lu\r\n\r\n", a->mime, a->etag[form], encoding,
+		(unsigned long)a->length[form]);
+	if (mg_strcasecmp(hm->method, mg_str("HEAD")))
+		mg_send(c, a->body[form], a->length[form]);
+	return 1;
+}
@@ -0,0 +1,9 @@
+#include "mongoose.h"
+
+// rewrites a file's content as it is loaded, returns a malloc'ed copy or NULL
+typedef char *(*web_asset_transform)(const char *path, const char *content,
+	size_t length, size_t *new_length);
+
+void web_assets_init(const char *root, web_asset_transform transform);
+int web_assets_serve(struct mg_connection *c, struct mg_http_message *hm);
+void web_assets_poll();
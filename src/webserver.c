@@ -21,6 +21,9 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include "dynamic_content.h"
+#include "adpcm.h"
+#include "dsp_utils.h"
+#include "web_assets.h"
 
 // Function declaration for S-meter
 extern int calculate_s_meter(struct rx *r, double rx_gain);
@@ -73,9 +76,29 @@ typedef struct {
     int64_t last_active_time;    // Timestamp of last activity
     int active;                  // Whether this connection is active
     char ip_addr[50];           // IP address of the client
+    int logged_in;              // the updates are pushed to it
+    int spectrum_fps;           // spectrum frames pushed per second, 0 if it polls
+    int spectrum_span;          // in Hz, 0 follows the SPAN setting
+    int spectrum_stream;        // index in spectrum_streams
+    int spectrum_key;           // the next frame has to be a key frame
+    int64_t spectrum_bytes;     // pushed since the last \webstat
+    int spectrum_dropped;       // frames skipped, the connection was backed up
+    unsigned field_cursor;      // version of the field changes it has been sent
+    uint64_t audio_cursor;      // in the remote audio ring
+    int audio_lag;              // samples left unread, the most since the last \webstat
+    int audio_dropped;          // samples skipped over, it fell too far behind
+    int audio_codec;            // AUDIO_PCM, AUDIO_ADPCM or AUDIO_ADPCM8
+    struct adpcm_state audio_state;
+    float audio_hist[16];       // of the decimation to 8000 sps
+    int audio_n;
+    int64_t audio_bytes;        // sent since the last \webstat
+    int64_t audio_pcm_bytes;    // that it would have been as pcm
+    int64_t audio_cpu_ns;       // spent coding it
+    int64_t audio_until;        // the audio is pushed until then, each "audio" moves it on
 } ws_connection_t;
 
 static ws_connection_t ws_connections[MAX_WS_CONNECTIONS] = {0};
+static ws_connection_t *ws_find(struct mg_connection *c);
 static int64_t last_ping_time = 0;  // Time of last ping check
 static struct mg_mgr mgr;  // Event manager
 
@@ -129,6 +152,15 @@ static char *read_file_content(const char *path, size_t *size) {
   return data;
 }
 
+// Puts the version into index.html as it is loaded into memory
+static char *web_asset_version(const char *path, const char *content,
+	size_t length, size_t *new_length){
+	const char *name = strrchr(path, '/');
+	if (!name || strcmp(name, "/index.html"))
+		return NULL;
+	return process_dynamic_content(content, length, new_length);
+}
+
 static void web_respond(struct mg_connection *c, char *message){
 	// Check if connection is still valid before sending
 	if (c && !c->is_closing) {
@@ -146,12 +178,9 @@ static void get_console(struct mg_connection *c){
 	mg_ws_send(c, buff, strlen(buff), WEBSOCKET_OP_TEXT);
 }
 
-static void get_updates(struct mg_connection *c, int all){
-	//send the settings of all the fields to the client
-	char buff[2000];
-	int i = 0;
-
-	get_console(c);
+// the meters, they are sent with every spectrum
+static void send_meters(struct mg_connection *c){
+	char buff[100];
 
 	// Send S-meter value 
 	struct rx *current_rx = rx_list;
@@ -177,17 +206,23 @@ static void get_updates(struct mg_connection *c, int all){
 		sprintf(buff, "CURRENT %.2f", current);
 		mg_ws_send(c, buff, strlen(buff), WEBSOCKET_OP_TEXT);
 	}
+}
 
-	while(1){
-		int update = remote_update_field(i, buff);
-		// return of -1 indicates the eof fields
-		if (update == -1)
-			return;
-	//send the status anyway
-		if (all || update )
-			mg_ws_send(c, buff, strlen(buff), WEBSOCKET_OP_TEXT); 
-		i++;
-	}
+static void get_updates(struct mg_connection *c, int all){
+	//send the fields that changed since the client's last update
+	static char fields[65536];
+	ws_connection_t *w = ws_find(c);
+	unsigned cursor = REMOTE_FIELDS_NEW;
+
+	get_console(c);
+	send_meters(c);
+
+	if (w && !all)
+		cursor = w->field_cursor;
+	int len = remote_field_updates(&cursor, fields, sizeof(fields));
+	mg_ws_send(c, fields, len, WEBSOCKET_OP_TEXT);
+	if (w)
+		w->field_cursor = cursor;
 }
 
 static void do_login(struct mg_connection *c, char *key){
@@ -211,26 +246,461 @@ static void do_login(struct mg_connection *c, char *key){
 	sprintf(response, "login %s", session_cookie);
 	web_respond(c, response);	
 	get_updates(c, 1);
+	ws_connection_t *w = ws_find(c);
+	if (w)
+		w->logged_in = 1;
 }
 
 static int16_t remote_samples[10000]; //the max samples are set by the queue lenght in modems.c
 
+static ws_connection_t *ws_find(struct mg_connection *c){
+	for (int i = 0; i < MAX_WS_CONNECTIONS; i++)
+		if (ws_connections[i].active && ws_connections[i].conn == c)
+			return ws_connections + i;
+	return NULL;
+}
+
+/*
+	The pushed spectrum
+
+	A client sends "spectrum_push=fps,span" (fps of 0 stops it) and the
+	spectrum is then pushed to it as binary websocket frames instead of
+	being polled as text. The clients asking for the same fps and span
+	share a stream: the bins are read and coded once per frame of the
+	stream, not once per client. Each frame is coded against the previous
+	one of the stream:
+		byte 0,1	'S','P'
+		byte 2		SPECTRUM_RX or SPECTRUM_TX, | SPECTRUM_KEY for a key frame
+		byte 3		0
+		byte 4,5	bins, little endian
+		then the runs, until all the bins are done:
+		0x00-0x7f	n + 1 bins unchanged
+		0x80-0xff	n - 0x7f bins follow, each as a byte to add (mod 256)
+							to the bin's previous value
+	A key frame is coded against all zeros. A client that joins a stream or
+	whose connection backs up is sent a key frame next. The levels are
+	0 to 95, as the text spectrum's characters less 32.
+*/
+
+#define SPECTRUM_RX 0
+#define SPECTRUM_TX 1
+#define SPECTRUM_KEY 0x80
+#define SPECTRUM_HEADER 6
+#define SPECTRUM_BACKLOG 65536	// bytes queued on a connection before frames are skipped
+
+struct spectrum_stream {
+	int fps, span;
+	int users;
+	int tx;
+	int n_bins;
+	int64_t due;
+	uint8_t bins[MAX_BINS];
+};
+
+static struct spectrum_stream spectrum_streams[MAX_WS_CONNECTIONS];
+static int spectrum_pushing = 0;	// clients being pushed to
+static int64_t spectrum_report_at = 0;
+
+// codes the bins against prev into out, returns the length
+static int spectrum_code(uint8_t *out, const uint8_t *bins, const uint8_t *prev,
+	int n, int kind){
+	int j = SPECTRUM_HEADER;
+
+	out[0] = 'S';
+	out[1] = 'P';
+	out[2] = kind;
+	out[3] = 0;
+	out[4] = n & 0xff;
+	out[5] = n >> 8;
+	for (int i = 0; i < n;){
+		int run = 0;
+		if (bins[i] == prev[i]){
+			while (i + run < n && run < 128 && bins[i + run] == prev[i + run])
+				run++;
+			out[j++] = run - 1;
+		}
+		else {
+			//a single unchanged bin costs more as a run than as a zero
+			while (i + run < n && run < 128 && (bins[i + run] != prev[i + run]
+				|| (i + run + 1 < n && bins[i + run + 1] != prev[i + run + 1])))
+				run++;
+			out[j++] = 0x7f + run;
+			for (int k = i; k < i + run; k++)
+				out[j++] = bins[k] - prev[k];
+		}
+		i += run;
+	}
+	return j;
+}
+
+static void spectrum_subscribe(struct mg_connection *c, char *args){
+	ws_connection_t *w = ws_find(c);
+	int fps = 0, span = 0;
+
+	if (!w)
+		return;
+	if (args)
+		sscanf(args, "%d,%d", &fps, &span);
+	if (fps < 0)
+		fps = 0;
+	if (fps > 50)
+		fps = 50;
+	w->spectrum_fps = fps;
+	w->spectrum_span = span < 0 ? 0 : span;
+	w->spectrum_stream = -1;
+}
+
+static int spectrum_stream_of(ws_connection_t *w){
+	int free_slot = -1;
+
+	for (int i = 0; i < MAX_WS_CONNECTIONS; i++){
+		struct spectrum_stream *s = spectrum_streams + i;
+		if (s->users && s->fps == w->spectrum_fps && s->span == w->spectrum_span)
+			return i;
+		if (!s->users && free_slot < 0)
+			free_slot = i;
+	}
+	struct spectrum_stream *s = spectrum_streams + free_slot;
+	s->fps = w->spectrum_fps;
+	s->span = w->spectrum_span;
+	s->n_bins = 0;
+	s->due = 0;
+	return free_slot;
+}
+
+// called by the webserver's loop, pushes the frames that are due
+static void spectrum_push(){
+	static uint8_t delta[SPECTRUM_HEADER + MAX_BINS * 2], key[SPECTRUM_HEADER + MAX_BINS * 2];
+	static const uint8_t zeros[MAX_BINS];
+	uint8_t bins[MAX_BINS];
+	int64_t now = mg_millis();
+
+	//gather the clients into the streams
+	for (int i = 0; i < MAX_WS_CONNECTIONS; i++)
+		spectrum_streams[i].users = 0;
+	spectrum_pushing = 0;
+	for (int i = 0; i < MAX_WS_CONNECTIONS; i++){
+		ws_connection_t *w = ws_connections + i;
+		if (!w->active || !w->conn || !w->spectrum_fps)
+			continue;
+		int stream = spectrum_stream_of(w);
+		if (stream != w->spectrum_stream){
+			w->spectrum_stream = stream;
+			w->spectrum_key = 1;
+		}
+		spectrum_streams[stream].users++;
+		spectrum_pushing++;
+	}
+
+	for (int s = 0; s < MAX_WS_CONNECTIONS; s++){
+		struct spectrum_stream *stream = spectrum_streams + s;
+		if (!stream->users || now < stream->due)
+			continue;
+		stream->due += 1000 / stream->fps;
+		if (stream->due < now)
+			stream->due = now + 1000 / stream->fps;
+
+		int tx;
+		int n = web_spectrum_bins(bins, stream->span, &tx);
+		int kind = tx ? SPECTRUM_TX : SPECTRUM_RX;
+		int delta_len = 0, key_len = 0;
+		//the deltas only make sense against a frame of the same shape
+		if (n == stream->n_bins && tx == stream->tx)
+			delta_len = spectrum_code(delta, bins, stream->bins, n, kind);
+
+		for (int i = 0; i < MAX_WS_CONNECTIONS; i++){
+			ws_connection_t *w = ws_connections + i;
+			if (!w->active || !w->conn || !w->spectrum_fps || w->spectrum_stream != s)
+				continue;
+			if (w->conn->is_closing || w->conn->send.len > SPECTRUM_BACKLOG){
+				w->spectrum_dropped++;
+				w->spectrum_key = 1;
+				continue;
+			}
+			if (w->spectrum_key || !delta_len){
+				if (!key_len)
+					key_len = spectrum_code(key, bins, zeros, n, kind | SPECTRUM_KEY);
+				mg_ws_send(w->conn, key, key_len, WEBSOCKET_OP_BINARY);
+				w->spectrum_bytes += key_len;
+				w->spectrum_key = 0;
+			}
+			else {
+				mg_ws_send(w->conn, delta, delta_len, WEBSOCKET_OP_BINARY);
+				w->spectrum_bytes += delta_len;
+			}
+			send_meters(w->conn);
+		}
+		memcpy(stream->bins, bins, n);
+		stream->n_bins = n;
+		stream->tx = tx;
+	}
+}
+
+// the pushed spectrum's bytes/s per client, since the last report
+void web_spectrum_status(){
+	char buff[200];
+	int64_t now = mg_millis();
+	double secs = (now - spectrum_report_at) / 1000.0;
+	int streams = 0;
+
+	for (int i = 0; i < MAX_WS_CONNECTIONS; i++)
+		if (spectrum_streams[i].users)
+			streams++;
+	for (int i = 0; i < MAX_WS_CONNECTIONS; i++){
+		ws_connection_t *w = ws_connections + i;
+		if (!w->active || !w->spectrum_fps)
+			continue;
+		sprintf(buff, "\n%s %d fps, span %d: %.1f kB/s, %d frames skipped",
+			w->ip_addr, w->spectrum_fps, w->spectrum_span,
+			secs > 0 ? w->spectrum_bytes / secs / 1000 : 0, w->spectrum_dropped);
+		write_console(FONT_LOG, buff);
+		w->spectrum_bytes = 0;
+		w->spectrum_dropped = 0;
+	}
+	sprintf(buff, "\nspectrum: %d clients pushed to in %d streams\n",
+		spectrum_pushing, streams);
+	write_console(FONT_LOG, buff);
+	spectrum_report_at = now;
+}
+
 static void get_spectrum(struct mg_connection *c){
 	char buff[3000];
-	web_get_spectrum(buff);
-	mg_ws_send(c, buff, strlen(buff), WEBSOCKET_OP_TEXT);
+	ws_connection_t *w = ws_find(c);
+
+	if (!w || !w->spectrum_fps){
+		web_get_spectrum(buff);
+		mg_ws_send(c, buff, strlen(buff), WEBSOCKET_OP_TEXT);
+	}
 	get_updates(c, 0);
 }
 
+/*
+	The audio is 16000 sps. A client sends "audio_codec=pcm", "adpcm"
+	(64 kbps) or "adpcm8" (32 kbps, decimated to 8000 sps) to pick how it
+	is sent; the default is raw 16 bit pcm as before. The coding is done
+	here on the webserver's thread, not the DSP's. The browser's
+	microphone may likewise be sent as ADPCM frames, see adpcm.h.
+*/
+
+#define AUDIO_PCM 0
+#define AUDIO_ADPCM 1
+#define AUDIO_ADPCM8 2
+#define AUDIO_TAPS 15
+#define AUDIO_PUSH_MS 1000	// the audio is pushed for this long after an "audio"
+
+static float audio_taps[AUDIO_TAPS];	// a low pass at 3.5 kHz for the 8000 sps
+
+static void audio_codec(struct mg_connection *c, char *args){
+	ws_connection_t *w = ws_find(c);
+
+	if (!w || !args)
+		return;
+	if (!strcmp(args, "adpcm"))
+		w->audio_codec = AUDIO_ADPCM;
+	else if (!strcmp(args, "adpcm8"))
+		w->audio_codec = AUDIO_ADPCM8;
+	else
+		w->audio_codec = AUDIO_PCM;
+	memset(&w->audio_state, 0, sizeof(w->audio_state));
+}
+
+static void send_audio(ws_connection_t *w, int16_t *samples, int count){
+	static uint8_t frame[ADPCM_BYTES(10000)];
+	int rate = 16000, n = 0;
+	long long start = thread_ns();
+	if (w->audio_codec == AUDIO_ADPCM8){
+		//the history is a ring, indexed by the 16000 sps sample count
+		for (int i = 0; i < count; i++){
+			w->audio_hist[w->audio_n & 15] = samples[i];
+			if (w->audio_n++ & 1)
+				continue;
+			float sum = 0;
+			for (int k = 0; k < AUDIO_TAPS; k++)
+				sum += w->audio_hist[(w->audio_n - 1 - k) & 15] * audio_taps[k];
+			samples[n++] = sum > 32767 ? 32767 : (sum < -32768 ? -32768 : sum);
+		}
+		rate = 8000;
+	}
+	else
+		n = count;
+	int length = adpcm_encode(&w->audio_state, rate, samples, n, frame);
+	long long cpu_ns = thread_ns() - start;
+
+	mg_ws_send(w->conn, frame, length, WEBSOCKET_OP_BINARY);
+	w->audio_bytes += length;
+	w->audio_pcm_bytes += count * sizeof(int16_t);
+	w->audio_cpu_ns += cpu_ns;
+}
+
+// sends the audio that is new since the client's cursor
+static void audio_push_to(ws_connection_t *w){
+	int lag;
+	int count = remote_audio_read(&w->audio_cursor, remote_samples, 10000, &lag,
+		&w->audio_dropped);
+	if (lag > w->audio_lag)
+		w->audio_lag = lag;
+	if (count <= 0)
+		return;
+	if (w->audio_codec != AUDIO_PCM)
+		send_audio(w, remote_samples, count);
+	else {
+		mg_ws_send(w->conn, remote_samples, count * sizeof(int16_t), WEBSOCKET_OP_BINARY);
+		w->audio_bytes += count * sizeof(int16_t);
+		w->audio_pcm_bytes += count * sizeof(int16_t);
+	}
+}
+
 static void get_audio(struct mg_connection *c){
 	char buff[3000];
-	web_get_spectrum(buff);
-	mg_ws_send(c, buff, strlen(buff), WEBSOCKET_OP_TEXT);
+	ws_connection_t *w = ws_find(c);
+
+	if (!w || !w->spectrum_fps){
+		web_get_spectrum(buff);
+		mg_ws_send(c, buff, strlen(buff), WEBSOCKET_OP_TEXT);
+	}
 	get_updates(c, 0);
 
-	int count = remote_audio_output(remote_samples);		
-	if (count > 0)
-		mg_ws_send(c, remote_samples, count * sizeof(int16_t), WEBSOCKET_OP_BINARY);
+	if (!w)
+		return;
+	w->audio_until = mg_millis() + AUDIO_PUSH_MS;
+	audio_push_to(w);
+}
+
+// the browser's microphone, as raw pcm or as ADPCM frames
+static void web_mic_input(const uint8_t *data, int length){
+	static int16_t samples[8192];
+
+	int count = adpcm_decode(data, length, samples, 8192, NULL);
+	if (count >= 0)
+		browser_mic_input(samples, count);
+	else
+		browser_mic_input((int16_t *)data, length / sizeof(int16_t));
+}
+
+// the audio's bytes/s per client and what the coding costs
+void web_audio_status(){
+	static int64_t report_at = 0;
+	static const char *codecs[] = {"pcm", "adpcm", "adpcm8"};
+	char buff[200];
+	int64_t now = mg_millis();
+	double secs = (now - report_at) / 1000.0;
+
+	for (int i = 0; i < MAX_WS_CONNECTIONS; i++){
+		ws_connection_t *w = ws_connections + i;
+		if (!w->active || !w->audio_pcm_bytes)
+			continue;
+		sprintf(buff, "\n%s audio %s: %.1f kB/s, %.0f%% saved, %.2f%% cpu, "
+			"%d msec behind, %d msec skipped",
+			w->ip_addr, codecs[w->audio_codec],
+			secs > 0 ? w->audio_bytes / secs / 1000 : 0,
+			100.0 - 100.0 * w->audio_bytes / w->audio_pcm_bytes,
+			secs > 0 ? w->audio_cpu_ns / secs / 1e7 : 0,
+			w->audio_lag / 16, w->audio_dropped / 16);
+		write_console(FONT_LOG, buff);
+		w->audio_bytes = w->audio_pcm_bytes = w->audio_cpu_ns = 0;
+		w->audio_lag = w->audio_dropped = 0;
+	}
+	report_at = now;
+}
+
+/*
+	The webserver's loop sleeps in mg_mgr_poll() until there is something
+	to do. The DSP and the ui call web_wake() as they make audio, console
+	text or field changes; it writes to mongoose's wakeup socket and the
+	loop then pushes what is new to the clients that are logged in. Only
+	the first web_wake() after a pass of the loop writes to the socket,
+	the rest find the wakeup already pending. Otherwise the loop only
+	wakes when a spectrum frame or the pings are due, or after WEB_IDLE_MS.
+*/
+
+#define WEB_IDLE_MS 1000
+
+static unsigned long wake_conn_id = 0;	// the listener, the wakeups are sent to it
+static int wake_pending = 0;
+static int64_t wake_asked_ns = 0;		// when the pending wakeup was asked for
+static int64_t wake_asked_last = 0;		// the one measured last, it may not be a new one yet
+static int audio_listeners = 0;		// clients the audio is pushed to
+static int64_t wake_passes = 0, wake_count = 0, wake_measured = 0;
+static int64_t wake_latency_ns = 0, wake_latency_max = 0;
+
+static int64_t web_now_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// can be called from any thread, after what is new has been put out
+void web_wake(){
+	unsigned long id = __atomic_load_n(&wake_conn_id, __ATOMIC_ACQUIRE);
+
+	if (!id || __atomic_exchange_n(&wake_pending, 1, __ATOMIC_ACQ_REL))
+		return;
+	__atomic_store_n(&wake_asked_ns, web_now_ns(), __ATOMIC_RELAXED);
+	mg_wakeup(&mgr, id, "", 0);
+}
+
+// the DSP wakes the webserver for the audio only if someone listens
+int web_audio_listeners(){
+	return __atomic_load_n(&audio_listeners, __ATOMIC_RELAXED);
+}
+
+// pushes the console, the field changes and the audio to the clients
+static void web_push(){
+	static char fields[65536];
+	char console[2100];
+	int64_t now = mg_millis();
+	int listeners = 0;
+
+	int console_len = web_get_console(console, 2000);
+	unsigned version = remote_field_version();
+
+	for (int i = 0; i < MAX_WS_CONNECTIONS; i++){
+		ws_connection_t *w = ws_connections + i;
+		if (!w->active || !w->conn || w->conn->is_closing || !w->logged_in)
+			continue;
+		if (console_len)
+			mg_ws_send(w->conn, console, strlen(console), WEBSOCKET_OP_TEXT);
+		if (w->field_cursor != version){
+			int len = remote_field_updates(&w->field_cursor, fields, sizeof(fields));
+			mg_ws_send(w->conn, fields, len, WEBSOCKET_OP_TEXT);
+		}
+		if (now < w->audio_until){
+			audio_push_to(w);
+			listeners++;
+		}
+	}
+	__atomic_store_n(&audio_listeners, listeners, __ATOMIC_RELAXED);
+}
+
+// how long the loop can sleep for, till the next spectrum frame or ping
+static int web_poll_ms(){
+	int64_t now = mg_millis();
+	int64_t due = now + WEB_IDLE_MS;
+
+	for (int i = 0; i < MAX_WS_CONNECTIONS; i++)
+		if (spectrum_streams[i].users && spectrum_streams[i].due < due)
+			due = spectrum_streams[i].due;
+	if (last_ping_time + 2001 < due)
+		due = last_ping_time + 2001;
+	return due > now ? due - now : 0;
+}
+
+// the loop's passes and the wakeups' latency, since the last report
+void web_wake_status(){
+	static int64_t report_at = 0;
+	char buff[200];
+	int64_t now = mg_millis();
+	double secs = (now - report_at) / 1000.0;
+
+	sprintf(buff, "\nwebserver: %.1f passes/s, %.1f wakeups/s, "
+		"push latency %.3f msec average, %.3f msec worst\n",
+		secs > 0 ? wake_passes / secs : 0, secs > 0 ? wake_count / secs : 0,
+		wake_measured ? wake_latency_ns / wake_measured / 1e6 : 0,
+		wake_latency_max / 1e6);
+	write_console(FONT_LOG, buff);
+	wake_passes = wake_count = wake_measured = 0;
+	wake_latency_ns = wake_latency_max = 0;
+	report_at = now;
 }
 
 static void get_logs(struct mg_connection *c, char *args){
@@ -432,6 +902,37 @@ static void execute_shell_script(struct mg_connection *c, const char *script_nam
   }
 }
 
+// queues the command for the ui, the reply comes back through web_command_reply()
+static void web_command(struct mg_connection *c, unsigned id, char *field, char *value){
+	struct remote_command rc;
+	char buff[100];
+
+	rc.source = REMOTE_WEB;
+	rc.client = c->id;
+	rc.id = id;
+	if (!strncmp(field, "key ", 4)){
+		rc.type = REMOTE_CMD_KEY;
+		snprintf(rc.args, sizeof(rc.args), "%s", field + 4);
+	}
+	else {
+		rc.type = REMOTE_CMD_EXEC;
+		if (value)
+			snprintf(rc.args, sizeof(rc.args), "%s %s", field, value);
+		else
+			snprintf(rc.args, sizeof(rc.args), "%s", field);
+	}
+	//the fields it changes are pushed on the wake of field_changed()
+	if (remote_command(&rc) && id){
+		sprintf(buff, "NAK %u", id);
+		web_respond(c, buff);
+	}
+}
+
+// called from the ui's thread, the reply is sent by the webserver's
+void web_command_reply(unsigned long client, char *reply){
+	mg_wakeup(&mgr, client, reply, strlen(reply));
+}
+
 static void web_despatcher(struct mg_connection *c, struct mg_ws_message *wm){
 	// Check if this is a VNC proxy WebSocket
     for (int i = 0; i < MAX_VNC_PROXIES; i++) {
@@ -450,11 +951,8 @@ static void web_despatcher(struct mg_connection *c, struct mg_ws_message *wm){
 		// Process browser microphone data
 		// Always accept browser mic data - the browser will only send when in TX mode
 		// and the browser_mic_input function will handle the data appropriately
-		int16_t *audio_samples = (int16_t *)wm->data.buf;
-		int sample_count = wm->data.len / sizeof(int16_t);
-		
 		// Pass the browser microphone data to the audio processing chain
-		browser_mic_input(audio_samples, sample_count);
+		web_mic_input((uint8_t *)wm->data.buf, wm->data.len);
 		return;
 	}
 
@@ -473,6 +971,14 @@ static void web_despatcher(struct mg_connection *c, struct mg_ws_message *wm){
 	field = strtok(NULL, "=");
 	value = strtok(NULL, "\n");
 
+	// "cookie id" asks for the command to be answered with the id
+	unsigned id = 0;
+	char *id_str = cookie ? strchr(cookie, ' ') : NULL;
+	if (id_str){
+		*id_str++ = 0;
+		id = strtoul(id_str, NULL, 10);
+	}
+
 	if (field == NULL || cookie == NULL){
 		printf("Invalid request on websocket\n");
 		web_respond(c, "quit Invalid request on websocket");
@@ -488,12 +994,19 @@ static void web_despatcher(struct mg_connection *c, struct mg_ws_message *wm){
 		do_login(c, value);
 	}
 	else if (cookie == NULL || strcmp(cookie, session_cookie)){
+		ws_connection_t *w = ws_find(c);
+		if (w)
+			w->logged_in = 0;
 		web_respond(c, "quit expired");
 		printf("Cookie not found, closing socket %s vs %s\n", cookie, session_cookie);
 		c->is_draining = 1;
 	}
 	else if (!strcmp(field, "spectrum"))
 		get_spectrum(c);
+	else if (!strcmp(field, "spectrum_push"))
+		spectrum_subscribe(c, value);
+	else if (!strcmp(field, "audio_codec"))
+		audio_codec(c, value);
 	else if (!strcmp(field, "audio"))
 		get_audio(c);
 	else if (!strcmp(field, "logbook"))
@@ -502,21 +1015,10 @@ static void web_despatcher(struct mg_connection *c, struct mg_ws_message *wm){
 		get_macros_list(c);
 	else if (!strcmp(field, "refresh"))
 		get_updates(c, 1);
-	else if (!strcmp(field, "BFO")) {
-		char buff[1200];
-		sprintf(buff, "bfo %s", value);
-		remote_execute(buff);
-		get_updates(c, 0);
-	}
-	else{
-		char buff[1200];
-		if (value)
-			sprintf(buff, "%s %s", field, value);
-		else
-			strcpy(buff, field);
-		remote_execute(buff);
-		get_updates(c, 0);
-	}
+	else if (!strcmp(field, "BFO"))
+		web_command(c, id, "bfo", value);
+	else
+		web_command(c, id, field, value);
 }
 
 static void fn(struct mg_connection *c, int ev, void *ev_data) {
@@ -1024,6 +1526,8 @@ static void fn(struct mg_connection *c, int ev, void *ev_data) {
       
       // Send the response
       mg_http_reply(c, 200, "Content-Type: application/json\r\n", "%s", output);
+      } else if (web_assets_serve(c, hm)) {
+        // Served from memory, compressed and with an ETag
       } else if (mg_match(hm->uri, mg_str("/index.html"), NULL) || 
                  mg_match(hm->uri, mg_str("/"), NULL)) {
         // This is a request for the main index.html file
@@ -1091,16 +1595,18 @@ static void fn(struct mg_connection *c, int ev, void *ev_data) {
       // If not a VNC proxy WebSocket, check if it's a browser microphone
       if (!is_vnc_ws) {
         // Process browser microphone data
-        int16_t *audio_samples = (int16_t *)wm->data.buf;
-        int sample_count = wm->data.len / sizeof(int16_t);
-        
         // Pass the browser microphone data to the audio processing chain
-        browser_mic_input(audio_samples, sample_count);
+        web_mic_input((uint8_t *)wm->data.buf, wm->data.len);
       }
     } else {
       // Regular message
       web_despatcher(c, wm);
     }
+  } else if (ev == MG_EV_WAKEUP) {
+    // a reply to a command, routed here by the connection's id
+    struct mg_str *data = (struct mg_str *) ev_data;
+    if (c->is_websocket && !c->is_closing && data->len > 0)
+      mg_ws_send(c, data->buf, data->len, WEBSOCKET_OP_TEXT);
   } else if (ev == MG_EV_WS_OPEN) {
     // WebSocket connection opened
     active_websocket_connections++;
@@ -1111,6 +1617,20 @@ static void fn(struct mg_connection *c, int ev, void *ev_data) {
         ws_connections[i].conn = c;
         ws_connections[i].last_active_time = mg_millis();
         ws_connections[i].active = 1;
+        ws_connections[i].spectrum_fps = 0;
+        ws_connections[i].spectrum_stream = -1;
+        ws_connections[i].spectrum_bytes = 0;
+        ws_connections[i].spectrum_dropped = 0;
+        ws_connections[i].field_cursor = REMOTE_FIELDS_NEW;
+        ws_connections[i].audio_codec = AUDIO_PCM;
+        ws_connections[i].audio_cursor = REMOTE_AUDIO_NEW;
+        ws_connections[i].audio_lag = 0;
+        ws_connections[i].audio_dropped = 0;
+        ws_connections[i].audio_bytes = 0;
+        ws_connections[i].audio_pcm_bytes = 0;
+        ws_connections[i].audio_cpu_ns = 0;
+        ws_connections[i].audio_until = 0;
+        ws_connections[i].logged_in = 0;
         
         // Store the client IP address
         char ip_str[50];
@@ -1242,11 +1762,15 @@ void *webserver_thread_function(void *server){
   // Set the user data pointer for the manager
   mgr.userdata = ws_data; 
 
+  // Load the web ui's files into memory
+  web_assets_init(s_web_root, web_asset_version);
+
   // Create HTTP listener - this will handle both HTTP and WebSocket connections
   if (webserver_debug_enabled) {
       printf("Starting HTTP listener on %s\n", s_http_addr);
   }
-  if (mg_http_listen(&mgr, s_http_addr, fn, &mgr) == NULL) {
+  struct mg_connection *listener = mg_http_listen(&mgr, s_http_addr, fn, &mgr);
+  if (listener == NULL) {
     fprintf(stderr, "Cannot listen on %s\n", s_http_addr);
     // Clean up resources
     free(g_cert_buf);
@@ -1281,14 +1805,39 @@ void *webserver_thread_function(void *server){
       printf("Webserver started.\n");
   }
 
+  // The producers wake the loop through the listener
+  if (mg_wakeup_init(&mgr))
+    __atomic_store_n(&wake_conn_id, listener->id, __ATOMIC_RELEASE);
+  else
+    fprintf(stderr, "No webserver wakeups, the updates wait for the clients to poll\n");
+
   // Event loop
   while(!quit_webserver){
-    mg_mgr_poll(&mgr, 100);  // Poll for 100ms
+    // sleep until woken, or till the next spectrum frame is due
+    mg_mgr_poll(&mgr, web_poll_ms());
+    wake_passes++;
+    if (__atomic_exchange_n(&wake_pending, 0, __ATOMIC_ACQ_REL)){
+      int64_t asked = __atomic_load_n(&wake_asked_ns, __ATOMIC_RELAXED);
+      web_push();
+      wake_count++;
+      if (asked > wake_asked_last){
+        int64_t latency = web_now_ns() - asked;
+        wake_latency_ns += latency;
+        wake_measured++;
+        if (latency > wake_latency_max)
+          wake_latency_max = latency;
+        wake_asked_last = asked;
+      }
+    }
+    spectrum_push();
+    web_assets_poll();
     
     // Check for stale connections
     check_websocket_connections();
   }
 
+  __atomic_store_n(&wake_conn_id, 0, __ATOMIC_RELEASE);
+
   // Cleanup (will be reached when quit_webserver is set)
   // First, close all active connections gracefully
   for (int i = 0; i < MAX_WS_CONNECTIONS; i++) {
@@ -1415,6 +1964,7 @@ void webserver_start(){
 	strcat(s_web_root, "/web");
 	//printf("Dir %s\n",s_web_root);
 	//logbook_open();
+	lowpass_design(audio_taps, AUDIO_TAPS, 3520, 16000, 0);
  	pthread_create( &webserver_thread, NULL, webserver_thread_function, 
 		(void*)NULL);
 }
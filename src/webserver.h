@@ -5,3 +5,9 @@ void web_update(char *message);
 int is_remote_browser_active();
 int is_localhost_connection_only();
 int get_active_connection_ips(char *buffer, int buffer_size);
+void web_spectrum_status();
+void web_audio_status();
+void web_wake();
+int web_audio_listeners();
+void web_wake_status();
+void web_command_reply(unsigned long client, char *reply);
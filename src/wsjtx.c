@@ -1,3 +1,30 @@
+/*
+	WSJT-X UDP messages
+
+	The sbitx talks to the programs that work with WSJT-X (GridTracker,
+	JTAlert, the loggers) as if it were WSJT-X. With the WSJTX_UDP setting
+	on, the messages are sent to WSJTX_ADDR (127.0.0.1:2237 by default,
+	a multicast group works too):
+	- Heartbeat every 15 seconds.
+	- Status when the frequency, the mode, the dx call or the tx
+		changes, and with each heartbeat.
+	- Decode for each message decoded by sbitx_ft8_decode().
+	- Clear when the band or the mode changes.
+	- QSO Logged when a contact is added to the logbook.
+
+	They are in the QDataStream format of WSJT-X's NetworkMessage.hpp,
+	schema 2. The programs reply to the address the messages come from:
+	- Reply (a double click on a decode) starts a qso as a click on the
+		console does.
+	- Halt Tx stops the transmission, or only the auto sequencing.
+
+	The decodes of a slot are collected by the decoder thread as it finds
+	them and go out together with a single sendmmsg() at the end of the
+	decode. The socket is non-blocking, the replies are read by
+	wsjtx_poll() on the ui thread.
+*/
+
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/types.h>
@@ -6,123 +33,416 @@
 #include <string.h>
 #include <arpa/inet.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <time.h>
 #include <complex.h>
+#include <fftw3.h>
+#include "sdr.h"
+#include "sdr_ui.h"
+#include "modem_ft8.h"
+#include "wsjtx.h"
+
+#define WSJTX_MAGIC 0xadbccbda
+#define WSJTX_SCHEMA 2
+#define WSJTX_ID "sbitx"
+
+#define MSG_HEARTBEAT 0
+#define MSG_STATUS 1
+#define MSG_DECODE 2
+#define MSG_CLEAR 3
+#define MSG_REPLY 4
+#define MSG_QSO_LOGGED 5
+#define MSG_HALT_TX 8
+
+#define MAX_BATCH 128
+#define MAX_MESSAGE 512
+
+#define FT8_START_QSO 1
 
 static int udp_socket = -1;
+static volatile int wsjtx_on = 0;
+static struct sockaddr_in wsjtx_addr;
+static char wsjtx_addr_str[64];
+static char wsjtx_failed_str[64];	// not tried again until WSJTX_ADDR changes
+
+// a message being packed
+struct wsjtx_msg {
+	int len;
+	uint8_t data[MAX_MESSAGE];
+};
+
+// the decodes of the slot, only touched by the decoder thread
+static struct wsjtx_msg batch[MAX_BATCH];
+static int batch_count = 0;
+
+/* ---- QDataStream packing, everything is big endian ---- */
+
+static void put_bytes(struct wsjtx_msg *m, const void *p, int len){
+	if (m->len + len > MAX_MESSAGE)
+		return;
+	memcpy(m->data + m->len, p, len);
+	m->len += len;
+}
+
+static void put_u8(struct wsjtx_msg *m, uint8_t v){
+	put_bytes(m, &v, 1);
+}
+
+static void put_u32(struct wsjtx_msg *m, uint32_t v){
+	v = htonl(v);
+	put_bytes(m, &v, 4);
+}
 
-void write_log(char *line);
+static void put_u64(struct wsjtx_msg *m, uint64_t v){
+	put_u32(m, v >> 32);
+	put_u32(m, v & 0xffffffff);
+}
 
-void wsjtx_send(char *response){
-    send(udp_socket, response, strlen(response), 0);
+static void put_double(struct wsjtx_msg *m, double d){
+	uint64_t v;
+	memcpy(&v, &d, 8);
+	put_u64(m, v);
 }
 
-void wsjtx_start(){
-  struct sockaddr_in serverAddr;
-  struct sockaddr_storage serverStorage;
-  socklen_t addr_size;
+// a QByteArray of utf-8, a null string is sent as an empty one
+static void put_utf8(struct wsjtx_msg *m, const char *s){
+	if (!s)
+		s = "";
+	int len = strlen(s);
+	put_u32(m, len);
+	put_bytes(m, s, len);
+}
+
+// QDateTime as the julian day, msecs since the midnight and UTC
+static void put_datetime(struct wsjtx_msg *m, time_t t){
+	put_u64(m, t / 86400 + 2440588);
+	put_u32(m, (t % 86400) * 1000);
+	put_u8(m, 1);
+}
 
-  udp_socket = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_UDP);
-  
-  serverAddr.sin_family = AF_INET;
-  serverAddr.sin_port = htons(2237);
-  serverAddr.sin_addr.s_addr = inet_addr("127.0.0.1");
-  memset(serverAddr.sin_zero, '\0', sizeof serverAddr.sin_zero);  
+static void put_header(struct wsjtx_msg *m, int type){
+	m->len = 0;
+	put_u32(m, WSJTX_MAGIC);
+	put_u32(m, WSJTX_SCHEMA);
+	put_u32(m, type);
+	put_utf8(m, WSJTX_ID);
+}
 
-  /*---- Bind the address struct to the socket ----*/
-  int e = bind(udp_socket, (struct sockaddr *) &serverAddr, sizeof(serverAddr));
+static void wsjtx_send(struct wsjtx_msg *m){
+	if (!wsjtx_on)
+		return;
+	sendto(udp_socket, m->data, m->len, MSG_DONTWAIT,
+		(struct sockaddr *)&wsjtx_addr, sizeof(wsjtx_addr));
 }
 
-void wsjtx_slice(){
-  struct sockaddr_in addr;
-  int e, len;
-  char buffer[1024];
+/* ---- QDataStream unpacking of the replies ---- */
+
+struct wsjtx_in {
+	const uint8_t *p, *end;
+	int bad;
+};
+
+static uint32_t get_u32(struct wsjtx_in *in){
+	uint32_t v;
+	if (in->end - in->p < 4){
+		in->bad = 1;
+		return 0;
+	}
+	memcpy(&v, in->p, 4);
+	in->p += 4;
+	return ntohl(v);
+}
 
-	len = sizeof(buffer);
-  e = recvfrom(udp_socket, buffer, sizeof(buffer), 0, (struct sockaddr *)&addr, &len);
-	if (e < 0)
+static uint8_t get_u8(struct wsjtx_in *in){
+	if (in->p >= in->end){
+		in->bad = 1;
+		return 0;
+	}
+	return *in->p++;
+}
+
+static double get_double(struct wsjtx_in *in){
+	uint64_t v = (uint64_t)get_u32(in) << 32;
+	v |= get_u32(in);
+	double d;
+	memcpy(&d, &v, 8);
+	return d;
+}
+
+static void get_utf8(struct wsjtx_in *in, char *s, int max){
+	uint32_t len = get_u32(in);
+	s[0] = 0;
+	if (len == 0xffffffff)
+		return;
+	if (len > in->end - in->p){
+		in->bad = 1;
 		return;
+	}
+	int n = len < max - 1 ? len : max - 1;
+	memcpy(s, in->p, n);
+	s[n] = 0;
+	in->p += len;
+}
 
-	int32_t *px;
-	px = (int32_t *) buffer;
-
-	int32_t magic, schema, id, l, i;
-	int32_t hours, minutes, seconds, snr, delta_freq;
-	char utf[1000], message[2000], mode[1000], unique[1000], log[1000];
-
-	magic = ntohl(*px++);
-	schema = ntohl(*px++);
-	id = ntohl(*px++);
-	
-	//printf("\nMsg: %d\n", id);
-	switch(id){
-		case 0:
-			//printf("Hearbeat!\n");
-			break;
-		case 1:
-			//printf("Status\n");
+/* ---- The decodes, from the decoder thread ---- */
+
+// queues the decode to go out with the rest of the slot
+void wsjtx_decode(time_t slot, int snr, float dt, float freq_hz,
+	bool is_ft8, const char *text){
+	if (!wsjtx_on)
+		return;
+	if (batch_count == MAX_BATCH)
+		wsjtx_flush();
+
+	struct wsjtx_msg *m = batch + batch_count++;
+	put_header(m, MSG_DECODE);
+	put_u8(m, 1);											// new
+	put_u32(m, (slot % 86400) * 1000);	// time
+	put_u32(m, snr);
+	put_double(m, dt);
+	put_u32(m, (uint32_t)(freq_hz + 0.5));
+	put_utf8(m, is_ft8 ? "~" : "+");
+	put_utf8(m, text);
+	put_u8(m, 0);											// low confidence
+	put_u8(m, 0);											// off air
+}
+
+// sends the decodes of the slot in one go
+void wsjtx_flush(){
+	struct mmsghdr msgs[MAX_BATCH];
+	struct iovec iov[MAX_BATCH];
+
+	if (!batch_count)
+		return;
+
+	memset(msgs, 0, sizeof(msgs));
+	for (int i = 0; i < batch_count; i++){
+		iov[i].iov_base = batch[i].data;
+		iov[i].iov_len = batch[i].len;
+		msgs[i].msg_hdr.msg_iov = iov + i;
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = &wsjtx_addr;
+		msgs[i].msg_hdr.msg_namelen = sizeof(wsjtx_addr);
+	}
+	if (wsjtx_on)
+		sendmmsg(udp_socket, msgs, batch_count, MSG_DONTWAIT);
+	batch_count = 0;
+}
+
+/* ---- From the ui thread ---- */
+
+void wsjtx_logged(time_t t, long freq, const char *mode, const char *call,
+	const char *rst_sent, const char *rst_recv, const char *exch_sent,
+	const char *exch_recv, const char *comments){
+	struct wsjtx_msg m;
+
+	put_header(&m, MSG_QSO_LOGGED);
+	put_datetime(&m, t);							// time off
+	put_utf8(&m, call);
+	put_utf8(&m, "");									// dx grid
+	put_u64(&m, freq);
+	put_utf8(&m, mode);
+	put_utf8(&m, rst_sent);
+	put_utf8(&m, rst_recv);
+	put_utf8(&m, "");									// tx power
+	put_utf8(&m, comments);
+	put_utf8(&m, "");									// name
+	put_datetime(&m, t);							// time on
+	put_utf8(&m, field_str("MYCALLSIGN"));	// operator
+	put_utf8(&m, field_str("MYCALLSIGN"));
+	put_utf8(&m, field_str("MYGRID"));
+	put_utf8(&m, exch_sent);
+	put_utf8(&m, exch_recv);
+	put_utf8(&m, "");									// propagation mode
+	wsjtx_send(&m);
+}
+
+static void wsjtx_heartbeat(){
+	struct wsjtx_msg m;
+
+	put_header(&m, MSG_HEARTBEAT);
+	put_u32(&m, 3);										// the highest schema we know
+	put_utf8(&m, VER_STR);
+	put_utf8(&m, "");
+	wsjtx_send(&m);
+}
+
+// the status, only sent if it has changed unless forced
+static void wsjtx_status(int force){
+	static uint8_t last[MAX_MESSAGE];
+	static int last_len = 0;
+	static long last_freq = -1;
+	static char last_mode[10];
+	struct wsjtx_msg m;
+
+	long freq = field_int("FREQ");
+	const char *mode = field_str("MODE");
+	int transmitting = is_in_tx();
+
+	//the old decodes don't belong to a new band or mode
+	if (labs(freq - last_freq) > 10000 || strcmp(mode, last_mode)){
+		if (last_freq != -1){
+			put_header(&m, MSG_CLEAR);
+			wsjtx_send(&m);
+		}
+		last_freq = freq;
+		strncpy(last_mode, mode, sizeof(last_mode) - 1);
+	}
+
+	put_header(&m, MSG_STATUS);
+	put_u64(&m, freq);
+	put_utf8(&m, mode);
+	put_utf8(&m, field_str("CALL"));
+	put_utf8(&m, field_str("SENT"));
+	put_utf8(&m, mode);								// tx mode
+	put_u8(&m, transmitting || !strcmp(field_str("FT8_AUTO"), "ON"));
+	put_u8(&m, transmitting);
+	put_u8(&m, 0);										// decoding
+	put_u32(&m, field_int("PITCH"));
+	put_u32(&m, field_int("TX_PITCH"));
+	put_utf8(&m, field_str("MYCALLSIGN"));
+	put_utf8(&m, field_str("MYGRID"));
+	put_utf8(&m, "");									// dx grid
+	put_u8(&m, 0);										// tx watchdog
+	put_utf8(&m, "");									// sub-mode
+	put_u8(&m, 0);										// fast mode
+	put_u8(&m, 0);										// special operation mode
+	put_u32(&m, 0xffffffff);					// frequency tolerance
+	put_u32(&m, !strcmp(mode, "FT4") ? 7 : 15);	// T/R period
+	put_utf8(&m, "sbitx");						// configuration name
+	put_utf8(&m, "");									// tx message
+
+	if (!force && m.len == last_len && !memcmp(m.data, last, m.len))
+		return;
+	memcpy(last, m.data, m.len);
+	last_len = m.len;
+	wsjtx_send(&m);
+}
+
+static void wsjtx_reply(struct wsjtx_in *in){
+	char mode[10], message[100], line[200];
+
+	uint32_t msecs = get_u32(in);
+	int snr = (int32_t)get_u32(in);
+	get_double(in);									// delta time
+	uint32_t freq = get_u32(in);
+	get_utf8(in, mode, sizeof(mode));
+	get_utf8(in, message, sizeof(message));
+	if (in->bad)
+		return;
+
+	//as the line of a decode on the console
+	int secs = msecs / 1000;
+	sprintf(line, "%02d%02d%02d %3d %+03d %-4d ~  %s", secs / 3600, (secs / 60) % 60,
+		secs % 60, 0, snr, freq, message);
+	ft8_process(line, FT8_START_QSO);
+}
+
+static void wsjtx_read(){
+	uint8_t buff[1024];
+	char id[64];
+
+	while (1){
+		int e = recv(udp_socket, buff, sizeof(buff), MSG_DONTWAIT);
+		if (e <= 0)
+			return;
+
+		struct wsjtx_in in = {buff, buff + e, 0};
+		if (get_u32(&in) != WSJTX_MAGIC)
+			continue;
+		get_u32(&in);										// schema
+		uint32_t type = get_u32(&in);
+		get_utf8(&in, id, sizeof(id));
+		if (in.bad)
+			continue;
+
+		switch(type){
+		case MSG_REPLY:
+			wsjtx_reply(&in);
 			break;
-		case 2:
-			// count the bytes of the unique string
-			l = ntohl(*px++);
-			char *pt = (char *)px;
-			for (i = 0; i < l; i++)
-				unique[i] = *pt++;
-			unique[i] = 0;
-			//printf("Unique : %s\n", unique);
-			//printf("New: %d\n", (int)(*pt));
-			pt++;
-			px = (int32_t *)pt;
-			int32_t mds = ntohl(*px++);
-			mds = mds/1000; //reduce to only seconds, drop millisecs
-			seconds = mds % 60;
-			hours = mds / 3600;
-			minutes = (mds / 60) % 60;
-			//printf("Time: %d:%d:%d\n", hours, minutes, seconds) ;
-			snr = ntohl(*px++);
-			//printf("SNR: %d\n", snr);
-			//printf("delta time:%g\n", (double *)px);
-			px++;px++;
-			delta_freq = ntohl(*px++); 
-			//printf("delta freq:%u\n", delta_freq);
-			//mode
-			l = ntohl(*px++);
-			pt = (char *)px;
-			//printf("mode(%d):", l);
-			for (i = 0; i < l; i++)
-				mode[i] = *pt++;
-			mode[i] = 0;
-			//printf("mode: %s\n", mode);
-			//message
-			px = (int32_t *)pt;			
-			l = ntohl(*px++);
-			pt = (char *)px;
-			for (i = 0; i < l; i++)
-				message[i] = *pt++;
-			message[i] = 0;	
-			//printf("msg: %s\n", message);
-			sprintf(log, "%02d:%02d:%02d %03d %4d %s %s", hours, minutes, seconds, 
-				snr, delta_freq, mode, message);
-			//append_log(log);
-			write_log(log);
-			puts(log);
+		case MSG_HALT_TX:
+			//auto only: stop sequencing after this transmission
+			if (get_u8(&in))
+				ft8_stop_repeat();
+			else {
+				ft8_abort();
+				abort_tx();
+			}
 			break;
-	}	
+		}
+	}
 }
 
-/*
-int main(){
+// opens the socket to the WSJTX_ADDR, returns -1 if it is bad
+static int wsjtx_open(const char *address){
+	char host[64];
+	int port = 2237;
+
+	strncpy(host, address, sizeof(host) - 1);
+	host[sizeof(host) - 1] = 0;
+	char *p = strchr(host, ':');
+	if (p){
+		*p++ = 0;
+		port = atoi(p);
+	}
 
-  puts("Starting udp\n");
-  wsjtx_start();
-  puts("Server started\n");
-  while (1){
-    wsjtx_slice();
-    usleep(1000);
-  }
-  return 0;
+	memset(&wsjtx_addr, 0, sizeof(wsjtx_addr));
+	wsjtx_addr.sin_family = AF_INET;
+	wsjtx_addr.sin_port = htons(port);
+	if (!inet_aton(host, &wsjtx_addr.sin_addr) || port <= 0){
+		printf("WSJTX_ADDR %s is not an address:port\n", address);
+		return -1;
+	}
+
+	if (udp_socket < 0)
+		udp_socket = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_UDP);
+	if (udp_socket < 0)
+		return -1;
+	//keep multicast on this machine
+	unsigned char ttl = 1;
+	setsockopt(udp_socket, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+	return 0;
 }
-*/
 
+// picks up the settings and the replies, from modem_poll()
+void wsjtx_poll(){
+	static time_t heartbeat_at = 0;
 
+	const char *value = field_str("WSJTX_UDP");
+	int on = value && !strcmp(value, "ON");
+	const char *address = field_str("WSJTX_ADDR");
+	if (!address)
+		address = "127.0.0.1:2237";
+
+	if (on && (!wsjtx_on || strcmp(address, wsjtx_addr_str))
+		&& strcmp(address, wsjtx_failed_str)){
+		wsjtx_on = 0;
+		strncpy(wsjtx_addr_str, address, sizeof(wsjtx_addr_str) - 1);
+		if (wsjtx_open(address) == 0){
+			wsjtx_on = 1;
+			wsjtx_failed_str[0] = 0;
+		}
+		else
+			strncpy(wsjtx_failed_str, address, sizeof(wsjtx_failed_str) - 1);
+		heartbeat_at = 0;
+	}
+	else if (!on){
+		wsjtx_on = 0;
+		wsjtx_failed_str[0] = 0;
+	}
+	if (!wsjtx_on)
+		return;
+
+	time_t now = time(NULL);
+	int force = 0;
+	if (now >= heartbeat_at){
+		wsjtx_heartbeat();
+		heartbeat_at = now + 15;
+		force = 1;
+	}
+	wsjtx_status(force);
+	wsjtx_read();
+}
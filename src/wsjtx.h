@@ -1,2 +1,10 @@
-void wsjtx_start();
-void wsjtx_slice();
+#include <stdbool.h>
+#include <time.h>
+
+void wsjtx_poll();
+void wsjtx_decode(time_t slot, int snr, float dt, float freq_hz,
+	bool is_ft8, const char *text);
+void wsjtx_flush();
+void wsjtx_logged(time_t t, long freq, const char *mode, const char *call,
+	const char *rst_sent, const char *rst_recv, const char *exch_sent,
+	const char *exch_recv, const char *comments);
@@ -0,0 +1,886 @@
+/*
+	WSPR receiver
+
+	Decodes the WSPR window, 1400 to 1600 Hz of USB audio above the
+	dial, straight from the IF, whatever the current mode is.
+	It is switched on with the WSPR_RX setting (\wspr_rx ON).
+
+	1. wspr_rx() is called by the DSP thread with each block of the IF
+	and pushes it into an if_ring (see dsp_utils.h).
+
+	2. The channel thread mixes 1500 Hz of the audio down to zero and
+	decimates the IF by 256, in two steps (96k->6k->375), to complex
+	baseband. Each WSPR symbol is then 256 samples long and the four
+	tones are exactly one fft bin (1.46 Hz) apart. The samples of
+	each 2 minute cycle, from the even minute, are collected into a
+	buffer. As with the wideband FT8 decoder, a gap in the IF or a
+	retuning spoils the cycle.
+
+	3. At the end of the cycle the buffer is handed to the decoder
+	thread that runs at a lower priority:
+	- A spectrogram of one symbol long ffts, zero padded to two symbols
+	  (0.73 Hz bins) and stepped every quarter of a symbol gives the
+	  noise floor and the candidates, the peaks of the average spectrum.
+	- The candidates are matched against the sync vector on the
+	  spectrogram for the start time, frequency and drift.
+	- The best are refined on the samples themselves (frequency, start
+	  and drift) and the powers of the four tones in each symbol give
+	  a soft bit.
+	- The soft bits are deinterleaved and sent to the Fano sequential
+	  decoder (K=32, rate 1/2).
+	- Only the standard (type 1) messages of callsign, 4 character grid
+	  and power are reported. The compound callsigns and the hashed
+	  messages (types 2 and 3) are only counted.
+	The spots are queued for wspr_poll(), on the user interface's tick,
+	to write to the console and add to ~/sbitx/data/wspr_spots.txt.
+
+	4. The decoder has until the next cycle is collected, two minutes.
+	\wsprstat prints how long each cycle took against that.
+
+	The IF is at 24 kHz, upper sideband (see radio_tune_to() in sbitx.c).
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <complex.h>
+#include <fftw3.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "sdr.h"
+#include "sdr_ui.h"
+#include "sound.h"
+#include "dsp_utils.h"
+
+#define WSPR_RING 128		// about 1.3 seconds of the IF
+#define WSPR_IF_RATE 96000
+#define WSPR_IF 24000
+#define WSPR_CENTER 1500	// of the window, in the audio
+
+#define WSPR_RATE 375
+#define WSPR_CYCLE 120
+#define WSPR_SAMPLES (WSPR_CYCLE * WSPR_RATE)
+#define WSPR_MIN_SAMPLES (114 * WSPR_RATE)
+#define WSPR_SYMBOLS 162
+#define WSPR_SPS 256			// samples per symbol
+#define WSPR_NFFT 512
+#define WSPR_STEP 64			// of the spectrogram, a quarter symbol
+#define WSPR_START 1.0		// the transmissions start a second into the cycle
+#define WSPR_MAX_CANDIDATES 40
+#define WSPR_MIN_SYNC 0.1f
+
+// the first stage only has to keep out what aliases onto the window
+#define FIR1_TAPS 96
+#define FIR1_CUTOFF 600
+#define FIR1_DECIMATE 16
+
+// the second stage sets the width, a little over the 200 Hz window
+#define FIR2_TAPS 384
+#define FIR2_CUTOFF 150
+#define FIR2_DECIMATE 16
+
+// the convolutional code
+#define POLY1 0xf2d05351
+#define POLY2 0xe4613c47
+#define WSPR_BITS 81			// 50 of the message and 31 of the tail
+#define FANO_DELTA 60
+#define FANO_MAX_CYCLES 10000	// for each bit
+
+static const uint8_t wspr_sync[WSPR_SYMBOLS] = {
+	1,1,0,0,0,0,0,0,1,0,0,0,1,1,1,0,0,0,1,0,
+	0,1,0,1,1,1,1,0,0,0,0,0,0,0,1,0,0,1,0,1,
+	0,0,0,0,0,0,1,0,1,1,0,0,1,1,0,1,0,0,0,1,
+	1,0,1,0,0,0,0,1,1,0,1,0,1,0,1,0,1,0,0,1,
+	0,0,1,0,1,1,0,0,0,1,1,0,1,0,1,0,0,0,1,0,
+	0,0,0,0,1,0,0,1,0,0,1,1,1,0,1,1,0,0,1,1,
+	0,1,0,0,0,1,1,1,0,0,0,0,0,1,0,1,0,0,1,1,
+	0,0,0,0,0,0,0,1,1,0,1,0,1,1,0,0,0,1,1,0,
+	0,0
+};
+
+static struct if_ring wspr_ring;
+static int wspr_active = 0;
+static volatile int wspr_restart = 0;	// the channel thread resets the channel
+
+// the channel
+static float complex osc, rot;
+static float complex fir1[2 * FIR1_TAPS], fir2[2 * FIR2_TAPS];
+static int fir1_pos, fir2_pos, fir1_phase, fir2_phase;
+static float fir1_coeff[FIR1_TAPS], fir2_coeff[FIR2_TAPS];
+
+// the cycle being collected
+static float complex *cycle_buff[2];
+static int cycle_fill = 0;
+static int cycle_samples;
+static long cycle;
+static int cycle_valid;
+static int cycle_dial;
+static double cycle_last_t;
+
+// the cycle handed over to the decoder
+static volatile int ready = -1;
+static int ready_samples;
+static long ready_cycle;
+static long ready_dial;
+
+// decoder
+static int mettab[2][256];
+static float complex tone_twiddle[4][WSPR_SPS];
+static fftwf_complex *fft_in, *fft_out;
+static fftwf_plan fft_plan;
+
+// stats
+static long long chan_ns, decode_ns, decode_ns_last, decode_ns_max;
+static double decode_msec_last, decode_msec_max;
+static int cycles, spots, others, candidates, tried, skipped, overruns;
+static pthread_t wspr_thread, wspr_decode_thread;
+
+static void channel_reset(){
+	osc = 1;
+	memset(fir1, 0, sizeof(fir1));
+	memset(fir2, 0, sizeof(fir2));
+	fir1_pos = fir2_pos = fir1_phase = fir2_phase = 0;
+	cycle_samples = 0;
+	cycle = -1;
+	cycle_valid = 0;
+	cycle_last_t = 0;
+}
+
+/* ---- the channel ---- */
+
+// a new cycle has started, pass on the one just collected
+static void cycle_end(long next, double t){
+	if (cycle >= 0 && cycle_valid && cycle_samples >= WSPR_MIN_SAMPLES){
+		cycles++;
+		if (ready >= 0)
+			overruns++;
+		else {
+			ready_samples = cycle_samples;
+			ready_cycle = cycle;
+			ready_dial = cycle_dial;
+			__atomic_store_n(&ready, cycle_fill, __ATOMIC_RELEASE);
+			cycle_fill ^= 1;
+		}
+	}
+
+	cycle = next;
+	cycle_samples = 0;
+	cycle_dial = freq_hdr;
+	rot = cexpf(-I * 2 * M_PI * (WSPR_IF + if_shift() + WSPR_CENTER) / WSPR_IF_RATE);
+	// we can't use a cycle that we joined late
+	cycle_valid = (t - next * (double)WSPR_CYCLE) < 0.5;
+}
+
+static void channel_process(struct if_block *b){
+	long c = (long)floor(b->t / WSPR_CYCLE);
+
+	if (c != cycle)
+		cycle_end(c, b->t);
+	else if (fabs(b->t - cycle_last_t - IF_BLOCK / (double)WSPR_IF_RATE) > 0.1
+		|| cycle_dial != freq_hdr)
+		cycle_valid = 0;
+	cycle_last_t = b->t;
+
+	float complex *out = cycle_buff[cycle_fill];
+
+	for (int i = 0; i < b->count; i++){
+		float complex z = (b->samples[i] / 200000000.0f) * osc;
+		osc = cmul(osc, rot);
+
+		fir1[fir1_pos] = fir1[fir1_pos + FIR1_TAPS] = z;
+		if (++fir1_pos == FIR1_TAPS)
+			fir1_pos = 0;
+		if (++fir1_phase < FIR1_DECIMATE)
+			continue;
+		fir1_phase = 0;
+
+		float complex *h = fir1 + fir1_pos;
+		float complex y = 0;
+		for (int k = 0; k < FIR1_TAPS; k++)
+			y += fir1_coeff[k] * h[k];
+
+		fir2[fir2_pos] = fir2[fir2_pos + FIR2_TAPS] = y;
+		if (++fir2_pos == FIR2_TAPS)
+			fir2_pos = 0;
+		if (++fir2_phase < FIR2_DECIMATE)
+			continue;
+		fir2_phase = 0;
+
+		h = fir2 + fir2_pos;
+		y = 0;
+		for (int k = 0; k < FIR2_TAPS; k++)
+			y += fir2_coeff[k] * h[k];
+
+		if (cycle_samples < WSPR_SAMPLES)
+			out[cycle_samples++] = y;
+	}
+
+	//keep the oscillator from drifting in amplitude
+	osc /= cabsf(osc);
+}
+
+void *wspr_thread_function(void *ptr){
+	while(1){
+		usleep(10000);
+
+		struct if_block *b;
+		while ((b = if_ring_next(&wspr_ring))){
+			if (__atomic_load_n(&wspr_restart, __ATOMIC_ACQUIRE)){
+				channel_reset();
+				__atomic_store_n(&wspr_restart, 0, __ATOMIC_RELEASE);
+			}
+			long long start = thread_ns();
+			channel_process(b);
+			chan_ns += thread_ns() - start;
+			if_ring_done(&wspr_ring);
+		}
+	}
+}
+
+/* ---- the Fano decoder ---- */
+
+static void convolve(const uint8_t *data, int nbits, uint8_t *coded){
+	uint32_t reg = 0;
+	for (int i = 0; i < nbits; i++){
+		reg = (reg << 1) | ((data[i / 8] >> (7 - i % 8)) & 1);
+		coded[2 * i] = __builtin_parity(reg & POLY1);
+		coded[2 * i + 1] = __builtin_parity(reg & POLY2);
+	}
+}
+
+struct fano_node {
+	uint32_t encstate;
+	int gamma;
+	int metrics[4];
+	int tm[2];
+	int i;
+};
+
+static int branch(uint32_t state){
+	return (__builtin_parity(state & POLY1) << 1) | __builtin_parity(state & POLY2);
+}
+
+// sorts the two branches out of the node, the better one first
+static void fano_branches(struct fano_node *np){
+	int lsym = branch(np->encstate);
+	int m0 = np->metrics[lsym];
+	int m1 = np->metrics[3 ^ lsym];
+	if (m0 > m1){
+		np->tm[0] = m0;
+		np->tm[1] = m1;
+	}
+	else {
+		np->tm[0] = m1;
+		np->tm[1] = m0;
+		np->encstate++;
+	}
+}
+
+// symbols are the soft bits, 0 (sure of 0) to 255 (sure of 1), two per bit
+// returns -1 if it gave up
+static int fano_decode(const uint8_t *symbols, uint8_t *data, int *cycles_taken){
+	struct fano_node nodes[WSPR_BITS + 1];
+	struct fano_node *lastnode = nodes + WSPR_BITS - 1;
+	struct fano_node *tail = nodes + WSPR_BITS - 31;
+	struct fano_node *np;
+	int i, t;
+
+	for (np = nodes; np <= lastnode; np++){
+		np->metrics[0] = mettab[0][symbols[0]] + mettab[0][symbols[1]];
+		np->metrics[1] = mettab[0][symbols[0]] + mettab[1][symbols[1]];
+		np->metrics[2] = mettab[1][symbols[0]] + mettab[0][symbols[1]];
+		np->metrics[3] = mettab[1][symbols[0]] + mettab[1][symbols[1]];
+		symbols += 2;
+	}
+
+	np = nodes;
+	np->encstate = 0;
+	fano_branches(np);
+	np->i = 0;
+	np->gamma = t = 0;
+
+	for (i = 1; i <= FANO_MAX_CYCLES * WSPR_BITS; i++){
+		int ngamma = np->gamma + np->tm[np->i];
+		if (ngamma >= t){
+			//the first visit to this node, tighten the threshold
+			if (np->gamma < t + FANO_DELTA)
+				while (ngamma >= t + FANO_DELTA)
+					t += FANO_DELTA;
+			np[1].gamma = ngamma;
+			np[1].encstate = np->encstate << 1;
+			if (++np == lastnode + 1)
+				break;
+			//the tail only has zeros
+			if (np >= tail)
+				np->tm[0] = np->metrics[branch(np->encstate)];
+			else
+				fano_branches(np);
+			np->i = 0;
+			continue;
+		}
+
+		//the threshold is violated, look back
+		for (;;){
+			if (np == nodes || np[-1].gamma < t){
+				//can't go back, loosen the threshold
+				t -= FANO_DELTA;
+				if (np->i != 0){
+					np->i = 0;
+					np->encstate ^= 1;
+				}
+				break;
+			}
+			if (--np < tail && np->i != 1){
+				//try the other branch
+				np->i++;
+				np->encstate ^= 1;
+				break;
+			}
+		}
+	}
+	*cycles_taken = i;
+	if (i > FANO_MAX_CYCLES * WSPR_BITS)
+		return -1;
+
+	np = nodes + 7;
+	for (i = 0; i < WSPR_BITS / 8; i++, np += 8)
+		data[i] = np->encstate;
+	return 0;
+}
+
+/* the branch metrics, in tenths of a bit, for soft bits that are
+	scaled to an rms of 50 around 128. They are worked out for a signal
+	as strong as the noise, near the limit of decoding. */
+static void metric_init(){
+	const float a = 35.0f, sigma = 35.0f, bias = 0.45f;
+
+	for (int s = 0; s < 256; s++){
+		float y = s - 127.5f;
+		double p1 = exp(-(y - a) * (y - a) / (2 * sigma * sigma));
+		double p0 = exp(-(y + a) * (y + a) / (2 * sigma * sigma));
+		mettab[1][s] = (int)lrint(10 * (log2(2 * p1 / (p0 + p1)) - bias));
+		mettab[0][s] = (int)lrint(10 * (log2(2 * p0 / (p0 + p1)) - bias));
+	}
+}
+
+/* ---- the message ---- */
+
+static const char wspr_chars[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ ";
+
+static int unpack_call(uint32_t n, char *call){
+	char tmp[7];
+
+	if (n >= 262177560)
+		return -1;
+	tmp[5] = wspr_chars[n % 27 + 10]; n /= 27;
+	tmp[4] = wspr_chars[n % 27 + 10]; n /= 27;
+	tmp[3] = wspr_chars[n % 27 + 10]; n /= 27;
+	tmp[2] = wspr_chars[n % 10]; n /= 10;
+	tmp[1] = wspr_chars[n % 36]; n /= 36;
+	tmp[0] = wspr_chars[n];
+	tmp[6] = 0;
+
+	//no spaces inside the callsign
+	int start = tmp[0] == ' ' ? 1 : 0, end = 6;
+	while (end > start && tmp[end - 1] == ' ')
+		end--;
+	for (int i = start; i < end; i++)
+		if (tmp[i] == ' ')
+			return -1;
+	if (end - start < 3 || tmp[start] == ' ')
+		return -1;
+	memcpy(call, tmp + start, end - start);
+	call[end - start] = 0;
+	return 0;
+}
+
+static int unpack_grid(int ngrid, char *grid){
+	if (ngrid >= 32400)
+		return -1;
+	int lat = ngrid % 180;
+	int lon = 179 - ngrid / 180;
+	grid[0] = 'A' + lon / 10;
+	grid[1] = 'A' + lat / 10;
+	grid[2] = '0' + lon % 10;
+	grid[3] = '0' + lat % 10;
+	grid[4] = 0;
+	return 0;
+}
+
+// returns 1 for a standard message, 0 for the others, -1 if it isn't valid
+static int unpack_message(const uint8_t *data, char *call, char *grid, int *power){
+	uint32_t n1 = (data[0] << 20) | (data[1] << 12) | (data[2] << 4) | (data[3] >> 4);
+	uint32_t n2 = ((data[3] & 0x0f) << 18) | (data[4] << 10) | (data[5] << 2)
+		| (data[6] >> 6);
+
+	*power = (int)(n2 & 127) - 64;
+	if (*power < 0 || *power > 60)
+		return 0;
+	int units = *power % 10;
+	if (units != 0 && units != 3 && units != 7)
+		return 0;
+	if (unpack_call(n1, call) < 0 || unpack_grid(n2 >> 7, grid) < 0)
+		return -1;
+	return 1;
+}
+
+/* ---- the decoder ---- */
+
+struct wspr_spot {
+	char call[8], grid[6];
+	int power;
+	float snr, dt, freq, drift;
+};
+
+struct wspr_candidate {
+	int bin, lag, drift;
+	float sync;
+};
+
+// matches the sync vector on the spectrogram, drift is in bins over the transmission
+static float coarse_sync(const float *ps, int n_steps, int bin, int lag, int drift){
+	float ss = 0, total = 0;
+
+	for (int k = 0; k < WSPR_SYMBOLS; k++){
+		int step = lag + 4 * k;
+		if (step >= n_steps)
+			break;
+		int b = bin - 3 + (int)lrintf(drift * (k - 81) / (float)WSPR_SYMBOLS);
+		const float *p = ps + step * WSPR_NFFT + b;
+		float cmet = (p[2] + p[6]) - (p[0] + p[4]);
+		ss += wspr_sync[k] ? cmet : -cmet;
+		total += p[0] + p[2] + p[4] + p[6];
+	}
+	return total > 0 ? ss / total : 0;
+}
+
+// powers of the four tones in each symbol, f0 is the middle of the tones
+static void symbol_powers(const float complex *c, int n, int start, float f0,
+	float drift, float (*p)[4]){
+
+	for (int k = 0; k < WSPR_SYMBOLS; k++){
+		float f = f0 + drift * (k - 81) / WSPR_SYMBOLS - 1.5f * WSPR_RATE / WSPR_SPS;
+		float complex r = cexpf(-I * 2 * M_PI * f / WSPR_RATE), o = 1;
+		float complex acc[4] = {0, 0, 0, 0};
+		int pos = start + k * WSPR_SPS;
+
+		for (int j = 0; j < WSPR_SPS; j++, o = cmul(o, r)){
+			if (pos + j < 0 || pos + j >= n)
+				continue;
+			float complex z = cmul(c[pos + j], o);
+			for (int t = 0; t < 4; t++)
+				acc[t] += cmul(z, tone_twiddle[t][j]);
+		}
+		for (int t = 0; t < 4; t++)
+			p[k][t] = crealf(acc[t]) * crealf(acc[t]) + cimagf(acc[t]) * cimagf(acc[t]);
+	}
+}
+
+static float fine_sync(float (*p)[4]){
+	float ss = 0, total = 0;
+
+	for (int k = 0; k < WSPR_SYMBOLS; k++){
+		float cmet = (p[k][1] + p[k][3]) - (p[k][0] + p[k][2]);
+		ss += wspr_sync[k] ? cmet : -cmet;
+		total += p[k][0] + p[k][1] + p[k][2] + p[k][3];
+	}
+	return total > 0 ? ss / total : 0;
+}
+
+static int bit_reverse(int i){
+	int r = 0;
+	for (int b = 0; b < 8; b++)
+		if (i & (1 << b))
+			r |= 0x80 >> b;
+	return r;
+}
+
+// demodulates and decodes at a start, frequency and drift
+static int wspr_demodulate(float (*p)[4], uint8_t *data){
+	float soft[WSPR_SYMBOLS];
+	uint8_t symbols[WSPR_SYMBOLS], coded[2 * WSPR_BITS];
+	double sum2 = 0;
+
+	//the sync tone is known, the data bit picks the upper or the lower pair
+	for (int k = 0; k < WSPR_SYMBOLS; k++){
+		if (wspr_sync[k])
+			soft[k] = sqrtf(p[k][3]) - sqrtf(p[k][1]);
+		else
+			soft[k] = sqrtf(p[k][2]) - sqrtf(p[k][0]);
+		sum2 += soft[k] * soft[k];
+	}
+	float scale = sum2 > 0 ? 50 / sqrt(sum2 / WSPR_SYMBOLS) : 0;
+	for (int k = 0; k < WSPR_SYMBOLS; k++){
+		float s = 128 + scale * soft[k];
+		symbols[k] = s < 0 ? 0 : (s > 255 ? 255 : (uint8_t)s);
+	}
+
+	for (int i = 0, n = 0; i < 256; i++){
+		int j = bit_reverse(i);
+		if (j < WSPR_SYMBOLS)
+			coded[n++] = symbols[j];
+	}
+
+	int fano_cycles;
+	memset(data, 0, 11);
+	if (fano_decode(coded, data, &fano_cycles) < 0)
+		return -1;
+
+	//a random sequence can pass the tail, it won't match the soft bits
+	uint8_t recoded[2 * WSPR_BITS];
+	int errors = 0;
+	convolve(data, WSPR_BITS, recoded);
+	for (int i = 0; i < WSPR_SYMBOLS; i++)
+		if (recoded[i] != (coded[i] > 128))
+			errors++;
+	return errors > WSPR_SYMBOLS / 4 ? -1 : 0;
+}
+
+static int candidate_compare(const void *a, const void *b){
+	float d = ((struct wspr_candidate *)b)->sync - ((struct wspr_candidate *)a)->sync;
+	return d > 0 ? 1 : (d < 0 ? -1 : 0);
+}
+
+static int float_compare(const void *a, const void *b){
+	float d = *(float *)a - *(float *)b;
+	return d > 0 ? 1 : (d < 0 ? -1 : 0);
+}
+
+typedef void (*wspr_callback)(void *ctx, struct wspr_spot *spot);
+
+// c is the complex baseband of a cycle at 375 samples/sec, 1500 Hz at zero
+static int wspr_decode(float complex *c, int n, double deadline,
+	wspr_callback callback, void *ctx){
+
+	int n_steps = (n - WSPR_SPS) / WSPR_STEP + 1;
+	if (n_steps < 4 * WSPR_SYMBOLS)
+		return 0;
+
+	//the spectrogram, bin WSPR_NFFT/2 is at zero
+	float *ps = (float *)malloc(n_steps * WSPR_NFFT * sizeof(float));
+	float avg[WSPR_NFFT];
+	memset(avg, 0, sizeof(avg));
+	for (int s = 0; s < n_steps; s++){
+		for (int j = 0; j < WSPR_NFFT; j++)
+			fft_in[j] = j < WSPR_SPS ? c[s * WSPR_STEP + j] : 0;
+		fftwf_execute(fft_plan);
+		float *row = ps + s * WSPR_NFFT;
+		for (int k = 0; k < WSPR_NFFT; k++){
+			float complex z = fft_out[(k + WSPR_NFFT / 2) % WSPR_NFFT];
+			row[k] = crealf(z) * crealf(z) + cimagf(z) * cimagf(z);
+			avg[k] += row[k] / n_steps;
+		}
+	}
+
+	//the noise floor is taken from the quieter bins
+	int noise_bins = (int)(150.0f * WSPR_NFFT / WSPR_RATE);
+	float sorted[WSPR_NFFT];
+	memcpy(sorted, avg + WSPR_NFFT / 2 - noise_bins, 2 * noise_bins * sizeof(float));
+	qsort(sorted, 2 * noise_bins, sizeof(float), float_compare);
+	float noise = sorted[(2 * noise_bins * 3) / 10];
+
+	//a signal spreads over its four tones, every other bin
+	float smooth[WSPR_NFFT];
+	int window = (int)(102.0f * WSPR_NFFT / WSPR_RATE);
+	for (int k = WSPR_NFFT / 2 - window - 1; k <= WSPR_NFFT / 2 + window + 1; k++){
+		smooth[k] = 0;
+		for (int j = -3; j <= 3; j++)
+			smooth[k] += avg[k + j];
+	}
+
+	struct wspr_candidate cand[WSPR_MAX_CANDIDATES];
+	int n_cand = 0;
+	for (int k = WSPR_NFFT / 2 - window; k <= WSPR_NFFT / 2 + window; k++){
+		if (smooth[k] <= smooth[k - 1] || smooth[k] < smooth[k + 1]
+			|| smooth[k] < 7 * noise * 1.05f)
+			continue;
+
+		//the best start, frequency and drift on the spectrogram
+		struct wspr_candidate best = {k, 0, 0, -1};
+		int max_lag = n_steps - 4 * (WSPR_SYMBOLS - 1) - 1;
+		int lag_limit = (int)(5.0f * WSPR_RATE / WSPR_STEP);
+		if (max_lag > lag_limit)
+			max_lag = lag_limit;
+		for (int bin = k - 1; bin <= k + 1; bin++)
+			for (int lag = 0; lag <= max_lag; lag++)
+				for (int d = 0; d <= 8; d++){
+					//from no drift outwards, the small drifts are alike here
+					int drift = d & 1 ? (d + 1) / 2 : -d / 2;
+					float sync = coarse_sync(ps, n_steps, bin, lag, drift);
+					if (sync > best.sync){
+						best.bin = bin;
+						best.lag = lag;
+						best.drift = drift;
+						best.sync = sync;
+					}
+				}
+		if (best.sync < WSPR_MIN_SYNC)
+			continue;
+		if (n_cand < WSPR_MAX_CANDIDATES)
+			cand[n_cand++] = best;
+		else if (best.sync > cand[WSPR_MAX_CANDIDATES - 1].sync)
+			cand[WSPR_MAX_CANDIDATES - 1] = best;
+		qsort(cand, n_cand, sizeof(cand[0]), candidate_compare);
+	}
+	free(ps);
+	candidates += n_cand;
+
+	float (*p)[4] = malloc(WSPR_SYMBOLS * sizeof(*p));
+	char decoded[WSPR_MAX_CANDIDATES][20];
+	int n_decoded = 0;
+
+	for (int i = 0; i < n_cand; i++){
+		if (monotonic_now() > deadline){
+			skipped += n_cand - i;
+			break;
+		}
+		tried++;
+
+		float f0 = (cand[i].bin - WSPR_NFFT / 2) * (float)WSPR_RATE / WSPR_NFFT;
+		float drift = cand[i].drift * (float)WSPR_RATE / WSPR_NFFT;
+		int start = cand[i].lag * WSPR_STEP;
+
+		//refine the frequency, then the start on the samples
+		float best_sync = -1, best_f = f0;
+		for (float df = -0.4f; df < 0.45f; df += 0.1f){
+			symbol_powers(c, n, start, f0 + df, drift, p);
+			float sync = fine_sync(p);
+			if (sync > best_sync){
+				best_sync = sync;
+				best_f = f0 + df;
+			}
+		}
+		int best_start = start;
+		for (int dl = -48; dl <= 48; dl += 8){
+			if (!dl)
+				continue;
+			symbol_powers(c, n, start + dl, best_f, drift, p);
+			float sync = fine_sync(p);
+			if (sync > best_sync){
+				best_sync = sync;
+				best_start = start + dl;
+			}
+		}
+
+		float best_drift = drift;
+		for (float dd = -0.5f; dd < 0.6f; dd += 0.25f){
+			if (fabsf(dd) < 0.1f)
+				continue;
+			symbol_powers(c, n, best_start, best_f, drift + dd, p);
+			float sync = fine_sync(p);
+			if (sync > best_sync){
+				best_sync = sync;
+				best_drift = drift + dd;
+			}
+		}
+
+		uint8_t data[11];
+		symbol_powers(c, n, best_start, best_f, best_drift, p);
+		if (wspr_demodulate(p, data) < 0)
+			continue;
+
+		struct wspr_spot spot;
+		int type = unpack_message(data, spot.call, spot.grid, &spot.power);
+		if (type < 0)
+			continue;
+		if (type == 0){
+			others++;
+			continue;
+		}
+
+		char text[20];
+		sprintf(text, "%s %s %d", spot.call, spot.grid, spot.power);
+		int j;
+		for (j = 0; j < n_decoded; j++)
+			if (!strcmp(decoded[j], text))
+				break;
+		if (j < n_decoded)
+			continue;
+		strcpy(decoded[n_decoded++], text);
+
+		//the snr is of the decoded tones over the noise in 2500 Hz
+		uint8_t coded[2 * WSPR_BITS], tones[WSPR_SYMBOLS];
+		convolve(data, WSPR_BITS, coded);
+		for (int r = 0, m = 0; r < 256; r++){
+			int k = bit_reverse(r);
+			if (k < WSPR_SYMBOLS)
+				tones[k] = wspr_sync[k] + 2 * coded[m++];
+		}
+		double sig = 0;
+		for (int k = 0; k < WSPR_SYMBOLS; k++)
+			sig += p[k][tones[k]];
+		sig = sig / WSPR_SYMBOLS - noise;
+		float enbw = (float)WSPR_RATE / WSPR_SPS;
+		spot.snr = sig > 0 ? 10 * log10(sig / (noise * 2500 / enbw)) : -40;
+		spot.dt = (float)best_start / WSPR_RATE - WSPR_START;
+		spot.freq = best_f;
+		spot.drift = best_drift;
+		callback(ctx, &spot);
+	}
+	free(p);
+	return n_decoded;
+}
+
+/* ---- the decoder thread ---- */
+
+struct wspr_ctx {
+	time_t t;
+	long dial;
+	int spots;
+};
+
+// the spots on their way to the user interface
+#define WSPR_REPORTS 64
+struct wspr_report {
+	time_t t;
+	long dial;
+	struct wspr_spot spot;
+};
+static struct wspr_report reports[WSPR_REPORTS];
+static int report_head = 0, report_tail = 0;
+
+static void wspr_on_spot(void *ctx, struct wspr_spot *s){
+	struct wspr_ctx *w = (struct wspr_ctx *)ctx;
+
+	int next = (report_head + 1) % WSPR_REPORTS;
+	if (next == __atomic_load_n(&report_tail, __ATOMIC_ACQUIRE))
+		return;
+	reports[report_head].t = w->t;
+	reports[report_head].dial = w->dial;
+	reports[report_head].spot = *s;
+	__atomic_store_n(&report_head, next, __ATOMIC_RELEASE);
+	w->spots++;
+}
+
+static void wspr_report(struct wspr_report *r){
+	struct wspr_spot *s = &r->spot;
+	char buff[200], path[200];
+	struct tm *t = gmtime(&r->t);
+	double mhz = (r->dial + WSPR_CENTER + s->freq) / 1e6;
+
+	sprintf(buff, "%02d%02d WSPR %+03d %4.1f %10.6f %+2.0f  %s %s %d\n",
+		t->tm_hour, t->tm_min, (int)lrintf(s->snr), s->dt, mhz, s->drift,
+		s->call, s->grid, s->power);
+	write_console(FONT_LOG, buff);
+
+	sprintf(path, "%s/sbitx/data/wspr_spots.txt", getenv("HOME"));
+	FILE *pf = fopen(path, "a");
+	if (pf){
+		fprintf(pf, "%02d%02d%02d %02d%02d %3d %4.1f %10.6f %-6s %s %2d %+.1f\n",
+			t->tm_year % 100, t->tm_mon + 1, t->tm_mday, t->tm_hour, t->tm_min,
+			(int)lrintf(s->snr), s->dt, mhz, s->call, s->grid, s->power, s->drift);
+		fclose(pf);
+	}
+}
+
+void *wspr_decode_function(void *ptr){
+	//stay out of the way of the modem and the user interface
+	setpriority(PRIO_PROCESS, syscall(SYS_gettid), 15);
+
+	while(1){
+		usleep(100000);
+
+		int buff = __atomic_load_n(&ready, __ATOMIC_ACQUIRE);
+		if (buff < 0)
+			continue;
+
+		struct wspr_ctx ctx;
+		ctx.t = (time_t)(ready_cycle * WSPR_CYCLE);
+		ctx.dial = ready_dial;
+		ctx.spots = 0;
+
+		//we have until the next cycle is collected
+		double start = monotonic_now();
+		double deadline = sound_monotonic_time((ready_cycle + 2) * (double)WSPR_CYCLE);
+		long long start_ns = thread_ns();
+		wspr_decode(cycle_buff[buff], ready_samples, deadline, wspr_on_spot, &ctx);
+		long long elapsed = thread_ns() - start_ns;
+
+		decode_ns += elapsed;
+		decode_ns_last = elapsed;
+		if (elapsed > decode_ns_max)
+			decode_ns_max = elapsed;
+		decode_msec_last = (monotonic_now() - start) * 1000;
+		if (decode_msec_last > decode_msec_max)
+			decode_msec_max = decode_msec_last;
+		spots += ctx.spots;
+		__atomic_store_n(&ready, -1, __ATOMIC_RELEASE);
+	}
+}
+
+void wspr_rx(int32_t *samples, int count){
+	if (wspr_active)
+		if_ring_push(&wspr_ring, samples, count);
+}
+
+// picks up the WSPR_RX setting and reports the spots, from modem_poll()
+void wspr_poll(){
+	const char *value = field_str("WSPR_RX");
+	int on = value && !strcmp(value, "ON");
+
+	while (report_tail != __atomic_load_n(&report_head, __ATOMIC_ACQUIRE)){
+		wspr_report(reports + report_tail);
+		__atomic_store_n(&report_tail, (report_tail + 1) % WSPR_REPORTS, __ATOMIC_RELEASE);
+	}
+
+	if (on == wspr_active)
+		return;
+	//the channel thread resets before it takes the first new block
+	if (on)
+		__atomic_store_n(&wspr_restart, 1, __ATOMIC_RELEASE);
+	wspr_active = on;
+}
+
+void wspr_reset_stats(){
+	chan_ns = decode_ns = decode_ns_last = decode_ns_max = 0;
+	decode_msec_last = decode_msec_max = 0;
+	cycles = spots = others = candidates = tried = skipped = overruns = 0;
+	if_ring_reset_stats(&wspr_ring);
+}
+
+void wspr_status(){
+	char buff[300];
+
+	if (!wspr_active){
+		write_console(FONT_LOG, "\nWSPR receive is off, turn it on with \\wspr_rx ON\n");
+		return;
+	}
+
+	double elapsed_ns = if_ring_elapsed_ns(&wspr_ring);
+	sprintf(buff, "\nWSPR over %.0f secs: filter %.1f%% decode %.1f%% cpu, "
+		"%d cycles %d spots (%d others) %d overruns, %d IF overflows\n"
+		"decode %.0f msec of the %d sec deadline (max %.0f), cpu %lld msec (max %lld), "
+		"%d candidates %d tried %d skipped\n",
+		elapsed_ns / 1e9, (100.0 * chan_ns) / elapsed_ns, (100.0 * decode_ns) / elapsed_ns,
+		cycles, spots, others, overruns, wspr_ring.overflows,
+		decode_msec_last, WSPR_CYCLE, decode_msec_max, decode_ns_last / 1000000,
+		decode_ns_max / 1000000, candidates, tried, skipped);
+	write_console(FONT_LOG, buff);
+}
+
+void wspr_init(){
+	if_ring_init(&wspr_ring, WSPR_RING);
+	lowpass_design(fir1_coeff, FIR1_TAPS, FIR1_CUTOFF, WSPR_IF_RATE, 1);
+	lowpass_design(fir2_coeff, FIR2_TAPS, FIR2_CUTOFF, WSPR_IF_RATE / FIR1_DECIMATE, 1);
+	metric_init();
+	for (int t = 0; t < 4; t++)
+		for (int j = 0; j < WSPR_SPS; j++)
+			tone_twiddle[t][j] = cexpf(-I * 2 * M_PI * t * j / WSPR_SPS);
+
+	fft_in = (fftwf_complex *)fftwf_malloc(WSPR_NFFT * sizeof(fftwf_complex));
+	fft_out = (fftwf_complex *)fftwf_malloc(WSPR_NFFT * sizeof(fftwf_complex));
+	fft_plan = fftwf_plan_dft_1d(WSPR_NFFT, fft_in, fft_out, FFTW_FORWARD, FFTW_ESTIMATE);
+
+	cycle_buff[0] = (float complex *)malloc(WSPR_SAMPLES * sizeof(float complex));
+	cycle_buff[1] = (float complex *)malloc(WSPR_SAMPLES * sizeof(float complex));
+	channel_reset();
+	wspr_reset_stats();
+
+	pthread_create(&wspr_thread, NULL, wspr_thread_function, (void*)NULL);
+	pthread_create(&wspr_decode_thread, NULL, wspr_decode_function, (void*)NULL);
+}
@@ -0,0 +1,80 @@
+// IMA ADPCM frames, the same as src/adpcm.c: an 8 byte header
+// ('A', 'D', rate in kHz, step index, int16 predictor, uint16 samples)
+// followed by the 4 bit codes, the first in the low nibble.
+
+const adpcmSteps = [
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+    253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+    1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+    3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442,
+    11487, 12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794,
+    32767
+];
+const adpcmIndex = [-1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8];
+
+function adpcmStep(s, code) {
+    const step = adpcmSteps[s.index];
+    let diff = step >> 3;
+    if (code & 4) diff += step;
+    if (code & 2) diff += step >> 1;
+    if (code & 1) diff += step >> 2;
+    s.predictor += (code & 8) ? -diff : diff;
+    s.predictor = Math.max(-32768, Math.min(32767, s.predictor));
+    s.index = Math.max(0, Math.min(88, s.index + adpcmIndex[code]));
+    return s.predictor;
+}
+
+// returns {rate, samples} or null if the buffer isn't a frame
+function adpcmDecode(buffer) {
+    const b = new Uint8Array(buffer);
+    if (b.length < 8 || b[0] != 65 || b[1] != 68)
+        return null;
+    const count = b[6] | (b[7] << 8);
+    if (b.length < 8 + ((count + 1) >> 1) || b[3] > 88)
+        return null;
+    const s = { index: b[3], predictor: ((b[4] | (b[5] << 8)) << 16) >> 16 };
+    const samples = new Int16Array(count);
+    for (let i = 0; i < count; i++) {
+        const code = b[8 + (i >> 1)];
+        samples[i] = adpcmStep(s, (i & 1) ? code >> 4 : code & 15);
+    }
+    return { rate: b[2] * 1000, samples: samples };
+}
+
+// codes an Int16Array into a frame, the state s carries on to the next
+function adpcmEncode(s, rate, samples) {
+    const count = samples.length;
+    const b = new Uint8Array(8 + ((count + 1) >> 1));
+    b[0] = 65;
+    b[1] = 68;
+    b[2] = rate / 1000;
+    b[3] = s.index;
+    b[4] = s.predictor & 0xff;
+    b[5] = (s.predictor >> 8) & 0xff;
+    b[6] = count & 0xff;
+    b[7] = count >> 8;
+
+    for (let i = 0; i < count; i++) {
+        const step = adpcmSteps[s.index];
+        let diff = samples[i] - s.predictor;
+        let code = 0;
+        if (diff < 0) {
+            code = 8;
+            diff = -diff;
+        }
+        if (diff >= step) {
+            code |= 4;
+            diff -= step;
+        }
+        if (diff >= step >> 1) {
+            code |= 2;
+            diff -= step >> 1;
+        }
+        if (diff >= step >> 2)
+            code |= 1;
+        adpcmStep(s, code);
+        b[8 + (i >> 1)] |= (i & 1) ? code << 4 : code;
+    }
+    return b.buffer;
+}